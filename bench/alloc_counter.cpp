@@ -0,0 +1,105 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "alloc_counter.hh"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <malloc.h>
+
+using namespace std;
+
+//   glibc's own allocator, under the names it keeps for the likes of this.
+// (Its free() is the same whichever of these the memory came from.)
+extern "C" void *__libc_malloc( size_t size );
+extern "C" void *__libc_calloc( size_t n, size_t size );
+extern "C" void *__libc_realloc( void *p, size_t size );
+extern "C" void *__libc_memalign( size_t alignment, size_t size );
+
+//   These are plain globals, because they are used before (and after) any
+// constructors run, and malloc() mustn't use thread_locals (they can
+// allocate).
+static atomic<bool> counting(false);
+static atomic<unsigned long> allocation_count(0);
+
+static inline void count_allocation()
+{
+	if ( counting.load(memory_order_relaxed) )
+		allocation_count.fetch_add(1, memory_order_relaxed);
+}
+
+void start_counting_allocations()
+{
+	allocation_count.store(0, memory_order_relaxed);
+	counting.store(true, memory_order_seq_cst);
+}
+
+unsigned long stop_counting_allocations()
+{
+	counting.store(false, memory_order_seq_cst);
+	return allocation_count.load(memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+// The replacements
+
+extern "C" void *malloc( size_t size ) noexcept
+{
+	count_allocation();
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc( size_t n, size_t size ) noexcept
+{
+	count_allocation();
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc( void *p, size_t size ) noexcept
+{
+	count_allocation();
+	return __libc_realloc(p, size);
+}
+
+extern "C" void *memalign( size_t alignment, size_t size ) noexcept
+{
+	count_allocation();
+	return __libc_memalign(alignment, size);
+}
+
+extern "C" void *aligned_alloc( size_t alignment, size_t size ) noexcept
+{
+	count_allocation();
+	return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign( void **p, size_t alignment, size_t size ) noexcept
+{
+	// The alignment has to be a power of two, and a multiple of sizeof(void *)
+	if ( alignment % sizeof(void *) != 0 or (alignment & (alignment - 1)) != 0 )
+		return EINVAL;
+
+	count_allocation();
+	*p = __libc_memalign(alignment, size);
+
+	return ( *p == NULL and size != 0 ) ? ENOMEM : 0;
+}
@@ -0,0 +1,36 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ALLOC_COUNTER_HH
+#define ALLOC_COUNTER_HH
+
+//   For --count-allocations: the benchmark replaces malloc() (and calloc(),
+// realloc() and the aligned ones) with versions which count the calls, and
+// then call glibc's own.  That catches everything: new, std::string, GLib.
+//   Only calls between start and stop are counted, from every thread.  So
+// whatever else is running then mustn't allocate either (the benchmark's own
+// sending and recording doesn't).
+
+void start_counting_allocations();
+
+// Returns how many there were since start_counting_allocations()
+unsigned long stop_counting_allocations();
+
+#endif // ALLOC_COUNTER_HH
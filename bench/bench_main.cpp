@@ -0,0 +1,812 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//   End-to-end benchmark (run by "make bench").  This runs the real serial
+// reader, dispatcher, handler and DBusPulseAudio, but with:
+//   * a pseudo-terminal instead of the Arduino: we write scripted MIDI into
+//     the master side, and SerialMIDIReader reads the slave side.
+//   * MockPulseServer instead of PulseAudio.  (Or, with "--backend sim", a
+//     SimulatedMixer instead of DBusPulseAudio and PulseAudio.)
+// So it needs neither, and runs offline.
+//   Channel c's fader controls client c (by its application.process.binary),
+// using the linear curve.  That makes every fader position set a different
+// volume, so when a Set arrives at the mock server (or mixer), we can tell
+// which event it came from, and so how long it took from the first byte of the
+// event being written to the Set.
+//   Instead of a scenario, it can send what a real controller sent, from a
+// file made with ttymidi_pulse's --capture.
+//   Or, with --parser, it just times the MIDI parser: see parser_bench.hh.
+// With --ramper-check, it just checks VolumeRamper against a script (see
+// ramper_check.hh): "make ramper-check" runs that.  --limiter-check does the
+// same for VolumeRateLimiter (see limiter_check.hh), for "make limiter-check".
+//   With --count-allocations, it checks that once the events have been through
+// once, they go through again without a single malloc() (see
+// alloc_counter.hh).  "make alloc-check" runs that.
+
+#include "alloc_counter.hh"
+#include "event_trace.hh"
+#include "fader_mapping.hh"
+#include "logger.hh"
+#include "midi_event_dispatcher.hh"
+#include "program_volume_handler.hh"
+#include "pulse_dbus.hh"
+#include "realtime.hh"
+#include "serial_capture.hh"
+#include "serial_reader.hh"
+#include "simulated_mixer.hh"
+#include "mock_pulse_server.hh"
+#include "limiter_check.hh"
+#include "parser_bench.hh"
+#include "ramper_check.hh"
+
+#include <algorithm>
+#include <argp.h>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Channels on each mock playback stream
+#define BENCH_STREAM_CHANNELS 2
+
+// How long to wait for the first event to get all of the way through
+#define BENCH_WARMUP_SECONDS 10
+
+//   After the last event has been sent, the run is over once no Set has
+// arrived for this long (or after BENCH_DRAIN_SECONDS)
+#define BENCH_QUIET_MS      300
+#define BENCH_DRAIN_SECONDS 10
+
+//------------------------------------------------------------------------------
+// Options
+
+struct BenchOptions
+{
+	size_t clients, streams, events;
+	unsigned long rate;         // Events per second (0 = as fast as possible)
+	string scenario;
+	string tracefile;
+	bool verbose;
+	double stream_rate, total_rate;     // ttymidi_pulse's --stream-rate and --total-rate
+	double tick_rate;                   // ttymidi_pulse's --tick-rate and --ramp
+	unsigned int ramp_ms;
+	int realtime_policy, realtime_priority;     // ttymidi_pulse's --realtime,
+	vector<int> reader_cpus, output_cpus;       // --reader-cpus and --output-cpus
+	string backend;             // "dbus" (with MockPulseServer) or "sim"
+	unsigned long latency_us;   // For SimulatedMixer
+	unsigned long churn;
+	string replayfile;          // "" = send the scenario
+	size_t parser_mb;           // 0 = the end-to-end benchmark
+	bool count_allocations;
+	bool ramper_check, limiter_check;
+
+	BenchOptions() :
+	clients(50), streams(2), events(20000), rate(2000), scenario("sweep"), verbose(false),
+	backend("dbus"), latency_us(0), churn(0), parser_mb(0), count_allocations(false), ramper_check(false), limiter_check(false)
+	{
+		Arguments defaults;
+		stream_rate = defaults.stream_rate;
+		total_rate = defaults.total_rate;
+		tick_rate = defaults.tick_rate;
+		ramp_ms = defaults.ramp_ms;
+		realtime_policy = defaults.realtime_policy;
+		realtime_priority = defaults.realtime_priority;
+	}
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state);
+
+static struct argp_option options[] =
+{
+	{"clients"  , 'n', "N"   , 0, "Number of PulseAudio clients on the mock server. Default = 50", 0 },
+	{"streams"  , 'S', "N"   , 0, "Playback streams per client. Default = 2", 0 },
+	{"events"   , 'e', "N"   , 0, "Number of MIDI events to send. Default = 20000", 0 },
+	{"rate"     , 'r', "N"   , 0, "Events per second to send (0 = as fast as they are taken). Default = 2000", 0 },
+	{"scenario" , 'x', "NAME", 0, "sweep: one fader moving up and down.  multi: all 16 faders at once. Default = sweep", 0 },
+	{"trace"    , 't', "FILE", 0, "Write the timings of every event to FILE, as Chrome trace-event JSON", 0 },
+	{"verbose"  , 'v', 0     , 0, "Let ttymidi_pulse print what it is doing", 0 },
+	{"backend"  , 'b', "NAME", 0, "dbus: DBusPulseAudio and a mock PulseAudio server.  sim: a SimulatedMixer. Default = dbus", 0 },
+	{"latency"  , 'l', "US"  , 0, "sim: how long each batch of volume changes takes, in microseconds. Default = 0", 0 },
+	{"churn"    , 'c', "N"   , 0, "sim: replace a stream after every N volume changes (0 = never). Default = 0", 0 },
+	{"replay"   , 'p', "FILE", 0, "Send the first device's bytes from a ttymidi_pulse --capture file, instead of a scenario, at the original timing (or as fast as possible, with --rate 0)", 0 },
+	{"stream-rate", 'R', "HZ", 0, "ttymidi_pulse's limit on volume changes per second to each stream (0 = none). Default = as ttymidi_pulse", 0 },
+	{"total-rate" , 'T', "HZ", 0, "ttymidi_pulse's limit on volume changes per second altogether (0 = none). Default = as ttymidi_pulse", 0 },
+	{"tick-rate", 'k', "HZ"  , 0, "ttymidi_pulse's volume ramping ticks per second (0 = no ramping). Default = as ttymidi_pulse", 0 },
+	{"ramp"     , 'm', "MS"  , 0, "ttymidi_pulse's ramp time over the whole range. Default = as ttymidi_pulse", 0 },
+	{"realtime" , 'X', "POLICY[:PRIO]", 0, "ttymidi_pulse's real-time mode (e.g. fifo:50), for its reader and output threads. Default = off", 0 },
+	{"reader-cpus", 'A', "CPUS", 0, "ttymidi_pulse's --reader-cpus", 0 },
+	{"output-cpus", 'O', "CPUS", 0, "ttymidi_pulse's --output-cpus", 0 },
+	{"count-allocations", 'a', 0, 0, "Send the events twice, and fail if there are any calls to malloc() while the second lot goes through. Needs --backend sim (GDBus allocates for every message), and --churn 0", 0 },
+	{"parser"   , 'P', "MB"  , 0, "Instead, time just the MIDI parser, over MB megabytes of each kind of input", 0 },
+	{"ramper-check", 'C', 0  , 0, "Instead, check that the volume ramper's writes (step size, tick times, first volumes, settling) are what they should be", 0 },
+	{"limiter-check", 'L', 0 , 0, "Instead, check that the rate limiter shares the overall limit between streams, and always writes the last volume", 0 },
+	{ 0         , 0  , 0     , 0, 0,                                                 0 }
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	BenchOptions *opts = (BenchOptions*)state->input;
+
+	switch (key)
+	{
+		case 'n': opts->clients  = strtoul(arg, NULL, 0); break;
+		case 'S': opts->streams  = strtoul(arg, NULL, 0); break;
+		case 'e': opts->events   = strtoul(arg, NULL, 0); break;
+		case 'r': opts->rate     = strtoul(arg, NULL, 0); break;
+		case 'x': opts->scenario = arg;                   break;
+		case 't': opts->tracefile = arg;                  break;
+		case 'v': opts->verbose  = true;                  break;
+		case 'b': opts->backend  = arg;                   break;
+		case 'l': opts->latency_us = strtoul(arg, NULL, 0); break;
+		case 'c': opts->churn    = strtoul(arg, NULL, 0); break;
+		case 'p': opts->replayfile = arg;                 break;
+		case 'R': opts->stream_rate = strtod(arg, NULL);  break;
+		case 'T': opts->total_rate  = strtod(arg, NULL);  break;
+		case 'k': opts->tick_rate   = strtod(arg, NULL);  break;
+		case 'm': opts->ramp_ms     = (unsigned int)strtoul(arg, NULL, 0); break;
+		case 'P': opts->parser_mb   = strtoul(arg, NULL, 0); break;
+		case 'a': opts->count_allocations = true;         break;
+		case 'C': opts->ramper_check = true;              break;
+		case 'L': opts->limiter_check = true;             break;
+
+		case 'X':
+			if ( !parse_realtime_policy(arg, opts->realtime_policy, opts->realtime_priority) )
+				argp_error(state, "bad real-time policy '%s'", arg);
+			break;
+		case 'A':
+		case 'O':
+			if ( !parse_cpu_list(arg, key == 'A' ? opts->reader_cpus : opts->output_cpus) )
+				argp_error(state, "bad list of CPUs '%s'", arg);
+			break;
+
+		case ARGP_KEY_ARG:
+		case ARGP_KEY_END:
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+// Scenarios
+
+// A pitch bend: 'position' is the raw 14-bit fader position (0-16383)
+struct BenchEvent
+{
+	unsigned char channel;
+	unsigned int position;
+};
+
+//   A fader moving up and down, 'step' at a time.  On the way down it lands on
+// different positions from on the way up, so nearby events never repeat one.
+static unsigned int triangle( size_t i, unsigned int step, unsigned int phase )
+{
+	unsigned int q = (unsigned int)((i * step + phase) % (2 * FADER_CURVE_SIZE));
+
+	return q < FADER_CURVE_SIZE ? q : 2 * FADER_CURVE_SIZE - 1 - q;
+}
+
+static bool make_scenario( const BenchOptions & opts, vector<BenchEvent> & events )
+{
+	events.resize(opts.events);
+
+	if ( opts.scenario == "sweep" )
+	{
+		for ( size_t i = 0; i < opts.events; i++ )
+		{
+			events[i].channel = 0;
+			events[i].position = triangle(i, 16, 0);
+		}
+	}
+	else if ( opts.scenario == "multi" )
+	{
+		for ( size_t i = 0; i < opts.events; i++ )
+		{
+			unsigned int c = (unsigned int)(i % MIDI_CHANNELS);
+			events[i].channel = (unsigned char)c;
+			events[i].position = triangle(i / MIDI_CHANNELS, 16, c * 1024);
+		}
+	}
+	else
+		return false;
+
+	return true;
+}
+
+//------------------------------------------------------------------------------
+// Latency measurement
+
+static long long now_ns()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//   Remembers when each event was sent, and works out the latency when the
+// mock server gets the Set it causes.  Only the first Set for an event counts
+// (the client may have several streams).  If the dispatcher coalesces an event
+// away, it never gets a Set, and so isn't counted.
+struct LatencyRecorder
+{
+	// Send time of the latest event for each (channel, position).  0 = none.
+	unique_ptr< atomic<long long>[] > sent;
+
+	// Linear curve volume -> position (-1 if no position gives that volume)
+	vector<int> position_for_volume;
+
+	mutex m;
+	vector<long long> latencies;
+	long long last_set = 0;
+
+	LatencyRecorder() :
+	sent(new atomic<long long>[MIDI_CHANNELS * FADER_CURVE_SIZE]), position_for_volume(65536, -1)
+	{
+		FaderCurve curve = FaderCurve::linear();
+
+		for ( unsigned int p = 0; p < FADER_CURVE_SIZE; p++ )
+			position_for_volume[curve.volume((int)p - 8192)] = (int)p;
+
+		this->reset();
+	}
+
+	void reset()
+	{
+		for ( size_t i = 0; i < MIDI_CHANNELS * FADER_CURVE_SIZE; i++ )
+			sent[i].store(0, memory_order_relaxed);
+
+		lock_guard<mutex> lock(m);
+		latencies.clear();
+		last_set = 0;
+	}
+
+	void event_sent( const BenchEvent & e, long long t )
+	{
+		sent[e.channel * FADER_CURVE_SIZE + e.position].store(t, memory_order_release);
+	}
+
+	// Runs on the mock server's thread (or the output thread, for SimulatedMixer)
+	static void on_volume_set( void *data, size_t client, __attribute__((unused)) size_t stream, uint32_t volume )
+	{
+		LatencyRecorder *self = static_cast<LatencyRecorder*>(data);
+		long long t = now_ns();
+
+		lock_guard<mutex> lock(self->m);
+		self->last_set = t;
+
+		// Client c is controlled by channel c
+		if ( client >= MIDI_CHANNELS or volume >= self->position_for_volume.size() )
+			return;
+
+		int position = self->position_for_volume[volume];
+		if ( position < 0 )
+			return;
+
+		long long t_sent = self->sent[client * FADER_CURVE_SIZE + (size_t)position].exchange(0, memory_order_acquire);
+		if ( t_sent != 0 )
+			self->latencies.push_back(t - t_sent);
+	}
+};
+
+static string format_us( long long ns )
+{
+	ostringstream out;
+	out << fixed << setprecision(1) << (double)ns / 1000.0 << "us";
+	return out.str();
+}
+
+//------------------------------------------------------------------------------
+
+// Opens a pseudo-terminal, and returns the master's fd (or -1)
+static int open_pty( string & slave_name, int & slave_fd )
+{
+	int master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if ( master_fd < 0 or grantpt(master_fd) != 0 or unlockpt(master_fd) != 0 )
+		return -1;
+
+	slave_name = ptsname(master_fd);
+
+	//   Keep the slave open ourselves, so that the pty stays up while the
+	// serial reader closes and re-opens it.  Make it raw now, so nothing we
+	// write gets mangled before the serial reader has set it up.
+	slave_fd = open(slave_name.c_str(), O_RDWR | O_NOCTTY);
+	if ( slave_fd < 0 )
+		return -1;
+
+	struct termios tio;
+	tcgetattr(slave_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave_fd, TCSANOW, &tio);
+
+	return master_fd;
+}
+
+static bool write_event( int fd, const BenchEvent & e )
+{
+	unsigned char bytes[3];
+	bytes[0] = (unsigned char)(0xE0 | e.channel);
+	bytes[1] = (unsigned char)(e.position & 0x7F);
+	bytes[2] = (unsigned char)((e.position >> 7) & 0x7F);
+
+	return write(fd, bytes, sizeof(bytes)) == (ssize_t)sizeof(bytes);
+}
+
+//   Writes the first device's reads from a capture to 'fd', at their original
+// timing (or as fast as possible).  The pitch bends in each read are given to
+// 'recorder' as if they were scenario events.  Returns how many there were.
+static size_t replay_capture( SerialCaptureReader & reader, int fd, bool original_timing, LatencyRecorder & recorder )
+{
+	size_t n_events = 0;
+	SerialCaptureRecord record;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	reader.rewind();
+	while ( reader.next(record) )
+	{
+		if ( record.device != 0 )
+			continue;
+
+		if ( original_timing )
+			this_thread::sleep_until(start + chrono::nanoseconds(record.time_ns));
+
+		long long t = now_ns();
+		for ( size_t i = 0; i + 2 < record.count; i++ )
+		{
+			const unsigned char *msg = record.data + i;
+			if ( (msg[0] & 0xF0) != 0xE0 or msg[1] >= 0x80 or msg[2] >= 0x80 )
+				continue;
+
+			BenchEvent e;
+			e.channel = (unsigned char)(msg[0] & 0x0F);
+			e.position = (unsigned int)msg[1] | ((unsigned int)msg[2] << 7);
+			recorder.event_sent(e, t);
+
+			n_events++;
+			i += 2;
+		}
+
+		if ( write(fd, record.data, record.count) != (ssize_t)record.count )
+		{
+			cerr << "Unable to write to the pseudo-terminal" << endl;
+			exit(1);
+		}
+	}
+
+	return n_events;
+}
+
+//   Writes the config file which the benchmark uses.  'client_binary' names
+// the clients (MockPulseServer's or SimulatedMixer's).
+static string write_mapping( size_t n_clients, string (*client_binary)( size_t ) )
+{
+	char filename[] = "/tmp/ttymidi_pulse_bench_XXXXXX";
+	int fd = mkstemp(filename);
+
+	if ( fd < 0 )
+		return "";
+
+	string config;
+	for ( size_t c = 0; c < MIDI_CHANNELS and c < n_clients; c++ )
+		config += to_string(c) + " application.process.binary " + client_binary(c) + " linear\n";
+
+	bool ok = write(fd, config.c_str(), config.size()) == (ssize_t)config.size();
+	close(fd);
+
+	if ( !ok )
+	{
+		unlink(filename);
+		return "";
+	}
+
+	return filename;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions opts;
+	static char doc[] = "ttymidi_pulse_bench - Feeds scripted MIDI to ttymidi_pulse, through a pty and a mock PulseAudio";
+	static struct argp argp = { options, parse_opt, 0, doc, NULL, NULL, NULL };
+
+	argp_parse(&argp, argc, argv, 0, 0, &opts);
+
+	if ( opts.parser_mb > 0 )
+		return run_parser_bench(opts.parser_mb);
+	if ( opts.ramper_check )
+		return run_ramper_check();
+	if ( opts.limiter_check )
+		return run_limiter_check();
+
+	vector<BenchEvent> events;
+	SerialCaptureReader capture;
+	string error;
+
+	if ( opts.replayfile != "" )
+	{
+		if ( !capture.open(opts.replayfile, error) )
+		{
+			cerr << "Unable to replay: " << error << endl;
+			return 1;
+		}
+	}
+	else if ( !make_scenario(opts, events) )
+	{
+		cerr << "Unknown scenario: " << opts.scenario << endl;
+		return 1;
+	}
+
+	if ( opts.clients == 0 or opts.streams == 0 )
+	{
+		cerr << "Need at least one client and one stream" << endl;
+		return 1;
+	}
+
+	bool use_sim = ( opts.backend == "sim" );
+	if ( !use_sim and opts.backend != "dbus" )
+	{
+		cerr << "Unknown backend: " << opts.backend << endl;
+		return 1;
+	}
+
+	if ( opts.count_allocations and ( !use_sim or opts.churn != 0 or opts.replayfile != "" ) )
+	{
+		cerr << "--count-allocations needs --backend sim, --churn 0, and a scenario rather than --replay" << endl;
+		return 1;
+	}
+
+	//------------------------------------------------------
+	// The mock PulseAudio (or the simulated mixer)
+
+	LatencyRecorder recorder;
+	recorder.latencies.reserve(events.size());
+	unique_ptr<MockPulseServer> mock;
+	unique_ptr<SimulatedMixer> mixer;
+
+	if ( use_sim )
+	{
+		mixer.reset(new SimulatedMixer(opts.clients, opts.streams, opts.latency_us * 1000, opts.churn));
+		mixer->set_volume_callback(&LatencyRecorder::on_volume_set, &recorder);
+	}
+	else
+	{
+		mock.reset(new MockPulseServer(opts.clients, opts.streams, BENCH_STREAM_CHANNELS));
+		mock->set_volume_callback(&LatencyRecorder::on_volume_set, &recorder);
+
+		if ( !mock->start(error) )
+		{
+			cerr << "Unable to start the mock PulseAudio server: " << error << endl;
+			return 1;
+		}
+
+		setenv("PULSE_DBUS_SERVER", mock->get_address().c_str(), 1);
+	}
+
+	auto get_set_count = [&]() { return use_sim ? mixer->get_set_count() : mock->get_set_count(); };
+
+	//------------------------------------------------------
+	// The fake serial device
+
+	string slave_name;
+	int slave_fd = -1;
+	int master_fd = open_pty(slave_name, slave_fd);
+	if ( master_fd < 0 )
+	{
+		cerr << "Unable to open a pseudo-terminal" << endl;
+		return 1;
+	}
+
+	string config_file = write_mapping(opts.clients, use_sim ? &SimulatedMixer::client_binary : &MockPulseServer::client_binary);
+	if ( config_file == "" )
+	{
+		cerr << "Unable to write the fader mapping" << endl;
+		return 1;
+	}
+
+	//------------------------------------------------------
+	// ttymidi_pulse itself, set up as in main.cpp
+
+	Arguments arguments;
+	arguments.silent = !opts.verbose;
+	arguments.verbose = opts.verbose;
+	logger.set_level(opts.verbose ? LOG_VERBOSE : LOG_ERROR);
+	logger.start();
+	arguments.stream_rate = opts.stream_rate;
+	arguments.total_rate = opts.total_rate;
+	arguments.tick_rate = opts.tick_rate;
+	arguments.ramp_ms = opts.ramp_ms;
+	arguments.realtime_policy = opts.realtime_policy;
+	arguments.realtime_priority = opts.realtime_priority;
+	arguments.reader_cpus = opts.reader_cpus;
+	arguments.output_cpus = opts.output_cpus;
+
+	SerialDevice device;
+	device.path = slave_name;
+	device.baudrate = arguments.baudrate;
+	device.channel_offset = 0;
+	arguments.serialdevices.push_back(device);
+	arguments.configfile = config_file;
+
+	const FaderMappingTable *mapping = FaderMappingTable::load(config_file, error);
+	if ( mapping == NULL )
+	{
+		cerr << "Unable to load the fader mapping: " << error << endl;
+		return 1;
+	}
+
+	if ( opts.tracefile != "" )
+	{
+		event_tracer.start_trace(TRACE_MAX_EVENTS);
+		if ( realtime_enabled(arguments) )
+			event_tracer.prefault_trace();
+	}
+
+	DBusPulseAudio dbus_pulse(arguments);
+	VolumeBackend & backend = use_sim ? static_cast<VolumeBackend&>(*mixer) : dbus_pulse;
+	MIDIHandler_Program_Volume handler(arguments, backend, mapping);
+	MIDIEventDispatcher dispatcher(arguments, &handler);
+	SerialMIDIReader serial_reader(arguments, device, dispatcher.add_input(device.path, 0));
+
+	try
+	{
+		if ( !backend.connect() )
+		{
+			cerr << "Unable to connect to the mock PulseAudio server" << endl;
+			return 1;
+		}
+	}
+	catch ( GError *e )
+	{
+		cerr << "Unable to connect to the mock PulseAudio server: " << e->message << endl;
+		g_error_free(e);
+		return 1;
+	}
+
+	dispatcher.start();
+
+	//   The serial device is read from an event loop, like in ttymidi_pulse.
+	// (DBus keeps its own thread, because this thread is busy sending.)
+	EventLoop loop;
+	if ( !loop.init() )
+	{
+		cerr << "Unable to create the event loop" << endl;
+		exit(1);
+	}
+
+	realtime_lock_memory(arguments);
+
+	thread reader_thread([&]()
+	{
+		realtime_thread_setup("reader", arguments, arguments.reader_cpus);
+		serial_reader.start(loop);
+		loop.run();
+		serial_reader.stop();
+	});
+
+	//   Sends the scenario's events, at opts.rate
+	auto send_events = [&]()
+	{
+		chrono::steady_clock::time_point next_send = chrono::steady_clock::now();
+		chrono::nanoseconds period(opts.rate == 0 ? 0 : 1000000000LL / (long long)opts.rate);
+
+		for ( const BenchEvent & e : events )
+		{
+			if ( opts.rate != 0 )
+			{
+				this_thread::sleep_until(next_send);
+				next_send += period;
+			}
+
+			recorder.event_sent(e, now_ns());
+
+			if ( !write_event(master_fd, e) )
+			{
+				cerr << "Unable to write to the pseudo-terminal" << endl;
+				exit(1);
+			}
+		}
+	};
+
+	//   Waits for the events which have been sent to get through: until no Set
+	// has arrived for BENCH_QUIET_MS (or BENCH_DRAIN_SECONDS have gone by)
+	auto wait_until_quiet = [&]()
+	{
+		unsigned long last_count = get_set_count();
+		auto last_change = chrono::steady_clock::now();
+		auto drain_end = last_change + chrono::seconds(BENCH_DRAIN_SECONDS);
+
+		while ( chrono::steady_clock::now() < drain_end )
+		{
+			this_thread::sleep_for(chrono::milliseconds(10));
+
+			unsigned long count = get_set_count();
+			if ( count != last_count )
+			{
+				last_count = count;
+				last_change = chrono::steady_clock::now();
+			}
+			else if ( dispatcher.queue_depth() == 0 and
+			          chrono::steady_clock::now() - last_change > chrono::milliseconds(BENCH_QUIET_MS) )
+				break;
+		}
+	};
+
+	//------------------------------------------------------
+	// Warm up
+
+	//   The serial reader flushes the pty when it opens it, so anything sent
+	// before then is lost.  Keep nudging fader 0 until something gets all of
+	// the way through.  This also fills the resolution cache.
+	BenchEvent nudge;
+	nudge.channel = 0;
+	nudge.position = 8192;
+
+	auto warmup_end = chrono::steady_clock::now() + chrono::seconds(BENCH_WARMUP_SECONDS);
+	while ( get_set_count() == 0 and chrono::steady_clock::now() < warmup_end )
+	{
+		write_event(master_fd, nudge);
+		nudge.position ^= 1;
+		this_thread::sleep_for(chrono::milliseconds(20));
+	}
+
+	if ( get_set_count() == 0 )
+	{
+		cerr << "Nothing got through to the mock PulseAudio server within " << BENCH_WARMUP_SECONDS << "s" << endl;
+		exit(1);    // Not return: the threads are still running
+	}
+
+	//   Before counting allocations, everything has to have happened once (every
+	// stream seen, every buffer grown as big as it gets), so send the whole lot
+	// once first.
+	if ( opts.count_allocations )
+	{
+		send_events();
+		wait_until_quiet();
+	}
+
+	this_thread::sleep_for(chrono::milliseconds(BENCH_QUIET_MS));
+	recorder.reset();
+	event_tracer.reset();
+
+	unsigned long base_applied   = dispatcher.get_applied_count();
+	unsigned long base_coalesced = dispatcher.get_coalesced_count();
+	unsigned long base_dropped   = dispatcher.get_overflow_count();
+	unsigned long base_sets      = get_set_count();
+	unsigned long base_deferred  = handler.get_limiter().get_deferred_count();
+	unsigned long base_suppressed = handler.get_limiter().get_suppressed_count();
+	unsigned long base_ticks     = handler.get_ramper().get_tick_count();
+
+	//------------------------------------------------------
+	// Run
+
+	if ( opts.replayfile != "" )
+		cout << "Replay of " << opts.replayfile << ": ";
+	else
+		cout << "Scenario " << opts.scenario << ": " << opts.events << " events, ";
+	cout << opts.clients << " clients x " << opts.streams << " streams, ";
+	if ( opts.rate == 0 )
+		cout << "sent as fast as possible" << endl;
+	else if ( opts.replayfile != "" )
+		cout << "at the original timing" << endl;
+	else
+		cout << opts.rate << " events/s offered" << endl;
+
+	if ( opts.count_allocations )
+		start_counting_allocations();
+
+	long long start = now_ns();
+
+	size_t n_sent = events.size();
+	if ( opts.replayfile != "" )
+		n_sent = replay_capture(capture, master_fd, opts.rate != 0, recorder);
+
+	send_events();
+
+	long long sent_done = now_ns();
+
+	// Wait for the last events to get through
+	wait_until_quiet();
+
+	unsigned long allocations = opts.count_allocations ? stop_counting_allocations() : 0;
+
+	//------------------------------------------------------
+	// Shut down
+
+	loop.quit();
+	reader_thread.join();
+	close(master_fd);
+	close(slave_fd);
+
+	dispatcher.stop();
+	backend.disconnect();
+	if ( mock )
+		mock->stop();
+	unlink(config_file.c_str());
+	logger.stop();
+
+	//------------------------------------------------------
+	// Report
+
+	unsigned long applied   = dispatcher.get_applied_count()   - base_applied;
+	unsigned long coalesced = dispatcher.get_coalesced_count() - base_coalesced;
+	unsigned long dropped   = dispatcher.get_overflow_count()  - base_dropped;
+	unsigned long sets      = get_set_count()             - base_sets;
+	unsigned long deferred  = handler.get_limiter().get_deferred_count()   - base_deferred;
+	unsigned long suppressed = handler.get_limiter().get_suppressed_count() - base_suppressed;
+	unsigned long ticks     = handler.get_ramper().get_tick_count()       - base_ticks;
+
+	lock_guard<mutex> lock(recorder.m);
+	vector<long long> & lat = recorder.latencies;
+	long long end = max(recorder.last_set, sent_done);
+	double seconds = (double)(end - start) / 1e9;
+
+	cout << fixed << setprecision(0);
+	cout << "Sent:       " << n_sent << " events in " << setprecision(3) << (double)(sent_done - start) / 1e9 << "s" << endl;
+	cout << "Throughput: " << setprecision(0) << (double)n_sent / seconds << " events/s (to the last Set)" << endl;
+	cout << "Dispatcher: " << applied << " applied, " << coalesced << " coalesced, " << dropped << " dropped" << endl;
+	cout << "Backend:    " << backend.get_stats() << endl;
+	cout << "Set calls:  " << sets << " (" << deferred << " held back by the rate limit first, " << suppressed << " suppressed)" << endl;
+	if ( handler.get_ramper().enabled() )
+		cout << "Ramping:    " << ticks << " ticks" << endl;
+	if ( opts.count_allocations )
+		cout << "Allocations: " << allocations << " while the events went through (the second time)" << endl;
+
+	//   Compare runs with and without --realtime, but only if it really was:
+	// without the privileges, the threads are ordinary ones.
+	cout << "Real-time:  " << realtime_description(arguments);
+	if ( realtime_failure_count() > 0 )
+		cout << " (but not all of it was allowed: see --verbose for why)";
+	cout << endl;
+
+	for ( int s = 0; s < EventTracer::N_STAGES; s++ )
+		cout << "Stage " << EventTracer::stage_name((EventTracer::Stage)s) << ": " << event_tracer.histograms[s].summary() << endl;
+
+	if ( opts.tracefile != "" )
+	{
+		if ( !event_tracer.write_trace(opts.tracefile, error) )
+			cerr << "Unable to write trace: " << error << endl;
+		else
+			cout << "Wrote trace to " << opts.tracefile << endl;
+	}
+
+	if ( lat.empty() )
+	{
+		cout << "Latency:    no samples" << endl;
+		return allocations == 0 ? 0 : 1;
+	}
+
+	sort(lat.begin(), lat.end());
+	auto percentile = [&lat]( double q ) { return lat[min(lat.size() - 1, (size_t)(q * (double)lat.size()))]; };
+
+	cout << "Latency from fader byte to Set (" << lat.size() << " events): "
+	     << "p50 " << format_us(percentile(0.5))
+	     << ", p99 " << format_us(percentile(0.99))
+	     << ", p999 " << format_us(percentile(0.999))
+	     << ", max " << format_us(lat.back()) << endl;
+
+	// With --count-allocations, any at all is a failure
+	return allocations == 0 ? 0 : 1;
+}
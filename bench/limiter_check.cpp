@@ -0,0 +1,181 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "limiter_check.hh"
+
+#include "event_trace.hh"
+#include "volume_rate_limiter.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// ttymidi_pulse's default limits
+#define LIMITER_CHECK_STREAM_RATE 30
+#define LIMITER_CHECK_TOTAL_RATE  300
+
+//   One fader controlling this many streams, moved every
+// LIMITER_CHECK_EVENT_MS for LIMITER_CHECK_MOVING_MS
+#define LIMITER_CHECK_STREAMS   20
+#define LIMITER_CHECK_EVENT_MS  5
+#define LIMITER_CHECK_MOVING_MS 2000
+
+// The held writes are taken this often (the output thread wakes when they're due)
+#define LIMITER_CHECK_TAKE_MS 1
+
+static unsigned int failures = 0;
+
+static void expect( bool ok, const string & what )
+{
+	if ( ok )
+		return;
+
+	cout << "  FAIL: " << what << endl;
+	failures++;
+}
+
+//   One fader, on all of the streams, moving every LIMITER_CHECK_EVENT_MS
+// until 'moving_ms', and then left alone until 'end_ms'.  Each event offers
+// every stream a new volume (in the same order each time, as the handler
+// does).  Returns how many writes each stream got, and what each was last
+// set to.
+static void run_fader( VolumeRateLimiter & limiter, uint64_t moving_ms, uint64_t end_ms,
+                       vector<unsigned long> & counts, vector<unsigned int> & last )
+{
+	vector<string> names;
+	for ( unsigned int i = 0; i < LIMITER_CHECK_STREAMS; i++ )
+		names.push_back("stream " + to_string(i));
+
+	counts.assign(LIMITER_CHECK_STREAMS, 0);
+	last.assign(LIMITER_CHECK_STREAMS, ~0u);
+
+	ReusableVector< pair<string,unsigned int> > due;
+	ReusableVector<EventTimes> origins;
+	EventTimes origin = EventTimes();
+
+	for ( uint64_t ms = 1; ms <= end_ms; ms++ )
+	{
+		uint64_t now_ns = ms * 1000000ULL;
+
+		if ( ms <= moving_ms and ms % LIMITER_CHECK_EVENT_MS == 0 )
+		{
+			unsigned int volume = (unsigned int)ms;
+			for ( unsigned int i = 0; i < LIMITER_CHECK_STREAMS; i++ )
+				if ( limiter.offer(names[i], volume, now_ns, origin) )
+				{
+					counts[i]++;
+					last[i] = volume;
+				}
+		}
+
+		if ( ms % LIMITER_CHECK_TAKE_MS != 0 )
+			continue;
+
+		due.clear();
+		origins.clear();
+		limiter.take_due(now_ns, due, origins);
+
+		for ( const pair<string,unsigned int> & write : due )
+		{
+			unsigned int i = (unsigned int)(find(names.begin(), names.end(), write.first) - names.begin());
+			counts[i]++;
+			last[i] = write.second;
+		}
+	}
+}
+
+static string describe( const vector<unsigned long> & counts )
+{
+	ostringstream out;
+	for ( unsigned long n : counts )
+		out << " " << n;
+	return out.str();
+}
+
+//   With the overall limit what holds them back, the streams share it: a
+// stream which comes later in each event doesn't wait while the earlier ones
+// take every token.
+static void check_many_streams()
+{
+	cout << LIMITER_CHECK_STREAMS << " streams on one fader" << endl;
+
+	VolumeRateLimiter limiter(LIMITER_CHECK_STREAM_RATE, LIMITER_CHECK_TOTAL_RATE);
+	vector<unsigned long> counts;
+	vector<unsigned int> last;
+	run_fader(limiter, LIMITER_CHECK_MOVING_MS, LIMITER_CHECK_MOVING_MS, counts, last);
+
+	unsigned long least = *min_element(counts.begin(), counts.end());
+	unsigned long most = *max_element(counts.begin(), counts.end());
+
+	//   300 a second for 2s, plus the burst, is about 630 writes, so each
+	// stream should get about 31
+	unsigned long total = 0;
+	for ( unsigned long n : counts )
+		total += n;
+
+	expect(most - least <= 2, "uneven writes per stream:" + describe(counts));
+	expect(total >= LIMITER_CHECK_TOTAL_RATE * LIMITER_CHECK_MOVING_MS / 1000, "too few writes altogether:" + describe(counts));
+	expect(limiter.get_written_count() == total, "written count doesn't match the writes");
+}
+
+// Once the fader stops, every stream gets its last volume
+static void check_last_volume()
+{
+	cout << "Last volume" << endl;
+
+	VolumeRateLimiter limiter(LIMITER_CHECK_STREAM_RATE, LIMITER_CHECK_TOTAL_RATE);
+	vector<unsigned long> counts;
+	vector<unsigned int> last;
+	run_fader(limiter, LIMITER_CHECK_MOVING_MS, LIMITER_CHECK_MOVING_MS + 1000, counts, last);
+
+	unsigned int final_volume = LIMITER_CHECK_MOVING_MS - LIMITER_CHECK_MOVING_MS % LIMITER_CHECK_EVENT_MS;
+	for ( unsigned int i = 0; i < LIMITER_CHECK_STREAMS; i++ )
+		if ( last[i] != final_volume )
+		{
+			ostringstream what;
+			what << "stream " << i << " was left at " << last[i] << ", not " << final_volume;
+			expect(false, what.str());
+		}
+
+	expect(limiter.next_due_ns() == 0, "still holding writes after the fader stopped");
+}
+
+int run_limiter_check()
+{
+	failures = 0;
+
+	check_many_streams();
+	check_last_volume();
+
+	if ( failures > 0 )
+	{
+		cout << failures << " VolumeRateLimiter check(s) failed" << endl;
+		return 1;
+	}
+
+	cout << "VolumeRateLimiter is OK" << endl;
+	return 0;
+}
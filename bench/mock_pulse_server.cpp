@@ -0,0 +1,390 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "mock_pulse_server.hh"
+
+#include <cstring>
+
+using namespace std;
+
+// Just the interfaces (and members) which DBusPulseAudio uses
+static const char introspection_xml[] =
+	"<node>"
+	"  <interface name='org.PulseAudio.Core1'>"
+	"    <method name='ListenForSignal'>"
+	"      <arg type='s' name='signal' direction='in'/>"
+	"      <arg type='ao' name='objects' direction='in'/>"
+	"    </method>"
+	"    <property type='ao' name='Clients' access='read'/>"
+	"    <property type='ao' name='PlaybackStreams' access='read'/>"
+	"  </interface>"
+	"  <interface name='org.PulseAudio.Core1.Client'>"
+	"    <property type='a{say}' name='PropertyList' access='read'/>"
+	"    <property type='ao' name='PlaybackStreams' access='read'/>"
+	"  </interface>"
+	"  <interface name='org.PulseAudio.Core1.Stream'>"
+	"    <property type='o' name='Client' access='read'/>"
+	"    <property type='au' name='Volume' access='readwrite'/>"
+	"    <property type='a{say}' name='PropertyList' access='read'/>"
+	"  </interface>"
+	"</node>";
+
+//==============================================================================
+// Starting and stopping
+
+bool MockPulseServer::start( string & error )
+{
+	GError *gerror = NULL;
+
+	if ( this->server_thread.joinable() )
+		return true;
+
+	this->introspection = g_dbus_node_info_new_for_xml(introspection_xml, &gerror);
+	if ( gerror != NULL )
+	{
+		error = gerror->message;
+		g_error_free(gerror);
+		return false;
+	}
+
+	// Everything the vtable callbacks need, laid out before any calls arrive
+	this->core_object.self = this;
+	this->core_object.client = 0;
+	this->core_object.stream = 0;
+
+	this->client_objects.resize(this->n_clients);
+	this->stream_objects.resize(this->n_clients * this->streams_per_client);
+	this->volumes.assign(this->stream_objects.size(), vector<uint32_t>(this->n_channels, 65536));
+
+	for ( size_t c = 0; c < this->n_clients; c++ )
+	{
+		this->client_objects[c].self = this;
+		this->client_objects[c].client = c;
+		this->client_objects[c].stream = 0;
+
+		for ( size_t i = 0; i < this->streams_per_client; i++ )
+		{
+			MockObject & s = this->stream_objects[c * this->streams_per_client + i];
+			s.self = this;
+			s.client = c;
+			s.stream = c * this->streams_per_client + i;
+		}
+	}
+
+	this->context = g_main_context_new();
+	this->loop = g_main_loop_new(this->context, FALSE);
+	this->started = false;
+
+	this->server_thread = thread(&MockPulseServer::server_thread_main, this);
+
+	unique_lock<mutex> lock(this->startup_mutex);
+	while ( !this->started )
+		this->startup_done.wait(lock);
+
+	if ( this->startup_error != "" )
+	{
+		lock.unlock();
+		error = this->startup_error;
+		this->stop();
+		return false;
+	}
+
+	return true;
+}
+
+gboolean MockPulseServer::quit_loop( gpointer user_data )
+{
+	g_main_loop_quit(static_cast<GMainLoop*>(user_data));
+
+	return G_SOURCE_REMOVE;
+}
+
+void MockPulseServer::stop()
+{
+	if ( !this->server_thread.joinable() )
+		return;
+
+	//   g_main_loop_quit() would be lost if the loop isn't running yet, so
+	// have the loop quit itself.
+	GSource *source = g_idle_source_new();
+	g_source_set_callback(source, &MockPulseServer::quit_loop, this->loop, NULL);
+	g_source_attach(source, this->context);
+	g_source_unref(source);
+
+	this->server_thread.join();
+
+	g_main_loop_unref(this->loop);
+	g_main_context_unref(this->context);
+	g_dbus_node_info_unref(this->introspection);
+	this->loop = nullptr;
+	this->context = nullptr;
+	this->introspection = nullptr;
+}
+
+void MockPulseServer::server_thread_main()
+{
+	GError *error = NULL;
+
+	//   The server's new-connection signal, and the calls to the objects
+	// registered on its connections, get dispatched here.
+	g_main_context_push_thread_default(this->context);
+
+	gchar *guid = g_dbus_generate_guid();
+	this->server = g_dbus_server_new_sync(
+	                   "unix:tmpdir=/tmp",
+	                   G_DBUS_SERVER_FLAGS_NONE,
+	                   guid,
+	                   NULL,  // GDBusAuthObserver
+	                   NULL,  // GCancellable
+	                   &error );
+	g_free(guid);
+
+	if ( this->server != NULL )
+	{
+		g_signal_connect(this->server, "new-connection", G_CALLBACK(&MockPulseServer::on_new_connection), this);
+		g_dbus_server_start(this->server);
+		this->address = g_dbus_server_get_client_address(this->server);
+	}
+
+	{
+		lock_guard<mutex> lock(this->startup_mutex);
+		if ( error != NULL )
+		{
+			this->startup_error = error->message;
+			g_error_free(error);
+		}
+		this->started = true;
+		this->startup_done.notify_one();
+	}
+
+	if ( this->server != NULL )
+	{
+		g_main_loop_run(this->loop);
+
+		g_dbus_server_stop(this->server);
+		g_object_unref(this->server);
+		this->server = nullptr;
+	}
+
+	for ( GDBusConnection *conn : this->connections )
+		g_object_unref(conn);
+	this->connections.clear();
+
+	g_main_context_pop_thread_default(this->context);
+}
+
+//==============================================================================
+// Objects
+
+string MockPulseServer::client_binary( size_t client )
+{
+	return "bench-client-" + to_string(client);
+}
+
+string MockPulseServer::client_path( size_t client )
+{
+	return "/org/pulseaudio/core1/client" + to_string(client);
+}
+
+string MockPulseServer::stream_path( size_t stream )
+{
+	return "/org/pulseaudio/core1/playback_stream" + to_string(stream);
+}
+
+// Runs on the server thread
+gboolean MockPulseServer::on_new_connection(
+	__attribute__((unused)) GDBusServer *server,
+	GDBusConnection *conn,
+	gpointer user_data )
+{
+	MockPulseServer *self = static_cast<MockPulseServer*>(user_data);
+
+	self->connections.push_back(G_DBUS_CONNECTION(g_object_ref(conn)));
+	self->register_objects(conn);
+
+	return TRUE;
+}
+
+void MockPulseServer::register_objects( GDBusConnection *conn )
+{
+	static const GDBusInterfaceVTable vtable =
+		{ &MockPulseServer::method_call, &MockPulseServer::get_property, &MockPulseServer::set_property, {0} };
+
+	GDBusInterfaceInfo *core_info   = g_dbus_node_info_lookup_interface(this->introspection, "org.PulseAudio.Core1");
+	GDBusInterfaceInfo *client_info = g_dbus_node_info_lookup_interface(this->introspection, "org.PulseAudio.Core1.Client");
+	GDBusInterfaceInfo *stream_info = g_dbus_node_info_lookup_interface(this->introspection, "org.PulseAudio.Core1.Stream");
+
+	//   Errors here would only mean that the path was already registered, so
+	// they are ignored.  The objects live as long as the connection does.
+	g_dbus_connection_register_object(conn, "/org/pulseaudio/core1", core_info, &vtable, &this->core_object, NULL, NULL);
+
+	for ( MockObject & c : this->client_objects )
+		g_dbus_connection_register_object(conn, client_path(c.client).c_str(), client_info, &vtable, &c, NULL, NULL);
+
+	for ( MockObject & s : this->stream_objects )
+		g_dbus_connection_register_object(conn, stream_path(s.stream).c_str(), stream_info, &vtable, &s, NULL, NULL);
+}
+
+// Like PulseAudio, the values are strings including their trailing '\0'
+GVariant *MockPulseServer::client_property_list( size_t client ) const
+{
+	GVariantBuilder builder;
+	string name = "Benchmark client " + to_string(client);
+	string binary = client_binary(client);
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{say}"));
+	g_variant_builder_add(&builder, "{s@ay}", "application.name",
+	                      g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, name.c_str(), name.size() + 1, 1));
+	g_variant_builder_add(&builder, "{s@ay}", "application.process.binary",
+	                      g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, binary.c_str(), binary.size() + 1, 1));
+
+	return g_variant_builder_end(&builder);
+}
+
+GVariant *MockPulseServer::client_streams( size_t client ) const
+{
+	GVariantBuilder builder;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("ao"));
+	for ( size_t i = 0; i < this->streams_per_client; i++ )
+		g_variant_builder_add(&builder, "o", stream_path(client * this->streams_per_client + i).c_str());
+
+	return g_variant_builder_end(&builder);
+}
+
+//==============================================================================
+// The vtable.  These all run on the server thread.
+
+void MockPulseServer::method_call(
+	__attribute__((unused)) GDBusConnection *conn,
+	__attribute__((unused)) const gchar *sender,
+	__attribute__((unused)) const gchar *object_path,
+	__attribute__((unused)) const gchar *interface_name,
+	const gchar *method_name,
+	__attribute__((unused)) GVariant *parameters,
+	GDBusMethodInvocation *invocation,
+	__attribute__((unused)) gpointer user_data )
+{
+	//   Clients and streams never come and go here, so there is nothing to
+	// signal: just say OK.
+	if ( strcmp(method_name, "ListenForSignal") == 0 )
+		g_dbus_method_invocation_return_value(invocation, NULL);
+	else
+		g_dbus_method_invocation_return_error_literal(invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD, "No such method");
+}
+
+GVariant *MockPulseServer::get_property(
+	__attribute__((unused)) GDBusConnection *conn,
+	__attribute__((unused)) const gchar *sender,
+	__attribute__((unused)) const gchar *object_path,
+	const gchar *interface_name,
+	const gchar *property_name,
+	GError **error,
+	gpointer user_data )
+{
+	MockObject *obj = static_cast<MockObject*>(user_data);
+	MockPulseServer *self = obj->self;
+	GVariantBuilder builder;
+
+	if ( strcmp(interface_name, "org.PulseAudio.Core1") == 0 )
+	{
+		if ( strcmp(property_name, "Clients") == 0 )
+		{
+			g_variant_builder_init(&builder, G_VARIANT_TYPE("ao"));
+			for ( size_t c = 0; c < self->n_clients; c++ )
+				g_variant_builder_add(&builder, "o", client_path(c).c_str());
+			return g_variant_builder_end(&builder);
+		}
+
+		if ( strcmp(property_name, "PlaybackStreams") == 0 )
+		{
+			g_variant_builder_init(&builder, G_VARIANT_TYPE("ao"));
+			for ( size_t s = 0; s < self->stream_objects.size(); s++ )
+				g_variant_builder_add(&builder, "o", stream_path(s).c_str());
+			return g_variant_builder_end(&builder);
+		}
+	}
+	else if ( strcmp(interface_name, "org.PulseAudio.Core1.Client") == 0 )
+	{
+		if ( strcmp(property_name, "PropertyList") == 0 )
+			return self->client_property_list(obj->client);
+
+		if ( strcmp(property_name, "PlaybackStreams") == 0 )
+			return self->client_streams(obj->client);
+	}
+	else if ( strcmp(interface_name, "org.PulseAudio.Core1.Stream") == 0 )
+	{
+		if ( strcmp(property_name, "Client") == 0 )
+			return g_variant_new_object_path(client_path(obj->client).c_str());
+
+		if ( strcmp(property_name, "Volume") == 0 )
+		{
+			const vector<uint32_t> & vol = self->volumes[obj->stream];
+			return g_variant_new_fixed_array(G_VARIANT_TYPE_UINT32, vol.data(), vol.size(), sizeof(uint32_t));
+		}
+
+		if ( strcmp(property_name, "PropertyList") == 0 )
+			return self->client_property_list(obj->client);
+	}
+
+	g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "No such property: %s.%s", interface_name, property_name);
+	return NULL;
+}
+
+gboolean MockPulseServer::set_property(
+	__attribute__((unused)) GDBusConnection *conn,
+	__attribute__((unused)) const gchar *sender,
+	__attribute__((unused)) const gchar *object_path,
+	const gchar *interface_name,
+	const gchar *property_name,
+	GVariant *value,
+	GError **error,
+	gpointer user_data )
+{
+	MockObject *obj = static_cast<MockObject*>(user_data);
+	MockPulseServer *self = obj->self;
+
+	if ( strcmp(interface_name, "org.PulseAudio.Core1.Stream") != 0 or strcmp(property_name, "Volume") != 0 )
+	{
+		g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "Property is read-only: %s.%s", interface_name, property_name);
+		return FALSE;
+	}
+
+	gsize n;
+	const uint32_t *vol = static_cast<const uint32_t*>(g_variant_get_fixed_array(value, &n, sizeof(uint32_t)));
+
+	//   PulseAudio accepts either one volume for all channels, or one per
+	// channel
+	if ( n != 1 and n != self->n_channels )
+	{
+		g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS, "Wrong number of channels: %u", (unsigned int)n);
+		return FALSE;
+	}
+
+	vector<uint32_t> & stored = self->volumes[obj->stream];
+	for ( size_t i = 0; i < stored.size(); i++ )
+		stored[i] = vol[n == 1 ? 0 : i];
+
+	self->set_count.fetch_add(1, memory_order_relaxed);
+
+	if ( self->volume_set_callback != NULL )
+		self->volume_set_callback(self->volume_set_data, obj->client, obj->stream, vol[0]);
+
+	return TRUE;
+}
@@ -0,0 +1,153 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MOCK_PULSE_SERVER_HH
+#define MOCK_PULSE_SERVER_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gio/gio.h>		// for g_dbus_*
+
+//   A stand-in for PulseAudio's module-dbus-protocol, for benchmarking.  It is
+// a peer-to-peer DBus server (like the real one), which serves just the parts
+// of org.PulseAudio.Core1 that DBusPulseAudio uses:
+//     /org/pulseaudio/core1                   Clients, PlaybackStreams, ListenForSignal()
+//     /org/pulseaudio/core1/client<i>         PropertyList, PlaybackStreams
+//     /org/pulseaudio/core1/playback_stream<j> Client, Volume, PropertyList
+//   Client i has application.process.binary = client_binary(i), and
+// 'streams_per_client' playback streams.  Setting a stream's volume calls the
+// volume callback (on the server's thread).
+//   Everything is served by a GMainContext on the server's own thread.
+struct MockPulseServer
+{
+	//   Called whenever a stream's Volume is Set.  'volume' is the volume of
+	// the first channel.
+	typedef void (*VolumeSetCallback)( void *data, size_t client, size_t stream, uint32_t volume );
+
+	MockPulseServer( size_t n_clients_in, size_t streams_per_client_in, size_t n_channels_in ) :
+	n_clients(n_clients_in), streams_per_client(streams_per_client_in), n_channels(n_channels_in),
+	volume_set_callback(NULL), volume_set_data(NULL), set_count(0)
+	{ }
+
+	~MockPulseServer() { this->stop(); }
+
+	//   Starts the server thread.  Returns false (and sets 'error') if the
+	// server couldn't be started.
+	bool start( std::string & error );
+	void stop();
+
+	// The address to connect to (i.e. to put in PULSE_DBUS_SERVER)
+	const std::string & get_address() const { return address; }
+
+	// Must be called before start()
+	void set_volume_callback( VolumeSetCallback callback, void *data )
+	{
+		volume_set_callback = callback;
+		volume_set_data = data;
+	}
+
+	static std::string client_binary( size_t client );
+
+	unsigned long get_set_count() const { return set_count.load(std::memory_order_relaxed); }
+
+private:
+	const size_t n_clients, streams_per_client, n_channels;
+
+	VolumeSetCallback volume_set_callback;
+	void *volume_set_data;
+
+	std::atomic<unsigned long> set_count;
+
+	// One of these per registered object, given to the vtable as user_data
+	struct MockObject
+	{
+		MockPulseServer *self;
+		size_t client;   // Index of the client (or of the stream's client)
+		size_t stream;   // Index of the stream (only for streams)
+	};
+
+	MockObject core_object;
+	std::vector<MockObject> client_objects, stream_objects;
+
+	// Volume of each channel of each stream.  Only used on the server thread.
+	std::vector< std::vector<uint32_t> > volumes;
+
+	std::string address;
+
+	GMainContext *context = nullptr;
+	GMainLoop *loop = nullptr;
+	GDBusServer *server = nullptr;
+	GDBusNodeInfo *introspection = nullptr;
+	std::vector<GDBusConnection*> connections;
+	std::thread server_thread;
+
+	//   start() waits on these for the server thread to have set up the
+	// server (or failed to).
+	std::mutex startup_mutex;
+	std::condition_variable startup_done;
+	bool started = false;
+	std::string startup_error;
+
+	void server_thread_main();
+	void register_objects( GDBusConnection *conn );
+
+	static std::string client_path( size_t client );
+	static std::string stream_path( size_t stream );
+	GVariant *client_property_list( size_t client ) const;
+	GVariant *client_streams( size_t client ) const;
+
+	static gboolean on_new_connection( GDBusServer *server, GDBusConnection *conn, gpointer user_data );
+	static gboolean quit_loop( gpointer user_data );
+
+	static void method_call(
+		GDBusConnection *conn,
+		const gchar *sender,
+		const gchar *object_path,
+		const gchar *interface_name,
+		const gchar *method_name,
+		GVariant *parameters,
+		GDBusMethodInvocation *invocation,
+		gpointer user_data );
+
+	static GVariant *get_property(
+		GDBusConnection *conn,
+		const gchar *sender,
+		const gchar *object_path,
+		const gchar *interface_name,
+		const gchar *property_name,
+		GError **error,
+		gpointer user_data );
+
+	static gboolean set_property(
+		GDBusConnection *conn,
+		const gchar *sender,
+		const gchar *object_path,
+		const gchar *interface_name,
+		const gchar *property_name,
+		GVariant *value,
+		GError **error,
+		gpointer user_data );
+};
+
+#endif // MOCK_PULSE_SERVER_HH
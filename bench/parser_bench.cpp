@@ -0,0 +1,212 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "parser_bench.hh"
+
+#include "midi_decoder.hh"
+#include "midi_handler_chain.hh"
+#include "midi_stream_parser.hh"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// How many times each input is decoded (the best one counts)
+#define PARSER_BENCH_RUNS 5
+
+// The bytes are fed in as if this many came with each read()
+#define PARSER_BENCH_READ_SIZE 4096
+
+//------------------------------------------------------------------------------
+// Inputs
+
+//   Faders: pitch bends on all 16 channels (several in a row on the same
+// channel use running status), with a MIDI clock byte now and then, sometimes
+// in the middle of a message.
+static void make_faders( vector<unsigned char> & out, size_t size, mt19937 & rng )
+{
+	while ( out.size() < size )
+	{
+		unsigned int channel = rng() % 16;
+		out.push_back((unsigned char)(0xE0 + channel));
+
+		for ( unsigned int n = rng() % 4 + 1; n > 0; n-- )
+		{
+			unsigned int position = rng() % 16384;
+			out.push_back((unsigned char)(position & 0x7F));
+			if ( rng() % 32 == 0 )
+				out.push_back(0xF8);
+			out.push_back((unsigned char)(position >> 7));
+		}
+	}
+}
+
+// SysEx dumps (which are all skipped), with a few notes in between
+static void make_sysex( vector<unsigned char> & out, size_t size, mt19937 & rng )
+{
+	while ( out.size() < size )
+	{
+		out.push_back(0xF0);
+		for ( unsigned int n = rng() % 1024 + 64; n > 0; n-- )
+			out.push_back((unsigned char)(rng() % 128));
+		out.push_back(0xF7);
+
+		out.push_back(0x90);
+		out.push_back((unsigned char)(rng() % 128));
+		out.push_back((unsigned char)(rng() % 128));
+	}
+}
+
+//   Line noise: data bytes which don't belong to anything, and now and then a
+// message.  The parser has to find its way back to each one.  (Each burst
+// starts with a tune request, which cancels running status, or the junk would
+// just be more controller changes.)
+static void make_noise( vector<unsigned char> & out, size_t size, mt19937 & rng )
+{
+	while ( out.size() < size )
+	{
+		out.push_back(0xF6);
+		for ( unsigned int n = rng() % 512; n > 0; n-- )
+			out.push_back((unsigned char)(rng() % 128));
+
+		out.push_back(0xB0);
+		out.push_back(7);
+		out.push_back((unsigned char)(rng() % 128));
+	}
+}
+
+//------------------------------------------------------------------------------
+// Handlers
+
+//   Handlers which just count (so that the compiler can't throw the work
+// away): one known at compile time, and the same behind MIDICommandHandler's
+// virtual functions.
+struct CountingHandler : StaticMIDIHandler<CountingHandler>
+{
+	unsigned long count = 0, sum = 0;
+
+	void controller_change(int channel, int controller_nr, int controller_value) { count++; sum += (unsigned long)(channel + controller_nr + controller_value); }
+	void note_on(int channel, int key, int velocity)                             { count++; sum += (unsigned long)(channel + key + velocity); }
+	void pitch_bend(int channel, int pitch)                                      { count++; sum += (unsigned long)(channel + pitch + 8192); }
+};
+
+struct VirtualCountingHandler : MIDICommandHandler
+{
+	CountingHandler counter;
+
+	virtual void controller_change(int channel, int controller_nr, int controller_value) override { counter.controller_change(channel, controller_nr, controller_value); }
+	virtual void note_on(int channel, int key, int velocity) override                             { counter.note_on(channel, key, velocity); }
+	virtual void pitch_bend(int channel, int pitch) override                                      { counter.pitch_bend(channel, pitch); }
+};
+
+//------------------------------------------------------------------------------
+
+static double seconds_since( chrono::steady_clock::time_point start )
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Runs 'feed' over 'data' in read-sized pieces, and returns the best time
+template <class Feed>
+static double time_best( const vector<unsigned char> & data, Feed feed )
+{
+	double best = 1e9;
+
+	for ( int run = 0; run < PARSER_BENCH_RUNS; run++ )
+	{
+		auto start = chrono::steady_clock::now();
+
+		for ( size_t i = 0; i < data.size(); i += PARSER_BENCH_READ_SIZE )
+			feed(data.data() + i, min((size_t)PARSER_BENCH_READ_SIZE, data.size() - i));
+
+		best = min(best, seconds_since(start));
+	}
+
+	return best;
+}
+
+static void report( const string & what, size_t bytes, unsigned long messages, double seconds )
+{
+	cout << "  " << left << setw(26) << what << right << fixed
+	     << setprecision(3) << setw(8) << (double)bytes / seconds / 1e9 << " GB/s, "
+	     << setprecision(1) << setw(8) << (double)messages / seconds / 1e6 << " M messages/s" << endl;
+}
+
+int run_parser_bench( size_t megabytes )
+{
+	struct Input { const char *name; void (*make)( vector<unsigned char> &, size_t, mt19937 & ); };
+	static const Input inputs[] =
+	{
+		{ "faders", &make_faders },
+		{ "sysex",  &make_sysex  },
+		{ "noise",  &make_noise  },
+	};
+
+	cout << "Parser microbenchmark: " << megabytes << " MB of each input, fed " << PARSER_BENCH_READ_SIZE << " bytes at a time" << endl;
+
+	for ( const Input & input : inputs )
+	{
+		mt19937 rng(12345);
+		vector<unsigned char> data;
+		data.reserve(megabytes * 1000000 + 2048);
+		input.make(data, megabytes * 1000000, rng);
+
+		cout << input.name << " (" << data.size() << " bytes):" << endl;
+
+		// Just the framing
+		MIDIBulkDecoder decoder;
+		MIDIDecodedMessage messages[MIDI_DECODE_BATCH];
+		unsigned long decoded = 0;
+
+		double seconds = time_best(data, [&]( const unsigned char *p, size_t count )
+		{
+			while ( count > 0 )
+			{
+				size_t consumed;
+				decoded += decoder.decode(p, count, 0, messages, MIDI_DECODE_BATCH, consumed);
+				p += consumed;
+				count -= consumed;
+			}
+		});
+		report("MIDIBulkDecoder", data.size(), decoded / PARSER_BENCH_RUNS, seconds);
+
+		//   The whole parser, into a handler known at compile time, and into the
+		// same handler behind the virtual MIDICommandHandler
+		Arguments arguments;
+		CountingHandler handler;
+		BasicMIDIStreamParser<CountingHandler> static_parser(arguments, &handler);
+
+		seconds = time_best(data, [&]( const unsigned char *p, size_t count ) { static_parser.feed(p, count, 0); });
+		report("parser -> handler", data.size(), handler.count / PARSER_BENCH_RUNS, seconds);
+
+		VirtualCountingHandler virtual_handler;
+		MIDIStreamParser virtual_parser(arguments, &virtual_handler);
+
+		seconds = time_best(data, [&]( const unsigned char *p, size_t count ) { virtual_parser.feed(p, count, 0); });
+		report("parser -> virtual handler", data.size(), virtual_handler.counter.count / PARSER_BENCH_RUNS, seconds);
+	}
+
+	return 0;
+}
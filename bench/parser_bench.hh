@@ -0,0 +1,33 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PARSER_BENCH_HH
+#define PARSER_BENCH_HH
+
+#include <cstddef>
+
+//   Microbenchmark of the serial MIDI parsing on its own (no pty, threads or
+// PulseAudio): MIDIBulkDecoder, and MIDIStreamParser into a handler (called
+// directly, and through the virtual functions), over 'megabytes' of generated
+// MIDI of a few kinds.  Prints bytes/s and messages/s, and returns main()'s
+// return value.
+int run_parser_bench( size_t megabytes );
+
+#endif // PARSER_BENCH_HH
@@ -0,0 +1,269 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "ramper_check.hh"
+
+#include "event_trace.hh"
+#include "volume_ramper.hh"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+//   The ramper being checked ticks 100 times a second, and ramps the whole
+// range in 100ms, i.e. 10 ticks of 6553
+#define RAMPER_CHECK_TICK_RATE 100
+#define RAMPER_CHECK_TICK_NS   10000000ULL
+#define RAMPER_CHECK_RAMP_MS   100
+#define RAMPER_CHECK_STEP      6553
+
+// Where the clock starts: well away from 0, and not on a tick
+#define RAMPER_CHECK_START_NS  5000003000ULL
+
+//   What one tick should write to one stream.  'event' is the read_ns of the
+// event which should be blamed for it (see event()).
+struct ExpectedWrite
+{
+	const char *stream;
+	unsigned int volume;
+	uint64_t event;
+};
+
+static unsigned int failures = 0;
+
+static void expect( bool ok, const string & what )
+{
+	if ( ok )
+		return;
+
+	cout << "  FAIL: " << what << endl;
+	failures++;
+}
+
+static void expect_equal( uint64_t got, uint64_t expected, const string & what )
+{
+	ostringstream out;
+	out << what << ": got " << got << ", expected " << expected;
+	expect(got == expected, out.str());
+}
+
+// An event, told apart from the others by its read_ns
+static EventTimes event( uint64_t id )
+{
+	EventTimes times;
+	times.read_ns = times.parsed_ns = times.dispatched_ns = id;
+	return times;
+}
+
+//   Ticks at 'now_ns', and checks that exactly 'expected' was written (in the
+// streams' order), each for the right event
+static void expect_tick( VolumeRamper & ramper, uint64_t now_ns, const vector<ExpectedWrite> & expected, const string & what )
+{
+	ReusableVector< pair<string,unsigned int> > writes;
+	ReusableVector<EventTimes> origins;
+	ramper.tick(now_ns, writes, origins);
+
+	ostringstream got, wanted;
+	for ( size_t i = 0; i < writes.size(); i++ )
+		got << " " << writes[i].first << "=" << writes[i].second << "@" << ( i < origins.size() ? origins[i].read_ns : 0 );
+	for ( const ExpectedWrite & w : expected )
+		wanted << " " << w.stream << "=" << w.volume << "@" << w.event;
+
+	expect(got.str() == wanted.str() and origins.size() == writes.size(),
+	       what + ": wrote {" + got.str() + " }, expected {" + wanted.str() + " }");
+}
+
+// The tick grid point at or before 'ns'
+static uint64_t grid( uint64_t ns )
+{
+	return ns - ns % RAMPER_CHECK_TICK_NS;
+}
+
+//------------------------------------------------------------------------------
+// Checks
+
+static void check_switched_off()
+{
+	cout << "Switched off" << endl;
+
+	VolumeRamper ramper(0, RAMPER_CHECK_RAMP_MS);
+	expect(!ramper.enabled(), "a tick rate of 0 should switch it off");
+}
+
+//   We don't know where a stream starts, so its first volume is written as it
+// is, on the very next tick, and then it has settled.
+static void check_first_volume()
+{
+	cout << "First volume" << endl;
+
+	VolumeRamper ramper(RAMPER_CHECK_TICK_RATE, RAMPER_CHECK_RAMP_MS);
+	uint64_t t = RAMPER_CHECK_START_NS;
+
+	expect_equal(ramper.next_tick_ns(t), 0, "nothing moving, so no tick due");
+	expect_tick(ramper, t, {}, "tick with nothing moving");
+
+	ramper.set_target("a", 40000, event(1));
+	expect_equal(ramper.next_tick_ns(t), t, "a new stream is due straight away");
+	expect_tick(ramper, t, {{"a", 40000, 1}}, "a new stream goes straight to its first volume");
+
+	expect_equal(ramper.next_tick_ns(t), 0, "settled after its first volume");
+	expect_tick(ramper, t + 5 * RAMPER_CHECK_TICK_NS, {}, "tick after settling");
+
+	//   Setting the target it already has doesn't start it moving (or blame
+	// the new event for anything)
+	ramper.set_target("a", 40000, event(2));
+	expect_equal(ramper.next_tick_ns(t), 0, "the same target again");
+}
+
+//   A full-scale move takes 'ramp' / 'tick' steps of the same size, on the
+// tick grid however late each tick is handled, and stops exactly on the
+// target.  Two streams move at once, with a write each per tick.
+static void check_step_and_grid()
+{
+	cout << "Step size and tick grid" << endl;
+
+	VolumeRamper ramper(RAMPER_CHECK_TICK_RATE, RAMPER_CHECK_RAMP_MS);
+	uint64_t t = RAMPER_CHECK_START_NS;
+
+	ramper.set_target("a", 0, event(1));
+	ramper.set_target("b", 65536, event(1));
+	expect_tick(ramper, t, {{"a", 0, 1}, {"b", 65536, 1}}, "first volumes");
+
+	t += 1000000;
+	ramper.set_target("a", 65536, event(2));
+	ramper.set_target("b", 50000, event(3));
+
+	uint64_t due = grid(RAMPER_CHECK_START_NS) + RAMPER_CHECK_TICK_NS;
+	expect_equal(ramper.next_tick_ns(t), due, "the next tick is on the grid");
+	expect_tick(ramper, due - 1, {}, "a tick before it's due");
+
+	unsigned int a = 0, b = 65536;
+	for ( unsigned int k = 1; k <= 10; k++ )
+	{
+		//   Each tick is handled a bit late, by a different amount, but the
+		// next one is still due on the grid
+		uint64_t now = due + 1000 * k;
+
+		a += RAMPER_CHECK_STEP;
+		vector<ExpectedWrite> expected;
+		expected.push_back({"a", a, 2});
+		if ( b > 50000 )
+		{
+			b = b - 50000 > RAMPER_CHECK_STEP ? b - RAMPER_CHECK_STEP : 50000;
+			expected.push_back({"b", b, 3});
+		}
+
+		ostringstream what;
+		what << "tick " << k;
+		expect_tick(ramper, now, expected, what.str());
+
+		due += RAMPER_CHECK_TICK_NS;
+		expect_equal(ramper.next_tick_ns(now), due, what.str() + ": next tick");
+	}
+
+	// 10 steps of 6553 are 6 short of full scale, so there's one small one
+	expect_tick(ramper, due, {{"a", 65536, 2}}, "the last, short, step");
+	expect_equal(ramper.next_tick_ns(due), 0, "settled on the target");
+	expect_equal(ramper.get_write_count(), 2 + 10 + 3 + 1, "writes counted");
+}
+
+//   Moving the target part way along turns the ramp round, from wherever it
+// has got to, and blames the new event
+static void check_new_target()
+{
+	cout << "New target while moving" << endl;
+
+	VolumeRamper ramper(RAMPER_CHECK_TICK_RATE, RAMPER_CHECK_RAMP_MS);
+	uint64_t t = grid(RAMPER_CHECK_START_NS);
+
+	ramper.set_target("a", 0, event(1));
+	expect_tick(ramper, t, {{"a", 0, 1}}, "first volume");
+
+	ramper.set_target("a", 65536, event(2));
+	for ( unsigned int k = 1; k <= 3; k++ )
+		expect_tick(ramper, t + k * RAMPER_CHECK_TICK_NS, {{"a", k * RAMPER_CHECK_STEP, 2}}, "going up");
+
+	ramper.set_target("a", 10000, event(3));
+	expect_tick(ramper, t + 4 * RAMPER_CHECK_TICK_NS, {{"a", 2 * RAMPER_CHECK_STEP, 3}}, "turned round");
+	expect_tick(ramper, t + 5 * RAMPER_CHECK_TICK_NS, {{"a", 10000, 3}}, "stops on the new target");
+	expect_equal(ramper.next_tick_ns(t + 5 * RAMPER_CHECK_TICK_NS), 0, "settled on the new target");
+}
+
+//   After nothing has moved for a while, the next tick is due as soon as
+// something does, and it's still only one step: a late tick doesn't catch up
+static void check_late_tick()
+{
+	cout << "Late tick" << endl;
+
+	VolumeRamper ramper(RAMPER_CHECK_TICK_RATE, RAMPER_CHECK_RAMP_MS);
+	uint64_t t = RAMPER_CHECK_START_NS;
+
+	ramper.set_target("a", 0, event(1));
+	expect_tick(ramper, t, {{"a", 0, 1}}, "first volume");
+
+	t += 1000000000ULL + 4321;
+	ramper.set_target("a", 65536, event(2));
+	expect_equal(ramper.next_tick_ns(t), t, "overdue, so due now");
+	expect_tick(ramper, t, {{"a", RAMPER_CHECK_STEP, 2}}, "one step, a second late");
+	expect_equal(ramper.next_tick_ns(t), grid(t) + RAMPER_CHECK_TICK_NS, "back on the grid");
+}
+
+// With no ramp time, a move goes straight there on the next tick
+static void check_no_ramp()
+{
+	cout << "No ramp" << endl;
+
+	VolumeRamper ramper(RAMPER_CHECK_TICK_RATE, 0);
+	uint64_t t = grid(RAMPER_CHECK_START_NS);
+
+	ramper.set_target("a", 0, event(1));
+	expect_tick(ramper, t, {{"a", 0, 1}}, "first volume");
+
+	ramper.set_target("a", 65536, event(2));
+	expect_equal(ramper.next_tick_ns(t), t + RAMPER_CHECK_TICK_NS, "due on the next tick");
+	expect_tick(ramper, t + RAMPER_CHECK_TICK_NS, {{"a", 65536, 2}}, "straight to the target");
+	expect_equal(ramper.next_tick_ns(t + RAMPER_CHECK_TICK_NS), 0, "settled");
+}
+
+int run_ramper_check()
+{
+	failures = 0;
+
+	check_switched_off();
+	check_first_volume();
+	check_step_and_grid();
+	check_new_target();
+	check_late_tick();
+	check_no_ramp();
+
+	if ( failures > 0 )
+	{
+		cout << failures << " VolumeRamper check(s) failed" << endl;
+		return 1;
+	}
+
+	cout << "VolumeRamper is OK" << endl;
+	return 0;
+}
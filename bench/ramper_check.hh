@@ -0,0 +1,31 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef RAMPER_CHECK_HH
+#define RAMPER_CHECK_HH
+
+//   Deterministic check of VolumeRamper (run by "make ramper-check"): drives
+// set_target(), tick() and next_tick_ns() with made-up times, and compares
+// what it writes, and when, with what it should.  Prints what was wrong, and
+// returns main()'s return value (1 if anything was).
+int run_ramper_check();
+
+#endif // RAMPER_CHECK_HH
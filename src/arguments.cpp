@@ -18,10 +18,14 @@
 */
 
 #include "arguments.hh"
+#include "fader_mapping.hh"
+#include "realtime.hh"
 
 #include <termios.h>
 #include <argp.h>
+#include <cstdlib>
 #include <iostream>
+#include <sched.h>
 
 using namespace std;
 
@@ -33,14 +37,100 @@ void arg_set_defaults(Arguments *arguments_local);
 
 static struct argp_option options[] =
 {
-	{"serialdevice" , 's', "DEV" , 0, "Serial device to use. Default = /dev/ttyUSB0", 0 },
-	{"baudrate"     , 'b', "BAUD", 0, "Serial port baud rate. Default = 115200", 0 },
+	{"serialdevice" , 's', "DEV[:BAUD[:OFFSET]]", 0, "Serial device to use. Can be given more than once. OFFSET is added to the device's MIDI channels. Default = /dev/ttyUSB0", 0 },
+	{"baudrate"     , 'b', "BAUD", 0, "Serial port baud rate, for devices which don't give one. Default = 115200", 0 },
+	{"config"       , 'c', "FILE", 0, "Fader mapping config file. Reloaded on change or SIGHUP. Default = built-in mapping", 0 },
+	{"trace"        , 't', "FILE", 0, "Write every event's timings to FILE on exit, as Chrome trace-event JSON (for chrome://tracing or Perfetto)", 0 },
+	{"capture"      , 'C', "FILE", 0, "Write everything read from the serial devices to FILE, with timings, for --replay", 0 },
+	{"replay"       , 'P', "FILE", 0, "Instead of reading the serial devices, replay a file written by --capture, and exit at the end", 0 },
+	{"replay-fast"  , 'F', 0     , 0, "Replay as fast as possible, rather than at the original timing", 0 },
+	{"backend"      , 'B', "NAME", 0, "How to set the volumes: native (PulseAudio's own protocol), dbus (PulseAudio's module-dbus-protocol), auto (native if PulseAudio answers it, otherwise dbus) or sim (a simulated mixer, with clients sim-client-0 to 15, for testing). Default = auto", 0 },
+	{"stream-rate"  , 'r', "HZ"  , 0, "Maximum volume changes per second sent to each PulseAudio stream. The last one is always sent. 0 = no limit. Default = 30", 0 },
+	{"total-rate"   , 'R', "HZ"  , 0, "Maximum volume changes per second sent to PulseAudio altogether. 0 = no limit. Default = 300", 0 },
+	{"tick-rate"    , 'T', "HZ"  , 0, "Move the volumes towards the faders this many times a second, ramping rather than jumping, with at most one change per stream each time (instead of --stream-rate and --total-rate). 0 = set them as the faders move. Default = 0", 0 },
+	{"ramp"         , 'M', "MS"  , 0, "With --tick-rate, how long a volume takes to ramp over its whole range. 0 = no ramp. Default = 50", 0 },
+	{"metrics"      , 'm', "PATH", 0, "Make a Unix domain socket at PATH, which gives a snapshot of the counters and latency histograms, in Prometheus's text format, to anything which connects", 0 },
+	{"feedback"     , 'f', 0     , 0, "Move motorized faders to match volumes which something else (e.g. pavucontrol) changes, by writing their positions to the serial devices", 0 },
+	{"realtime"     , 'X', "POLICY[:PRIO]", 0, "Real-time mode: run the threads which read the serial devices and set the volumes with POLICY (fifo or rr) at priority PRIO (1-99, default 50), and lock the memory into RAM. Needs CAP_SYS_NICE and CAP_IPC_LOCK (or big enough ulimit -r and -l); without them, it carries on as usual", 0 },
+	{"reader-cpus"  , 'A', "CPUS", 0, "Keep the thread which reads the serial devices on CPUS, e.g. 2 or 2,3 or 0-1", 0 },
+	{"output-cpus"  , 'O', "CPUS", 0, "Keep the thread which sets the volumes on CPUS", 0 },
 	{"verbose"      , 'v', 0     , 0, "For debugging: Produce verbose output", 0 },
 	{"printonly"    , 'p', 0     , 0, "Super debugging: Print values read from serial -- and do nothing else", 0 },
 	{"quiet"        , 'q', 0     , 0, "Don't produce any output, even when the print command is sent", 0 },
 	{ 0             , 0  , 0     , 0, 0,                                                 0 }
 };
 
+// Converts e.g. 115200 to B115200.  Exits if the rate isn't supported.
+static unsigned int baud_constant( unsigned long baud )
+{
+	switch (baud)
+	{
+		case 1200   : return B1200  ;
+		case 2400   : return B2400  ;
+		case 4800   : return B4800  ;
+		case 9600   : return B9600  ;
+		case 19200  : return B19200 ;
+		case 38400  : return B38400 ;
+		case 57600  : return B57600 ;
+		case 115200 : return B115200;
+		default:
+			cerr << "Baud rate " << baud << " is not supported." << endl;
+			exit(1);
+	}
+}
+
+//   Parses DEV[:BAUD[:OFFSET]].  A baud rate of 0 means "whatever -b says",
+// which isn't known until all of the options have been seen.
+static SerialDevice parse_serial_device( const string & spec )
+{
+	SerialDevice answer;
+	answer.baudrate = 0;
+	answer.channel_offset = 0;
+
+	size_t colon = spec.find(':');
+	answer.path = spec.substr(0, colon);
+
+	if ( colon != string::npos )
+	{
+		string rest = spec.substr(colon + 1);
+		size_t colon2 = rest.find(':');
+		string baud = rest.substr(0, colon2);
+		char *end;
+
+		if ( baud != "" )
+		{
+			unsigned long baud_temp = strtoul(baud.c_str(), &end, 10);
+			if ( *end != '\0' )
+			{
+				cerr << "Bad baud rate '" << baud << "' for " << answer.path << endl;
+				exit(1);
+			}
+			answer.baudrate = baud_constant(baud_temp);
+		}
+
+		if ( colon2 != string::npos )
+		{
+			string offset = rest.substr(colon2 + 1);
+			long offset_temp = strtol(offset.c_str(), &end, 10);
+
+			if ( offset == "" or *end != '\0' or offset_temp < 0 or offset_temp + MIDI_CHANNELS > MAX_FADER_CHANNELS )
+			{
+				cerr << "Bad channel offset '" << offset << "' for " << answer.path << " (it must be 0-" << MAX_FADER_CHANNELS - MIDI_CHANNELS << ")" << endl;
+				exit(1);
+			}
+			answer.channel_offset = (int)offset_temp;
+		}
+	}
+
+	if ( answer.path == "" )
+	{
+		cerr << "Bad serial device '" << spec << "'" << endl;
+		exit(1);
+	}
+
+	return answer;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	//   Get the input argument from argp_parse, which we know is a pointer to
@@ -62,27 +152,105 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		case 's':
 			if (arg == NULL)
 				break;
-			arguments->serialdevice = arg;
+			arguments->serialdevices.push_back(parse_serial_device(arg));
+			break;
+		case 'c':
+			if (arg == NULL)
+				break;
+			arguments->configfile = arg;
+			break;
+		case 't':
+			if (arg == NULL)
+				break;
+			arguments->tracefile = arg;
+			break;
+		case 'C':
+			if (arg == NULL)
+				break;
+			arguments->capturefile = arg;
+			break;
+		case 'P':
+			if (arg == NULL)
+				break;
+			arguments->replayfile = arg;
+			break;
+		case 'F':
+			arguments->replay_fast = true;
+			break;
+		case 'f':
+			arguments->feedback = true;
+			break;
+		case 'm':
+			if (arg == NULL)
+				break;
+			arguments->metricssocket = arg;
+			break;
+		case 'B':
+			if (arg == NULL)
+				break;
+			arguments->backend = arg;
+			break;
+		case 'r':
+		case 'R':
+		case 'T':
+		{
+			if (arg == NULL)
+				break;
+			char *end;
+			double rate = strtod(arg, &end);
+			if ( *end != '\0' or rate < 0 )
+			{
+				cerr << "Bad rate '" << arg << "'" << endl;
+				exit(1);
+			}
+			if ( key == 'r' )
+				arguments->stream_rate = rate;
+			else if ( key == 'R' )
+				arguments->total_rate = rate;
+			else
+				arguments->tick_rate = rate;
+			break;
+		}
+		case 'M':
+		{
+			if (arg == NULL)
+				break;
+			char *end;
+			unsigned long ms = strtoul(arg, &end, 10);
+			if ( *end != '\0' or ms > 60000 )
+			{
+				cerr << "Bad ramp time '" << arg << "'" << endl;
+				exit(1);
+			}
+			arguments->ramp_ms = (unsigned int)ms;
+			break;
+		}
+		case 'X':
+			if (arg == NULL)
+				break;
+			if ( !parse_realtime_policy(arg, arguments->realtime_policy, arguments->realtime_priority) )
+			{
+				cerr << "Bad real-time policy '" << arg << "' (it must be fifo or rr, then optionally a priority from 1 to 99, e.g. fifo:50)" << endl;
+				exit(1);
+			}
+			break;
+		case 'A':
+		case 'O':
+			if (arg == NULL)
+				break;
+			if ( !parse_cpu_list(arg, key == 'A' ? arguments->reader_cpus : arguments->output_cpus) )
+			{
+				cerr << "Bad list of CPUs '" << arg << "'" << endl;
+				exit(1);
+			}
 			break;
 		case 'b':
 			if (arg == NULL)
 				break;
 			baud_temp = strtoul(arg, NULL, 0);
 			if (baud_temp != EINVAL and baud_temp != ERANGE)
-				switch (baud_temp)
-				{
-					case 1200   : arguments->baudrate = B1200  ; break;
-					case 2400   : arguments->baudrate = B2400  ; break;
-					case 4800   : arguments->baudrate = B4800  ; break;
-					case 9600   : arguments->baudrate = B9600  ; break;
-					case 19200  : arguments->baudrate = B19200 ; break;
-					case 38400  : arguments->baudrate = B38400 ; break;
-					case 57600  : arguments->baudrate = B57600 ; break;
-					case 115200 : arguments->baudrate = B115200; break;
-					default:
-						cerr << "Baud rate " << baud_temp << " is not supported." << endl;
-						exit(1);
-				}
+				arguments->baudrate = baud_constant(baud_temp);
+			break;
 
 		case ARGP_KEY_ARG:
 		case ARGP_KEY_END:
@@ -105,7 +273,15 @@ Arguments::Arguments()
 	this->silent    = false;
 	this->verbose   = false;
 	this->baudrate  = B115200;
-	this->serialdevice = "/dev/ttyUSB0";
+	this->replay_fast = false;
+	this->backend   = "auto";
+	this->stream_rate = 30;
+	this->total_rate  = 300;
+	this->tick_rate   = 0;
+	this->ramp_ms     = 50;
+	this->feedback    = false;
+	this->realtime_policy   = SCHED_OTHER;
+	this->realtime_priority = 0;
 }
 
 Arguments parse_all_the_arguments(int argc, char** argv)
@@ -116,12 +292,31 @@ Arguments parse_all_the_arguments(int argc, char** argv)
 
 	argp_parse(&argp, argc, argv, 0, 0, &answer);
 
+	if ( answer.serialdevices.empty() )
+		answer.serialdevices.push_back(parse_serial_device("/dev/ttyUSB0"));
+
+	for ( SerialDevice & device : answer.serialdevices )
+		if ( device.baudrate == 0 )
+			device.baudrate = answer.baudrate;
+
 	if ( answer.verbose and answer.silent )
 	{
 		cerr << "Options 'verbose' and 'silent' are mutually exclusive" << endl;
 		exit(1);
 	}
 
+	if ( answer.backend != "auto" and answer.backend != "native" and answer.backend != "dbus" and answer.backend != "sim" )
+	{
+		cerr << "Unknown backend '" << answer.backend << "'" << endl;
+		exit(1);
+	}
+
+	if ( answer.capturefile != "" and answer.replayfile != "" )
+	{
+		cerr << "Options 'capture' and 'replay' are mutually exclusive" << endl;
+		exit(1);
+	}
+
 	if ( answer.printonly and answer.silent )
 	{
 		cerr << "Options 'printonly' and 'silent' are mutually exclusive" << endl;
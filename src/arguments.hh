@@ -21,12 +21,49 @@
 #define ARGUMENTS_H
 
 #include <string>
+#include <vector>
+
+//   A serial device to read MIDI from (-s DEV[:BAUD[:OFFSET]]).  Its MIDI
+// channels have 'channel_offset' added to them, so that several controllers
+// can work different faders (e.g. the second box's channel 0 is fader 16).
+struct SerialDevice
+{
+	std::string path;
+	unsigned int baudrate;      // e.g. B115200
+	int channel_offset;
+};
 
 struct Arguments
 {
 	bool silent, verbose, printonly;
-	unsigned int baudrate;
-	std::string serialdevice;
+	unsigned int baudrate;      // For devices which don't give their own
+	std::vector<SerialDevice> serialdevices;
+	std::string configfile;     // "" = use the built-in fader mapping
+	std::string tracefile;      // "" = don't write a trace
+	std::string capturefile;    // "" = don't capture the serial data
+	std::string replayfile;     // "" = read the serial devices, not a capture
+	std::string metricssocket;  // "" = don't serve any metrics
+	bool replay_fast;           // Replay as fast as possible, not at the original timing
+	std::string backend;        // Which VolumeBackend: "auto", "native", "dbus" or "sim"
+
+	//   Maximum volume writes per second, to each PulseAudio stream and to all
+	// of them together (see VolumeRateLimiter).  0 = no limit.
+	double stream_rate, total_rate;
+
+	//   If 'tick_rate' isn't 0, the volumes are moved towards the faders that
+	// many times a second, taking 'ramp_ms' to cover the whole range (see
+	// VolumeRamper).
+	double tick_rate;
+	unsigned int ramp_ms;
+
+	// Move motorized faders to follow volume changes made by anything else
+	bool feedback;
+
+	//   Real-time mode (see realtime.hh): the scheduling policy for the reader
+	// and output threads (SCHED_FIFO or SCHED_RR; SCHED_OTHER = off) and their
+	// priority, and the CPUs to keep each of them on (empty = any).
+	int realtime_policy, realtime_priority;
+	std::vector<int> reader_cpus, output_cpus;
 
 	Arguments();
 };
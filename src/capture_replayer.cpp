@@ -0,0 +1,101 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "capture_replayer.hh"
+#include "event_trace.hh"
+#include "logger.hh"
+
+using namespace std;
+
+CaptureReplayer::CaptureReplayer( const Arguments & args_in, SerialCaptureReader & reader_in, const vector<MIDICommandHandler *> & handlers, bool original_timing_in ) :
+arguments(args_in), reader(reader_in), original_timing(original_timing_in),
+loop(nullptr), timer(-1), start_ns(0), have_pending(false), records_replayed(0)
+{
+	for ( MIDICommandHandler *handler : handlers )
+		this->parsers.emplace_back(new MIDIStreamParser(args_in, handler));
+}
+
+void CaptureReplayer::start( EventLoop & loop_in, function<void()> on_finished_in )
+{
+	this->loop = &loop_in;
+	this->on_finished = on_finished_in;
+	this->timer = this->loop->add_timer([this]( uint32_t ) { this->replay_due(); });
+
+	this->reader.rewind();
+	this->have_pending = false;
+	this->start_ns = monotonic_ns();
+
+	this->loop->set_timer(this->timer, 0);
+}
+
+void CaptureReplayer::stop()
+{
+	if ( this->loop != nullptr )
+		this->loop->remove_timer(this->timer);
+
+	this->timer = -1;
+	this->loop = nullptr;
+}
+
+//   Called by the loop's timer.  Replays every record which is due (or a batch
+// of them, if we aren't keeping to the original timing), and sets the timer
+// for the next one.
+void CaptureReplayer::replay_due()
+{
+	for ( unsigned int n = 0; ; n++ )
+	{
+		if ( !this->have_pending )
+		{
+			if ( !this->reader.next(this->pending) )
+				break;
+			this->have_pending = true;
+		}
+
+		uint64_t now_ns = monotonic_ns();
+
+		if ( this->original_timing )
+		{
+			uint64_t due_ns = this->start_ns + this->pending.time_ns;
+			if ( due_ns > now_ns )
+			{
+				// Round up, so we don't wake up just before it
+				this->loop->set_timer(this->timer, (unsigned int)((due_ns - now_ns + 999999) / 1000000));
+				return;
+			}
+		}
+		else if ( n == CAPTURE_REPLAY_BATCH )
+		{
+			// Let the loop do anything else it has to, and then carry on
+			this->loop->set_timer(this->timer, 0);
+			return;
+		}
+
+		if ( this->pending.device < this->parsers.size() )
+			this->parsers[this->pending.device]->feed(this->pending.data, this->pending.count, now_ns);
+
+		this->have_pending = false;
+		this->records_replayed++;
+	}
+
+	if ( this->reader.is_truncated() )
+		logger.log(LOG_INFO, "The capture file ends part way through a record");
+
+	if ( this->on_finished )
+		this->on_finished();
+}
@@ -0,0 +1,79 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CAPTURE_REPLAYER_HH
+#define CAPTURE_REPLAYER_HH
+
+#include "event_loop.hh"
+#include "midi_command_handler.hh"
+#include "midi_stream_parser.hh"
+#include "serial_capture.hh"
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+//   How many records to replay each time the loop comes round, when replaying
+// as fast as possible
+#define CAPTURE_REPLAY_BATCH 64
+
+//   Feeds a capture file (see SerialCaptureWriter) back through a
+// MIDIStreamParser for each captured device, in place of SerialMIDIReader.
+// Either the records are replayed at the times they were read, or as fast as
+// the loop can go.  The events are timed (see EventTracer) from when they are
+// replayed.
+//   This runs on an EventLoop, so the loop still sees signals etc. while it is
+// going.
+struct CaptureReplayer
+{
+	const Arguments arguments;
+
+	//   'handlers' are for the devices in the capture, in order.  Records for
+	// devices without one are skipped.
+	CaptureReplayer( const Arguments & args_in, SerialCaptureReader & reader_in, const std::vector<MIDICommandHandler *> & handlers, bool original_timing_in );
+
+	//   'on_finished' is called (from the loop) once every record has been
+	// replayed.
+	void start( EventLoop & loop_in, std::function<void()> on_finished_in );
+	void stop();
+
+	unsigned long get_records_replayed() const { return records_replayed; }
+
+private:
+	SerialCaptureReader & reader;
+	std::vector< std::unique_ptr<MIDIStreamParser> > parsers;
+	bool original_timing;
+
+	EventLoop *loop;
+	int timer;
+	std::function<void()> on_finished;
+
+	// When the first record was replayed (see monotonic_ns())
+	uint64_t start_ns;
+
+	// The next record, if it has been read but isn't due yet
+	SerialCaptureRecord pending;
+	bool have_pending;
+
+	unsigned long records_replayed;
+
+	void replay_due();
+};
+
+#endif // CAPTURE_REPLAYER_HH
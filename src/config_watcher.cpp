@@ -0,0 +1,94 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config_watcher.hh"
+
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+using namespace std;
+
+bool ConfigWatcher::start( const string & filename )
+{
+	string dir;
+	size_t slash = filename.rfind('/');
+
+	if ( slash == string::npos )
+	{
+		dir = ".";
+		this->file_name = filename;
+	}
+	else
+	{
+		dir = (slash == 0) ? "/" : filename.substr(0, slash);
+		this->file_name = filename.substr(slash + 1);
+	}
+
+	this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if ( this->inotify_fd < 0 )
+		return false;
+
+	// IN_CLOSE_WRITE: written in place.  IN_MOVED_TO: renamed over.
+	if ( inotify_add_watch(this->inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0 )
+	{
+		this->stop();
+		return false;
+	}
+
+	return true;
+}
+
+void ConfigWatcher::stop()
+{
+	if ( this->inotify_fd >= 0 )
+		close(this->inotify_fd);
+
+	this->inotify_fd = -1;
+}
+
+bool ConfigWatcher::file_changed()
+{
+	// Enough for quite a few events; any more will be read next time
+	alignas(struct inotify_event) char buf[4096];
+	bool answer = false;
+
+	if ( this->inotify_fd < 0 )
+		return false;
+
+	while ( true )
+	{
+		ssize_t len = read(this->inotify_fd, buf, sizeof(buf));
+
+		if ( len <= 0 )
+			break;
+
+		for ( char *p = buf; p < buf + len; )
+		{
+			const struct inotify_event *event = (const struct inotify_event *)p;
+
+			if ( event->len > 0 and this->file_name == event->name )
+				answer = true;
+
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	return answer;
+}
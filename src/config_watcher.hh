@@ -0,0 +1,51 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CONFIG_WATCHER_HH
+#define CONFIG_WATCHER_HH
+
+#include <string>
+
+//   Uses inotify to find out when a config file has been changed.  We watch the
+// file's directory rather than the file itself, because most editors save by
+// writing a new file and renaming it over the old one.
+struct ConfigWatcher
+{
+	ConfigWatcher() :
+	inotify_fd(-1)
+	{ }
+
+	~ConfigWatcher() { stop(); }
+
+	bool start( const std::string & filename );
+	void stop();
+
+	// Becomes readable when something has happened in the directory
+	int get_fd() const { return inotify_fd; }
+
+	//   Reads the events which are waiting (without blocking), and returns true
+	// if any of them were for our file.
+	bool file_changed();
+
+private:
+	int inotify_fd;
+	std::string file_name;   // Without the directory
+};
+
+#endif // CONFIG_WATCHER_HH
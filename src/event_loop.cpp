@@ -0,0 +1,352 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "event_loop.hh"
+#include "logger.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// How many epoll events to take at once
+#define EVENT_LOOP_MAX_EVENTS 32
+
+using namespace std;
+
+EventLoop::~EventLoop()
+{
+	this->detach_glib_context();
+
+	// Whoever added fds and timers is responsible for removing them
+	if ( this->quit_fd >= 0 )
+		close(this->quit_fd);
+	if ( this->epoll_fd >= 0 )
+		close(this->epoll_fd);
+}
+
+bool EventLoop::init()
+{
+	this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if ( this->epoll_fd < 0 )
+		return false;
+
+	this->quit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ( this->quit_fd < 0 )
+		return false;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = this->quit_fd;
+
+	return epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->quit_fd, &ev) == 0;
+}
+
+//==============================================================================
+// File descriptors and timers
+
+bool EventLoop::add_fd( int fd, uint32_t events, Callback callback )
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+
+	int op = this->callbacks.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	if ( epoll_ctl(this->epoll_fd, op, fd, &ev) != 0 )
+	{
+		logger.log(LOG_ERROR, "EventLoop::add_fd(): epoll_ctl() failed: %s", strerror(errno));
+		return false;
+	}
+
+	this->callbacks[fd] = callback;
+
+	return true;
+}
+
+void EventLoop::remove_fd( int fd )
+{
+	if ( this->callbacks.erase(fd) == 0 )
+		return;
+
+	epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int EventLoop::add_timer( Callback callback )
+{
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if ( timer_fd < 0 )
+		return -1;
+
+	//   The timerfd stays readable until it is read, so read it before doing
+	// anything else.
+	bool ok = this->add_fd(timer_fd, EPOLLIN, [timer_fd, callback]( uint32_t events )
+	{
+		uint64_t expirations;
+		if ( read(timer_fd, &expirations, sizeof(expirations)) != (ssize_t)sizeof(expirations) )
+			return;
+
+		callback(events);
+	});
+
+	if ( !ok )
+	{
+		close(timer_fd);
+		return -1;
+	}
+
+	return timer_fd;
+}
+
+void EventLoop::set_timer( int timer_fd, unsigned int ms )
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+
+	// An all-zero time would disarm it
+	spec.it_value.tv_sec  = ms / 1000;
+	spec.it_value.tv_nsec = (ms % 1000) * 1000000L + (ms == 0 ? 1 : 0);
+
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+void EventLoop::cancel_timer( int timer_fd )
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+
+	timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+void EventLoop::remove_timer( int timer_fd )
+{
+	if ( timer_fd < 0 )
+		return;
+
+	this->remove_fd(timer_fd);
+	close(timer_fd);
+}
+
+//==============================================================================
+// GMainContext
+
+void EventLoop::attach_glib_context( GMainContext *context )
+{
+	this->detach_glib_context();
+
+	if ( !g_main_context_acquire(context) )
+	{
+		logger.log(LOG_ERROR, "EventLoop::attach_glib_context(): the context belongs to another thread");
+		return;
+	}
+
+	this->glib_context = context;
+	this->glib_fds.resize(8);
+}
+
+void EventLoop::detach_glib_context()
+{
+	if ( this->glib_context == nullptr )
+		return;
+
+	this->sync_glib_fds(0);
+	g_main_context_release(this->glib_context);
+
+	this->glib_context = nullptr;
+	this->glib_fds.clear();
+}
+
+static uint32_t glib_to_epoll( gushort events )
+{
+	uint32_t answer = 0;
+
+	if ( events & G_IO_IN )  answer |= EPOLLIN;
+	if ( events & G_IO_OUT ) answer |= EPOLLOUT;
+	if ( events & G_IO_PRI ) answer |= EPOLLPRI;
+
+	return answer;
+}
+
+static gushort epoll_to_glib( uint32_t events )
+{
+	gushort answer = 0;
+
+	if ( events & EPOLLIN )  answer |= G_IO_IN;
+	if ( events & EPOLLOUT ) answer |= G_IO_OUT;
+	if ( events & EPOLLPRI ) answer |= G_IO_PRI;
+	if ( events & EPOLLERR ) answer |= G_IO_ERR;
+	if ( events & EPOLLHUP ) answer |= G_IO_HUP;
+
+	return answer;
+}
+
+// Finds 'fd' in a list sorted by fd, or returns NULL
+static const pair<int,uint32_t> *find_fd( const vector< pair<int,uint32_t> > & fds, int fd )
+{
+	auto it = lower_bound(fds.begin(), fds.end(), make_pair(fd, (uint32_t)0));
+
+	return ( it != fds.end() and it->first == fd ) ? &*it : NULL;
+}
+
+bool EventLoop::is_glib_fd( int fd ) const
+{
+	return find_fd(this->glib_watched, fd) != NULL;
+}
+
+//   Makes the epoll set watch the first 'n_fds' of 'glib_fds' (and none of
+// the context's old ones).  Usually nothing has changed, and this doesn't need
+// any system calls (or allocate anything).
+void EventLoop::sync_glib_fds( int n_fds )
+{
+	vector< pair<int,uint32_t> > & wanted = this->glib_wanted;
+	wanted.clear();
+
+	for ( int i = 0; i < n_fds; i++ )
+		wanted.push_back(make_pair(this->glib_fds[i].fd, glib_to_epoll(this->glib_fds[i].events)));
+
+	// The same fd can be in there more than once
+	sort(wanted.begin(), wanted.end());
+
+	size_t n_wanted = 0;
+	for ( size_t i = 0; i < wanted.size(); i++ )
+	{
+		if ( n_wanted > 0 and wanted[n_wanted - 1].first == wanted[i].first )
+			wanted[n_wanted - 1].second |= wanted[i].second;
+		else
+			wanted[n_wanted++] = wanted[i];
+	}
+	wanted.resize(n_wanted);
+
+	for ( const auto & w : this->glib_watched )
+		if ( find_fd(wanted, w.first) == NULL )
+			epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, w.first, NULL);
+
+	for ( const auto & w : wanted )
+	{
+		const pair<int,uint32_t> *old = find_fd(this->glib_watched, w.first);
+		if ( old != NULL and old->second == w.second )
+			continue;
+
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = w.second;
+		ev.data.fd = w.first;
+
+		int op = ( old == NULL ) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		epoll_ctl(this->epoll_fd, op, w.first, &ev);
+	}
+
+	this->glib_watched.swap(wanted);
+}
+
+//==============================================================================
+
+void EventLoop::quit()
+{
+	this->running = false;
+
+	uint64_t one = 1;
+	if ( write(this->quit_fd, &one, sizeof(one)) < 0 and errno != EAGAIN )
+		logger.log(LOG_ERROR, "EventLoop::quit(): unable to wake up the loop: %s", strerror(errno));
+}
+
+void EventLoop::run()
+{
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+	//   quit() might have been called before we got here.  The eventfd
+	// remembers that even though 'running' doesn't.
+	this->running = true;
+
+	while ( this->running )
+	{
+		//   Ask the GMainContext what it wants to wait for, and how long for
+		// (e.g. if it has an idle source ready, the timeout is 0).
+		GMainContext *context = this->glib_context;
+		gint priority = 0, timeout = -1, n_glib = 0;
+
+		if ( context != nullptr )
+		{
+			g_main_context_prepare(context, &priority);
+
+			n_glib = g_main_context_query(context, priority, &timeout, this->glib_fds.data(), (gint)this->glib_fds.size());
+			if ( n_glib > (gint)this->glib_fds.size() )
+			{
+				this->glib_fds.resize((size_t)n_glib);
+				n_glib = g_main_context_query(context, priority, &timeout, this->glib_fds.data(), (gint)this->glib_fds.size());
+			}
+
+			this->sync_glib_fds(n_glib);
+
+			for ( gint i = 0; i < n_glib; i++ )
+				this->glib_fds[i].revents = 0;
+		}
+
+		int n = epoll_wait(this->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+
+		if ( n < 0 and errno != EINTR )
+		{
+			logger.log(LOG_ERROR, "EventLoop::run(): epoll_wait() failed: %s", strerror(errno));
+			break;
+		}
+
+		for ( int i = 0; i < n; i++ )
+		{
+			int fd = events[i].data.fd;
+
+			if ( fd == this->quit_fd )
+			{
+				uint64_t count;
+				if ( read(this->quit_fd, &count, sizeof(count)) == (ssize_t)sizeof(count) )
+					this->running = false;
+				continue;
+			}
+
+			if ( context != nullptr and this->is_glib_fd(fd) )
+			{
+				for ( gint j = 0; j < n_glib; j++ )
+					if ( this->glib_fds[j].fd == fd )
+						this->glib_fds[j].revents |= (gushort)(epoll_to_glib(events[i].events) & (this->glib_fds[j].events | G_IO_ERR | G_IO_HUP));
+				continue;
+			}
+
+			//   Copy the callback, because it might remove itself (or an
+			// earlier one might have removed it already).
+			auto it = this->callbacks.find(fd);
+			if ( it == this->callbacks.end() )
+				continue;
+
+			Callback callback = it->second;
+			callback(events[i].events);
+		}
+
+		// A callback might have detached the context
+		if ( context != nullptr and context == this->glib_context )
+		{
+			if ( g_main_context_check(context, priority, this->glib_fds.data(), n_glib) )
+				g_main_context_dispatch(context);
+		}
+	}
+}
@@ -0,0 +1,93 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVENT_LOOP_HH
+#define EVENT_LOOP_HH
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <utility>
+#include <vector>
+#include <gio/gio.h>		// for GMainContext
+
+//   An epoll loop, which sleeps until one of its file descriptors has something
+// for it.  It can also run a GMainContext: that context's file descriptors are
+// put in the same epoll set, so the same thread dispatches its sources (e.g.
+// DBus replies) as they become ready.
+//   Everything except quit() must be called from the thread which calls run().
+// (Before run() has started, that means whichever thread will call it.)
+struct EventLoop
+{
+	//   Called with the epoll events (EPOLLIN, EPOLLHUP, ...) which happened.
+	// Callbacks may add and remove file descriptors (including their own).
+	typedef std::function<void(uint32_t)> Callback;
+
+	EventLoop() :
+	epoll_fd(-1), quit_fd(-1), running(false), glib_context(nullptr)
+	{ }
+
+	~EventLoop();
+
+	// Returns false if the epoll set couldn't be made
+	bool init();
+
+	//   Watch 'fd' for 'events'.  Adding an fd which is already watched just
+	// changes its events and callback.
+	bool add_fd( int fd, uint32_t events, Callback callback );
+	void remove_fd( int fd );
+
+	//   A one-shot timer: the callback is called once, 'ms' after set_timer().
+	// Returns the timerfd, or -1.  Destroy it with remove_timer().
+	int add_timer( Callback callback );
+	void set_timer( int timer_fd, unsigned int ms );
+	void cancel_timer( int timer_fd );
+	void remove_timer( int timer_fd );
+
+	//   Runs 'context' as part of this loop.  This acquires it for this thread,
+	// so nothing else may iterate it.
+	void attach_glib_context( GMainContext *context );
+	void detach_glib_context();
+
+	//   Runs until quit() is called.  quit() can be called from any thread (or a
+	// callback).
+	void run();
+	void quit();
+
+private:
+	int epoll_fd;
+	int quit_fd;     // An eventfd, for quit() to wake us up
+	std::atomic<bool> running;
+
+	std::map<int,Callback> callbacks;
+
+	//   The GMainContext's file descriptors, as they were the last time we put
+	// them into the epoll set ((fd, epoll events), sorted by fd).  They are
+	// checked on every iteration, so these are vectors which are reused, not
+	// maps (which would allocate every time).
+	GMainContext *glib_context;
+	std::vector<GPollFD> glib_fds;
+	std::vector< std::pair<int,uint32_t> > glib_watched, glib_wanted;
+
+	void sync_glib_fds( int n_fds );
+	bool is_glib_fd( int fd ) const;
+};
+
+#endif // EVENT_LOOP_HH
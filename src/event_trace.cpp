@@ -0,0 +1,319 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "event_trace.hh"
+#include "realtime.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <initializer_list>
+#include <sstream>
+
+using namespace std;
+
+EventTracer event_tracer;
+
+thread_local EventTimes EventTracer::current = { 0, 0, 0 };
+thread_local uint64_t EventTracer::current_dbus_done_ns = 0;
+thread_local unsigned int EventTracer::current_dbus_calls = 0;
+
+//==============================================================================
+// LatencyHistogram
+
+//   The first 8 buckets are 0-7ns.  After that, each power of two is split into
+// 8 buckets, by the 3 bits below the top bit.
+unsigned int LatencyHistogram::bucket_for( uint64_t ns )
+{
+	if ( ns < (1u << SUB_BUCKET_BITS) )
+		return (unsigned int)ns;
+
+	unsigned int top_bit = 63 - (unsigned int)__builtin_clzll(ns);
+	unsigned int sub = (unsigned int)(ns >> (top_bit - SUB_BUCKET_BITS)) & ((1u << SUB_BUCKET_BITS) - 1);
+
+	return ((top_bit - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + sub;
+}
+
+// The largest duration which goes in the bucket
+uint64_t LatencyHistogram::bucket_top( unsigned int bucket )
+{
+	if ( bucket < (1u << SUB_BUCKET_BITS) )
+		return bucket;
+
+	unsigned int top_bit = (bucket >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+	uint64_t sub = bucket & ((1u << SUB_BUCKET_BITS) - 1);
+	uint64_t bottom = ((1ULL << SUB_BUCKET_BITS) + sub) << (top_bit - SUB_BUCKET_BITS);
+
+	return bottom + (1ULL << (top_bit - SUB_BUCKET_BITS)) - 1;
+}
+
+void LatencyHistogram::record( uint64_t ns )
+{
+	this->buckets[bucket_for(ns)].fetch_add(1, memory_order_relaxed);
+	this->n.fetch_add(1, memory_order_relaxed);
+	this->sum_ns.fetch_add(ns, memory_order_relaxed);
+
+	uint64_t old_max = this->max_ns.load(memory_order_relaxed);
+	while ( ns > old_max and !this->max_ns.compare_exchange_weak(old_max, ns, memory_order_relaxed) )
+		;
+}
+
+void LatencyHistogram::reset()
+{
+	for ( atomic<uint64_t> & b : this->buckets )
+		b.store(0, memory_order_relaxed);
+
+	this->n.store(0, memory_order_relaxed);
+	this->max_ns.store(0, memory_order_relaxed);
+	this->sum_ns.store(0, memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::percentile( double q ) const
+{
+	uint64_t total = this->count();
+
+	if ( total == 0 )
+		return 0;
+
+	// The rank of the sample we want (1 = the smallest)
+	uint64_t rank = (uint64_t)(q * (double)total);
+	if ( rank < 1 )
+		rank = 1;
+
+	uint64_t seen = 0;
+	for ( unsigned int i = 0; i < N_BUCKETS; i++ )
+	{
+		seen += this->buckets[i].load(memory_order_relaxed);
+		if ( seen >= rank )
+			return min(bucket_top(i), this->max());
+	}
+
+	return this->max();
+}
+
+uint64_t LatencyHistogram::count_at_most( uint64_t ns ) const
+{
+	uint64_t answer = 0;
+
+	for ( unsigned int i = 0; i < N_BUCKETS and bucket_top(i) <= ns; i++ )
+		answer += this->buckets[i].load(memory_order_relaxed);
+
+	return answer;
+}
+
+static string format_ns( uint64_t ns )
+{
+	ostringstream out;
+	out << fixed << setprecision(1) << (double)ns / 1000.0 << "us";
+	return out.str();
+}
+
+string LatencyHistogram::summary() const
+{
+	ostringstream out;
+
+	out << this->count() << " events";
+	if ( this->count() > 0 )
+		out << ", p50 "  << format_ns(this->percentile(0.5))
+		    << ", p99 "  << format_ns(this->percentile(0.99))
+		    << ", p999 " << format_ns(this->percentile(0.999))
+		    << ", max "  << format_ns(this->max());
+
+	return out.str();
+}
+
+//==============================================================================
+// EventTracer
+
+const char *EventTracer::stage_name( Stage stage )
+{
+	switch ( stage )
+	{
+		case PARSE: return "read -> parsed";
+		case QUEUE: return "parsed -> dispatched";
+		case DBUS:  return "dispatched -> DBus done";
+		case TOTAL: return "read -> DBus done";
+		case N_STAGES:
+		default:    return "?";
+	}
+}
+
+// Called by the output thread just before it calls the handler
+void EventTracer::dispatching( const EventTimes & times )
+{
+	current = times;
+	current.dispatched_ns = monotonic_ns();
+	current_dbus_done_ns = 0;
+	current_dbus_calls = 0;
+}
+
+//   Called (on the output thread) for each DBus call, once it has completed.
+// 'finished_ns' is when its reply arrived, and 'origin' is the event it was
+// made for: the current one, or an earlier one whose write was held back.
+void EventTracer::dbus_call_finished( uint64_t finished_ns, const EventTimes & origin )
+{
+	if ( finished_ns == 0 or origin.dispatched_ns == 0 )
+		return;
+
+	this->histograms[DBUS].record(finished_ns - origin.dispatched_ns);
+	if ( origin.read_ns != 0 )
+		this->histograms[TOTAL].record(finished_ns - origin.read_ns);
+
+	// Only the current event's trace record hasn't been written yet
+	if ( origin.dispatched_ns != current.dispatched_ns )
+		return;
+
+	current_dbus_calls++;
+	if ( finished_ns > current_dbus_done_ns )
+		current_dbus_done_ns = finished_ns;
+}
+
+// Called by the output thread once the handler has returned
+void EventTracer::event_finished( unsigned char operation, unsigned char channel )
+{
+	if ( current.read_ns != 0 and current.parsed_ns != 0 )
+		this->histograms[PARSE].record(current.parsed_ns - current.read_ns);
+	if ( current.parsed_ns != 0 and current.dispatched_ns != 0 )
+		this->histograms[QUEUE].record(current.dispatched_ns - current.parsed_ns);
+
+	if ( this->trace_capacity == 0 )
+		return;
+
+	//   Only this thread adds records, so there's no need for anything
+	// cleverer.  (The release is for write_trace(), once this thread has gone.)
+	size_t i = this->trace_used.load(memory_order_relaxed);
+	if ( i >= this->trace_capacity )
+	{
+		this->trace_dropped.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+
+	TraceRecord & r = this->trace_records[i];
+	r.times        = current;
+	r.dbus_done_ns = current_dbus_done_ns;
+	r.dbus_calls   = current_dbus_calls;
+	r.operation    = operation;
+	r.channel      = channel;
+
+	this->trace_used.store(i + 1, memory_order_release);
+}
+
+void EventTracer::reset()
+{
+	for ( LatencyHistogram & h : this->histograms )
+		h.reset();
+
+	this->trace_used.store(0, memory_order_relaxed);
+	this->trace_dropped.store(0, memory_order_relaxed);
+}
+
+// Must be called before any events go through
+void EventTracer::start_trace( size_t max_events )
+{
+	this->trace_records.reset(new TraceRecord[max_events]);
+	this->trace_capacity = max_events;
+	this->trace_used.store(0, memory_order_relaxed);
+}
+
+// Faults in the trace's pages, so that the output thread doesn't take the faults
+void EventTracer::prefault_trace()
+{
+	prefault_memory(this->trace_records.get(), this->trace_capacity * sizeof(TraceRecord));
+}
+
+//   Writes the events in Chrome's trace-event JSON format, which chrome://tracing
+// and Perfetto can open.  Each stage of each event is a span on its own row:
+// the serial thread for the parse, the queue, and the output thread for DBus.
+// This should only be called once the events have stopped.
+bool EventTracer::write_trace( const string & filename, string & error ) const
+{
+	ofstream out(filename.c_str());
+
+	if ( !out )
+	{
+		error = "unable to open " + filename + ": " + strerror(errno);
+		return false;
+	}
+
+	size_t used = this->trace_used.load(memory_order_acquire);
+
+	// Timestamps are in microseconds, counted from the earliest one
+	uint64_t origin = UINT64_MAX;
+	for ( size_t i = 0; i < used; i++ )
+	{
+		const EventTimes & t = this->trace_records[i].times;
+		for ( uint64_t ns : { t.read_ns, t.parsed_ns, t.dispatched_ns } )
+			if ( ns != 0 and ns < origin )
+				origin = ns;
+	}
+
+	out << "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":" << this->trace_dropped.load(memory_order_relaxed) << "},\"traceEvents\":[\n";
+
+	// Names for the rows
+	static const char * const row_names[] = { "serial: read -> parsed", "queue: parsed -> dispatched", "output: dispatched -> DBus done" };
+	for ( int tid = 0; tid < 3; tid++ )
+		out << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << tid + 1 << ",\"name\":\"thread_name\",\"args\":{\"name\":\"" << row_names[tid] << "\"}},\n";
+
+	out << fixed << setprecision(3);
+
+	bool first = true;
+	for ( size_t i = 0; i < used; i++ )
+	{
+		const TraceRecord & r = this->trace_records[i];
+		const EventTimes & t = r.times;
+
+		struct Span { const char *name; int tid; uint64_t start, end; } spans[3] =
+		{
+			{ "parse", 1, t.read_ns,       t.parsed_ns     },
+			{ "queue", 2, t.parsed_ns,     t.dispatched_ns },
+			{ "dbus",  3, t.dispatched_ns, r.dbus_done_ns  },
+		};
+
+		for ( const Span & s : spans )
+		{
+			if ( s.start == 0 or s.end < s.start )
+				continue;
+
+			if ( !first )
+				out << ",\n";
+			first = false;
+
+			out << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << s.tid
+			    << ",\"name\":\"" << s.name << "\""
+			    << ",\"ts\":" << (double)(s.start - origin) / 1000.0
+			    << ",\"dur\":" << (double)(s.end - s.start) / 1000.0
+			    << ",\"args\":{\"event\":" << i
+			    << ",\"operation\":" << (unsigned int)r.operation
+			    << ",\"channel\":" << (unsigned int)r.channel
+			    << ",\"dbus_calls\":" << r.dbus_calls << "}}";
+		}
+	}
+
+	out << "\n]}\n";
+
+	if ( !out )
+	{
+		error = "unable to write " + filename;
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,157 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVENT_TRACE_HH
+#define EVENT_TRACE_HH
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <time.h>
+
+// Maximum number of events kept for the --trace file
+#define TRACE_MAX_EVENTS 200000
+
+// Nanoseconds on the monotonic clock
+inline uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+//   When an event got to each stage, by monotonic_ns().  0 = it hasn't (or we
+// don't know).
+struct EventTimes
+{
+	uint64_t read_ns;        // Its first byte came out of attempt_serial_read()
+	uint64_t parsed_ns;      // The parser had decoded it (and its batch)
+	uint64_t dispatched_ns;  // The handler was called with it
+};
+
+//   A histogram of durations, which any number of threads can add to at once
+// without locking.  The buckets are logarithmic, with 8 per power of two, so
+// the percentiles it gives are within 12.5%.
+struct LatencyHistogram
+{
+	LatencyHistogram() { reset(); }
+
+	void record( uint64_t ns );
+	void reset();
+
+	uint64_t count() const { return n.load(std::memory_order_relaxed); }
+	uint64_t max() const { return max_ns.load(std::memory_order_relaxed); }
+	uint64_t sum() const { return sum_ns.load(std::memory_order_relaxed); }
+
+	//   How many took at most 'ns'.  (Durations in the same bucket as 'ns' are
+	// all counted, or none of them are.)
+	uint64_t count_at_most( uint64_t ns ) const;
+
+	// An upper bound on the q'th quantile (q = 0 to 1)
+	uint64_t percentile( double q ) const;
+
+	// e.g. "1234 events, p50 10.0us, p99 ..."
+	std::string summary() const;
+
+private:
+	static const unsigned int SUB_BUCKET_BITS = 3;
+	static const unsigned int N_BUCKETS = 64 << SUB_BUCKET_BITS;
+
+	std::atomic<uint64_t> buckets[N_BUCKETS];
+	std::atomic<uint64_t> n, max_ns, sum_ns;
+
+	static unsigned int bucket_for( uint64_t ns );
+	static uint64_t bucket_top( unsigned int bucket );
+};
+
+//   Follows MIDI events through the program, and keeps a histogram of how long
+// each stage takes:
+//     PARSE: read from the serial device -> decoded by the parser
+//     QUEUE: decoded -> handler called (i.e. waiting in MIDIEventDispatcher)
+//     DBUS:  handler called -> a DBus call made for it has completed
+//     TOTAL: read from the serial device -> a DBus call has completed
+//   The timestamps for the event being worked on are in 'current', which is
+// per thread.  The serial reader's thread fills in the first two, and
+// MIDIEventDispatcher carries them over to the output thread with the event.
+//   A volume which is written later (held back by the rate limit, or on one of
+// the ramper's ticks) keeps the times of the event which asked for it, so its
+// DBus and total times include how long it waited.  Those calls are only in
+// the histograms, though: the event's --trace record has gone by then.
+//   Optionally (start_trace()), every event's timings are also kept, so that
+// write_trace() can save them in Chrome's trace-event format.
+struct EventTracer
+{
+	enum Stage
+	{
+		PARSE,
+		QUEUE,
+		DBUS,
+		TOTAL,
+		N_STAGES
+	};
+
+	static thread_local EventTimes current;
+
+	LatencyHistogram histograms[N_STAGES];
+
+	EventTracer() : trace_capacity(0), trace_used(0), trace_dropped(0) {}
+
+	static const char *stage_name( Stage stage );
+
+	// Serial reader's thread
+	static void bytes_read( uint64_t read_ns ) { current.read_ns = read_ns; }
+	static void parsed() { current.parsed_ns = monotonic_ns(); }
+
+	// Output thread
+	void dispatching( const EventTimes & times );
+	void dbus_call_finished( uint64_t finished_ns, const EventTimes & origin );
+	void event_finished( unsigned char operation, unsigned char channel );
+
+	void reset();
+
+	// Keep (up to 'max_events') events' timings for write_trace()
+	void start_trace( size_t max_events );
+	void prefault_trace();      // For real-time mode
+	bool write_trace( const std::string & filename, std::string & error ) const;
+
+private:
+	struct TraceRecord
+	{
+		EventTimes times;
+		uint64_t dbus_done_ns;      // The last of its DBus calls (0 = none)
+		unsigned int dbus_calls;
+		unsigned char operation, channel;
+	};
+
+	// Only the output thread writes these
+	static thread_local uint64_t current_dbus_done_ns;
+	static thread_local unsigned int current_dbus_calls;
+
+	std::unique_ptr<TraceRecord[]> trace_records;
+	size_t trace_capacity;
+	std::atomic<size_t> trace_used;
+	std::atomic<unsigned long> trace_dropped;
+};
+
+// There is only one of these, because events go through the whole program
+extern EventTracer event_tracer;
+
+#endif // EVENT_TRACE_HH
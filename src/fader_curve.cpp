@@ -0,0 +1,233 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "fader_curve.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+
+using namespace std;
+
+// Stores a volume in the table, clamped to what PulseAudio can take
+void FaderCurve::set( unsigned int position, double vol )
+{
+	int v = (int)vol;
+
+	if ( v < 0 )
+		v = 0;
+	if ( v > 65535 )
+		v = 65535;
+
+	this->table[position] = (uint16_t)v;
+}
+
+//   Every curve we make goes up with the fader, except for BREAKPOINTS ones,
+// where the points can say anything.
+void FaderCurve::find_monotonic()
+{
+	this->monotonic = is_sorted(this->table, this->table + FADER_CURVE_SIZE);
+}
+
+int FaderCurve::pitch( unsigned int vol ) const
+{
+	size_t best = 0;
+
+	if ( this->monotonic )
+	{
+		//   The first position at or above 'vol', unless the one below it is at
+		// least as close, in which case the first position with that one's
+		// volume.
+		best = (size_t)(lower_bound(this->table, this->table + FADER_CURVE_SIZE, vol) - this->table);
+
+		if ( best == FADER_CURVE_SIZE or ( best > 0 and vol - this->table[best - 1] <= this->table[best] - vol ) )
+			best = (size_t)(lower_bound(this->table, this->table + best, this->table[best - 1]) - this->table);
+	}
+	else
+	{
+		unsigned int best_distance = ~0u;
+
+		for ( size_t i = 0; i < FADER_CURVE_SIZE; i++ )
+		{
+			unsigned int distance = this->table[i] > vol ? this->table[i] - vol : vol - this->table[i];
+			if ( distance < best_distance )
+			{
+				best = i;
+				best_distance = distance;
+			}
+		}
+	}
+
+	return (int)best - 8192;
+}
+
+FaderCurve FaderCurve::log_fit()
+{
+	FaderCurve answer(LOG_FIT);
+
+	for ( unsigned int i = 0; i < FADER_CURVE_SIZE; i++ )
+	{
+		double x = 4*i; // number 0-65535
+		//   All of the following constants I got from a Log fit in gnumeric.
+		// I plotted the data of 'fader level' vs 'fader travel in mm'.
+		answer.set(i, 18864.560759108*log(x+2046.27968)-144258.687272491);
+	}
+
+	answer.find_monotonic();
+	return answer;
+}
+
+FaderCurve FaderCurve::linear()
+{
+	FaderCurve answer(LINEAR);
+
+	for ( unsigned int i = 0; i < FADER_CURVE_SIZE; i++ )
+		answer.set(i, i * 65535.0 / (FADER_CURVE_SIZE - 1));
+
+	answer.find_monotonic();
+	return answer;
+}
+
+FaderCurve FaderCurve::db_linear( double min_db )
+{
+	FaderCurve answer(DB_LINEAR);
+
+	// The bottom of the fader is always silent
+	answer.set(0, 0);
+
+	for ( unsigned int i = 1; i < FADER_CURVE_SIZE; i++ )
+	{
+		double db = min_db * (1.0 - (double)i / (FADER_CURVE_SIZE - 1));
+		double amplitude = pow(10.0, db / 20.0);
+
+		//   PulseAudio's volumes are cubic (see pa_sw_volume_from_linear()),
+		// and 65536 is 0dB.
+		answer.set(i, cbrt(amplitude) * 65536.0);
+	}
+
+	answer.find_monotonic();
+	return answer;
+}
+
+FaderCurve FaderCurve::breakpoints( vector<Breakpoint> points )
+{
+	FaderCurve answer(BREAKPOINTS);
+
+	if ( points.empty() )
+	{
+		for ( unsigned int i = 0; i < FADER_CURVE_SIZE; i++ )
+			answer.set(i, 0);
+		answer.find_monotonic();
+		return answer;
+	}
+
+	sort(points.begin(), points.end(),
+	     [](const Breakpoint & a, const Breakpoint & b) { return a.position < b.position; });
+
+	size_t seg = 0;
+
+	for ( unsigned int i = 0; i < FADER_CURVE_SIZE; i++ )
+	{
+		// Before the first point or after the last one, the curve is flat
+		if ( i <= points.front().position )
+		{
+			answer.set(i, points.front().volume);
+			continue;
+		}
+		if ( i >= points.back().position )
+		{
+			answer.set(i, points.back().volume);
+			continue;
+		}
+
+		// Find the segment [seg, seg+1] which contains i
+		while ( points[seg+1].position < i )
+			seg++;
+
+		const Breakpoint & a = points[seg];
+		const Breakpoint & b = points[seg+1];
+		double t = (double)(i - a.position) / (b.position - a.position);
+
+		answer.set(i, a.volume + t * ((double)b.volume - a.volume));
+	}
+
+	answer.find_monotonic();
+	return answer;
+}
+
+FaderCurve *FaderCurve::from_spec( const string & spec )
+{
+	if ( spec == "log" )
+		return new FaderCurve(log_fit());
+
+	if ( spec == "linear" )
+		return new FaderCurve(linear());
+
+	if ( spec == "db" )
+		return new FaderCurve(db_linear(-60.0));
+
+	if ( spec.compare(0, 3, "db:") == 0 )
+	{
+		char *end;
+		double min_db = strtod(spec.c_str() + 3, &end);
+
+		if ( *end != '\0' or end == spec.c_str() + 3 or min_db >= 0 )
+			return NULL;
+
+		return new FaderCurve(db_linear(min_db));
+	}
+
+	if ( spec.compare(0, 7, "points:") == 0 )
+	{
+		vector<Breakpoint> points;
+		istringstream list(spec.substr(7));
+		string point;
+
+		while ( getline(list, point, ',') )
+		{
+			unsigned long position, volume;
+			char *end;
+
+			position = strtoul(point.c_str(), &end, 10);
+			if ( *end != ':' or end == point.c_str() )
+				return NULL;
+
+			const char *vol_str = end + 1;
+			volume = strtoul(vol_str, &end, 10);
+			if ( *end != '\0' or end == vol_str )
+				return NULL;
+
+			if ( position >= FADER_CURVE_SIZE or volume > 65535 )
+				return NULL;
+
+			Breakpoint b;
+			b.position = (unsigned int)position;
+			b.volume   = (unsigned int)volume;
+			points.push_back(b);
+		}
+
+		if ( points.empty() )
+			return NULL;
+
+		return new FaderCurve(breakpoints(points));
+	}
+
+	return NULL;
+}
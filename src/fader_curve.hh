@@ -0,0 +1,91 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FADER_CURVE_HH
+#define FADER_CURVE_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Number of possible pitch bend values (14 bits)
+#define FADER_CURVE_SIZE 16384
+
+//   Maps a fader position (i.e. a pitch bend value) to a PulseAudio volume
+// (0-65535).  The whole table gets worked out when the curve is made, so that
+// looking up a volume is just reading from an array.
+struct FaderCurve
+{
+	enum Type
+	{
+		LOG_FIT,       // The fit of our faders' travel (see log_fit())
+		LINEAR,        // Fader position proportional to PulseAudio volume
+		DB_LINEAR,     // Fader position proportional to dB
+		BREAKPOINTS    // Straight lines between user-supplied points
+	};
+
+	// A point on a BREAKPOINTS curve
+	struct Breakpoint
+	{
+		unsigned int position;   // 0-16383
+		unsigned int volume;     // 0-65535
+	};
+
+	static FaderCurve log_fit();
+	static FaderCurve linear();
+	// 'min_db' is the level at the bottom of the fader's travel (e.g. -60)
+	static FaderCurve db_linear( double min_db );
+	static FaderCurve breakpoints( std::vector<Breakpoint> points );
+
+	//   Makes a curve from a description, as used in the mapping config file:
+	//     "log", "linear", "db", "db:<dB at bottom>", or
+	//     "points:<position>:<volume>,<position>:<volume>,..."
+	// Returns NULL if the description doesn't make sense.  The curve must be
+	// deleted later.
+	static FaderCurve *from_spec( const std::string & spec );
+
+	//   Takes a pitch bend value, as given to MIDICommandHandler::pitch_bend()
+	// (-8192 to 8191).
+	unsigned int volume( int pitch ) const
+	{
+		return table[(unsigned int)(pitch + 8192) & (FADER_CURVE_SIZE - 1)];
+	}
+
+	//   The other way round: the pitch bend value (-8192 to 8191) which gives
+	// the volume closest to 'vol'.  Where several do (e.g. at the ends of a
+	// curve, where it is flat), it's the lowest one.
+	int pitch( unsigned int vol ) const;
+
+	Type get_type() const { return type; }
+
+private:
+	Type type;
+	bool monotonic;     // Whether the volumes never go down (so pitch() can search)
+	uint16_t table[FADER_CURVE_SIZE];
+
+	explicit FaderCurve( Type type_in ) :
+	type(type_in), monotonic(false)
+	{ }
+
+	void find_monotonic();
+
+	void set( unsigned int position, double vol );
+};
+
+#endif // FADER_CURVE_HH
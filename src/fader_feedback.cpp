@@ -0,0 +1,155 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "fader_feedback.hh"
+#include "logger.hh"
+#include "program_volume_handler.hh"
+#include "serial_reader.hh"
+#include "utils.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+FaderFeedback::FaderFeedback() :
+handler(nullptr), loop(nullptr), wake_pending(false), moved_count(0), touched_count(0)
+{
+	for ( int i = 0; i < MAX_FADER_CHANNELS; i++ )
+	{
+		this->touched_ns[i] = 0;
+		this->sent_ns[i] = 0;
+	}
+
+	//   This is made now, rather than by start(), because the backend can
+	// call volume_changed() as soon as it's connected, and until it is
+	// disconnected.
+	this->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+FaderFeedback::~FaderFeedback()
+{
+	if ( this->wake_fd >= 0 )
+		close(this->wake_fd);
+}
+
+bool FaderFeedback::start( EventLoop & loop_in )
+{
+	if ( this->wake_fd < 0 or this->handler == nullptr )
+		return false;
+
+	this->loop = &loop_in;
+	if ( !this->loop->add_fd(this->wake_fd, EPOLLIN, [this]( uint32_t ) { this->on_wake(); }) )
+		return false;
+
+	// Anything which came in before now is waiting already
+	lock_guard<mutex> lock(this->pending_mutex);
+	if ( !this->pending.empty() )
+		this->wake();
+
+	return true;
+}
+
+void FaderFeedback::stop()
+{
+	if ( this->loop != nullptr )
+		this->loop->remove_fd(this->wake_fd);
+
+	this->loop = nullptr;
+}
+
+void FaderFeedback::volume_changed( const string & stream, unsigned int volume )
+{
+	lock_guard<mutex> lock(this->pending_mutex);
+
+	this->pending[stream] = volume;
+
+	// The loop only needs waking once for each batch
+	if ( !this->wake_pending )
+		this->wake();
+}
+
+// Called with 'pending_mutex' locked
+void FaderFeedback::wake()
+{
+	uint64_t one = 1;
+	if ( write(this->wake_fd, &one, sizeof(one)) < 0 and errno != EAGAIN )
+		logger.log(LOG_ERROR, "FaderFeedback::wake(): unable to wake up the loop: %s", strerror(errno));
+
+	this->wake_pending = true;
+}
+
+bool FaderFeedback::fader_moved( int channel, uint64_t now_ns )
+{
+	if ( channel < 0 or channel >= MAX_FADER_CHANNELS )
+		return false;
+
+	if ( now_ns - this->sent_ns[channel].load(memory_order_relaxed) < FADER_FEEDBACK_SETTLE_MS * 1000000ULL )
+		return true;
+
+	this->touched_ns[channel].store(now_ns, memory_order_relaxed);
+	return false;
+}
+
+//   Takes the batch of volume changes, and moves the faders for the ones which
+// weren't our own doing.  Each device gets one write for the lot.
+void FaderFeedback::on_wake()
+{
+	uint64_t count;
+	if ( read(this->wake_fd, &count, sizeof(count)) != (ssize_t)sizeof(count) )
+		return;
+
+	map<string,unsigned int> changes;
+	{
+		lock_guard<mutex> lock(this->pending_mutex);
+		changes.swap(this->pending);
+		this->wake_pending = false;
+	}
+
+	uint64_t now_ns = monotonic_ns();
+
+	for ( const auto & change : changes )
+	{
+		int channel, pitch;
+		if ( !this->handler->fader_position(change.first, change.second, now_ns, channel, pitch) )
+			continue;
+
+		// Don't fight whoever is moving the fader
+		if ( now_ns - this->touched_ns[channel].load(memory_order_relaxed) < FADER_FEEDBACK_TOUCH_MS * 1000000ULL )
+		{
+			this->touched_count.fetch_add(1, memory_order_relaxed);
+			continue;
+		}
+
+		for ( SerialMIDIReader *reader : this->devices )
+			reader->queue_pitch_bend(channel - reader->device.channel_offset, pitch);
+
+		this->sent_ns[channel].store(now_ns, memory_order_relaxed);
+		this->moved_count.fetch_add(1, memory_order_relaxed);
+
+		logger.log(LOG_VERBOSE, "Moving fader %d to %d (volume %u of %s)", channel, pitch, change.second, change.first.c_str());
+	}
+
+	for ( SerialMIDIReader *reader : this->devices )
+		reader->flush_writes();
+}
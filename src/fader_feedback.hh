@@ -0,0 +1,105 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef FADER_FEEDBACK_HH
+#define FADER_FEEDBACK_HH
+
+#include "event_loop.hh"
+#include "fader_mapping.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct MIDIHandler_Program_Volume;
+struct SerialMIDIReader;
+
+//   For this long after the controller sends a fader's position, the fader is
+// taken to be in someone's hand, and isn't moved
+#define FADER_FEEDBACK_TOUCH_MS 500
+
+//   For this long after we move a fader, whatever the controller sends for it
+// is taken to be the motor getting there, not a hand
+#define FADER_FEEDBACK_SETTLE_MS 300
+
+//   Moves motorized faders to match volumes which something else has changed
+// (e.g. pavucontrol).  The backend tells this about every volume change, on
+// its own thread, and the changes are picked up by the loop, a batch at a
+// time: only the latest volume of each stream is kept until then.  The
+// handler turns each one into a fader position (ignoring the ones it set
+// itself), and the serial readers write them to their devices.
+//   The faders' own echoes are ignored too: see fader_moved().
+struct FaderFeedback
+{
+	FaderFeedback();
+	~FaderFeedback();
+
+	//   Before start(): whose faders these are, and the devices they are on.
+	// A fader's position is written to every device whose channels include it.
+	void set_handler( MIDIHandler_Program_Volume *handler_in ) { handler = handler_in; }
+	void add_device( SerialMIDIReader *reader ) { devices.push_back(reader); }
+
+	// These must be called on the loop's thread
+	bool start( EventLoop & loop_in );
+	void stop();
+
+	//   Can be called from any thread (see VolumeBackend::watch_volumes()),
+	// even before start()
+	void volume_changed( const std::string & stream, unsigned int volume );
+
+	//   The controller has sent fader 'channel''s position.  Returns true if
+	// that is the motor following a position we sent it, rather than a hand,
+	// so that it doesn't change any volumes.  (Called on the output thread.)
+	bool fader_moved( int channel, uint64_t now_ns );
+
+	// Counters (these can be read from any thread)
+	unsigned long get_moved_count() const { return moved_count.load(std::memory_order_relaxed); }
+	unsigned long get_touched_count() const { return touched_count.load(std::memory_order_relaxed); }
+
+private:
+	MIDIHandler_Program_Volume *handler;
+	std::vector<SerialMIDIReader*> devices;
+
+	EventLoop *loop;
+	int wake_fd;                // An eventfd, for volume_changed() to wake the loop
+
+	std::mutex pending_mutex;
+	std::map<std::string,unsigned int> pending;     // stream -> latest volume
+	bool wake_pending;
+
+	//   When (see monotonic_ns()) each fader was last moved by the controller,
+	// and by us
+	std::atomic<uint64_t> touched_ns[MAX_FADER_CHANNELS];
+	std::atomic<uint64_t> sent_ns[MAX_FADER_CHANNELS];
+
+	std::atomic<unsigned long> moved_count;
+	std::atomic<unsigned long> touched_count;
+
+	void wake();
+	void on_wake();
+
+	FaderFeedback( const FaderFeedback & ) = delete;
+	FaderFeedback & operator=( const FaderFeedback & ) = delete;
+};
+
+#endif // FADER_FEEDBACK_HH
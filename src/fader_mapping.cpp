@@ -0,0 +1,193 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "fader_mapping.hh"
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+
+using namespace std;
+
+bool split_config_line( const string & line, vector<string> & fields, string & error );
+
+//==============================================================================
+
+size_t FaderMappingTable::n_rules() const
+{
+	size_t answer = 0;
+
+	for ( const auto & rules : this->rules_by_channel )
+		answer += rules.size();
+
+	return answer;
+}
+
+const FaderCurve *FaderMappingTable::get_curve( const string & spec )
+{
+	for ( const auto & c : this->curves )
+		if ( c.first == spec )
+			return c.second.get();
+
+	FaderCurve *curve = FaderCurve::from_spec(spec);
+	if ( curve == NULL )
+		return NULL;
+
+	this->curves.push_back(make_pair(spec, unique_ptr<FaderCurve>(curve)));
+
+	return curve;
+}
+
+bool FaderMappingTable::add_rule( int channel, const string & prop_name, const string & prop_val, const string & curve_spec, string & error )
+{
+	Fader_Program_Mapping rule;
+
+	rule.channel = channel;
+	rule.curve   = this->get_curve(curve_spec);
+
+	if ( rule.curve == NULL )
+	{
+		error = "bad curve '" + curve_spec + "'";
+		return false;
+	}
+
+	if ( !PropertyMatch::parse(prop_name, prop_val, rule.match, error) )
+		return false;
+
+	this->rules_by_channel[channel].push_back(rule);
+
+	return true;
+}
+
+FaderMappingTable *FaderMappingTable::built_in()
+{
+	FaderMappingTable *answer = new FaderMappingTable;
+	string error;
+
+	// MIDI Channel nr, pulse property, pulse property value, fader curve
+	answer->add_rule(0, "application.name", "Music Player Daemon", "log", error);
+	answer->add_rule(1, "application.process.binary", "gnome-mpv", "log", error);
+	answer->add_rule(1, "application.process.binary", "mpv", "log", error);
+	answer->add_rule(2, "application.process.binary", "firefox", "log", error);
+	answer->add_rule(2, "application.process.binary", "firefox-bin", "log", error);
+	answer->add_rule(2, "application.process.binary", "firefox-esr", "log", error);
+
+	return answer;
+}
+
+//   Splits a line of the config file into whitespace-separated fields, which
+// can be quoted.  Everything after a '#' (outside quotes) is ignored.
+bool split_config_line( const string & line, vector<string> & fields, string & error )
+{
+	size_t i = 0;
+
+	fields.clear();
+
+	while ( i < line.size() )
+	{
+		if ( isspace((unsigned char)line[i]) )
+		{
+			i++;
+			continue;
+		}
+
+		if ( line[i] == '#' )
+			break;
+
+		string field;
+
+		if ( line[i] == '"' )
+		{
+			size_t end = line.find('"', i + 1);
+			if ( end == string::npos )
+			{
+				error = "unterminated quote";
+				return false;
+			}
+
+			field = line.substr(i + 1, end - i - 1);
+			i = end + 1;
+		}
+		else
+		{
+			while ( i < line.size() and !isspace((unsigned char)line[i]) and line[i] != '#' )
+				field.append(1, line[i++]);
+		}
+
+		fields.push_back(field);
+	}
+
+	return true;
+}
+
+FaderMappingTable *FaderMappingTable::load( const string & filename, string & error )
+{
+	ifstream file(filename);
+	string line;
+	vector<string> fields;
+	unsigned int line_nr = 0;
+
+	if ( !file )
+	{
+		error = "cannot open " + filename;
+		return NULL;
+	}
+
+	unique_ptr<FaderMappingTable> answer(new FaderMappingTable);
+
+	while ( getline(file, line) )
+	{
+		line_nr++;
+
+		string where = filename + ":" + to_string(line_nr) + ": ";
+
+		if ( !split_config_line(line, fields, error) )
+		{
+			error = where + error;
+			return NULL;
+		}
+
+		if ( fields.empty() )
+			continue;
+
+		if ( fields.size() < 3 or fields.size() > 4 )
+		{
+			error = where + "expected <channel> <property name> <property value> [<curve>]";
+			return NULL;
+		}
+
+		char *end;
+		long channel = strtol(fields[0].c_str(), &end, 10);
+		if ( *end != '\0' or fields[0].empty() or channel < 0 or channel >= MAX_FADER_CHANNELS )
+		{
+			error = where + "bad channel '" + fields[0] + "'";
+			return NULL;
+		}
+
+		string curve_spec = (fields.size() == 4) ? fields[3] : "log";
+
+		if ( !answer->add_rule((int)channel, fields[1], fields[2], curve_spec, error) )
+		{
+			error = where + error;
+			return NULL;
+		}
+	}
+
+	return answer.release();
+}
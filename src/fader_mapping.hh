@@ -0,0 +1,91 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FADER_MAPPING_HH
+#define FADER_MAPPING_HH
+
+#include "fader_curve.hh"
+#include "stream_index.hh"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#define MIDI_CHANNELS 16
+
+//   Faders are numbered by MIDI channel, plus the channel offset of the device
+// they are on (see SerialDevice).  So there can be more of them than channels.
+#define MAX_FADER_CHANNELS 128
+
+//   One rule: which PulseAudio streams a fader (MIDI channel + offset)
+// controls, by a property of their client or of the streams themselves
+struct Fader_Program_Mapping
+{
+	int channel;
+	PropertyMatch match;
+	const FaderCurve *curve;
+};
+
+//   All of the rules, sorted by channel, so that an event only has to look at
+// the rules for its own channel.  Once made, this never changes: a reload makes
+// a whole new one.
+struct FaderMappingTable
+{
+	//   The rules which used to be hard-coded.  These are used if no config
+	// file is given.
+	static FaderMappingTable *built_in();
+
+	//   Reads a config file.  Each line is a rule:
+	//     <channel> <property name> <property value> [<curve>]
+	// Fields are separated by whitespace, and can be put in double quotes if
+	// they contain any.  The property is the client's, or, with "stream:" in
+	// front (e.g. stream:media.role), the stream's own.  The value can be a
+	// prefix or a glob: see PropertyMatch.  The curve is as for
+	// FaderCurve::from_spec(), and defaults to "log".  '#' starts a comment.
+	//   e.g. to control video playback, but not (say) the browser's
+	// notification sounds, which are media.role "event":
+	//     2 stream:media.role video
+	//   Returns NULL (and sets 'error') if the file can't be read or is wrong.
+	// The table must be deleted later.
+	static FaderMappingTable *load( const std::string & filename, std::string & error );
+
+	const std::vector<Fader_Program_Mapping> & rules_for( int channel ) const
+	{
+		static const std::vector<Fader_Program_Mapping> no_rules;
+
+		if ( channel < 0 or channel >= MAX_FADER_CHANNELS )
+			return no_rules;
+
+		return rules_by_channel[channel];
+	}
+
+	size_t n_rules() const;
+
+private:
+	std::vector<Fader_Program_Mapping> rules_by_channel[MAX_FADER_CHANNELS];
+
+	//   The curves the rules point to.  Rules with the same curve description
+	// share one.
+	std::vector< std::pair< std::string, std::unique_ptr<FaderCurve> > > curves;
+
+	const FaderCurve *get_curve( const std::string & spec );
+	bool add_rule( int channel, const std::string & prop_name, const std::string & prop_val, const std::string & curve_spec, std::string & error );
+};
+
+#endif // FADER_MAPPING_HH
@@ -0,0 +1,194 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "logger.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+using namespace std;
+
+Logger logger;
+
+Logger::Logger() :
+max_level(LOG_INFO), enqueue_pos(0), dequeue_pos(0), dropped_count(0), running(false)
+{
+	for ( size_t i = 0; i < LOG_RING_SIZE; i++ )
+		this->ring[i].sequence.store(i, memory_order_relaxed);
+}
+
+//   Writes the timestamp, the message and a newline into 'buffer' (which is
+// LOG_RECORD_SIZE long), and returns the length.
+size_t Logger::format_line( char *buffer, const char *format, va_list args )
+{
+	//   Each thread keeps the timestamp it made last, and only makes a new one
+	// when the second changes.  The coarse clock doesn't need a system call.
+	static thread_local time_t prefix_second = 0;
+	static thread_local char prefix[32];
+	static thread_local size_t prefix_length = 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+	if ( now.tv_sec != prefix_second or prefix_length == 0 )
+	{
+		struct tm timeinfo;
+		localtime_r(&now.tv_sec, &timeinfo);
+		prefix_length = strftime(prefix, sizeof(prefix), "[%Y-%m-%d %H:%M:%S] ", &timeinfo);
+		prefix_second = now.tv_sec;
+	}
+
+	memcpy(buffer, prefix, prefix_length);
+	size_t length = prefix_length;
+
+	// Leave room for the newline
+	int n = vsnprintf(buffer + length, LOG_RECORD_SIZE - length - 1, format, args);
+	if ( n > 0 )
+		length += min((size_t)n, LOG_RECORD_SIZE - length - 2);
+
+	buffer[length++] = '\n';
+
+	return length;
+}
+
+void Logger::log( LogLevel level, const char *format, ... )
+{
+	if ( !this->enabled(level) )
+		return;
+
+	va_list args;
+	va_start(args, format);
+
+	if ( !this->running.load(memory_order_acquire) )
+	{
+		char buffer[LOG_RECORD_SIZE];
+		size_t length = format_line(buffer, format, args);
+		va_end(args);
+
+		if ( write(STDERR_FILENO, buffer, length) < 0 )
+			this->dropped_count.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+
+	//   Claim a slot.  Another thread might claim the same position first, in
+	// which case try the next one.
+	size_t pos = this->enqueue_pos.load(memory_order_relaxed);
+	Record *record;
+
+	for ( ;; )
+	{
+		record = &this->ring[pos & (LOG_RING_SIZE - 1)];
+		size_t sequence = record->sequence.load(memory_order_acquire);
+
+		if ( sequence == pos )
+		{
+			if ( this->enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed) )
+				break;
+		}
+		else if ( sequence < pos )
+		{
+			// The writer hasn't got round to this slot since last time: full
+			va_end(args);
+			this->dropped_count.fetch_add(1, memory_order_relaxed);
+			return;
+		}
+		else
+			pos = this->enqueue_pos.load(memory_order_relaxed);
+	}
+
+	record->length = format_line(record->text, format, args);
+	va_end(args);
+
+	record->sequence.store(pos + 1, memory_order_release);
+}
+
+//==============================================================================
+// Writer thread
+
+//   Writes everything which is ready, in order, with one write() for as many
+// lines as it can.  Returns false if there was nothing.
+bool Logger::write_pending()
+{
+	static char out[64 * LOG_RECORD_SIZE];
+	size_t out_length = 0;
+	bool got_any = false;
+
+	for ( ;; )
+	{
+		Record & record = this->ring[this->dequeue_pos & (LOG_RING_SIZE - 1)];
+
+		bool ready = record.sequence.load(memory_order_acquire) == this->dequeue_pos + 1;
+
+		if ( out_length > 0 and ( !ready or out_length + record.length > sizeof(out) ) )
+		{
+			if ( write(STDERR_FILENO, out, out_length) < 0 )
+				this->dropped_count.fetch_add(1, memory_order_relaxed);
+			out_length = 0;
+		}
+
+		if ( !ready )
+			break;
+
+		memcpy(out + out_length, record.text, record.length);
+		out_length += record.length;
+		got_any = true;
+
+		// The slot is free again, for the next time round the ring
+		record.sequence.store(this->dequeue_pos + LOG_RING_SIZE, memory_order_release);
+		this->dequeue_pos++;
+	}
+
+	return got_any;
+}
+
+void Logger::writer_main()
+{
+	while ( this->running.load(memory_order_acquire) )
+	{
+		if ( !this->write_pending() )
+			this_thread::sleep_for(chrono::milliseconds(LOG_WRITER_PERIOD_MS));
+	}
+
+	this->write_pending();
+}
+
+void Logger::start()
+{
+	if ( this->writer_thread.joinable() )
+		return;
+
+	this->running.store(true, memory_order_release);
+	this->writer_thread = thread(&Logger::writer_main, this);
+}
+
+//   Lines which are being logged while this is happening might still go into
+// the ring, after the writer has finished.  Only call this once the other
+// threads have stopped logging.
+void Logger::stop()
+{
+	if ( !this->writer_thread.joinable() )
+		return;
+
+	this->running.store(false, memory_order_release);
+	this->writer_thread.join();
+}
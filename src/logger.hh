@@ -0,0 +1,99 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LOGGER_HH
+#define LOGGER_HH
+
+#include <atomic>
+#include <cstdarg>
+#include <cstddef>
+#include <thread>
+
+//   How many log lines can be waiting for the writer thread, and how long each
+// one can be (including the timestamp and newline).  Longer lines are cut
+// short.  LOG_RING_SIZE must be a power of two.
+#define LOG_RING_SIZE   1024
+#define LOG_RECORD_SIZE 320
+
+// How often the writer thread looks for log lines
+#define LOG_WRITER_PERIOD_MS 20
+
+enum LogLevel
+{
+	LOG_ERROR,      // Always printed
+	LOG_INFO,       // Not with --quiet
+	LOG_VERBOSE     // Only with --verbose
+};
+
+//   Log lines are formatted (with printf-style formats) by whichever thread
+// logs them, into a slot of a lock-free ring, and written to stderr by a
+// background thread.  So logging never waits for the terminal, or for a lock.
+// If the ring is full, the line is dropped (and counted).
+//   Lines below the level are thrown away before anything is formatted.  The
+// timestamp at the start of each line is only re-made once a second (per
+// thread).
+//   Until start() (and after stop()), lines are written straight away by the
+// thread which logs them.
+struct Logger
+{
+	Logger();
+	~Logger() { stop(); }
+
+	void set_level( LogLevel level ) { max_level.store(level, std::memory_order_relaxed); }
+	bool enabled( LogLevel level ) const { return level <= max_level.load(std::memory_order_relaxed); }
+
+	// A newline is added to the end
+	void log( LogLevel level, const char *format, ... ) __attribute__((format(printf, 3, 4)));
+
+	// Start and stop the writer thread.  stop() writes whatever is left.
+	void start();
+	void stop();
+
+	unsigned long get_dropped_count() const { return dropped_count.load(std::memory_order_relaxed); }
+
+private:
+	//   A slot in the ring.  'sequence' says whose turn it is: the slot at
+	// position p is free for the producer which claims p when sequence == p,
+	// and ready for the writer when sequence == p + 1.
+	struct alignas(64) Record
+	{
+		std::atomic<size_t> sequence;
+		size_t length;
+		char text[LOG_RECORD_SIZE];
+	};
+
+	std::atomic<int> max_level;
+
+	Record ring[LOG_RING_SIZE];
+	alignas(64) std::atomic<size_t> enqueue_pos;
+	alignas(64) size_t dequeue_pos;     // Only the writer uses this
+
+	std::atomic<unsigned long> dropped_count;
+
+	std::thread writer_thread;
+	std::atomic<bool> running;
+
+	static size_t format_line( char *buffer, const char *format, va_list args );
+	bool write_pending();
+	void writer_main();
+};
+
+extern Logger logger;
+
+#endif // LOGGER_HH
@@ -17,89 +17,156 @@
 	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "capture_replayer.hh"
+#include "config_watcher.hh"
+#include "event_trace.hh"
+#include "fader_feedback.hh"
+#include "logger.hh"
+#include "metrics.hh"
+#include "metrics_server.hh"
+#include "midi_event_dispatcher.hh"
+#include "program_volume_handler.hh"
 #include "pulse_dbus.hh"
+#include "pulse_native.hh"
+#include "realtime.hh"
+#include "serial_capture.hh"
 #include "serial_reader.hh"
+#include "simulated_mixer.hh"
 #include "utils.hh"
 
+#include <cerrno>
+#include <csignal>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <thread>
-#include <cmath>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
 
 using namespace std;
 
-// This is a global variable so you know when the threads have to stop running
-bool program_running;
-
-// Function to quit program upon receiving a SIGINT or SIGTERM
-void exit_cli(int sig);
-void exit_cli(__attribute__((unused)) int sig)
+//   SIGINT and SIGTERM quit, and SIGHUP reloads the fader mapping.  These are
+// blocked in every thread, and read from a signalfd by the event loop instead.
+static void get_handled_signals( sigset_t & mask )
 {
-	program_running = false;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
 }
 
-struct Fader_Program_Mapping
-{
-	int channel;
-	const char *prop_name, *prop_val;
-};
-
-//   This is a concrete example of a MIDICommandHandler.  When we get a MIDI
-// command, we will use PulseAudio to control some volumes.  This is the only
-// piece of code which connects the 'ttymidi' side with the 'Pulse DBus' side.
-struct MIDIHandler_Program_Volume : MIDICommandHandler
+static bool watch_signals( EventLoop & loop, int & signal_fd, const function<void()> & reload_mapping )
 {
-	DBusPulseAudio & dbus_pulse;
-	const Fader_Program_Mapping rules[6] =
-	{
-		// MIDI Channel nr, pulse property, pulse property value
-		{0, "application.name", "Music Player Daemon"},
-		{1, "application.process.binary", "gnome-mpv"},
-		{1, "application.process.binary", "mpv"},
-		{2, "application.process.binary", "firefox"},
-		{2, "application.process.binary", "firefox-bin"},
-		{2, "application.process.binary", "firefox-esr"},
-	};
+	sigset_t mask;
+	get_handled_signals(mask);
 
-	MIDIHandler_Program_Volume( DBusPulseAudio & dbus_pulse_in ) :
-	dbus_pulse(dbus_pulse_in)
-	{}
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if ( signal_fd < 0 )
+		return false;
 
-	virtual void pitch_bend(int channel, int pitch)
+	int fd = signal_fd;
+	return loop.add_fd(fd, EPOLLIN, [fd, &loop, reload_mapping]( uint32_t )
 	{
-		for ( const auto & rule : rules )
+		struct signalfd_siginfo info;
+
+		while ( read(fd, &info, sizeof(info)) == (ssize_t)sizeof(info) )
 		{
-			if ( channel == rule.channel )
+			if ( info.ssi_signo == SIGHUP )
+				reload_mapping();
+			else
 			{
-				double x = 4*(pitch+8192); // number 0-65535
-				//   All of the following constants I got from a Log fit in
-				// gnumeric.  I plotted the data of 'fader level' vs 'fader
-				// travel in mm'.
-				double y = 18864.560759108*log(x+2046.27968)-144258.687272491 ;
-				int y2 = (int)y;
-				if ( y2 < 0 )
-					y2 = 0;
-				if ( y2 > 65535)
-					y2 = 65535;
-
-				dbus_pulse.set_client_volume(y2, rule.prop_name, rule.prop_val);
+				logger.log(LOG_INFO, "Caught SIGINT/SIGTERM. Exiting.");
+				loop.quit();
 			}
 		}
+	});
+}
+
+//   Makes the VolumeBackend which --backend asks for, and tries to connect it.
+// (If it can't connect, it tries again when it's needed.)  "auto" means the
+// native protocol if PulseAudio answers it, and otherwise DBus.  If there is
+// a 'feedback', it hears about every volume change.
+static VolumeBackend *make_backend( const Arguments & arguments, EventLoop & loop, FaderFeedback *feedback )
+{
+	VolumeBackend::VolumeCallback callback;
+	if ( feedback != nullptr )
+		callback = [feedback]( const string & stream, unsigned int volume ) { feedback->volume_changed(stream, volume); };
+
+	if ( arguments.backend == "sim" )
+	{
+		VolumeBackend *sim = new SimulatedMixer(MIDI_CHANNELS, 2, 0, 0);
+		sim->watch_volumes(callback);
+		sim->connect();
+		return sim;
+	}
+
+	if ( arguments.backend != "dbus" )
+	{
+		NativePulseAudio *native = new NativePulseAudio(arguments);
+		native->watch_volumes(callback);
+		if ( native->connect() or arguments.backend == "native" )
+			return native;
+
+		delete native;
+		logger.log(LOG_INFO, "PulseAudio's native protocol isn't answering. Trying DBus.");
 	}
-};
 
-void main_loop(SerialMIDIReader &serial_reader);
-void main_loop(SerialMIDIReader &serial_reader)
+	// Replies and signals from PulseAudio are dispatched by the loop too
+	DBusPulseAudio *dbus_pulse = new DBusPulseAudio(arguments);
+	dbus_pulse->use_event_loop(loop);
+	dbus_pulse->watch_volumes(callback);
+	dbus_pulse->connect();
+
+	return dbus_pulse;
+}
+
+//   The metrics which the dispatcher and handler already count, for
+// MetricsServer.  Each input's are labelled with its device.
+static void write_pipeline_metrics( string & out, const MIDIEventDispatcher & dispatcher, const MIDIHandler_Program_Volume & handler )
 {
-	//   Note: program_running can be set to 0 by the function exit_cli().  This
-	// happens when the program gets a SIGINT or SIGTERM signal.  Until that
-	// happens, just keep running in a loop.
-	while (program_running)
+	typedef MIDIEventDispatcher::Input Input;
+
+	static const struct
 	{
-		serial_reader.main_loop_iteration();
+		const char *name;
+		const char *type;
+		const char *help;
+		uint64_t (*value)( const Input & );
 	}
+	input_metrics[] =
+	{
+		{ "ttymidi_events_received_total",  "counter", "MIDI events given to the dispatcher",
+		  []( const Input & i ) -> uint64_t { return i.get_received_count(); } },
+		{ "ttymidi_events_applied_total",   "counter", "MIDI events handled",
+		  []( const Input & i ) -> uint64_t { return i.get_applied_count(); } },
+		{ "ttymidi_events_coalesced_total", "counter", "Fader values replaced by newer ones before being handled",
+		  []( const Input & i ) -> uint64_t { return i.get_coalesced_count(); } },
+		{ "ttymidi_events_dropped_total",   "counter", "MIDI events dropped because the queue was full",
+		  []( const Input & i ) -> uint64_t { return i.get_overflow_count(); } },
+		{ "ttymidi_queue_depth",            "gauge",   "MIDI events waiting to be handled",
+		  []( const Input & i ) -> uint64_t { return i.queue_depth(); } },
+		{ "ttymidi_queue_depth_max",        "gauge",   "The most MIDI events which have been waiting at once",
+		  []( const Input & i ) -> uint64_t { return i.get_max_queue_depth(); } },
+	};
 
-	if (!serial_reader.arguments.silent)
-		cerr << current_time() << "Exited loop in main_loop()" << endl;
+	for ( const auto & m : input_metrics )
+	{
+		metrics_header(out, m.name, m.type, m.help);
+		for ( const unique_ptr<Input> & input : dispatcher.get_inputs() )
+			metrics_value(out, m.name, "input=\"" + input->name + "\"", m.value(*input));
+	}
+
+	const VolumeRateLimiter & limiter = handler.get_limiter();
+	metrics_header(out, "ttymidi_volume_changes_total", "counter", "Volume changes, by what happened to them");
+	metrics_value(out, "ttymidi_volume_changes_total", "result=\"sent\"", limiter.get_written_count());
+	metrics_value(out, "ttymidi_volume_changes_total", "result=\"deferred\"", limiter.get_deferred_count());
+	metrics_value(out, "ttymidi_volume_changes_total", "result=\"suppressed\"", limiter.get_suppressed_count());
+	metrics_value(out, "ttymidi_volume_changes_total", "result=\"ramped\"", handler.get_ramper().get_write_count());
+
+	metrics_header(out, "ttymidi_log_lines_dropped_total", "counter", "Log lines dropped because they came too fast");
+	metrics_value(out, "ttymidi_log_lines_dropped_total", "", logger.get_dropped_count());
 }
 
 int main(int argc, char** argv)
@@ -108,47 +175,275 @@ int main(int argc, char** argv)
 	Arguments arguments;
 	arguments = parse_all_the_arguments(argc, argv);
 
-	// Create object to deal with PulseAudio over DBus
-	DBusPulseAudio dbus_pulse(arguments);
+	//   Block the signals before any threads start, so that they all inherit
+	// it, and the signals only ever turn up in the signalfd.
+	sigset_t mask;
+	get_handled_signals(mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	//   Log lines are written out by a thread of their own, so that logging
+	// (even every MIDI message, with --verbose) doesn't hold anything up.
+	logger.set_level(arguments.silent ? LOG_ERROR : arguments.verbose ? LOG_VERBOSE : LOG_INFO);
+	logger.start();
+
+	//   Everything on this thread (serial data, signals, config file changes,
+	// DBus replies) is run from this loop.
+	EventLoop loop;
+	if ( !loop.init() )
+	{
+		cerr << current_time() << "Unable to create the event loop: " << strerror(errno) << endl;
+		exit(1);
+	}
+
+	//   Moving motorized faders only makes sense if there are serial devices to
+	// write to.  This has to outlive the backend, which tells it about volume
+	// changes until it's disconnected.
+	bool use_feedback = arguments.feedback and arguments.replayfile == "" and !arguments.printonly;
+	FaderFeedback feedback;
+
+	//   Create object to set the volumes (PulseAudio, or a simulation of it),
+	// and (attempt to) connect it
+	unique_ptr<VolumeBackend> backend(make_backend(arguments, loop, use_feedback ? &feedback : nullptr));
+
+	// Load the fader mapping
+	const FaderMappingTable *mapping;
+	if ( arguments.configfile == "" )
+		mapping = FaderMappingTable::built_in();
+	else
+	{
+		string error;
+		mapping = FaderMappingTable::load(arguments.configfile, error);
+		if ( mapping == NULL )
+		{
+			cerr << current_time() << "Unable to load fader mapping: " << error << endl;
+			exit(1);
+		}
+	}
 
 	// Create object to handle MIDI commands
-	MIDIHandler_Program_Volume handler(dbus_pulse);
+	MIDIHandler_Program_Volume handler(arguments, *backend, mapping);
+
+	//   A reload leaves the old mapping for the events which are using it, so
+	// it's deleted a little later (once they have finished with it).
+	int mapping_reclaim_timer = loop.add_timer([&]( uint32_t )
+	{
+		if ( handler.reclaim_old_mappings() > 0 )
+			loop.set_timer(mapping_reclaim_timer, MAPPING_RECLAIM_MS);
+	});
+
+	function<void()> reload_mapping = [&]()
+	{
+		if ( handler.reload_mapping() )
+			loop.set_timer(mapping_reclaim_timer, MAPPING_RECLAIM_MS);
+	};
+
+	int signal_fd = -1;
+	if ( !watch_signals(loop, signal_fd, reload_mapping) )
+	{
+		cerr << current_time() << "Unable to watch for signals: " << strerror(errno) << endl;
+		exit(1);
+	}
+
+	// Watch the config file, so that it can be reloaded when it changes
+	ConfigWatcher config_watcher;
+	if ( arguments.configfile != "" and !config_watcher.start(arguments.configfile) )
+		logger.log(LOG_INFO, "Unable to watch %s for changes. Send SIGHUP to reload it.", arguments.configfile.c_str());
+
+	if ( config_watcher.get_fd() >= 0 )
+		loop.add_fd(config_watcher.get_fd(), EPOLLIN, [&config_watcher, &reload_mapping]( uint32_t )
+		{
+			if ( config_watcher.file_changed() )
+				reload_mapping();
+		});
+
+	//   Create an object to pass the MIDI commands from the serial devices to
+	// the handler (on its own thread)
+	MIDIEventDispatcher dispatcher(arguments, &handler);
+
+	//   Create an object to handle each serial device.  They all share the one
+	// handler (and PulseAudio connection).  Or, to replay a capture, one which
+	// stands in for all of them.
+	vector< unique_ptr<SerialMIDIReader> > serial_readers;
+	SerialCaptureWriter capture;
+	SerialCaptureReader replay_reader;
+	unique_ptr<CaptureReplayer> replayer;
+
+	if ( arguments.replayfile != "" )
+	{
+		string error;
+		if ( !replay_reader.open(arguments.replayfile, error) )
+		{
+			cerr << current_time() << "Unable to replay: " << error << endl;
+			exit(1);
+		}
 
-	// Create an object to handle the serial device
-	SerialMIDIReader serial_reader(arguments, &handler);
+		vector<MIDICommandHandler *> inputs;
+		for ( const SerialDevice & device : replay_reader.get_devices() )
+			inputs.push_back(dispatcher.add_input(device.path, device.channel_offset));
+
+		replayer.reset(new CaptureReplayer(arguments, replay_reader, inputs, !arguments.replay_fast));
+	}
+	else
+	{
+		string error;
+		if ( arguments.capturefile != "" and !capture.open(arguments.capturefile, arguments.serialdevices, error) )
+		{
+			cerr << current_time() << "Unable to capture: " << error << endl;
+			exit(1);
+		}
+
+		for ( size_t i = 0; i < arguments.serialdevices.size(); i++ )
+		{
+			const SerialDevice & device = arguments.serialdevices[i];
+			MIDIEventDispatcher::Input *input = dispatcher.add_input(device.path, device.channel_offset);
+			serial_readers.emplace_back(new SerialMIDIReader(arguments, device, input));
+
+			if ( capture.is_open() )
+				serial_readers.back()->set_capture(&capture, (unsigned int)i);
+
+			feedback.add_device(serial_readers.back().get());
+		}
+	}
+
+	if ( use_feedback )
+	{
+		handler.set_feedback(&feedback);
+		feedback.set_handler(&handler);
+
+		if ( !feedback.start(loop) )
+		{
+			cerr << current_time() << "Unable to start moving the faders: " << strerror(errno) << endl;
+			exit(1);
+		}
+	}
+
+	MetricsServer metrics_server;
+	if ( arguments.metricssocket != "" )
+	{
+		string error;
+		metrics_server.add_source([&dispatcher, &handler]( string & out ) { write_pipeline_metrics(out, dispatcher, handler); });
+
+		if ( !metrics_server.start(loop, arguments.metricssocket, error) )
+		{
+			cerr << current_time() << "Unable to serve metrics: " << error << endl;
+			exit(1);
+		}
+	}
 
 	if (arguments.printonly)
 		cout << current_time() << "Super debug mode: Only printing the signal to screen. Nothing else." << endl;
 
-	// (Attempt to) open the DBus connection
-	dbus_pulse.connect();
+	// Keep every event's timings, if they are wanted
+	if ( arguments.tracefile != "" )
+		event_tracer.start_trace(TRACE_MAX_EVENTS);
+
+	if ( realtime_enabled(arguments) )
+	{
+		logger.log(LOG_INFO, "Real-time mode: %s", realtime_description(arguments).c_str());
+		if ( arguments.tracefile != "" )
+			event_tracer.prefault_trace();
+	}
+
+	//------------------------------------------------------
+	// Start the thread that talks to PulseAudio
+	dispatcher.start();
+
+	// Start reading the serial devices
+	for ( unique_ptr<SerialMIDIReader> & serial_reader : serial_readers )
+		serial_reader->start(loop);
+
+	//   Or start the replay.  Once it's over, wait for the events to get
+	// through the dispatcher, and then quit.
+	int replay_drain_timer = -1;
+	if ( replayer )
+		replayer->start(loop, [&]()
+		{
+			logger.log(LOG_INFO, "Finished replaying %lu reads from %s", replayer->get_records_replayed(), arguments.replayfile.c_str());
+
+			replay_drain_timer = loop.add_timer([&]( uint32_t )
+			{
+				if ( dispatcher.queue_depth() == 0 )
+					loop.quit();
+				else
+					loop.set_timer(replay_drain_timer, 10);
+			});
+			loop.set_timer(replay_drain_timer, 0);
+		});
+
+	//   Everything has been allocated and every thread started, so lock it all
+	// into RAM, and make this thread (which reads the serial devices) real-time
+	// too.  Threads started after this inherit its priority, so nothing much
+	// should be.
+	realtime_lock_memory(arguments);
+	realtime_thread_setup("reader", arguments, arguments.reader_cpus);
+
+	// This returns once we get a SIGINT or SIGTERM
+	loop.run();
 
 	//------------------------------------------------------
-	// Start the thread that polls serial data
-	program_running = true;
-	//   Thread for polling serial data.  As serial is currently read in
-	// blocking mode, by this we can enable ctrl+C quitting and avoid zombie
-	// alsa ports when killing app with ctrl+Z
-	thread thr(&main_loop, ref(serial_reader));
-	thr.detach();
-
-	signal(SIGINT, exit_cli);
-	signal(SIGTERM, exit_cli);
-
-	//   Do nothing.  This thread just waits until program_running=false (which
-	// is set by exit_cli() when we get a SIGINT or SIGTERM.
-	while (program_running)
-		sleep(1);
+	// Restore the old port settings
+	feedback.stop();
+	metrics_server.stop();
+	for ( unique_ptr<SerialMIDIReader> & serial_reader : serial_readers )
+		serial_reader->stop();
+	capture.close();
+
+	if ( replayer )
+		replayer->stop();
+	loop.remove_timer(replay_drain_timer);
+	loop.remove_timer(mapping_reclaim_timer);
+
+	if ( config_watcher.get_fd() >= 0 )
+		loop.remove_fd(config_watcher.get_fd());
+	loop.remove_fd(signal_fd);
+	close(signal_fd);
+
+	//   Wait for the PulseAudio thread to finish what it is doing.  It might be
+	// waiting for DBus replies, which only the loop dispatches, so keep the loop
+	// running until it has stopped.
+	thread stopper([&dispatcher, &loop]()
+	{
+		dispatcher.stop();
+		loop.quit();
+	});
+	loop.run();
+	stopper.join();
+
+	// Clean up PulseAudio things
+	backend->disconnect();
+
+	// Everything else has stopped, so write out the last of the log
+	logger.stop();
 
 	if ( !arguments.silent )
-		cerr << current_time() << "Caught SIGINT/SIGTERM. Exiting." << endl;
+	{
+		if ( logger.get_dropped_count() > 0 )
+			cerr << current_time() << "Log lines dropped because they came too fast: " << logger.get_dropped_count() << endl;
 
-	//------------------------------------------------------
-	// restore the old port settings
-	serial_reader.close_serial_device();
+		cerr << current_time() << backend->get_stats() << endl;
+
+		const VolumeRateLimiter & limiter = handler.get_limiter();
+		cerr << current_time() << "Volume changes: " << limiter.get_written_count() << " sent (" << limiter.get_deferred_count() << " of them held back by the rate limit first), " << limiter.get_suppressed_count() << " suppressed" << endl;
 
-	// Clean up DBus things
-	dbus_pulse.disconnect();
+		const VolumeRamper & ramper = handler.get_ramper();
+		if ( ramper.enabled() )
+			cerr << current_time() << "Ramping: " << ramper.get_tick_count() << " ticks, " << ramper.get_write_count() << " volume changes" << endl;
+
+		if ( use_feedback )
+			cerr << current_time() << "Faders moved: " << feedback.get_moved_count() << " (" << feedback.get_touched_count() << " left alone, because they were being moved)" << endl;
+
+		for ( int s = 0; s < EventTracer::N_STAGES; s++ )
+			cerr << current_time() << "Latency " << EventTracer::stage_name((EventTracer::Stage)s) << ": " << event_tracer.histograms[s].summary() << endl;
+	}
+
+	if ( arguments.tracefile != "" )
+	{
+		string error;
+		if ( !event_tracer.write_trace(arguments.tracefile, error) )
+			cerr << current_time() << "Unable to write trace: " << error << endl;
+		else if ( !arguments.silent )
+			cerr << current_time() << "Wrote trace to " << arguments.tracefile << endl;
+	}
 
 	return 0;
 }
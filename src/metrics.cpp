@@ -0,0 +1,166 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "metrics.hh"
+#include "event_trace.hh"
+
+#include <cstring>
+
+using namespace std;
+
+Metrics metrics;
+
+thread_local Metrics::Shard *Metrics::thread_shard = nullptr;
+
+//   Prometheus's name for each MetricCounter, in the same order.  Counters
+// with the same name (told apart by their labels) must be next to each other.
+static const struct
+{
+	const char *name;
+	const char *labels;
+	const char *help;
+}
+metric_info[N_METRIC_COUNTERS] =
+{
+	{ "ttymidi_serial_bytes_read_total",       "", "Bytes read from the serial devices" },
+	{ "ttymidi_midi_messages_total",           "", "MIDI messages decoded" },
+	{ "ttymidi_midi_resyncs_total",            "", "Times junk was skipped to find the next MIDI status byte" },
+	{ "ttymidi_midi_framing_errors_total",     "", "MIDI messages which were cut short, and stray SysEx ends" },
+	{ "ttymidi_serial_reconnects_total",       "", "Times a serial device was opened again after it went" },
+	{ "ttymidi_backend_reconnects_total",      "", "Times the connection to PulseAudio was made again after it went" },
+	{ "ttymidi_dbus_calls_total",              "method=\"Get\"",             "DBus calls made to PulseAudio, by method" },
+	{ "ttymidi_dbus_calls_total",              "method=\"Set\"",             "" },
+	{ "ttymidi_dbus_calls_total",              "method=\"ListenForSignal\"", "" },
+	{ "ttymidi_dbus_calls_total",              "method=\"other\"",           "" },
+};
+
+// Upper bounds of the histogram buckets which are reported, in nanoseconds
+static const uint64_t histogram_bounds_ns[] =
+{
+	10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+	100000000, 250000000, 1000000000
+};
+
+Metrics::Metrics() :
+n_shards(0)
+{
+	for ( Shard & shard : this->shards )
+	{
+		for ( atomic<uint64_t> & c : shard.counters )
+			c.store(0, memory_order_relaxed);
+		shard.shared = false;
+	}
+
+	this->shards[METRICS_MAX_SHARDS - 1].shared = true;
+}
+
+//   Gives the calling thread the next shard.  Once they have run out, the rest
+// of the threads share the last one (which is always added to atomically).
+Metrics::Shard *Metrics::claim_shard()
+{
+	size_t i = this->n_shards.fetch_add(1, memory_order_relaxed);
+
+	thread_shard = &this->shards[min(i, (size_t)METRICS_MAX_SHARDS - 1)];
+	return thread_shard;
+}
+
+uint64_t Metrics::total( MetricCounter counter ) const
+{
+	uint64_t answer = 0;
+
+	for ( const Shard & shard : this->shards )
+		answer += shard.counters[counter].load(memory_order_relaxed);
+
+	return answer;
+}
+
+void Metrics::write_prometheus( string & out ) const
+{
+	for ( int i = 0; i < N_METRIC_COUNTERS; i++ )
+	{
+		if ( i == 0 or strcmp(metric_info[i].name, metric_info[i - 1].name) != 0 )
+			metrics_header(out, metric_info[i].name, "counter", metric_info[i].help);
+
+		metrics_value(out, metric_info[i].name, metric_info[i].labels, this->total((MetricCounter)i));
+	}
+
+	metrics_header(out, "ttymidi_latency_seconds", "histogram", "Time taken by each stage of handling a MIDI event (see EventTracer)");
+	for ( int s = 0; s < EventTracer::N_STAGES; s++ )
+		metrics_histogram(out, "ttymidi_latency_seconds", string("stage=\"") + EventTracer::stage_name((EventTracer::Stage)s) + "\"", event_tracer.histograms[s]);
+}
+
+//==============================================================================
+// Prometheus's text format
+
+void metrics_header( string & out, const char *name, const char *type, const char *help )
+{
+	out += "# HELP ";
+	out += name;
+	out += ' ';
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += ' ';
+	out += type;
+	out += '\n';
+}
+
+static void metrics_line( string & out, const char *name, const char *suffix, const string & labels, const string & value )
+{
+	out += name;
+	out += suffix;
+	if ( labels != "" )
+	{
+		out += '{';
+		out += labels;
+		out += '}';
+	}
+	out += ' ';
+	out += value;
+	out += '\n';
+}
+
+void metrics_value( string & out, const char *name, const string & labels, uint64_t value )
+{
+	metrics_line(out, name, "", labels, to_string(value));
+}
+
+static string seconds( uint64_t ns )
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.9g", (double)ns / 1e9);
+	return buffer;
+}
+
+//   The histogram's own buckets are much finer than Prometheus wants, so they
+// are added up into a few.  A bucket's count is of the events which took no
+// longer than its bound, to within the histogram's precision.
+void metrics_histogram( string & out, const char *name, const string & labels, const LatencyHistogram & histogram )
+{
+	string comma = ( labels == "" ) ? "" : ",";
+
+	for ( uint64_t bound : histogram_bounds_ns )
+		metrics_line(out, name, "_bucket", labels + comma + "le=\"" + seconds(bound) + "\"", to_string(histogram.count_at_most(bound)));
+
+	metrics_line(out, name, "_bucket", labels + comma + "le=\"+Inf\"", to_string(histogram.count()));
+	metrics_line(out, name, "_sum", labels, seconds(histogram.sum()));
+	metrics_line(out, name, "_count", labels, to_string(histogram.count()));
+}
@@ -0,0 +1,102 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+struct LatencyHistogram;
+
+//   The most threads which get a shard of their own.  Any more than that share
+// the last one.
+#define METRICS_MAX_SHARDS 16
+
+//   Things which are counted.  (See metric_info in metrics.cpp for their
+// Prometheus names.)
+enum MetricCounter
+{
+	METRIC_SERIAL_BYTES,            // Read from the serial devices
+	METRIC_MIDI_MESSAGES,           // Decoded from them
+	METRIC_MIDI_RESYNCS,            // Junk skipped to find a status byte
+	METRIC_MIDI_FRAMING_ERRORS,     // Messages cut short, and stray SysEx ends
+	METRIC_SERIAL_RECONNECTS,
+	METRIC_BACKEND_RECONNECTS,      // Of PulseAudio (DBus or native)
+	METRIC_DBUS_CALLS_GET,
+	METRIC_DBUS_CALLS_SET,
+	METRIC_DBUS_CALLS_LISTEN_FOR_SIGNAL,
+	METRIC_DBUS_CALLS_OTHER,
+	N_METRIC_COUNTERS
+};
+
+//   Counters which are cheap enough to bump on every byte or event.  Each
+// thread has a shard of its own, on cache lines of its own, so adding to a
+// counter is a plain load and store which no other thread's cache ever
+// wants.  The shards are only added up when someone asks (see
+// write_prometheus()).
+struct Metrics
+{
+	Metrics();
+
+	void add( MetricCounter counter, uint64_t n = 1 )
+	{
+		Shard *shard = ( thread_shard != nullptr ) ? thread_shard : claim_shard();
+		std::atomic<uint64_t> & c = shard->counters[counter];
+
+		if ( shard->shared )
+			c.fetch_add(n, std::memory_order_relaxed);
+		else
+			c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	// The sum over all of the shards.  This can be called from any thread.
+	uint64_t total( MetricCounter counter ) const;
+
+	//   Appends all of the counters, and the latency histograms, in
+	// Prometheus's text format.
+	void write_prometheus( std::string & out ) const;
+
+private:
+	struct alignas(64) Shard
+	{
+		std::atomic<uint64_t> counters[N_METRIC_COUNTERS];
+		bool shared;    // Whether more than one thread adds to this one
+	};
+
+	Shard shards[METRICS_MAX_SHARDS];
+	std::atomic<size_t> n_shards;
+
+	// There is only one Metrics, so this can be static
+	static thread_local Shard *thread_shard;
+
+	Shard *claim_shard();
+};
+
+extern Metrics metrics;
+
+//   Helpers for writing Prometheus's text format.  'labels' is e.g.
+// "stage=\"parse\"", or "".
+void metrics_header( std::string & out, const char *name, const char *type, const char *help );
+void metrics_value( std::string & out, const char *name, const std::string & labels, uint64_t value );
+void metrics_histogram( std::string & out, const char *name, const std::string & labels, const LatencyHistogram & histogram );
+
+#endif // METRICS_HH
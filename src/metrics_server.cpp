@@ -0,0 +1,140 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "metrics_server.hh"
+#include "logger.hh"
+#include "metrics.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+bool MetricsServer::start( EventLoop & loop_in, const string & path_in, string & error )
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	if ( path_in.size() >= sizeof(address.sun_path) )
+	{
+		error = "The path is too long: " + path_in;
+		return false;
+	}
+	strcpy(address.sun_path, path_in.c_str());
+
+	//   A socket left behind by an earlier run would be in the way, so it goes.
+	// Anything else there is left alone: a mistyped path mustn't delete e.g.
+	// the config file (we might be running as root).
+	struct stat info;
+	if ( lstat(path_in.c_str(), &info) == 0 )
+	{
+		if ( !S_ISSOCK(info.st_mode) )
+		{
+			error = path_in + " already exists, and isn't a socket";
+			return false;
+		}
+
+		if ( unlink(path_in.c_str()) != 0 )
+		{
+			error = "Unable to remove the old socket " + path_in + ": " + strerror(errno);
+			return false;
+		}
+	}
+	else if ( errno != ENOENT )
+	{
+		error = path_in + ": " + strerror(errno);
+		return false;
+	}
+
+	this->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ( this->listen_fd < 0 )
+	{
+		error = string("socket(): ") + strerror(errno);
+		return false;
+	}
+
+	if ( bind(this->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 or listen(this->listen_fd, 8) != 0 )
+	{
+		error = path_in + ": " + strerror(errno);
+		close(this->listen_fd);
+		this->listen_fd = -1;
+		return false;
+	}
+
+	this->path = path_in;
+	this->loop = &loop_in;
+	this->loop->add_fd(this->listen_fd, EPOLLIN, [this]( uint32_t ) { this->on_connection(); });
+
+	return true;
+}
+
+void MetricsServer::stop()
+{
+	if ( this->listen_fd < 0 )
+		return;
+
+	this->loop->remove_fd(this->listen_fd);
+	close(this->listen_fd);
+	unlink(this->path.c_str());
+
+	this->listen_fd = -1;
+	this->loop = nullptr;
+}
+
+//   Everyone who is waiting gets the same snapshot.  The snapshot is a few
+// kilobytes, which fits in the socket's buffer, so a single send() does it.
+void MetricsServer::on_connection()
+{
+	bool made_snapshot = false;
+
+	while ( true )
+	{
+		int fd = accept4(this->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if ( fd < 0 )
+		{
+			if ( errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR )
+				logger.log(LOG_VERBOSE, "MetricsServer: accept() failed: %s", strerror(errno));
+			return;
+		}
+
+		if ( !made_snapshot )
+		{
+			this->snapshot.clear();
+			metrics.write_prometheus(this->snapshot);
+			for ( const Source & source : this->sources )
+				source(this->snapshot);
+
+			made_snapshot = true;
+		}
+
+		ssize_t sent = send(fd, this->snapshot.data(), this->snapshot.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		if ( sent != (ssize_t)this->snapshot.size() )
+			logger.log(LOG_VERBOSE, "MetricsServer: only sent %zd of %zu bytes", sent, this->snapshot.size());
+
+		close(fd);
+		this->query_count.fetch_add(1, memory_order_relaxed);
+	}
+}
@@ -0,0 +1,71 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef METRICS_SERVER_HH
+#define METRICS_SERVER_HH
+
+#include "event_loop.hh"
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+//   Listens on a Unix domain socket, and gives everyone who connects a snapshot
+// of the metrics, in Prometheus's text format, then hangs up.  (e.g.
+// "socat - UNIX-CONNECT:/run/user/1000/ttymidi.metrics")  It runs on the
+// EventLoop, and never waits for the client: a client which won't take the
+// whole snapshot at once only gets part of it.
+struct MetricsServer
+{
+	// Appends some metrics (see metrics_header() and metrics_value())
+	typedef std::function<void(std::string &)> Source;
+
+	MetricsServer() :
+	listen_fd(-1), loop(nullptr), query_count(0)
+	{ }
+
+	~MetricsServer() { stop(); }
+
+	//   Everything in the global 'metrics' is always included.  These add
+	// whatever else there is (e.g. the dispatcher's queues).
+	void add_source( Source source ) { sources.push_back(source); }
+
+	//   Makes the socket (replacing whatever is at 'path'), and answers it from
+	// 'loop'.  These must be called on the loop's thread.
+	bool start( EventLoop & loop_in, const std::string & path_in, std::string & error );
+	void stop();
+
+	unsigned long get_query_count() const { return query_count.load(std::memory_order_relaxed); }
+
+private:
+	int listen_fd;
+	std::string path;
+	EventLoop *loop;
+
+	std::vector<Source> sources;
+	std::string snapshot;       // Kept to save allocating
+
+	std::atomic<unsigned long> query_count;
+
+	void on_connection();
+};
+
+#endif // METRICS_SERVER_HH
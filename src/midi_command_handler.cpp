@@ -1,7 +1,5 @@
 /*
-	Copyright 2011 Thiago Teixeira
-	          2012 Jari Suominen
-	          2019 Jet Holloway
+	Copyright 2019 Jet Holloway
 
 	This file is part of ttymidi_pulse.
 
@@ -20,101 +18,17 @@
 */
 
 #include "midi_command_handler.hh"
-#include "utils.hh"
+#include "midi_handler_chain.hh"
 
-#include <iostream>
-
-using namespace std;
-
-void MIDICommandHandler::parse_midi_command(unsigned char *buf, const Arguments & arguments )
+//   These go through the virtual functions, so the handler can be anything.
+// (See midi_handler_chain.hh for handlers which are fixed at compile time.)
+void MIDICommandHandler::parse_midi_command( const unsigned char *buf )
 {
-	/*
-	   MIDI COMMANDS
-	   -------------------------------------------------------------------
-	   name                 status      param 1          param 2
-	   -------------------------------------------------------------------
-	   note off             0x80+C       key #            velocity
-	   note on              0x90+C       key #            velocity
-	   poly key pressure    0xA0+C       key #            pressure value
-	   control change       0xB0+C       control #        control value
-	   program change       0xC0+C       program #        --
-	   mono key pressure    0xD0+C       pressure value   --
-	   pitch bend           0xE0+C       range (LSB)      range (MSB)
-	   system               0xF0+C       manufacturer     model
-	   -------------------------------------------------------------------
-	   C is the channel number, from 0 to 15;
-	   -------------------------------------------------------------------
-	   source: http://ftp.ec.vanderbilt.edu/computermusic/musc216site/MIDI.Commands.html
-
-	   In this program the pitch bend range will be transmitter as
-	   one single 8-bit number. So the end result is that MIDI commands
-	   will be transmitted as 3 bytes, starting with the operation byte:
-
-	   buf[0] --> operation/channel
-	   buf[1] --> param1
-	   buf[2] --> param2        (param2 not transmitted on program change or key press)
-   */
-
-	int operation, channel, param1, param2;
-
-	operation = buf[0] & 0xF0;
-	channel   = buf[0] & 0x0F;
-	param1    = buf[1];
-	param2    = buf[2];
-
-	if (arguments.verbose)
-		cerr << current_time();
-
-	switch (operation)
-	{
-		case 0x80:
-			if (arguments.verbose)
-				fprintf(stderr, "Serial  0x%x Note off           %03u %03u %03u\n", operation, channel, param1, param2);
-			this->note_on(channel, param1, param2);
-			break;
-
-		case 0x90:
-			if (arguments.verbose)
-				fprintf(stderr, "Serial  0x%x Note on            %03u %03u %03u\n", operation, channel, param1, param2);
-			this->note_off(channel, param1, param2);
-			break;
-
-		case 0xA0:
-			if (arguments.verbose)
-				fprintf(stderr, "Serial  0x%x Pressure change    %03u %03u %03u\n", operation, channel, param1, param2);
-			this->aftertouch(channel, param1, param2);
-			break;
-
-		case 0xB0:
-			if (arguments.verbose)
-				fprintf(stderr, "Serial  0x%x Controller change  %03u %03u %03u\n", operation, channel, param1, param2);
-			this->controller_change(channel, param1, param2);
-			break;
-
-		case 0xC0:
-			if (arguments.verbose)
-				fprintf(stderr, "Serial  0x%x Program change     %03u %03u\n", operation, channel, param1);
-			this->program_change(channel, param1);
-			break;
-
-		case 0xD0:
-			if (arguments.verbose)
-				fprintf(stderr, "Serial  0x%x Channel pressure   %03u %03u\n", operation, channel, param1);
-			this->channel_pressure(channel, param1);
-			break;
-
-		case 0xE0:
-			param1 = (param1 & 0x7F) + ((param2 & 0x7F) << 7);
-			if (arguments.verbose)
-				fprintf(stderr, "Serial  0x%x Pitch bend         %03u %05i\n", operation, channel, param1);
-			this->pitch_bend(channel, param1 - 8192); // in alsa MIDI we want signed int
-			break;
-
-		// Not implementing system commands (0xF0)
+	EventTracer::parsed();
+	decode_midi_command(buf, *this);
+}
 
-		default:
-			if (!arguments.silent)
-				fprintf(stderr, "0x%x Unknown MIDI cmd   %03u %03u %03u\n", operation, channel, param1, param2);
-			break;
-	}
+void MIDICommandHandler::handle_midi_event( const MIDIEvent & event )
+{
+	dispatch_midi_event(event, *this);
 }
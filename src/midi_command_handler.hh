@@ -23,11 +23,25 @@
 #define MIDI_COMMAND_HANDLER_H
 
 #include "arguments.hh"
+#include "event_trace.hh"
+
+//   A MIDI command, after it has been decoded by parse_midi_command().  This is
+// what gets passed between threads, so it is kept small and plain.
+struct MIDIEvent
+{
+	unsigned char operation;   // 0x80, 0x90, ... 0xE0
+	unsigned char channel;
+	int param1, param2;        // param2 unused for 0xC0/0xD0/0xE0
+	EventTimes times;          // For EventTracer
+};
 
 //   This is a struct which does something with MIDI commands.  You need to
 // instantiate a concrete class which inherits from this, because otherwise
 // the program won't have anything to do with all of the MIDI commands it is
 // recieving.
+//   Every call is virtual, so which handler it is can be decided at run time.
+// Handlers which are known at compile time can skip that: see
+// midi_handler_chain.hh.
 struct MIDICommandHandler
 {
 	virtual void note_on(__attribute__((unused)) int channel, __attribute__((unused)) int key, __attribute__((unused)) int velocity) {}
@@ -38,7 +52,16 @@ struct MIDICommandHandler
 	virtual void channel_pressure(__attribute__((unused)) int channel, __attribute__((unused)) int pressure) {}
 	virtual void pitch_bend(__attribute__((unused)) int channel, __attribute__((unused)) int pitch) {}
 
-	void parse_midi_command(unsigned char *buf, const Arguments & arguments );
+	//   For handlers which hold some work back to do later (e.g. volume changes
+	// which are being rate limited).  Whoever calls the handler calls this
+	// after each event, and again by the time it returns, by monotonic_ns().
+	// (0 = not until after the next event.)
+	virtual uint64_t do_held_work(__attribute__((unused)) uint64_t now_ns) { return 0; }
+
+	void parse_midi_command( const unsigned char *buf );
+
+	// Calls whichever of the above functions the event is for
+	void handle_midi_event( const MIDIEvent & event );
 };
 
 #endif // MIDI_COMMAND_HANDLER_H
@@ -0,0 +1,318 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "midi_decoder.hh"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+//==============================================================================
+// The status byte table
+
+static constexpr MIDIStatusInfo status_info( MIDIByteKind kind, unsigned int length )
+{
+	return MIDIStatusInfo{ (unsigned char)kind, (unsigned char)length };
+}
+
+static constexpr MIDIStatusInfo status_info_for( unsigned int b )
+{
+	return b <  0x80 ? status_info(MIDI_KIND_DATA, 0)
+	     : b <  0xC0 ? status_info(MIDI_KIND_CHANNEL, 3)       // Note off/on, aftertouch, controller
+	     : b <  0xE0 ? status_info(MIDI_KIND_CHANNEL, 2)       // Program change, channel pressure
+	     : b <  0xF0 ? status_info(MIDI_KIND_CHANNEL, 3)       // Pitch bend
+	     : b == 0xF0 ? status_info(MIDI_KIND_SYSEX_START, 1)
+	     : b == 0xF1 ? status_info(MIDI_KIND_SYSTEM_COMMON, 2) // MTC quarter frame
+	     : b == 0xF2 ? status_info(MIDI_KIND_SYSTEM_COMMON, 3) // Song position
+	     : b == 0xF3 ? status_info(MIDI_KIND_SYSTEM_COMMON, 2) // Song select
+	     : b <  0xF7 ? status_info(MIDI_KIND_SYSTEM_COMMON, 1) // Undefined, tune request
+	     : b == 0xF7 ? status_info(MIDI_KIND_SYSEX_END, 1)
+	     : b <  0xFF ? status_info(MIDI_KIND_REALTIME, 1)
+	     :             status_info(MIDI_KIND_TEXT, 3);         // 0xFF 0x00 0x00
+}
+
+#define MIDI_STATUS_ROW(b) \
+	status_info_for(b + 0x0), status_info_for(b + 0x1), status_info_for(b + 0x2), status_info_for(b + 0x3), \
+	status_info_for(b + 0x4), status_info_for(b + 0x5), status_info_for(b + 0x6), status_info_for(b + 0x7), \
+	status_info_for(b + 0x8), status_info_for(b + 0x9), status_info_for(b + 0xA), status_info_for(b + 0xB), \
+	status_info_for(b + 0xC), status_info_for(b + 0xD), status_info_for(b + 0xE), status_info_for(b + 0xF)
+
+static constexpr MIDIStatusInfo status_table[256] =
+{
+	MIDI_STATUS_ROW(0x00), MIDI_STATUS_ROW(0x10), MIDI_STATUS_ROW(0x20), MIDI_STATUS_ROW(0x30),
+	MIDI_STATUS_ROW(0x40), MIDI_STATUS_ROW(0x50), MIDI_STATUS_ROW(0x60), MIDI_STATUS_ROW(0x70),
+	MIDI_STATUS_ROW(0x80), MIDI_STATUS_ROW(0x90), MIDI_STATUS_ROW(0xA0), MIDI_STATUS_ROW(0xB0),
+	MIDI_STATUS_ROW(0xC0), MIDI_STATUS_ROW(0xD0), MIDI_STATUS_ROW(0xE0), MIDI_STATUS_ROW(0xF0)
+};
+
+#undef MIDI_STATUS_ROW
+
+static_assert(status_table[0x7F].kind == MIDI_KIND_DATA and status_table[0x80].length == 3, "status table");
+static_assert(status_table[0xC3].length == 2 and status_table[0xD3].length == 2 and status_table[0xE3].length == 3, "status table");
+static_assert(status_table[0xF8].kind == MIDI_KIND_REALTIME and status_table[0xFF].kind == MIDI_KIND_TEXT, "status table");
+
+const MIDIStatusInfo & midi_status_info( unsigned char b )
+{
+	return status_table[b];
+}
+
+//==============================================================================
+
+//   Every status byte has its top bit set, so SSE2's movemask picks them out of
+// 16 bytes at once.
+size_t midi_find_status_byte( const unsigned char *data, size_t count )
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for ( ; i + 16 <= count; i += 16 )
+	{
+		__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(bytes);
+
+		if ( mask != 0 )
+			return i + (unsigned int)__builtin_ctz(mask);
+	}
+#endif
+
+	for ( ; i < count; i++ )
+		if ( data[i] & 0x80 )
+			return i;
+
+	return count;
+}
+
+//==============================================================================
+// MIDIBulkDecoder
+
+void MIDIBulkDecoder::reset()
+{
+	this->state = WAIT_STATUS;
+	this->msg_len = 0;
+	this->msg_expected = 0;
+	this->msg_read_ns = 0;
+	this->running_status = 0;
+	this->text_len = 0;
+	this->text_expected = 0;
+	this->text[0] = 0;
+	this->realtime_count = 0;
+	this->sysex_count = 0;
+	this->skipped_count = 0;
+	this->resync_count = 0;
+	this->framing_error_count = 0;
+	this->skipping_junk = false;
+}
+
+void MIDIBulkDecoder::start_message( unsigned char status, uint64_t read_ns )
+{
+	// A message which didn't get finished is thrown away
+	if ( this->state == MESSAGE )
+	{
+		this->skipped_count += this->msg_len;
+		this->framing_error_count++;
+	}
+
+	this->msg[0] = status;
+	this->msg[1] = 0;
+	this->msg[2] = 0;
+	this->msg_len = 1;
+	this->msg_expected = status_table[status].length;
+	this->msg_read_ns = read_ns;
+
+	this->state = MESSAGE;
+}
+
+size_t MIDIBulkDecoder::decode( const unsigned char *data, size_t count, uint64_t read_ns,
+                                MIDIDecodedMessage *messages, size_t max_messages, size_t & consumed )
+{
+	size_t n = 0, i = 0;
+
+	while ( i < count and n < max_messages )
+	{
+		if ( this->state == TEXT_LENGTH or this->state == TEXT_BODY )
+		{
+			if ( this->state == TEXT_LENGTH )
+			{
+				this->text_len = 0;
+				this->text_expected = data[i++];
+				this->state = TEXT_BODY;
+			}
+
+			// Text can contain any byte, so don't look for status bytes
+			size_t take = min(this->text_expected - this->text_len, count - i);
+			memcpy(this->text + this->text_len, data + i, take);
+			this->text_len += take;
+			i += take;
+
+			if ( this->text_len < this->text_expected )
+				break;
+
+			this->text[this->text_len] = 0;
+			this->state = WAIT_STATUS;
+
+			MIDIDecodedMessage & m = messages[n++];
+			m.bytes[0] = 0xFF;
+			m.bytes[1] = 0;
+			m.bytes[2] = 0;
+			m.length = 1;
+			m.read_ns = this->msg_read_ns;
+
+			// Stop, so that the text is still there for the caller
+			break;
+		}
+
+		//   The usual case: a whole channel message (or the data bytes of a
+		// running status one) is all here, so take it in one go.
+		if ( this->state == WAIT_STATUS and i + 3 <= count )
+		{
+			size_t start = ( data[i] & 0x80 ) ? 1 : 0;
+			unsigned char status = start ? data[i] : this->running_status;
+
+			if ( status >= 0x80 and status < 0xF0 )
+			{
+				size_t length = status_table[status].length;
+				unsigned char param1 = data[i + start];
+				unsigned char param2 = ( length == 3 ) ? data[i + start + 1] : 0;
+
+				if ( ( (param1 | param2) & 0x80 ) == 0 )
+				{
+					MIDIDecodedMessage & m = messages[n++];
+					m.bytes[0] = status;
+					m.bytes[1] = param1;
+					m.bytes[2] = param2;
+					m.length = (unsigned char)length;
+					m.read_ns = read_ns;
+
+					this->running_status = status;
+					this->skipping_junk = false;
+					i += start + length - 1;
+					continue;
+				}
+			}
+		}
+
+		//   Between messages (without running status) and in SysEx, only a
+		// status byte means anything, so skip straight to the next one.
+		if ( this->state == SYSEX or ( this->state == WAIT_STATUS and this->running_status == 0 ) )
+		{
+			size_t skip = midi_find_status_byte(data + i, count - i);
+
+			if ( this->state == SYSEX )
+				this->sysex_count += skip;
+			else if ( skip > 0 )
+			{
+				//   A run of junk is counted once, even if it's split across
+				// reads (or by real-time bytes)
+				this->skipped_count += skip;
+				if ( !this->skipping_junk )
+					this->resync_count++;
+				this->skipping_junk = true;
+			}
+
+			i += skip;
+			if ( i == count )
+				break;
+
+			if ( status_table[data[i]].kind != MIDI_KIND_REALTIME )
+				this->skipping_junk = false;
+		}
+
+		unsigned char c = data[i++];
+
+		switch ( (MIDIByteKind)status_table[c].kind )
+		{
+			case MIDI_KIND_DATA:
+				// Running status (if there wasn't any, it would have been skipped)
+				if ( this->state == WAIT_STATUS )
+					this->start_message(this->running_status, read_ns);
+
+				this->msg[this->msg_len++] = c;
+				break;
+
+			case MIDI_KIND_CHANNEL:
+				this->running_status = c;
+				this->start_message(c, read_ns);
+				break;
+
+			case MIDI_KIND_SYSTEM_COMMON:
+			case MIDI_KIND_TEXT:
+				this->running_status = 0;
+				this->start_message(c, read_ns);
+				break;
+
+			case MIDI_KIND_SYSEX_START:
+				if ( this->state == MESSAGE )
+				{
+					this->skipped_count += this->msg_len;
+					this->framing_error_count++;
+				}
+				this->running_status = 0;
+				this->sysex_count++;
+				this->state = SYSEX;
+				continue;
+
+			case MIDI_KIND_SYSEX_END:
+				if ( this->state == SYSEX )
+					this->sysex_count++;
+				else
+				{
+					this->skipped_count++;
+					this->framing_error_count++;
+				}
+				this->running_status = 0;
+				this->state = WAIT_STATUS;
+				continue;
+
+			// These can go anywhere, even in the middle of another message
+			case MIDI_KIND_REALTIME:
+			default:
+				this->realtime_count++;
+				continue;
+		}
+
+		if ( this->msg_len < this->msg_expected )
+			continue;
+
+		// We have a whole message
+		this->state = WAIT_STATUS;
+
+		if ( this->msg[0] < 0xF0 )
+		{
+			MIDIDecodedMessage & m = messages[n++];
+			m.bytes[0] = this->msg[0];
+			m.bytes[1] = this->msg[1];
+			m.bytes[2] = this->msg[2];
+			m.length = (unsigned char)this->msg_len;
+			m.read_ns = this->msg_read_ns;
+		}
+		else if ( this->msg[0] == 0xFF and this->msg[1] == 0x00 and this->msg[2] == 0x00 )
+			this->state = TEXT_LENGTH;
+		else
+			this->skipped_count += this->msg_len;
+	}
+
+	consumed = i;
+	return n;
+}
@@ -0,0 +1,144 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MIDI_DECODER_HH
+#define MIDI_DECODER_HH
+
+#include <cstddef>
+#include <cstdint>
+
+// How many messages MIDIStreamParser asks MIDIBulkDecoder for at a time
+#define MIDI_DECODE_BATCH 64
+
+//   What each byte value is, in a MIDI stream.  See midi_status_info().
+enum MIDIByteKind
+{
+	MIDI_KIND_DATA,            // 0x00-0x7F
+	MIDI_KIND_CHANNEL,         // 0x80-0xEF: note on, pitch bend, ...
+	MIDI_KIND_SYSEX_START,     // 0xF0
+	MIDI_KIND_SYSTEM_COMMON,   // 0xF1-0xF6: song position, tune request, ...
+	MIDI_KIND_SYSEX_END,       // 0xF7
+	MIDI_KIND_REALTIME,        // 0xF8-0xFE: clock, start, stop, ...
+	MIDI_KIND_TEXT             // 0xFF: (from the Arduino) 0xFF 0x00 0x00, length, text
+};
+
+struct MIDIStatusInfo
+{
+	unsigned char kind;     // A MIDIByteKind
+	unsigned char length;   // Of the whole message, including the status byte
+};
+
+//   A complete message, as it came in.  bytes[0] is the status byte (which
+// might have come from running status), and bytes[length..2] are 0.
+//   A text message is just bytes[0] = 0xFF: its text is in
+// MIDIBulkDecoder::get_text().
+struct MIDIDecodedMessage
+{
+	unsigned char bytes[3];
+	unsigned char length;
+	uint64_t read_ns;       // The read_ns of the decode() which had its first byte
+};
+
+//   Splits a stream of MIDI bytes into messages, many at a time.  Messages can
+// be split across calls to decode().  Each status byte's message length and
+// kind come from a table, so there is no special-casing per message type.
+//   As well as normal channel messages, this understands:
+//    - Running status: data bytes without a status byte re-use the last
+//      channel message's status byte.
+//    - Real-time bytes (0xF8-0xFE, e.g. MIDI clock), which can turn up in the
+//      middle of another message.  They are counted and skipped, without
+//      disturbing the message they interrupt.
+//    - SysEx (0xF0 ... 0xF7), which is skipped.
+//    - System common messages, which are skipped (and cancel running status).
+//    - Text messages: 0xFF 0x00 0x00, then a length byte, then that many bytes
+//      of text.
+//   Data bytes which don't belong to anything (e.g. after the device has been
+// opened half way through a message, or line noise) are skipped until the
+// next status byte.  That, and skipping SysEx, looks at 16 bytes at a time.
+struct MIDIBulkDecoder
+{
+	MIDIBulkDecoder() { reset(); }
+
+	// Forget any partial message, and the running status
+	void reset();
+
+	//   Decodes as much of 'data' as it can, into at most 'max_messages' of
+	// 'messages'.  Returns how many messages it made, and sets 'consumed' to how
+	// many of the bytes it used.  (It only stops short of 'count' if 'messages'
+	// fills up, or after a text message, so that get_text() is still that
+	// message's.)  'read_ns' is when the bytes were read (see monotonic_ns()).
+	size_t decode( const unsigned char *data, size_t count, uint64_t read_ns,
+	               MIDIDecodedMessage *messages, size_t max_messages, size_t & consumed );
+
+	// The text of the last text message (null terminated)
+	const char *get_text() const { return text; }
+
+	// Bytes which were skipped: real-time, SysEx and system common, and junk
+	uint64_t get_realtime_count() const { return realtime_count; }
+	uint64_t get_sysex_count()    const { return sysex_count; }
+	uint64_t get_skipped_count()  const { return skipped_count; }
+
+	//   How many times junk was skipped to find a status byte, and how many
+	// messages were cut short by another status byte (plus SysEx ends without
+	// a start)
+	uint64_t get_resync_count()        const { return resync_count; }
+	uint64_t get_framing_error_count() const { return framing_error_count; }
+
+private:
+	enum State
+	{
+		WAIT_STATUS,   // Between messages
+		MESSAGE,       // Part way through a message
+		SYSEX,         // Skipping a SysEx message
+		TEXT_LENGTH,   // Had 0xFF 0x00 0x00, waiting for the length
+		TEXT_BODY      // Part way through the text
+	};
+
+	State state;
+
+	unsigned char msg[3];
+	size_t msg_len, msg_expected;
+	uint64_t msg_read_ns;
+
+	// 0 if there isn't one
+	unsigned char running_status;
+
+	// The length is a single byte, so this can't overflow
+	char text[256];
+	size_t text_len, text_expected;
+
+	uint64_t realtime_count, sysex_count, skipped_count;
+	uint64_t resync_count, framing_error_count;
+
+	// In a run of junk which has already been counted in resync_count
+	bool skipping_junk;
+
+	void start_message( unsigned char status, uint64_t read_ns );
+};
+
+//   The length and kind of a message which starts with byte 'b'.  (For a data
+// byte, it's the length of nothing.)
+const MIDIStatusInfo & midi_status_info( unsigned char b );
+
+//   Returns the index of the first status byte (one with its top bit set) in
+// 'data', or 'count' if there isn't one.
+size_t midi_find_status_byte( const unsigned char *data, size_t count );
+
+#endif // MIDI_DECODER_HH
@@ -0,0 +1,234 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "midi_event_dispatcher.hh"
+#include "logger.hh"
+#include "realtime.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+
+using namespace std;
+
+//==============================================================================
+// Producer side (each serial reader's thread)
+
+bool MIDIEventDispatcher::Input::enqueue( const MIDIEvent & event )
+{
+	if ( !this->queue.push(event) )
+	{
+		this->overflow_count.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+
+	// Only this thread writes max_queue_depth, so this doesn't need a CAS
+	size_t depth = this->queue.size();
+	if ( depth > this->max_queue_depth.load(memory_order_relaxed) )
+		this->max_queue_depth.store(depth, memory_order_relaxed);
+
+	this->owner.wake_output_thread();
+
+	return true;
+}
+
+void MIDIEventDispatcher::wake_output_thread()
+{
+	//   Pairs with the fence in output_thread_main(): either the output thread
+	// sees our event before it goes to sleep, or we see that it is asleep.
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if ( this->output_waiting.load(memory_order_relaxed) )
+	{
+		lock_guard<mutex> lock(this->wakeup_mutex);
+		this->wakeup.notify_one();
+	}
+}
+
+void *MIDIEventDispatcher::Input::operator new( size_t size )
+{
+	void *p;
+
+	if ( posix_memalign(&p, alignof(Input), size) != 0 )
+		throw bad_alloc();
+
+	return p;
+}
+
+MIDIEventDispatcher::Input *MIDIEventDispatcher::add_input( const string & name, int channel_offset )
+{
+	this->inputs.emplace_back(new Input(*this, name, channel_offset));
+	return this->inputs.back().get();
+}
+
+//==============================================================================
+// Consumer side (output thread)
+
+bool MIDIEventDispatcher::all_queues_empty() const
+{
+	for ( const unique_ptr<Input> & input : this->inputs )
+		if ( !input->queue.empty() )
+			return false;
+
+	return true;
+}
+
+void MIDIEventDispatcher::output_thread_main()
+{
+	MIDIEvent event;
+
+	realtime_thread_setup("output", this->arguments, this->arguments.output_cpus);
+
+	// When the handler next wants do_held_work() (0 = after the next event)
+	uint64_t held_due_ns = 0;
+
+	while ( this->running )
+	{
+		// Take (at most) one event from each input in turn
+		bool got_one = false;
+
+		for ( const unique_ptr<Input> & input : this->inputs )
+		{
+			if ( !input->queue.pop(event) )
+				continue;
+
+			got_one = true;
+
+			if ( event.operation == 0xD0 or event.operation == 0xE0 )
+			{
+				//   Take the latest value out of the slot.  If another one
+				// arrives after this, the slot gets queued again.
+				CoalescingSlot & slot = this->slot_for(event.operation, event.channel);
+				slot.dirty.exchange(false, memory_order_acq_rel);
+				event.param1 = slot.value.load(memory_order_relaxed);
+				event.times.read_ns = slot.read_ns.load(memory_order_relaxed);
+				event.times.parsed_ns = slot.parsed_ns.load(memory_order_relaxed);
+			}
+
+			event_tracer.dispatching(event.times);
+			this->output_handler->handle_midi_event(event);
+			event_tracer.event_finished(event.operation, event.channel);
+			input->applied_count.fetch_add(1, memory_order_relaxed);
+		}
+
+		if ( got_one or held_due_ns != 0 )
+		{
+			uint64_t now_ns = monotonic_ns();
+			if ( got_one or now_ns >= held_due_ns )
+				held_due_ns = this->output_handler->do_held_work(now_ns);
+		}
+
+		if ( got_one )
+			continue;
+
+		//   The queues are empty, so sleep until an input wakes us up (or the
+		// handler wants to do its held work).
+		unique_lock<mutex> lock(this->wakeup_mutex);
+
+		this->output_waiting.store(true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		if ( this->all_queues_empty() and this->running )
+		{
+			uint64_t now_ns = monotonic_ns();
+
+			if ( held_due_ns == 0 )
+				this->wakeup.wait(lock);
+			else if ( held_due_ns > now_ns )
+				this->wakeup.wait_for(lock, chrono::nanoseconds(held_due_ns - now_ns));
+		}
+
+		this->output_waiting.store(false, memory_order_relaxed);
+	}
+}
+
+void MIDIEventDispatcher::start()
+{
+	//   In real-time mode, the queues' pages are faulted in now, rather than
+	// when the first events go through them.
+	if ( realtime_enabled(this->arguments) )
+		for ( const unique_ptr<Input> & input : this->inputs )
+			prefault_memory(input.get(), sizeof(Input));
+
+	this->running = true;
+	this->output_thread = thread(&MIDIEventDispatcher::output_thread_main, this);
+}
+
+void MIDIEventDispatcher::stop()
+{
+	if ( !this->output_thread.joinable() )
+		return;
+
+	{
+		lock_guard<mutex> lock(this->wakeup_mutex);
+		this->running = false;
+		this->wakeup.notify_one();
+	}
+
+	this->output_thread.join();
+
+	for ( const unique_ptr<Input> & input : this->inputs )
+		logger.log(LOG_INFO, "MIDI events from %s: %lu received, %lu applied, %lu coalesced, %lu dropped (queue max depth %zu/%zu)",
+		           input->name.c_str(), input->get_received_count(), input->get_applied_count(),
+		           input->get_coalesced_count(), input->get_overflow_count(),
+		           input->get_max_queue_depth(), input->queue.capacity());
+}
+
+//==============================================================================
+// Counters
+
+size_t MIDIEventDispatcher::queue_depth() const
+{
+	size_t answer = 0;
+	for ( const unique_ptr<Input> & input : this->inputs )
+		answer += input->queue_depth();
+	return answer;
+}
+
+size_t MIDIEventDispatcher::get_max_queue_depth() const
+{
+	size_t answer = 0;
+	for ( const unique_ptr<Input> & input : this->inputs )
+		answer = max(answer, input->get_max_queue_depth());
+	return answer;
+}
+
+unsigned long MIDIEventDispatcher::get_overflow_count() const
+{
+	unsigned long answer = 0;
+	for ( const unique_ptr<Input> & input : this->inputs )
+		answer += input->get_overflow_count();
+	return answer;
+}
+
+unsigned long MIDIEventDispatcher::get_coalesced_count() const
+{
+	unsigned long answer = 0;
+	for ( const unique_ptr<Input> & input : this->inputs )
+		answer += input->get_coalesced_count();
+	return answer;
+}
+
+unsigned long MIDIEventDispatcher::get_applied_count() const
+{
+	unsigned long answer = 0;
+	for ( const unique_ptr<Input> & input : this->inputs )
+		answer += input->get_applied_count();
+	return answer;
+}
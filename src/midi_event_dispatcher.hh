@@ -0,0 +1,228 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MIDI_EVENT_DISPATCHER_HH
+#define MIDI_EVENT_DISPATCHER_HH
+
+#include "fader_mapping.hh"
+#include "midi_command_handler.hh"
+#include "spsc_queue.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//   Number of decoded MIDI events which can be waiting for the output thread,
+// per input
+#define MIDI_EVENT_QUEUE_SIZE 1024
+
+//   This sits between the serial readers and the handler which does the real
+// work (e.g. talking to PulseAudio).  Each serial reader gives MIDI commands
+// to its own Input (see add_input()), which just puts them into a queue.  A
+// separate output thread takes them out of the queues, and passes them on to
+// 'output_handler'.  This way, the serial readers never have to wait for
+// PulseAudio.
+//   The output thread takes one event from each input's queue in turn, so a
+// controller which sends a lot can't hold up the others.  If it falls so far
+// behind that an input's queue fills up, that input's new events are dropped
+// (and counted).
+//   Pitch bend and channel pressure carry a single value per channel, and only
+// the latest one matters (e.g. a fader being moved).  These are coalesced: the
+// value goes into a per-(operation, channel) slot, and the queue only holds a
+// reminder that the slot is dirty.  If a new value arrives before the output
+// thread has got around to the old one, the old one is simply overwritten.
+// So however fast the controller sends, the output thread only ever applies
+// one value per slot per update it manages to do.
+struct MIDIEventDispatcher
+{
+	//   Where one serial device's MIDI commands go in.  Only one thread may
+	// call these (for each Input).  The channels have the device's
+	// channel_offset added.
+	//   It's 'final', so a parser which knows it has an Input (see
+	// BasicMIDIStreamParser) calls these directly, and can inline them.
+	struct Input final : MIDICommandHandler
+	{
+		const std::string name;
+		const int channel_offset;
+
+		Input( MIDIEventDispatcher & owner_in, const std::string & name_in, int channel_offset_in ) :
+		name(name_in), channel_offset(channel_offset_in), owner(owner_in),
+		received_count(0), overflow_count(0), max_queue_depth(0), coalesced_count(0), applied_count(0)
+		{ }
+
+		virtual void note_on(int channel, int key, int velocity) override                      { push(0x90, channel, key, velocity); }
+		virtual void note_off(int channel, int key, int velocity) override                     { push(0x80, channel, key, velocity); }
+		virtual void aftertouch(int channel, int key, int pressure) override                   { push(0xA0, channel, key, pressure); }
+		virtual void controller_change(int channel, int controller_nr, int controller_value) override { push(0xB0, channel, controller_nr, controller_value); }
+		virtual void program_change(int channel, int program_nr) override                      { push(0xC0, channel, program_nr, 0); }
+		virtual void channel_pressure(int channel, int pressure) override                      { push_coalesced(0xD0, channel, pressure); }
+		virtual void pitch_bend(int channel, int pitch) override                               { push_coalesced(0xE0, channel, pitch); }
+
+		// Counters (these can be read from any thread)
+		size_t queue_depth() const { return queue.size(); }
+		unsigned long get_received_count() const { return received_count.load(std::memory_order_relaxed); }
+		unsigned long get_overflow_count() const { return overflow_count.load(std::memory_order_relaxed); }
+		size_t get_max_queue_depth() const { return max_queue_depth.load(std::memory_order_relaxed); }
+		unsigned long get_coalesced_count() const { return coalesced_count.load(std::memory_order_relaxed); }
+		unsigned long get_applied_count() const { return applied_count.load(std::memory_order_relaxed); }
+
+		//   The queue is aligned to cache lines, which plain 'new' doesn't
+		// respect (before C++17).
+		static void *operator new( size_t size );
+		static void operator delete( void *p ) { free(p); }
+
+	private:
+		friend struct MIDIEventDispatcher;
+
+		MIDIEventDispatcher & owner;
+		SPSCQueue<MIDIEvent, MIDI_EVENT_QUEUE_SIZE> queue;
+
+		std::atomic<unsigned long> received_count;    // Events given to us
+		std::atomic<unsigned long> overflow_count;
+		std::atomic<size_t> max_queue_depth;
+		std::atomic<unsigned long> coalesced_count;   // Values overwritten before being applied
+		std::atomic<unsigned long> applied_count;     // Events given to output_handler
+
+		void push( unsigned char operation, int channel, int param1, int param2 );
+		void push_coalesced( unsigned char operation, int channel, int value );
+		bool enqueue( const MIDIEvent & event );
+	};
+
+	const Arguments arguments;
+	MIDICommandHandler * const output_handler;
+
+	MIDIEventDispatcher( const Arguments & args_in, MIDICommandHandler * const handler_in ) :
+	arguments(args_in), output_handler(handler_in), running(false), output_waiting(false)
+	{ }
+
+	//   Makes a new input (owned by this).  All of the inputs must be added
+	// before start().
+	Input *add_input( const std::string & name, int channel_offset );
+
+	const std::vector< std::unique_ptr<Input> > & get_inputs() const { return inputs; }
+
+	// Start/stop the output thread
+	void start();
+	void stop();
+
+	// Counters, added up over all of the inputs (these can be read from any thread)
+	size_t queue_depth() const;
+	size_t get_max_queue_depth() const;
+	unsigned long get_overflow_count() const;
+	unsigned long get_coalesced_count() const;
+	unsigned long get_applied_count() const;
+
+private:
+	std::vector< std::unique_ptr<Input> > inputs;
+
+	struct CoalescingSlot
+	{
+		std::atomic<int> value;
+		std::atomic<bool> dirty;
+
+		//   The EventTimes of the latest value.  These are only roughly in
+		// step with 'value' (they are only for EventTracer).
+		std::atomic<uint64_t> read_ns, parsed_ns;
+
+		CoalescingSlot() : value(0), dirty(false), read_ns(0), parsed_ns(0) {}
+	};
+
+	//   Indexed by [operation >> 4 & 0x7][channel], where the channel has had
+	// its input's offset added.  (So inputs with the same offset share them.)
+	CoalescingSlot slots[8][MAX_FADER_CHANNELS];
+
+	std::thread output_thread;
+	std::atomic<bool> running;
+
+	//   The output thread sleeps on 'wakeup' when every queue is empty.  The
+	// producers only touch the mutex if 'output_waiting' is set.
+	std::mutex wakeup_mutex;
+	std::condition_variable wakeup;
+	std::atomic<bool> output_waiting;
+
+	CoalescingSlot & slot_for( unsigned char operation, int channel );
+	void wake_output_thread();
+	bool all_queues_empty() const;
+	void output_thread_main();
+};
+
+//==============================================================================
+// Producer side (each serial reader's thread).  These are here, rather than in
+// the .cpp, so that the serial readers' parsers can inline them.
+
+inline MIDIEventDispatcher::CoalescingSlot & MIDIEventDispatcher::slot_for( unsigned char operation, int channel )
+{
+	return this->slots[(operation >> 4) & 0x7][(unsigned int)channel % MAX_FADER_CHANNELS];
+}
+
+inline void MIDIEventDispatcher::Input::push( unsigned char operation, int channel, int param1, int param2 )
+{
+	MIDIEvent event;
+	event.operation = operation;
+	event.channel   = (unsigned char)(channel + this->channel_offset);
+	event.param1    = param1;
+	event.param2    = param2;
+	event.times     = EventTracer::current;
+
+	this->received_count.fetch_add(1, std::memory_order_relaxed);
+	this->enqueue(event);
+}
+
+//   Stores the value in its slot, and only queues the event if the slot wasn't
+// already waiting to be applied.  (The queued event's value is ignored: the
+// output thread takes whatever is in the slot when it gets to it.)
+inline void MIDIEventDispatcher::Input::push_coalesced( unsigned char operation, int channel, int value )
+{
+	channel += this->channel_offset;
+	CoalescingSlot & slot = this->owner.slot_for(operation, channel);
+
+	this->received_count.fetch_add(1, std::memory_order_relaxed);
+
+	slot.value.store(value, std::memory_order_relaxed);
+	slot.read_ns.store(EventTracer::current.read_ns, std::memory_order_relaxed);
+	slot.parsed_ns.store(EventTracer::current.parsed_ns, std::memory_order_relaxed);
+
+	//   The release half of this makes sure the output thread sees the value
+	// (or a newer one) once it sees the slot is dirty.
+	if ( slot.dirty.exchange(true, std::memory_order_acq_rel) )
+	{
+		// The previous value hasn't been applied yet; it never will be now
+		this->coalesced_count.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	MIDIEvent event;
+	event.operation = operation;
+	event.channel   = (unsigned char)channel;
+	event.param1    = value;
+	event.param2    = 0;
+	event.times     = EventTracer::current;
+
+	//   If the queue is full, nothing is going to clean the slot, so do it
+	// here.  Otherwise the slot would stay dirty forever.
+	if ( !this->enqueue(event) )
+		slot.dirty.store(false, std::memory_order_release);
+}
+
+#endif // MIDI_EVENT_DISPATCHER_HH
@@ -0,0 +1,170 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MIDI_HANDLER_CHAIN_HH
+#define MIDI_HANDLER_CHAIN_HH
+
+#include "event_trace.hh"
+#include "logger.hh"
+#include "midi_command_handler.hh"
+
+#include <cstdint>
+
+//   Decoding MIDI into calls on a handler whose type is known at compile time,
+// so that a call goes straight from the parser to whatever does the work, and
+// the compiler can inline it.  (e.g. the serial readers' parsers, which give
+// everything to MIDIEventDispatcher::Input.)  MIDICommandHandler's virtual
+// functions are still there, for handlers which are only known at run time.
+
+//   Decodes one complete MIDI message (see MIDIStreamParser), and calls the
+// matching function of 'handler'.  'Handler' can be a StaticMIDIHandler, or
+// any MIDICommandHandler (which is only called directly if it's 'final').
+// The caller does EventTracer::parsed(), so that a batch of messages can
+// share it.
+//   In this program the pitch bend range will be transmitted as one 14 bit
+// number.  So the end result is that MIDI commands will be transmitted as 3
+// bytes, starting with the operation byte:
+//     buf[0] --> operation/channel
+//     buf[1] --> param1
+//     buf[2] --> param2   (param2 not transmitted on program change or key press)
+template <class Handler>
+inline void decode_midi_command( const unsigned char *buf, Handler & handler )
+{
+	/*
+	   MIDI COMMANDS
+	   -------------------------------------------------------------------
+	   name                 status      param 1          param 2
+	   -------------------------------------------------------------------
+	   note off             0x80+C       key #            velocity
+	   note on              0x90+C       key #            velocity
+	   poly key pressure    0xA0+C       key #            pressure value
+	   control change       0xB0+C       control #        control value
+	   program change       0xC0+C       program #        --
+	   mono key pressure    0xD0+C       pressure value   --
+	   pitch bend           0xE0+C       range (LSB)      range (MSB)
+	   system               0xF0+C       manufacturer     model
+	   -------------------------------------------------------------------
+	   C is the channel number, from 0 to 15;
+	   -------------------------------------------------------------------
+	   source: http://ftp.ec.vanderbilt.edu/computermusic/musc216site/MIDI.Commands.html
+	*/
+
+	int operation = buf[0] & 0xF0;
+	int channel   = buf[0] & 0x0F;
+	int param1    = buf[1];
+	int param2    = buf[2];
+
+	// Don't even make the call to log, most of the time
+	const bool verbose = logger.enabled(LOG_VERBOSE);
+
+	switch (operation)
+	{
+		case 0x80:
+			if ( verbose )
+				logger.log(LOG_VERBOSE, "Serial  0x%x Note off           %03u %03u %03u", operation, channel, param1, param2);
+			handler.note_off(channel, param1, param2);
+			break;
+
+		case 0x90:
+			if ( verbose )
+				logger.log(LOG_VERBOSE, "Serial  0x%x Note on            %03u %03u %03u", operation, channel, param1, param2);
+			handler.note_on(channel, param1, param2);
+			break;
+
+		case 0xA0:
+			if ( verbose )
+				logger.log(LOG_VERBOSE, "Serial  0x%x Pressure change    %03u %03u %03u", operation, channel, param1, param2);
+			handler.aftertouch(channel, param1, param2);
+			break;
+
+		case 0xB0:
+			if ( verbose )
+				logger.log(LOG_VERBOSE, "Serial  0x%x Controller change  %03u %03u %03u", operation, channel, param1, param2);
+			handler.controller_change(channel, param1, param2);
+			break;
+
+		case 0xC0:
+			if ( verbose )
+				logger.log(LOG_VERBOSE, "Serial  0x%x Program change     %03u %03u", operation, channel, param1);
+			handler.program_change(channel, param1);
+			break;
+
+		case 0xD0:
+			if ( verbose )
+				logger.log(LOG_VERBOSE, "Serial  0x%x Channel pressure   %03u %03u", operation, channel, param1);
+			handler.channel_pressure(channel, param1);
+			break;
+
+		case 0xE0:
+			param1 = (param1 & 0x7F) + ((param2 & 0x7F) << 7);
+			if ( verbose )
+				logger.log(LOG_VERBOSE, "Serial  0x%x Pitch bend         %03u %05i", operation, channel, param1);
+			handler.pitch_bend(channel, param1 - 8192); // in alsa MIDI we want signed int
+			break;
+
+		// Not implementing system commands (0xF0)
+
+		default:
+			logger.log(LOG_INFO, "0x%x Unknown MIDI cmd   %03u %03u %03u", operation, channel, param1, param2);
+			break;
+	}
+}
+
+// Calls whichever of handler's functions 'event' is for
+template <class Handler>
+inline void dispatch_midi_event( const MIDIEvent & event, Handler & handler )
+{
+	switch (event.operation)
+	{
+		case 0x80: handler.note_off(event.channel, event.param1, event.param2);          break;
+		case 0x90: handler.note_on(event.channel, event.param1, event.param2);           break;
+		case 0xA0: handler.aftertouch(event.channel, event.param1, event.param2);        break;
+		case 0xB0: handler.controller_change(event.channel, event.param1, event.param2); break;
+		case 0xC0: handler.program_change(event.channel, event.param1);                  break;
+		case 0xD0: handler.channel_pressure(event.channel, event.param1);                break;
+		case 0xE0: handler.pitch_bend(event.channel, event.param1);                      break;
+		default:                                                                         break;
+	}
+}
+
+//==============================================================================
+
+//   The base of a compile-time handler (CRTP: 'Derived' is the handler).  Like
+// MIDICommandHandler, but nothing is virtual: Derived hides whichever of these
+// it wants to.
+template <class Derived>
+struct StaticMIDIHandler
+{
+	void note_on(__attribute__((unused)) int channel, __attribute__((unused)) int key, __attribute__((unused)) int velocity) {}
+	void note_off(__attribute__((unused)) int channel, __attribute__((unused)) int key, __attribute__((unused)) int velocity) {}
+	void aftertouch(__attribute__((unused)) int channel, __attribute__((unused)) int key, __attribute__((unused)) int pressure) {}
+	void controller_change(__attribute__((unused)) int channel, __attribute__((unused)) int controller_nr, __attribute__((unused)) int controller_value) {}
+	void program_change(__attribute__((unused)) int channel, __attribute__((unused)) int program_nr) {}
+	void channel_pressure(__attribute__((unused)) int channel, __attribute__((unused)) int pressure) {}
+	void pitch_bend(__attribute__((unused)) int channel, __attribute__((unused)) int pitch) {}
+	uint64_t do_held_work(__attribute__((unused)) uint64_t now_ns) { return 0; }
+
+	void parse_midi_command( const unsigned char *buf ) { EventTracer::parsed(); decode_midi_command(buf, derived()); }
+	void handle_midi_event( const MIDIEvent & event ) { dispatch_midi_event(event, derived()); }
+
+private:
+	Derived & derived() { return static_cast<Derived &>(*this); }
+};
+
+#endif // MIDI_HANDLER_CHAIN_HH
@@ -0,0 +1,113 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MIDI_STREAM_PARSER_HH
+#define MIDI_STREAM_PARSER_HH
+
+#include "logger.hh"
+#include "metrics.hh"
+#include "midi_command_handler.hh"
+#include "midi_decoder.hh"
+#include "midi_handler_chain.hh"
+
+#include <cstddef>
+#include <cstdint>
+
+//   Turns the bytes coming from the serial device into MIDI commands, which it
+// gives to a Handler (see decode_midi_command()).  The bytes can be fed in
+// however they happen to arrive: a message which is split over two reads is
+// remembered until the rest of it turns up.
+//   The framing (running status, real-time bytes, SysEx, text messages, and
+// skipping junk) is done by MIDIBulkDecoder, a batch of messages at a time.
+// Text messages get printed.
+//   'Handler' is whatever the commands go to.  If it's known at compile time
+// (e.g. a class which is 'final', or a StaticMIDIHandler), the calls to it
+// can be inlined.  MIDIStreamParser is the one for any MIDICommandHandler.
+template <class Handler>
+struct BasicMIDIStreamParser
+{
+	const Arguments arguments;
+	Handler * const midi_command_handler;
+
+	BasicMIDIStreamParser( const Arguments & args_in, Handler * const handler_in ) :
+	arguments(args_in), midi_command_handler(handler_in)
+	{ }
+
+	// Forget any partial message, and the running status
+	void reset() { decoder.reset(); }
+
+	//   'read_ns' is when the bytes were read (see monotonic_ns()).  Each
+	// message is timed from the read which brought its first byte.
+	void feed( const unsigned char *data, size_t count, uint64_t read_ns );
+
+	const MIDIBulkDecoder & get_decoder() const { return decoder; }
+
+private:
+	MIDIBulkDecoder decoder;
+};
+
+typedef BasicMIDIStreamParser<MIDICommandHandler> MIDIStreamParser;
+
+//==============================================================================
+
+template <class Handler>
+void BasicMIDIStreamParser<Handler>::feed( const unsigned char *data, size_t count, uint64_t read_ns )
+{
+	MIDIDecodedMessage messages[MIDI_DECODE_BATCH];
+
+	uint64_t resyncs = this->decoder.get_resync_count();
+	uint64_t framing_errors = this->decoder.get_framing_error_count();
+
+	while ( count > 0 )
+	{
+		size_t consumed;
+		size_t n = this->decoder.decode(data, count, read_ns, messages, MIDI_DECODE_BATCH, consumed);
+
+		// The whole batch was decoded at once, so it has one time
+		if ( n > 0 )
+		{
+			EventTracer::parsed();
+			metrics.add(METRIC_MIDI_MESSAGES, n);
+		}
+
+		for ( size_t i = 0; i < n; i++ )
+		{
+			const MIDIDecodedMessage & m = messages[i];
+
+			if ( m.bytes[0] == 0xFF )
+			{
+				logger.log(LOG_INFO, "0xFF Non-MIDI message: %s", this->decoder.get_text());
+				continue;
+			}
+
+			EventTracer::bytes_read(m.read_ns);
+			decode_midi_command(m.bytes, *this->midi_command_handler);
+		}
+
+		data += consumed;
+		count -= consumed;
+	}
+
+	if ( this->decoder.get_resync_count() != resyncs )
+		metrics.add(METRIC_MIDI_RESYNCS, this->decoder.get_resync_count() - resyncs);
+	if ( this->decoder.get_framing_error_count() != framing_errors )
+		metrics.add(METRIC_MIDI_FRAMING_ERRORS, this->decoder.get_framing_error_count() - framing_errors);
+}
+
+#endif // MIDI_STREAM_PARSER_HH
@@ -0,0 +1,235 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "program_volume_handler.hh"
+#include "fader_feedback.hh"
+#include "logger.hh"
+
+using namespace std;
+
+void MIDIHandler_Program_Volume::pitch_bend(int channel, int pitch)
+{
+	// This doesn't lock anything: a reload can happen at the same time
+	RCUPointer<const FaderMappingTable>::ReadGuard table = this->mapping.read();
+
+	const vector<Fader_Program_Mapping> & rules = table->rules_for(channel);
+	if ( rules.empty() )
+		return;
+
+	uint64_t now_ns = monotonic_ns();
+
+	// A motorized fader going where we sent it isn't anyone moving it
+	if ( this->feedback != nullptr and this->feedback->fader_moved(channel, now_ns) )
+		return;
+
+	//   Each rule's streams are set all at once.  Streams which have been set
+	// too recently are held back by the limiter, and set by do_held_work().
+	// With the ramper, this only moves the targets, and do_held_work() does
+	// all of the setting.
+	for ( size_t r = 0; r < rules.size(); r++ )
+	{
+		const Fader_Program_Mapping & rule = rules[r];
+		unsigned int volume = rule.curve->volume(pitch);
+
+		this->streams.clear();
+		if ( !this->backend.resolve(rule.match, this->streams) )
+		{
+			// No connection, so whatever was held back is out of date
+			this->limiter.clear();
+			this->ramper.clear();
+			return;
+		}
+
+		if ( this->feedback != nullptr )
+			this->follow_streams(channel, r);
+
+		if ( this->ramper.enabled() )
+		{
+			for ( const string & stream : this->streams )
+				this->ramper.set_target(stream, volume, EventTracer::current);
+			continue;
+		}
+
+		this->writes.clear();
+		this->write_origins.clear();
+		for ( const string & stream : this->streams )
+			if ( this->limiter.offer(stream, volume, now_ns, EventTracer::current) )
+			{
+				pair<string,unsigned int> & write = this->writes.append();
+				write.first = stream;
+				write.second = volume;
+				this->write_origins.push_back(EventTracer::current);
+			}
+
+		this->send_volumes(now_ns);
+	}
+}
+
+uint64_t MIDIHandler_Program_Volume::do_held_work( uint64_t now_ns )
+{
+	this->writes.clear();
+	this->write_origins.clear();
+
+	//   The ramper already sends at most one change per stream per tick, so
+	// its changes don't go through the limiter as well.
+	if ( this->ramper.enabled() )
+		this->ramper.tick(now_ns, this->writes, this->write_origins);
+	else
+		this->limiter.take_due(now_ns, this->writes, this->write_origins);
+
+	this->send_volumes(now_ns);
+
+	if ( this->ramper.enabled() )
+		return this->ramper.next_tick_ns(now_ns);
+	else
+		return this->limiter.next_due_ns();
+}
+
+//==============================================================================
+// Feedback
+
+//   Remembers that 'streams' are on fader 'channel', by rule number 'rule' of
+// that channel.  (If a stream is on more than one fader, the last one to move
+// wins.)
+void MIDIHandler_Program_Volume::follow_streams( int channel, size_t rule )
+{
+	lock_guard<mutex> lock(this->feedback_mutex);
+
+	//   Streams come and go, so this would keep growing.  The ones which are
+	// still there get put back as soon as their faders move.
+	if ( this->fed_back_streams.size() + this->streams.size() > FEEDBACK_MAX_STREAMS )
+		this->fed_back_streams.clear();
+
+	for ( const string & stream : this->streams )
+	{
+		//   Look it up first: making the pair to insert would copy the string,
+		// even when it's there already.
+		auto it = this->fed_back_streams.find(stream);
+		bool is_new = ( it == this->fed_back_streams.end() );
+		if ( is_new )
+			it = this->fed_back_streams.insert(make_pair(stream, FedBackStream())).first;
+
+		FedBackStream & s = it->second;
+
+		if ( is_new )
+		{
+			for ( size_t i = 0; i < FEEDBACK_ECHO_VOLUMES; i++ )
+			{
+				s.sent[i] = ~0u;
+				s.sent_ns[i] = 0;
+			}
+			s.next_sent = 0;
+		}
+
+		s.channel = channel;
+		s.rule = rule;
+	}
+}
+
+//   Sets the volumes in 'writes' (for the events in 'write_origins'), and
+// remembers them for fader_position().  They are remembered first, so that
+// they are there however soon PulseAudio tells us about them.
+void MIDIHandler_Program_Volume::send_volumes( uint64_t now_ns )
+{
+	if ( this->feedback != nullptr and !this->writes.empty() )
+	{
+		lock_guard<mutex> lock(this->feedback_mutex);
+
+		for ( const pair<string,unsigned int> & w : this->writes )
+		{
+			auto it = this->fed_back_streams.find(w.first);
+			if ( it == this->fed_back_streams.end() )
+				continue;
+
+			FedBackStream & s = it->second;
+			s.sent[s.next_sent] = w.second;
+			s.sent_ns[s.next_sent] = now_ns;
+			s.next_sent = (s.next_sent + 1) % FEEDBACK_ECHO_VOLUMES;
+		}
+	}
+
+	this->backend.set_volumes(this->writes, this->write_origins);
+}
+
+bool MIDIHandler_Program_Volume::fader_position( const string & stream, unsigned int volume, uint64_t now_ns, int & channel, int & pitch )
+{
+	size_t rule;
+	{
+		lock_guard<mutex> lock(this->feedback_mutex);
+
+		auto it = this->fed_back_streams.find(stream);
+		if ( it == this->fed_back_streams.end() )
+			return false;
+
+		//   Each of ours comes back once (if it changed anything), so forget
+		// it once it has.  One which hasn't come back by now never will (it
+		// didn't change anything), and mustn't hide someone else setting the
+		// same volume later.
+		FedBackStream & s = it->second;
+		for ( size_t i = 0; i < FEEDBACK_ECHO_VOLUMES; i++ )
+			if ( s.sent[i] == volume and s.sent_ns[i] + FADER_FEEDBACK_SETTLE_MS * 1000000ULL > now_ns )
+			{
+				s.sent[i] = ~0u;
+				return false;
+			}
+
+		channel = it->second.channel;
+		rule = it->second.rule;
+	}
+
+	RCUPointer<const FaderMappingTable>::ReadGuard table = this->mapping.read();
+
+	// The mapping might have been reloaded since
+	const vector<Fader_Program_Mapping> & rules = table->rules_for(channel);
+	if ( rule >= rules.size() )
+		return false;
+
+	pitch = rules[rule].curve->pitch(volume);
+	return true;
+}
+
+bool MIDIHandler_Program_Volume::reload_mapping()
+{
+	string error;
+
+	if ( arguments.configfile == "" )
+		return false;
+
+	const FaderMappingTable *new_table = FaderMappingTable::load(arguments.configfile, error);
+
+	if ( new_table == NULL )
+	{
+		logger.log(LOG_INFO, "Not reloading fader mapping: %s", error.c_str());
+		return false;
+	}
+
+	//   Events which are using the old table carry on with it.  It is deleted
+	// later, once none are.
+	this->mapping.replace(new_table);
+
+	// The faders' rules have changed, so forget which streams they set
+	{
+		lock_guard<mutex> lock(this->feedback_mutex);
+		this->fed_back_streams.clear();
+	}
+
+	logger.log(LOG_INFO, "Reloaded fader mapping from %s: %zu rules", arguments.configfile.c_str(), new_table->n_rules());
+
+	return true;
+}
@@ -0,0 +1,140 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROGRAM_VOLUME_HANDLER_HH
+#define PROGRAM_VOLUME_HANDLER_HH
+
+#include "fader_mapping.hh"
+#include "midi_command_handler.hh"
+#include "rcu_pointer.hh"
+#include "volume_backend.hh"
+#include "volume_ramper.hh"
+#include "volume_rate_limiter.hh"
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct FaderFeedback;
+
+//   How many of the volumes we have set each stream to are remembered, to
+// recognise them when they come back (see fader_position()).  Each is only
+// remembered for FADER_FEEDBACK_SETTLE_MS.
+#define FEEDBACK_ECHO_VOLUMES 8
+
+// How many streams to remember the faders of, before starting again
+#define FEEDBACK_MAX_STREAMS 256
+
+//   How long after reloading the mapping to delete the old one (and how often
+// to try again, if an event is still using it)
+#define MAPPING_RECLAIM_MS 100
+
+//   How many streams one event is expected to set at most.  (More is fine: it
+// just means allocating the first time.)
+#define HANDLER_PREALLOCATED_STREAMS 64
+
+//   This is a concrete example of a MIDICommandHandler.  When we get a MIDI
+// command, we will use PulseAudio (or some other VolumeBackend) to control
+// some volumes.  This is the only piece of code which connects the 'ttymidi'
+// side with the volume side.
+//   Volume changes go through a VolumeRateLimiter, so that a fast fader
+// doesn't swamp PulseAudio.  Or, with --tick-rate, they go through a
+// VolumeRamper instead, and are sent on its ticks.
+struct MIDIHandler_Program_Volume final : MIDICommandHandler
+{
+	const Arguments arguments;
+	VolumeBackend & backend;
+
+	//   Takes ownership of 'mapping_in'.  (See FaderMappingTable::built_in()
+	// and FaderMappingTable::load().)
+	MIDIHandler_Program_Volume( const Arguments & args_in, VolumeBackend & backend_in, const FaderMappingTable *mapping_in ) :
+	arguments(args_in), backend(backend_in), mapping(mapping_in),
+	limiter(args_in.stream_rate, args_in.total_rate),
+	ramper(args_in.tick_rate, args_in.ramp_ms), feedback(nullptr)
+	{
+		streams.preallocate(HANDLER_PREALLOCATED_STREAMS);
+		writes.preallocate(HANDLER_PREALLOCATED_STREAMS);
+		write_origins.preallocate(HANDLER_PREALLOCATED_STREAMS);
+	}
+
+	virtual void pitch_bend(int channel, int pitch) override;
+
+	//   Sends the volume changes which were held back by the rate limit (or
+	// the ramper's next step)
+	virtual uint64_t do_held_work(uint64_t now_ns) override;
+
+	const VolumeRateLimiter & get_limiter() const { return limiter; }
+	const VolumeRamper & get_ramper() const { return ramper; }
+
+	//   Reads the config file again, and swaps the new mapping in.  Events
+	// being handled meanwhile carry on with the old one.  If the file is
+	// wrong, the old mapping is kept.  This can be called from any thread.
+	bool reload_mapping();
+
+	//   Deletes the mappings which reload_mapping() replaced, once no event is
+	// using them.  Returns how many are left, to try again later.  This can be
+	// called from any thread.
+	size_t reclaim_old_mappings() { return mapping.reclaim(); }
+
+	//   Moves motorized faders to follow volumes which something else changes.
+	// Call this before any events arrive.
+	void set_feedback( FaderFeedback *feedback_in ) { feedback = feedback_in; }
+
+	//   For FaderFeedback: the fader which last set 'stream', and the position
+	// it would be in to give 'volume'.  Returns false if no fader has set
+	// 'stream', or if 'volume' is one we set it to in the last
+	// FADER_FEEDBACK_SETTLE_MS before 'now_ns' (i.e. it's only PulseAudio
+	// telling us what we did).  This can be called from any thread.
+	bool fader_position( const std::string & stream, unsigned int volume, uint64_t now_ns, int & channel, int & pitch );
+
+private:
+	RCUPointer<const FaderMappingTable> mapping;
+
+	VolumeRateLimiter limiter;
+	VolumeRamper ramper;
+
+	//   Only used by pitch_bend() and do_held_work(), but kept (strings and
+	// all), so that handling an event doesn't allocate anything
+	VolumeBackend::StreamList streams;
+	VolumeBackend::VolumeWrites writes;
+	VolumeBackend::WriteOrigins write_origins;    // The event each write is for
+
+	//   With feedback, which fader (and which of its rules) set each stream,
+	// and the last few volumes it was set to, and when.  (These are written
+	// by the output thread, and read by FaderFeedback's.)
+	struct FedBackStream
+	{
+		int channel;
+		size_t rule;
+		unsigned int sent[FEEDBACK_ECHO_VOLUMES];
+		uint64_t sent_ns[FEEDBACK_ECHO_VOLUMES];
+		size_t next_sent;
+	};
+
+	FaderFeedback *feedback;
+	std::mutex feedback_mutex;
+	std::map<std::string,FedBackStream> fed_back_streams;
+
+	void follow_streams( int channel, size_t rule );
+	void send_volumes( uint64_t now_ns );
+};
+
+#endif // PROGRAM_VOLUME_HANDLER_HH
@@ -18,31 +18,37 @@
 */
 
 #include "pulse_dbus.hh"
-#include "utils.hh"
+#include "event_trace.hh"
+#include "logger.hh"
+#include "metrics.hh"
 
-#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include <string.h>
 
 using namespace std;
 
-GVariant* get_things_gv(
-	GDBusConnection *conn,
-	const char *get_method_name,
-	const char * interface,
-	const char * path );
-
-void set_things_gv(
-	GDBusConnection *conn,
-	const char *get_method_name,
-	const char * interface,
-	const char * path, GVariant* input );
+// The most channels a stream can have (PulseAudio's PA_CHANNELS_MAX)
+#define DBUS_MAX_CHANNELS 32
 
 // Note: these functions delete the GVariant input
 vector<string> gv_to_vs( GVariant *gv );
 
 vector<uint32_t> gv_to_vuint32( GVariant *gv );
 
+map<string,string> gv_to_property_list( GVariant *gv, const vector<string> & keys );
+
 // Note: this function creates a GVariant, that must be freed later
-GVariant *vuint32_to_gv( const vector<uint32_t> & vuint32 );
+GVariant *volume_to_gv( size_t n_channels, uint32_t volume );
+
+DBusCall property_get_call( const string & path, const char *interface, const char *property );
+
+void set_property_set_call( DBusCall & call, const string & path, const char *interface, const char *property, GVariant *value );
+
+GVariant *take_property_value( DBusCall & call );
+
+void check_call_errors( DBusCall *calls, size_t n_calls );
+static void check_call_errors( vector<DBusCall> & calls ) { check_call_errors(calls.data(), calls.size()); }
 
 //==============================================================================
 
@@ -55,6 +61,14 @@ void throw_glib_errors( GError *e )
 		return;
 }
 
+//   This is the error that occurs when a PulseAudio object (client, stream,
+// etc.) disappears while we are talking to it.
+static bool object_vanished( GError *e )
+{
+	return e->domain == g_dbus_error_quark() and
+	       e->code == G_DBUS_ERROR_UNKNOWN_METHOD;
+}
+
 // Connects to PulseAudio via DBus
 bool DBusPulseAudio::connect()
 {
@@ -63,8 +77,7 @@ bool DBusPulseAudio::connect()
 
 	if ( this->conn_open == true )
 	{
-		if ( !arguments.silent )
-			cerr << current_time() << "ERROR: DBusPulseAudio::connect(): Connection already open" << endl;
+		logger.log(LOG_INFO, "ERROR: DBusPulseAudio::connect(): Connection already open");
 		return true;
 	}
 
@@ -103,13 +116,11 @@ bool DBusPulseAudio::connect()
 
 	if ( pulse_server_string == "" )
 	{
-		if (arguments.verbose)
-			cerr << current_time() << "Unable to find PulseAudio bus name" << endl;
+		logger.log(LOG_VERBOSE, "Unable to find PulseAudio bus name");
 		return false;
 	}
 
-	if ( !arguments.silent )
-		cerr << current_time() << "Connecting to PulseAudio bus: " << pulse_server_string << endl;
+	logger.log(LOG_INFO, "Connecting to PulseAudio bus: %s", pulse_server_string.c_str());
 
 	// Connect to the bus
 	this->pulse_conn = g_dbus_connection_new_for_address_sync(
@@ -121,67 +132,486 @@ bool DBusPulseAudio::connect()
 	throw_glib_errors(error);
 
 	this->conn_open = true;
+
+	if ( this->ever_connected )
+		metrics.add(METRIC_BACKEND_RECONNECTS);
+	this->ever_connected = true;
+
+	// Replies and signals will be dispatched on this thread
+	this->start_dbus_thread();
+
+	//   Subscribe before the cache gets filled, so that nothing can happen in
+	// between the two which we don't hear about.
+	this->listen_for_core_signals();
+
 	return true;
 }
 
-//   Gets general things from PulseAudio.  This could include: clients, sinks,
-// etc.  It returns them in a GVariant.  This function is meant to be wrapped by
-// another function which returns the thigns in a nicer data structure
-GVariant* get_things_gv( GDBusConnection *conn, const char *get_method_name, const char * interface, const char * path )
+//==============================================================================
+// The DBus thread, and sending calls
+
+//   This is shared between call_all() and the callbacks of the calls it sends,
+// so that it knows when all of the replies have arrived.
+struct DBusCallBatch
 {
-	GVariant *temp_tva, *temp_va, *temp_a;
-	GError *error = NULL;
+	DBusPulseAudio *self;
+	GDBusConnection *conn;
+	DBusCall *calls;
+	size_t n_calls;
 
-	temp_tva = g_dbus_connection_call_sync(
-		conn,
-		NULL,                              // Bus name
-		path,                              // Path of object
-		"org.freedesktop.DBus.Properties", // Interface name
-		"Get",                             // Method name
-		g_variant_new("(ss)",interface,get_method_name), // Params
-		NULL,                              // reply type
-		G_DBUS_CALL_FLAGS_NONE,
-		-1,                                // Timeout
-		NULL,                              // Cancellable
-		&error
-	);
-	throw_glib_errors(error);
+	mutex m;
+	condition_variable finished;
+	size_t outstanding;
+};
+
+void DBusPulseAudio::use_event_loop( EventLoop & loop )
+{
+	if ( this->dbus_context != nullptr )
+		return;
+
+	this->dbus_context = g_main_context_new();
+	this->event_loop = &loop;
+
+	//   Anything started from this thread (signal subscriptions, in particular)
+	// gets its callbacks dispatched by the loop.
+	g_main_context_push_thread_default(this->dbus_context);
+	loop.attach_glib_context(this->dbus_context);
+}
+
+void DBusPulseAudio::start_dbus_thread()
+{
+	// The event loop does the job of the DBus thread
+	if ( this->dbus_thread.joinable() or this->event_loop != nullptr )
+		return;
+
+	this->dbus_context = g_main_context_new();
+	this->dbus_loop = g_main_loop_new(this->dbus_context, FALSE);
+
+	this->dbus_thread = thread(&DBusPulseAudio::dbus_thread_main, this);
+}
+
+void DBusPulseAudio::stop_dbus_thread()
+{
+	//   This must be on the event loop's thread, like use_event_loop() was.
+	// Nothing can be dispatched after this.
+	if ( this->event_loop != nullptr )
+	{
+		this->event_loop->detach_glib_context();
+		g_main_context_pop_thread_default(this->dbus_context);
+		g_main_context_unref(this->dbus_context);
+		this->dbus_context = nullptr;
+		this->event_loop = nullptr;
+		return;
+	}
+
+	if ( !this->dbus_thread.joinable() )
+		return;
+
+	g_main_loop_quit(this->dbus_loop);
+	this->dbus_thread.join();
+
+	g_main_loop_unref(this->dbus_loop);
+	g_main_context_unref(this->dbus_context);
+	this->dbus_loop = nullptr;
+	this->dbus_context = nullptr;
+}
+
+void DBusPulseAudio::dbus_thread_main()
+{
+	//   Anything started from this thread (calls, signal subscriptions) gets
+	// its callbacks dispatched here.
+	g_main_context_push_thread_default(this->dbus_context);
+
+	g_main_loop_run(this->dbus_loop);
+
+	g_main_context_pop_thread_default(this->dbus_context);
+}
+
+//   Arranges for func(data) to be called on the DBus thread (or the event
+// loop's).  Unlike g_main_context_invoke(), this never runs it straight away.
+void DBusPulseAudio::run_in_dbus_thread( GSourceFunc func, gpointer data )
+{
+	GSource *source = g_idle_source_new();
+
+	g_source_set_callback(source, func, data, NULL);
+	g_source_attach(source, this->dbus_context);
+	g_source_unref(source);
+}
+
+static void on_call_finished( GObject *source, GAsyncResult *res, gpointer user_data )
+{
+	DBusCall *call = static_cast<DBusCall*>(user_data);
+	DBusCallBatch *batch = call->batch;
+
+	call->reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &call->error);
+	call->finished_ns = monotonic_ns();
+
+	lock_guard<mutex> lock(batch->m);
+	if ( --batch->outstanding == 0 )
+		batch->finished.notify_one();
+}
+
+// Runs on the DBus thread: sends every call in the batch, without waiting
+static gboolean send_batch( gpointer user_data )
+{
+	DBusCallBatch *batch = static_cast<DBusCallBatch*>(user_data);
+
+	for ( size_t i = 0; i < batch->n_calls; i++ )
+	{
+		DBusCall & call = batch->calls[i];
+
+		g_dbus_connection_call(
+			batch->conn,
+			NULL,                              // Bus name
+			call.path.c_str(),                 // Path of object
+			call.interface,                    // Interface name
+			call.method,                       // Method name
+			call.params,                       // Params
+			NULL,                              // reply type
+			G_DBUS_CALL_FLAGS_NONE,
+			-1,                                // Timeout
+			NULL,                              // Cancellable
+			&on_call_finished,
+			&call
+		);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+// Which counter a call to 'method' is counted in
+static MetricCounter dbus_method_metric( const char *method )
+{
+	if ( strcmp(method, "Get") == 0 )
+		return METRIC_DBUS_CALLS_GET;
+	if ( strcmp(method, "Set") == 0 )
+		return METRIC_DBUS_CALLS_SET;
+	if ( strcmp(method, "ListenForSignal") == 0 )
+		return METRIC_DBUS_CALLS_LISTEN_FOR_SIGNAL;
+
+	return METRIC_DBUS_CALLS_OTHER;
+}
+
+//   Sends all of the calls at once, and waits until every one of them has had
+// a reply (or an error).  This doesn't throw: each call's 'reply' or 'error'
+// gets filled in, and it's up to the caller to deal with them (see
+// check_call_errors()).
+void DBusPulseAudio::call_all( DBusCall *calls, size_t n_calls )
+{
+	if ( n_calls == 0 )
+		return;
+
+	DBusCallBatch batch;
+	batch.self = this;
+	batch.conn = this->pulse_conn;
+	batch.calls = calls;
+	batch.n_calls = n_calls;
+	batch.outstanding = n_calls;
+
+	for ( size_t i = 0; i < n_calls; i++ )
+	{
+		calls[i].reply = NULL;
+		calls[i].error = NULL;
+		calls[i].finished_ns = 0;
+		calls[i].batch = &batch;
+	}
+
+	this->call_count.fetch_add(n_calls, memory_order_relaxed);
+	for ( size_t i = 0; i < n_calls; i++ )
+		metrics.add(dbus_method_metric(calls[i].method));
+	if ( n_calls > this->max_calls_in_flight.load(memory_order_relaxed) )
+		this->max_calls_in_flight.store(n_calls, memory_order_relaxed);
+
+	this->run_in_dbus_thread(&send_batch, &batch);
+
+	//   If this is the event loop's thread (e.g. connect() being called from
+	// main()), nobody else is going to dispatch the replies, so do it here.
+	// They arrive on this thread, so there's no need to lock.
+	if ( g_main_context_is_owner(this->dbus_context) )
+	{
+		while ( batch.outstanding > 0 )
+			g_main_context_iteration(this->dbus_context, TRUE);
+		return;
+	}
+
+	unique_lock<mutex> lock(batch.m);
+	while ( batch.outstanding > 0 )
+		batch.finished.wait(lock);
+}
+
+// Makes a call to org.freedesktop.DBus.Properties.Get
+DBusCall property_get_call( const string & path, const char *interface, const char *property )
+{
+	DBusCall call;
+
+	call.path      = path;
+	call.interface = "org.freedesktop.DBus.Properties";
+	call.method    = "Get";
+	call.params    = g_variant_new("(ss)", interface, property);
+	call.reply     = NULL;
+	call.error     = NULL;
+	call.finished_ns = 0;
+	call.batch     = NULL;
+
+	return call;
+}
 
-	// extract the array out of the tuple of variant
-	temp_va = g_variant_get_child_value(temp_tva,0);
+//   Makes 'call' (which may be an old one, being reused) a call to
+// org.freedesktop.DBus.Properties.Set.  This uses up 'value'.
+void set_property_set_call( DBusCall & call, const string & path, const char *interface, const char *property, GVariant *value )
+{
+	call.path      = path;
+	call.interface = "org.freedesktop.DBus.Properties";
+	call.method    = "Set";
+	call.params    = g_variant_new("(ssv)", interface, property, value);
+	call.reply     = NULL;
+	call.error     = NULL;
+	call.finished_ns = 0;
+	call.batch     = NULL;
+}
+
+//   Takes the value out of a Get call's reply, and frees the reply.  Returns
+// NULL if the call didn't get a reply.  The value must be freed later.
+GVariant *take_property_value( DBusCall & call )
+{
+	GVariant *temp_va, *temp_a;
+
+	if ( call.reply == NULL )
+		return NULL;
+
+	// extract the value out of the tuple of variant
+	temp_va = g_variant_get_child_value(call.reply,0);
 	temp_a = g_variant_get_variant(temp_va);
 
 	// Clean up
 	g_variant_unref(temp_va);
-	g_variant_unref(temp_tva);
+	g_variant_unref(call.reply);
+	call.reply = NULL;
 
 	return temp_a;
 }
 
-void set_things_gv( GDBusConnection *conn, const char *get_method_name, const char * interface, const char * path, GVariant* input )
+//   Goes through the errors from a batch of calls.  Errors for objects which
+// have vanished are just freed (those calls are left with reply = NULL).  Any
+// other error gets thrown, after everything else has been cleaned up.
+void check_call_errors( DBusCall *calls, size_t n_calls )
 {
-	GVariant *temp_tva;
-	GError *error = NULL;
+	GError *first_error = NULL;
 
-	temp_tva = g_dbus_connection_call_sync(
-		conn,
-		NULL,                              // Bus name
-		path,                              // Path of object
-		"org.freedesktop.DBus.Properties", // Interface name
-		"Set",                             // Method name
-		g_variant_new("(ssv)",interface,get_method_name,input), // Params
-		NULL,                              // reply type
-		G_DBUS_CALL_FLAGS_NONE,
-		-1,                                // Timeout
-		NULL,                              // Cancellable
-		&error
-	);
-	throw_glib_errors(error);
+	for ( size_t i = 0; i < n_calls; i++ )
+	{
+		DBusCall & call = calls[i];
 
-	// Clean up
-	g_variant_unref(temp_tva);
+		if ( call.error == NULL )
+			continue;
+
+		if ( first_error == NULL and !object_vanished(call.error) )
+			first_error = call.error;
+		else
+			g_error_free(call.error);
+
+		call.error = NULL;
+	}
+
+	if ( first_error == NULL )
+		return;
+
+	for ( size_t i = 0; i < n_calls; i++ )
+	{
+		if ( calls[i].reply != NULL )
+			g_variant_unref(calls[i].reply);
+		calls[i].reply = NULL;
+	}
+
+	throw first_error;
+}
+
+//==============================================================================
+// Signals
+
+// Shared between listen_for_core_signals() and subscribe_core_signals()
+struct DBusSubscribeJob
+{
+	DBusPulseAudio *self;
+	mutex m;
+	condition_variable finished;
+	bool done;
+};
+
+//   Asks PulseAudio to tell us when clients and playback streams come and go,
+// so that the resolution cache can be kept up to date.  And, if anyone is
+// watching, when streams' volumes change.
+void DBusPulseAudio::listen_for_core_signals()
+{
+	static const char * const signal_names[] =
+	{
+		"org.PulseAudio.Core1.NewClient",
+		"org.PulseAudio.Core1.ClientRemoved",
+		"org.PulseAudio.Core1.NewPlaybackStream",
+		"org.PulseAudio.Core1.PlaybackStreamRemoved",
+		"org.PulseAudio.Core1.Stream.VolumeUpdated",
+	};
+
+	vector<DBusCall> calls;
+
+	for ( const char * signal_name : signal_names )
+	{
+		if ( strcmp(signal_name, "org.PulseAudio.Core1.Stream.VolumeUpdated") == 0 and !this->volume_callback )
+			continue;
+
+		DBusCall call;
+
+		call.path      = "/org/pulseaudio/core1";
+		call.interface = "org.PulseAudio.Core1";
+		call.method    = "ListenForSignal";
+		// An empty list of objects means "from any object"
+		call.params    = g_variant_new("(s@ao)", signal_name, g_variant_new_objv(NULL, 0));
+
+		calls.push_back(call);
+	}
+
+	this->call_all(calls);
+	check_call_errors(calls);
+
+	for ( DBusCall & call : calls )
+		if ( call.reply != NULL )
+			g_variant_unref(call.reply);
+
+	//   The callback gets dispatched in whatever the thread-default context is
+	// when we subscribe, so this has to be done on the DBus thread.  Wait for
+	// it, so that the cache doesn't get filled before we are listening.
+	DBusSubscribeJob job;
+	job.self = this;
+	job.done = false;
+
+	this->run_in_dbus_thread(&DBusPulseAudio::subscribe_core_signals, &job);
+
+	// As in call_all()
+	if ( g_main_context_is_owner(this->dbus_context) )
+	{
+		while ( !job.done )
+			g_main_context_iteration(this->dbus_context, TRUE);
+		return;
+	}
+
+	unique_lock<mutex> lock(job.m);
+	while ( !job.done )
+		job.finished.wait(lock);
+}
+
+// Runs on the DBus thread (see listen_for_core_signals())
+gboolean DBusPulseAudio::subscribe_core_signals( gpointer user_data )
+{
+	DBusSubscribeJob *job = static_cast<DBusSubscribeJob*>(user_data);
+	DBusPulseAudio *self = job->self;
+
+	guint id = g_dbus_connection_signal_subscribe(
+		self->pulse_conn,
+		NULL,                              // Sender (none on a peer-to-peer connection)
+		"org.PulseAudio.Core1",            // Interface name
+		NULL,                              // Signal name (all of them)
+		"/org/pulseaudio/core1",           // Path of object
+		NULL,                              // arg0
+		G_DBUS_SIGNAL_FLAGS_NONE,
+		&DBusPulseAudio::on_core_signal,
+		self,
+		NULL );
+	self->signal_subscriptions.push_back(id);
+
+	// Every stream's VolumeUpdated, from whichever object it is
+	if ( self->volume_callback )
+	{
+		id = g_dbus_connection_signal_subscribe(
+			self->pulse_conn,
+			NULL,
+			"org.PulseAudio.Core1.Stream",
+			"VolumeUpdated",
+			NULL,
+			NULL,
+			G_DBUS_SIGNAL_FLAGS_NONE,
+			&DBusPulseAudio::on_volume_updated,
+			self,
+			NULL );
+		self->signal_subscriptions.push_back(id);
+	}
+
+	lock_guard<mutex> lock(job->m);
+	job->done = true;
+	job->finished.notify_one();
+
+	return G_SOURCE_REMOVE;
+}
+
+void DBusPulseAudio::stop_listening_for_core_signals()
+{
+	for ( guint id : this->signal_subscriptions )
+		g_dbus_connection_signal_unsubscribe(this->pulse_conn, id);
+
+	this->signal_subscriptions.clear();
+}
+
+//   Called on the DBus thread for each signal from the core.  This just queues
+// the signal up, for update_cache() to deal with.
+void DBusPulseAudio::on_core_signal(
+	__attribute__((unused)) GDBusConnection *conn,
+	__attribute__((unused)) const gchar *sender_name,
+	__attribute__((unused)) const gchar *object_path,
+	__attribute__((unused)) const gchar *interface_name,
+	const gchar *signal_name,
+	GVariant *parameters,
+	gpointer user_data )
+{
+	DBusPulseAudio *self = static_cast<DBusPulseAudio*>(user_data);
+	const gchar *path;
+	CoreSignal sig;
+
+	if ( strcmp(signal_name, "NewClient") == 0 )
+		sig = NEW_CLIENT;
+	else if ( strcmp(signal_name, "ClientRemoved") == 0 )
+		sig = CLIENT_REMOVED;
+	else if ( strcmp(signal_name, "NewPlaybackStream") == 0 )
+		sig = NEW_PLAYBACK_STREAM;
+	else if ( strcmp(signal_name, "PlaybackStreamRemoved") == 0 )
+		sig = PLAYBACK_STREAM_REMOVED;
+	else
+		return;
+
+	g_variant_get(parameters, "(&o)", &path);
+
+	lock_guard<mutex> lock(self->pending_signals_mutex);
+	self->pending_signals.push_back(make_pair(sig, string(path)));
 }
 
+//   Called on the DBus thread when a stream's volume changes.  Unlike the core
+// signals, this doesn't need anything from PulseAudio, so it is passed
+// straight on.
+void DBusPulseAudio::on_volume_updated(
+	__attribute__((unused)) GDBusConnection *conn,
+	__attribute__((unused)) const gchar *sender_name,
+	const gchar *object_path,
+	__attribute__((unused)) const gchar *interface_name,
+	__attribute__((unused)) const gchar *signal_name,
+	GVariant *parameters,
+	gpointer user_data )
+{
+	DBusPulseAudio *self = static_cast<DBusPulseAudio*>(user_data);
+
+	GVariant *volumes_gv = g_variant_get_child_value(parameters, 0);
+	gsize n_channels;
+	const guint32 *volumes = static_cast<const guint32*>(g_variant_get_fixed_array(volumes_gv, &n_channels, sizeof(guint32)));
+
+	unsigned int volume = 0;
+	for ( gsize i = 0; i < n_channels; i++ )
+		volume = max(volume, (unsigned int)volumes[i]);
+
+	g_variant_unref(volumes_gv);
+
+	self->volume_callback(object_path, volume);
+}
+
+//==============================================================================
+// Converting GVariants
+
 // Note: this function deletes the GVariant input
 vector<string> gv_to_vs( GVariant *gv )
 {
@@ -218,229 +648,458 @@ vector<uint32_t> gv_to_vuint32( GVariant *gv )
 	return answer;
 }
 
+//   Makes an "au" with 'volume' for each of 'n_channels'.  The array is made
+// on the stack and copied straight into the GVariant, rather than going
+// through a GVariantBuilder (which allocates as it goes).
 // Note: this function creates a GVariant, that must be freed later
-GVariant *vuint32_to_gv( const vector<uint32_t> & vuint32 )
+GVariant *volume_to_gv( size_t n_channels, uint32_t volume )
 {
-	GVariantBuilder *builder;
-	GVariant *answer;
+	uint32_t volumes[DBUS_MAX_CHANNELS];
 
-	// Create a 'builder' object
-	builder = g_variant_builder_new(G_VARIANT_TYPE("au"));
+	n_channels = min(n_channels, (size_t)DBUS_MAX_CHANNELS);
+	for ( size_t i = 0; i < n_channels; i++ )
+		volumes[i] = volume;
 
-	// Add all of the values to the builder
-	for ( uint32_t u : vuint32 )
-		g_variant_builder_add(builder, "u", u);
+	return g_variant_new_fixed_array(G_VARIANT_TYPE_UINT32, volumes, n_channels, sizeof(uint32_t));
+}
+
+//   Picks the properties named in 'keys' out of a PulseAudio object's
+// properties (which is a dictionary of string -> array of bytes).  Nothing
+// else is copied: each key is compared where it lies in the GVariant, and a
+// wanted value is read in one go with g_variant_get_fixed_array().
+// Note: this function deletes the GVariant input
+map<string,string> gv_to_property_list( GVariant *gv_adsab, const vector<string> & keys )
+{
+	map<string,string> answer;
+	GVariantIter iter;
+	const gchar *key;
+	GVariant *data_gv;
+
+	g_variant_iter_init(&iter, gv_adsab);
+
+	// Stop as soon as everything has been found
+	while ( answer.size() < keys.size() and g_variant_iter_next(&iter, "{&s@ay}", &key, &data_gv) )
+	{
+		for ( const string & wanted : keys )
+		{
+			if ( strcmp(key, wanted.c_str()) != 0 )
+				continue;
+
+			gsize length;
+			const char *data = static_cast<const char*>(g_variant_get_fixed_array(data_gv, &length, 1));
 
-	// Convert the builder into an actual GVariant
-	answer = g_variant_new("au", builder);
+			// Do not include the trailing '\0'
+			if ( length > 0 and data[length-1] == '\0' )
+				length--;
+
+			answer[wanted].assign(data, length);
+			break;
+		}
+
+		g_variant_unref(data_gv);
+	}
 
 	// Clean up
-	g_variant_builder_unref(builder);
+	g_variant_unref(gv_adsab);
 
 	return answer;
 }
 
-// Gets all of the clients, and returns their DBus paths
-vector<string> DBusPulseAudio::get_clients( )
+//==============================================================================
+// The resolution cache
+
+//   Brings the cache up to date: either by fetching everything (the first
+// time, or after the connection was lost), or by applying whatever signals
+// have arrived since the last call.
+void DBusPulseAudio::update_cache()
 {
-	GVariant * gv = get_things_gv( this->pulse_conn, "Clients", "org.PulseAudio.Core1", "/org/pulseaudio/core1" );
-	return gv_to_vs(gv);
+	if ( !this->cache_valid )
+	{
+		this->rebuild_cache();
+		return;
+	}
+
+	vector< pair<CoreSignal,string> > signals;
+	{
+		lock_guard<mutex> lock(this->pending_signals_mutex);
+		signals.swap(this->pending_signals);
+	}
+
+	//   Deal with runs of the same signal together, so that whatever needs to
+	// be fetched for them is fetched all at once.
+	for ( size_t i = 0; i < signals.size(); )
+	{
+		vector<string> paths;
+		size_t j = i;
+
+		while ( j < signals.size() and signals[j].first == signals[i].first )
+			paths.push_back(signals[j++].second);
+
+		switch ( signals[i].first )
+		{
+			case NEW_CLIENT:
+				this->cache_add_clients(paths);
+				break;
+			case CLIENT_REMOVED:
+				for ( const string & p : paths )
+					this->cache_remove_client(p);
+				break;
+			case NEW_PLAYBACK_STREAM:
+				this->cache_add_streams(paths);
+				break;
+			case PLAYBACK_STREAM_REMOVED:
+				for ( const string & p : paths )
+					this->cache_remove_stream(p);
+				break;
+			default:
+				break;
+		}
+
+		i = j;
+	}
 }
 
-// Gets all of the sinks, and returns their DBus paths
-vector<string> DBusPulseAudio::get_sinks( )
+// Throws the cache away, and fills it again from scratch
+void DBusPulseAudio::rebuild_cache()
 {
-	GVariant * gv = get_things_gv( this->pulse_conn, "Sinks", "org.PulseAudio.Core1", "/org/pulseaudio/core1" );
-	return gv_to_vs(gv);
+	//   Anything which has been signalled so far will be picked up by the
+	// fetch below.  Anything signalled during the fetch will be applied
+	// (harmlessly, if it is a repeat) by the next update_cache().
+	this->invalidate_cache();
+
+	vector<DBusCall> calls;
+	calls.push_back(property_get_call("/org/pulseaudio/core1", "org.PulseAudio.Core1", "Clients"));
+	calls.push_back(property_get_call("/org/pulseaudio/core1", "org.PulseAudio.Core1", "PlaybackStreams"));
+
+	this->call_all(calls);
+	check_call_errors(calls);
+
+	vector<string> clients = gv_to_vs(take_property_value(calls[0]));
+	vector<string> streams = gv_to_vs(take_property_value(calls[1]));
+
+	this->cache_add_clients(clients);
+	this->cache_add_streams(streams);
+
+	logger.log(LOG_VERBOSE, "Resolution cache: %zu clients, %zu playback streams", this->clients_cache.size(), this->streams_cache.size());
+
+	this->cache_valid = true;
 }
 
-// Gets all of a clients playback streams, and returns their DBus paths
-vector<string> DBusPulseAudio::get_playback_streams( const char * path )
+void DBusPulseAudio::invalidate_cache()
 {
-	GVariant * gv = get_things_gv( this->pulse_conn, "PlaybackStreams", "org.PulseAudio.Core1.Client", path );
-	return gv_to_vs(gv);
+	this->cache_valid = false;
+	this->clients_cache.clear();
+	this->streams_cache.clear();
+	this->stream_index.clear_streams();
+
+	lock_guard<mutex> lock(this->pending_signals_mutex);
+	this->pending_signals.clear();
 }
 
-// Gets a stream's volume
-vector<uint32_t> DBusPulseAudio::get_volume( const char * path )
+// Fetches the properties of all of the clients (which we don't already know)
+void DBusPulseAudio::cache_add_clients( const vector<string> & client_paths )
 {
-	GVariant * gv = get_things_gv( this->pulse_conn, "Volume", "org.PulseAudio.Core1.Stream", path );
-	return gv_to_vuint32(gv);
+	vector<DBusCall> calls;
+
+	// We can hear about a client twice (e.g. by a signal and by a full fetch)
+	for ( const string & c : client_paths )
+		if ( this->clients_cache.count(c) == 0 )
+			calls.push_back(property_get_call(c, "org.PulseAudio.Core1.Client", "PropertyList"));
+
+	this->call_all(calls);
+	check_call_errors(calls);
+
+	for ( DBusCall & call : calls )
+	{
+		//   If the client has already gone again, then ClientRemoved will
+		// arrive (or has arrived), so just forget about it.
+		GVariant *gv = take_property_value(call);
+		if ( gv == NULL )
+			continue;
+
+		this->clients_cache[call.path].properties = gv_to_property_list(gv, this->stream_index.get_client_properties());
+	}
 }
 
-// Sets a stream's volume
-void DBusPulseAudio::set_volume( const char * path, const vector<uint32_t> & vols )
+void DBusPulseAudio::cache_remove_client( const string & client_path )
 {
-	GVariant * gv = vuint32_to_gv(vols);
-	set_things_gv( this->pulse_conn, "Volume", "org.PulseAudio.Core1.Stream", path, gv );
-	// Apparently you don't have to free 'gv', as it is already freed or something
+	auto it = this->clients_cache.find(client_path);
+
+	if ( it == this->clients_cache.end() )
+		return;
+
+	// Normally PlaybackStreamRemoved has already dealt with these
+	set<string> streams = it->second.streams;
+	for ( const string & s : streams )
+		this->cache_remove_stream(s);
+
+	this->clients_cache.erase(client_path);
 }
 
-// Get's a PulseAudio object's properties
-map<string,string> DBusPulseAudio::get_property_list( const char *interface, const char *path )
+//   Fetches the client and number of channels (and, if any rules match on
+// them, the properties) of all of the streams which we don't already know, and
+// adds them to the index.
+void DBusPulseAudio::cache_add_streams( const vector<string> & stream_paths )
 {
-	GVariant *gv_adsab;
-	map<string,string> answer;
+	vector<DBusCall> calls;
 
-	// Make the DBus call to get the data
-	gv_adsab = get_things_gv(this->pulse_conn, "PropertyList", interface, path);
+	const vector<string> & stream_properties = this->stream_index.get_stream_properties();
+	size_t calls_per_stream = stream_properties.empty() ? 2 : 3;
 
-	for ( size_t i = 0; i < g_variant_n_children(gv_adsab); i++ )
+	for ( const string & s : stream_paths )
 	{
-		GVariant *property, *key_gv, *data_gv;
-
-		property = g_variant_get_child_value(gv_adsab,i);
+		if ( this->streams_cache.count(s) )
+			continue;
+
+		calls.push_back(property_get_call(s, "org.PulseAudio.Core1.Stream", "Client"));
+		//   We keep the number of channels, so that setting the volume doesn't
+		// need a get_volume() first.
+		calls.push_back(property_get_call(s, "org.PulseAudio.Core1.Stream", "Volume"));
+		if ( calls_per_stream == 3 )
+			calls.push_back(property_get_call(s, "org.PulseAudio.Core1.Stream", "PropertyList"));
+	}
 
-		// Unpack the dictionary entry
-		string key, data;
+	this->call_all(calls);
 
-		if ( g_variant_n_children(property) != 2 )
+	//   Not every stream has a client, in which case PulseAudio replies with
+	// org.PulseAudio.Core1.NoSuchPropertyError.
+	for ( size_t i = 0; i < calls.size(); i += calls_per_stream )
+	{
+		GError *e = calls[i].error;
+		if ( e != NULL and e->domain == g_io_error_quark() and e->code == G_IO_ERROR_DBUS_ERROR )
 		{
-			cerr << current_time() << "ERROR: Property is a dictionary entry which does not have 2 children" << endl;
-			exit(1);
+			g_error_free(e);
+			calls[i].error = NULL;
 		}
+	}
+
+	check_call_errors(calls);
+
+	vector< pair<string,CachedStream> > new_streams;
+	vector<string> unknown_clients;
 
-		key_gv  = g_variant_get_child_value(property,0);
-		data_gv = g_variant_get_child_value(property,1);
+	for ( size_t i = 0; i < calls.size(); i += calls_per_stream )
+	{
+		CachedStream stream;
+		GVariant *client_gv = take_property_value(calls[i]);
+		GVariant *volume_gv = take_property_value(calls[i+1]);
+		GVariant *properties_gv = ( calls_per_stream == 3 ) ? take_property_value(calls[i+2]) : NULL;
 
-		// data_gv is an array of bytes, not a string, so decode that
-		// But do not include the trailing '\0'
-		for ( size_t j = 0; j < g_variant_n_children(data_gv) - 1; j++ )
+		if ( client_gv != NULL )
 		{
-			GVariant *byte_gv = g_variant_get_child_value(data_gv, j);
-			data.append(1, g_variant_get_byte(byte_gv));
-			g_variant_unref(byte_gv);
+			stream.client = g_variant_get_string(client_gv, NULL);
+			g_variant_unref(client_gv);
 		}
 
-		key  = g_variant_get_string(key_gv, NULL);
+		if ( properties_gv != NULL )
+			stream.properties = gv_to_property_list(properties_gv, stream_properties);
 
-		answer[key] = data;
+		// The stream has already gone again
+		if ( volume_gv == NULL )
+			continue;
 
-		// Clean up
-		g_variant_unref(key_gv);
-		g_variant_unref(data_gv);
-		g_variant_unref(property);
+		stream.n_channels = gv_to_vuint32(volume_gv).size();
+
+		//   The stream's client should already be known, but maybe we haven't
+		// processed its signal yet.
+		if ( stream.client != "" and this->clients_cache.count(stream.client) == 0 )
+			unknown_clients.push_back(stream.client);
+
+		new_streams.push_back(make_pair(calls[i].path, stream));
 	}
 
-	// Clean up
-	g_variant_unref(gv_adsab);
+	this->cache_add_clients(unknown_clients);
 
-	return answer;
+	for ( const auto & s : new_streams )
+	{
+		const map<string,string> *client_properties = NULL;
+
+		auto it = this->clients_cache.find(s.second.client);
+		if ( it != this->clients_cache.end() )
+		{
+			it->second.streams.insert(s.first);
+			client_properties = &it->second.properties;
+		}
+
+		this->stream_index.add_stream(s.first, client_properties, &s.second.properties);
+		this->streams_cache[s.first] = s.second;
+	}
 }
 
+void DBusPulseAudio::cache_remove_stream( const string & stream_path )
+{
+	auto it = this->streams_cache.find(stream_path);
+
+	if ( it == this->streams_cache.end() )
+		return;
+
+	auto client_it = this->clients_cache.find(it->second.client);
+	if ( client_it != this->clients_cache.end() )
+		client_it->second.streams.erase(stream_path);
+
+	this->stream_index.remove_stream(stream_path);
+	this->streams_cache.erase(it);
+}
+
+//   Called when we find out that the connection to PulseAudio has gone away.
+// Everything we know about it is now stale.  (The DBus thread keeps running,
+// ready for the next connection.)
+void DBusPulseAudio::connection_closed()
+{
+	this->stop_listening_for_core_signals();
+	this->invalidate_cache();
+
+	g_object_unref(this->pulse_conn);
+	this->conn_open = false;
+}
+
+//==============================================================================
+
 //   This may fail, if there is no connection to pulseaudio, but it will not
 // crash the prgoram.
-void DBusPulseAudio::set_client_volume( unsigned int vol_in, const char *prop_name, const char *prop_val )
+bool DBusPulseAudio::resolve( const PropertyMatch & match, StreamList & streams )
 {
-	vector<string> clients, mpd_stream_paths;
-
 	if ( this->conn_open == false )
 	{
 		// Attempt to re-open the connection
 		if ( !this->connect() )
 		{
-			if (arguments.verbose)
-				cerr << current_time() << "DBusPulseAudio::set_client_volume(): the connection is closed" << endl;
-			return;
+			logger.log(LOG_VERBOSE, "DBusPulseAudio::resolve(): the connection is closed");
+			return false;
 		}
 	}
 
 	try
 	{
-		// Get the pulse clients
-		clients = this->get_clients();
+		//   The cache only keeps the properties which have been asked about.
+		// A new one means fetching everything again (just this once).
+		if ( this->stream_index.index_property(match) )
+			this->cache_valid = false;
 
-		// Go through each client
-		for ( const string & c : clients )
-		{
-			map<string,string> properties = this->get_property_list("org.PulseAudio.Core1.Client", c.c_str() );
+		// Apply any client/stream changes which PulseAudio has told us about
+		this->update_cache();
 
-			if ( properties.find(prop_name) != properties.end() and properties[prop_name] == (string)prop_val )
-				for ( const string & path : this->get_playback_streams( c.c_str() ) )
-					mpd_stream_paths.push_back(path);
-		}
+		this->stream_index.find(match, streams);
+	}
+	catch ( GError * e )
+	{
+		this->handle_volume_error(e);
+	}
+
+	return this->conn_open;
+}
+
+void DBusPulseAudio::set_volumes( const VolumeWrites & writes, const WriteOrigins & origins )
+{
+	if ( writes.empty() or this->conn_open == false )
+		return;
 
-		// Go through each stream and set the volume
-		for ( const string & stream_path : mpd_stream_paths )
+	try
+	{
+		//   Streams which have gone since they were resolved are dropped from
+		// the cache here.
+		this->update_cache();
+
+		ReusableVector<DBusCall> & calls = this->volume_calls;
+		calls.clear();
+		this->volume_call_writes.clear();
+
+		for ( size_t i = 0; i < writes.size(); i++ )
 		{
+			const pair<string,unsigned int> & write = writes[i];
+
+			auto stream_it = this->streams_cache.find(write.first);
+			if ( stream_it == this->streams_cache.end() )
+				continue;
+
 			// Note that the maximum volume is supposedly 65535
-			vector<uint32_t> old_vols, new_vols;
+			set_property_set_call(calls.append(), write.first, "org.PulseAudio.Core1.Stream", "Volume",
+			                      volume_to_gv(stream_it->second.n_channels, write.second));
+			this->volume_call_writes.push_back(i);
+		}
 
-			old_vols = this->get_volume( stream_path.c_str() );
+		this->call_all(calls.data(), calls.size());
 
-			new_vols = old_vols;
-			for ( uint32_t & v : new_vols )
-				v = vol_in;
+		//   If a stream has gone, but we haven't processed its signal yet,
+		// that isn't an error.
+		check_call_errors(calls.data(), calls.size());
 
-			this->set_volume( stream_path.c_str(), new_vols );
-		}
+		for ( size_t c = 0; c < calls.size(); c++ )
+			if ( calls[c].reply != NULL )
+			{
+				event_tracer.dbus_call_finished(calls[c].finished_ns, origins[this->volume_call_writes[c]]);
+				g_variant_unref(calls[c].reply);
+			}
 	}
 	catch ( GError * e )
 	{
-		if ( e->domain == g_dbus_error_quark() and
-		     e->code == G_DBUS_ERROR_UNKNOWN_METHOD )
-		// "GDBus.Error:org.freedesktop.DBus.Error.UnknownMethod"
-		// This is the error that occurs when a pulseaudio client
-		// disappears half way through set_pulse_client_volume()
-		{
-			//   Silently ignore this, because it's not really an error.  It's
-			// just the same outcome as if zero instances of the client were
-			// running in the first place.
-			g_error_free(e);
-		}
-		else if ( e->domain == g_io_error_quark() and
-		          e->code == G_IO_ERROR_CLOSED )
-		// "The connection is closed"
-		// This happens when we kill pulseaudio while tty_pulse is running
-		{
-			if ( !arguments.silent )
-				cerr << current_time() << "Pulseaudio connection has closed" << endl;
-			g_error_free(e);
-			this->conn_open = false;
-		}
-		else if ( e->domain == g_io_error_quark() and
-		          e->code == G_IO_ERROR_TIMED_OUT )
-		// "Timeout was reached"
-		/// Not sure what is causing this
-		{
-			if ( !arguments.silent )
-			{
-				cerr << current_time() << "a weird GError: " << endl;
-				cerr << "error->message: " << e->message << endl;
-				cerr << "error->domain:  g_io_error_quark() = " << e->domain << endl;
-				cerr << "error->code:    " << e->code << endl;
-				g_error_free(e);
-
-				/// Not sure if we should close the connection
-//				this->conn_open = false;
-			}
-		}
-		else if ( e->domain == g_dbus_error_quark() )
-		// Other GDBUus errors
-		{
-			cerr << current_time() << "Unhandled GError: " << endl;
-			cerr << "error->message: " << e->message << endl;
-			cerr << "error->domain:  g_dbus_error_quark()" << endl;
-			cerr << "error->code:    " << e->code << endl;
-			throw e;
-		}
-		else if ( e->domain == g_io_error_quark() )
-		// Other GIO errors
-		{
-			cerr << current_time() << "Unhandled GError: " << endl;
-			cerr << "error->message: " << e->message << endl;
-			cerr << "error->domain:  g_io_error_quark()" << endl;
-			cerr << "error->code:    " << e->code << endl;
-			throw e;
-		}
-		else
+		this->handle_volume_error(e);
+	}
+}
+
+string DBusPulseAudio::get_stats() const
+{
+	return "DBus: " + to_string(this->get_call_count()) + " calls, at most " + to_string(this->get_max_calls_in_flight()) + " in flight at once";
+}
+
+//   Deals with an error from setting volumes.  Anything we don't know how to
+// deal with gets thrown again.
+void DBusPulseAudio::handle_volume_error( GError *e )
+{
+	if ( e->domain == g_dbus_error_quark() and
+	     e->code == G_DBUS_ERROR_UNKNOWN_METHOD )
+	// "GDBus.Error:org.freedesktop.DBus.Error.UnknownMethod"
+	// This is the error that occurs when a pulseaudio client
+	// disappears half way through set_pulse_client_volume()
+	{
+		//   Silently ignore this, because it's not really an error.  It's
+		// just the same outcome as if zero instances of the client were
+		// running in the first place.
+		g_error_free(e);
+	}
+	else if ( e->domain == g_io_error_quark() and
+	          e->code == G_IO_ERROR_CLOSED )
+	// "The connection is closed"
+	// This happens when we kill pulseaudio while tty_pulse is running
+	{
+		logger.log(LOG_INFO, "Pulseaudio connection has closed");
+		g_error_free(e);
+		this->connection_closed();
+	}
+	else if ( e->domain == g_io_error_quark() and
+	          e->code == G_IO_ERROR_TIMED_OUT )
+	// "Timeout was reached"
+	/// Not sure what is causing this
+	{
+		if ( !arguments.silent )
 		{
-			cerr << current_time() << "Unhandled GError: " << endl;
-			cerr << "error->message: " << e->message << endl;
-			cerr << "error->domain:  " << e->domain << endl;
-			cerr << "error->code:    " << e->code << endl;
-			throw e;
+			logger.log(LOG_ERROR, "A weird GError: %s (domain %u, code %d)",
+			           e->message, e->domain, e->code);
 		}
+		g_error_free(e);
+
+		/// Not sure if we should close the connection
+//		this->conn_open = false;
+	}
+	else if ( e->domain == g_dbus_error_quark() )
+	// Other GDBUus errors
+	{
+		logger.log(LOG_ERROR, "Unhandled GDBus error: %s (domain %u, code %d)",
+		           e->message, e->domain, e->code);
+		throw e;
+	}
+	else if ( e->domain == g_io_error_quark() )
+	// Other GIO errors
+	{
+		logger.log(LOG_ERROR, "Unhandled GIO error: %s (domain %u, code %d)",
+		           e->message, e->domain, e->code);
+		throw e;
+	}
+	else
+	{
+		logger.log(LOG_ERROR, "Unhandled GError: %s (domain %u, code %d)",
+		           e->message, e->domain, e->code);
+		throw e;
 	}
 }
 
@@ -450,10 +1109,17 @@ void DBusPulseAudio::disconnect()
 	{
 		GError *error = nullptr;
 
+		this->stop_listening_for_core_signals();
+		this->invalidate_cache();
+
 		g_dbus_connection_close_sync(this->pulse_conn, nullptr, &error );
 		g_object_unref(this->pulse_conn);
-		throw_glib_errors(error);
-
 		this->conn_open = false;
+
+		this->stop_dbus_thread();
+
+		throw_glib_errors(error);
 	}
+
+	this->stop_dbus_thread();
 }
@@ -21,14 +21,39 @@
 #define PULSE_DBUS_HH
 
 #include "arguments.hh"
+#include "event_loop.hh"
+#include "volume_backend.hh"
 
+#include <atomic>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
 #include <gio/gio.h>		// for g_dbus_*
 
 void throw_glib_errors( GError *e );
 
-struct DBusPulseAudio
+struct DBusCallBatch;
+
+//   A single DBus method call.  These are sent in batches by
+// DBusPulseAudio::call_all(), which fills in 'reply' or 'error'.
+struct DBusCall
+{
+	std::string path;
+	const char *interface;
+	const char *method;
+	GVariant *params;       // Floating reference, which gets used up by the call
+	GVariant *reply;        // Must be unref'd (if not NULL)
+	GError *error;          // Must be freed (if not NULL)
+	uint64_t finished_ns;   // When the reply (or error) arrived (see monotonic_ns())
+	DBusCallBatch *batch;   // Only used while the call is in flight
+};
+
+//   Talks to PulseAudio through module-dbus-protocol.  Stream IDs are the
+// streams' object paths.
+struct DBusPulseAudio : VolumeBackend
 {
 	const Arguments arguments;
 
@@ -36,33 +61,127 @@ struct DBusPulseAudio
 	arguments(args_in)
 	{ }
 
-	bool connect();
+	//   Makes 'loop' dispatch the DBus replies and signals, on whichever thread
+	// runs it, rather than a thread of our own.  Call this from that thread,
+	// before connect().
+	void use_event_loop( EventLoop & loop );
+
+	virtual bool connect();
+	virtual void disconnect();
+
+	virtual bool resolve( const PropertyMatch & match, StreamList & streams );
+	virtual void set_volumes( const VolumeWrites & writes, const WriteOrigins & origins );
 
-	void set_client_volume( unsigned int vol_in, const char *prop_name, const char *prop_val );
+	virtual std::string get_stats() const;
 
-	void disconnect();
+	// Counters
+	unsigned long get_call_count() const { return call_count.load(std::memory_order_relaxed); }
+	size_t get_max_calls_in_flight() const { return max_calls_in_flight.load(std::memory_order_relaxed); }
 
 private:
 	bool conn_open = false;
+	bool ever_connected = false;    // So that connecting again counts as a reconnect
 
 	GDBusConnection *pulse_conn;
 
-	std::vector<std::string> get_clients( );
-
-	std::vector<std::string> get_sinks( );
-
-	std::vector<std::string> get_playback_streams(
-		const char * path );
-
-	std::vector<uint32_t> get_volume( const char * path );
-
-	void set_volume(
-		const char * path,
-		const std::vector<uint32_t> & vols );
-
-	std::map<std::string,std::string> get_property_list(
-		const char *interface,
-		const char *path );
+	//   All of the DBus replies and signals are dispatched by this context,
+	// which runs in its own thread (or in 'event_loop', if there is one).  This
+	// means we can send lots of calls at once, and then wait for all of the
+	// replies together, rather than waiting for each reply before sending the
+	// next call.
+	GMainContext *dbus_context = nullptr;
+	GMainLoop *dbus_loop = nullptr;
+	std::thread dbus_thread;
+	EventLoop *event_loop = nullptr;
+
+	std::atomic<unsigned long> call_count{0};
+	std::atomic<size_t> max_calls_in_flight{0};
+
+	void start_dbus_thread();
+	void stop_dbus_thread();
+	void dbus_thread_main();
+	void run_in_dbus_thread( GSourceFunc func, gpointer data );
+
+	void call_all( DBusCall *calls, size_t n_calls );
+	void call_all( std::vector<DBusCall> & calls ) { call_all(calls.data(), calls.size()); }
+
+	//   set_volumes()'s calls, kept (paths and all) so that it doesn't have to
+	// allocate them each time
+	ReusableVector<DBusCall> volume_calls;
+	ReusableVector<size_t> volume_call_writes;    // Which write each call is for
+
+	void handle_volume_error( GError *e );
+
+	//   The resolution cache.  Rather than asking PulseAudio about every client
+	// on each fader event, we fetch everything once and then keep it current
+	// using the core's NewClient/ClientRemoved/NewPlaybackStream/
+	// PlaybackStreamRemoved signals.
+	struct CachedClient
+	{
+		std::map<std::string,std::string> properties;   // Only the indexed ones
+		std::set<std::string> streams;
+	};
+
+	//   A stream's own properties are fetched once, when it appears.  (The
+	// native protocol hears about them changing, but this doesn't.)
+	struct CachedStream
+	{
+		std::string client;     // "" if the stream has no client
+		size_t n_channels;
+		std::map<std::string,std::string> properties;   // Only the indexed ones
+	};
+
+	enum CoreSignal
+	{
+		NEW_CLIENT,
+		CLIENT_REMOVED,
+		NEW_PLAYBACK_STREAM,
+		PLAYBACK_STREAM_REMOVED
+	};
+
+	//   Signals arrive on the DBus thread.  The callback only queues them up in
+	// 'pending_signals' (hence the mutex); it doesn't talk to PulseAudio.
+	std::vector<guint> signal_subscriptions;
+	std::mutex pending_signals_mutex;
+	std::vector< std::pair<CoreSignal,std::string> > pending_signals;
+
+	bool cache_valid = false;
+	std::map<std::string,CachedClient> clients_cache;
+	std::map<std::string,CachedStream> streams_cache;
+	//   Stream paths by the properties which resolve() has been asked to match
+	// on.  (The caches only keep those properties.)
+	StreamIndex stream_index;
+
+	static void on_core_signal(
+		GDBusConnection *conn,
+		const gchar *sender_name,
+		const gchar *object_path,
+		const gchar *interface_name,
+		const gchar *signal_name,
+		GVariant *parameters,
+		gpointer user_data );
+
+	static void on_volume_updated(
+		GDBusConnection *conn,
+		const gchar *sender_name,
+		const gchar *object_path,
+		const gchar *interface_name,
+		const gchar *signal_name,
+		GVariant *parameters,
+		gpointer user_data );
+
+	static gboolean subscribe_core_signals( gpointer user_data );
+
+	void listen_for_core_signals();
+	void stop_listening_for_core_signals();
+	void update_cache();
+	void rebuild_cache();
+	void invalidate_cache();
+	void cache_add_clients( const std::vector<std::string> & client_paths );
+	void cache_remove_client( const std::string & client_path );
+	void cache_add_streams( const std::vector<std::string> & stream_paths );
+	void cache_remove_stream( const std::string & stream_path );
+	void connection_closed();
 };
 
 #endif  // PULSE_DBUS_HH
@@ -0,0 +1,403 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pulse_native.hh"
+#include "event_trace.hh"
+#include "logger.hh"
+#include "metrics.hh"
+
+#include <algorithm>
+#include <cstdlib>
+
+using namespace std;
+
+// Properties which aren't strings can't be matched anyway
+static map<string,string> string_properties( const pa_proplist *proplist )
+{
+	map<string,string> answer;
+
+	void *state = NULL;
+	const char *key;
+	while ( ( key = pa_proplist_iterate(proplist, &state) ) != NULL )
+	{
+		const char *value = pa_proplist_gets(proplist, key);
+		if ( value != NULL )
+			answer[key] = value;
+	}
+
+	return answer;
+}
+
+//==============================================================================
+// Callbacks.  These are all called on libpulse's thread, with the mainloop
+// locked.
+
+void NativePulseAudio::on_context_state( pa_context *c, void *userdata )
+{
+	NativePulseAudio *self = (NativePulseAudio *)userdata;
+	pa_context_state_t state = pa_context_get_state(c);
+
+	if ( !PA_CONTEXT_IS_GOOD(state) and self->connected )
+	{
+		logger.log(LOG_INFO, "Pulseaudio connection has closed");
+		self->connected = false;
+	}
+
+	// Whoever is waiting (connect(), or for an operation) should look again
+	if ( state == PA_CONTEXT_READY or !PA_CONTEXT_IS_GOOD(state) )
+		pa_threaded_mainloop_signal(self->mainloop, 0);
+}
+
+//   Something has happened to a client or sink input.  Anything new (or
+// changed) has to be asked about, and we find out about it later on, in
+// on_client_info() or on_sink_input_info().
+void NativePulseAudio::on_subscription( pa_context *c, pa_subscription_event_type_t type, uint32_t index, void *userdata )
+{
+	NativePulseAudio *self = (NativePulseAudio *)userdata;
+
+	unsigned int facility = type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+	bool removed = ( type & PA_SUBSCRIPTION_EVENT_TYPE_MASK ) == PA_SUBSCRIPTION_EVENT_REMOVE;
+	pa_operation *op = NULL;
+
+	if ( facility == PA_SUBSCRIPTION_EVENT_CLIENT )
+	{
+		if ( removed )
+		{
+			self->clients.erase(index);
+			self->index_sink_inputs_of(index);
+		}
+		else
+			op = pa_context_get_client_info(c, index, on_client_info, self);
+	}
+	else if ( facility == PA_SUBSCRIPTION_EVENT_SINK_INPUT )
+	{
+		if ( removed )
+		{
+			self->sink_inputs.erase(index);
+			self->stream_index.remove_stream(to_string(index));
+		}
+		else
+			op = pa_context_get_sink_input_info(c, index, on_sink_input_info, self);
+	}
+
+	if ( op != NULL )
+		pa_operation_unref(op);
+}
+
+//   Called once per client, and then with eol != 0 at the end.  (eol < 0 means
+// it failed, e.g. because the client had already gone.)
+void NativePulseAudio::on_client_info( pa_context *, const pa_client_info *info, int eol, void *userdata )
+{
+	NativePulseAudio *self = (NativePulseAudio *)userdata;
+
+	if ( eol != 0 or info == NULL )
+	{
+		pa_threaded_mainloop_signal(self->mainloop, 0);
+		return;
+	}
+
+	map<string,string> properties = string_properties(info->proplist);
+
+	//   Clients change quite often, but their streams only need indexing again
+	// if their properties have.
+	CachedClient & client = self->clients[info->index];
+	if ( client.properties != properties )
+	{
+		client.properties.swap(properties);
+		self->index_sink_inputs_of(info->index);
+	}
+}
+
+void NativePulseAudio::on_sink_input_info( pa_context *, const pa_sink_input_info *info, int eol, void *userdata )
+{
+	NativePulseAudio *self = (NativePulseAudio *)userdata;
+
+	if ( eol != 0 or info == NULL )
+	{
+		pa_threaded_mainloop_signal(self->mainloop, 0);
+		return;
+	}
+
+	map<string,string> properties = string_properties(info->proplist);
+
+	//   Every volume we set comes back to us as a change, so only index it
+	// again if it's a new sink input, or its properties (e.g. media.name, on
+	// the next track) or client have changed.
+	auto it = self->sink_inputs.find(info->index);
+	bool changed = it == self->sink_inputs.end() or it->second.client != info->client or it->second.properties != properties;
+
+	CachedSinkInput & sink_input = self->sink_inputs[info->index];
+	sink_input.n_channels = info->volume.channels;
+
+	//   A new sink input's volume isn't a change, but anything after that is
+	// (including the ones we set: whoever is watching sorts those out).
+	pa_volume_t volume = pa_cvolume_max(&info->volume);
+	if ( it != self->sink_inputs.end() and sink_input.volume != volume and self->volume_callback )
+		self->volume_callback(to_string(info->index), volume);
+	sink_input.volume = volume;
+
+	if ( changed )
+	{
+		sink_input.client = info->client;
+		sink_input.properties.swap(properties);
+		self->index_sink_input(info->index, sink_input);
+	}
+}
+
+void NativePulseAudio::on_success( pa_context *, int, void *userdata )
+{
+	NativePulseAudio *self = (NativePulseAudio *)userdata;
+	pa_threaded_mainloop_signal(self->mainloop, 0);
+}
+
+void NativePulseAudio::on_volume_set( pa_context *, int success, void *userdata )
+{
+	NativeVolumeRequest *request = (NativeVolumeRequest *)userdata;
+
+	if ( success )
+		request->finished_ns = monotonic_ns();
+
+	pa_threaded_mainloop_signal(request->mainloop, 0);
+}
+
+//==============================================================================
+
+//   Waits for 'op' to finish (or be cancelled, because the connection has
+// gone), and unrefs it.  The mainloop must be locked.  Returns false if it
+// didn't complete.
+bool NativePulseAudio::wait_for( pa_operation *op )
+{
+	if ( op == NULL )
+		return false;
+
+	while ( pa_operation_get_state(op) == PA_OPERATION_RUNNING )
+		pa_threaded_mainloop_wait(this->mainloop);
+
+	bool done = pa_operation_get_state(op) == PA_OPERATION_DONE;
+	pa_operation_unref(op);
+
+	return done;
+}
+
+// Connects to PulseAudio, with its native protocol
+bool NativePulseAudio::connect()
+{
+	if ( this->connected )
+	{
+		logger.log(LOG_INFO, "ERROR: NativePulseAudio::connect(): Connection already open");
+		return true;
+	}
+
+	// Clear up after a connection which has gone
+	this->disconnect();
+
+	this->mainloop = pa_threaded_mainloop_new();
+	this->context = pa_context_new(pa_threaded_mainloop_get_api(this->mainloop), "ttymidi_pulse");
+
+	pa_context_set_state_callback(this->context, on_context_state, this);
+	pa_context_set_subscribe_callback(this->context, on_subscription, this);
+
+	if ( pa_threaded_mainloop_start(this->mainloop) < 0 )
+	{
+		logger.log(LOG_ERROR, "NativePulseAudio::connect(): unable to start libpulse's thread");
+		this->disconnect();
+		return false;
+	}
+
+	pa_threaded_mainloop_lock(this->mainloop);
+
+	// NULL = the default server (e.g. $PULSE_SERVER)
+	bool ok = pa_context_connect(this->context, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL) >= 0;
+
+	while ( ok )
+	{
+		pa_context_state_t state = pa_context_get_state(this->context);
+
+		if ( state == PA_CONTEXT_READY )
+			break;
+		if ( !PA_CONTEXT_IS_GOOD(state) )
+			ok = false;
+		else
+			pa_threaded_mainloop_wait(this->mainloop);
+	}
+
+	if ( !ok )
+	{
+		logger.log(LOG_VERBOSE, "Unable to connect to PulseAudio: %s", pa_strerror(pa_context_errno(this->context)));
+
+		pa_threaded_mainloop_unlock(this->mainloop);
+		this->disconnect();
+		return false;
+	}
+
+	this->connected = true;
+
+	if ( this->ever_connected )
+		metrics.add(METRIC_BACKEND_RECONNECTS);
+	this->ever_connected = true;
+
+	logger.log(LOG_INFO, "Connected to PulseAudio: %s", pa_context_get_server(this->context));
+
+	//   Subscribe before the cache gets filled, so that nothing can happen in
+	// between the two which we don't hear about.
+	ok = this->wait_for(pa_context_subscribe(this->context, (pa_subscription_mask_t)(PA_SUBSCRIPTION_MASK_CLIENT | PA_SUBSCRIPTION_MASK_SINK_INPUT), on_success, this)) and
+	     this->wait_for(pa_context_get_client_info_list(this->context, on_client_info, this)) and
+	     this->wait_for(pa_context_get_sink_input_info_list(this->context, on_sink_input_info, this));
+
+	pa_threaded_mainloop_unlock(this->mainloop);
+
+	if ( !ok )
+	{
+		logger.log(LOG_INFO, "Unable to get the clients and sink inputs from PulseAudio");
+		this->disconnect();
+		return false;
+	}
+
+	return true;
+}
+
+void NativePulseAudio::disconnect()
+{
+	// This waits for libpulse's thread to finish, so it mustn't be locked
+	if ( this->mainloop != NULL )
+		pa_threaded_mainloop_stop(this->mainloop);
+
+	if ( this->context != NULL )
+	{
+		pa_context_disconnect(this->context);
+		pa_context_unref(this->context);
+		this->context = NULL;
+	}
+
+	if ( this->mainloop != NULL )
+	{
+		pa_threaded_mainloop_free(this->mainloop);
+		this->mainloop = NULL;
+	}
+
+	this->connected = false;
+
+	this->clients.clear();
+	this->sink_inputs.clear();
+	this->stream_index.clear_streams();
+}
+
+//==============================================================================
+
+// These need the mainloop to be locked
+void NativePulseAudio::index_sink_input( uint32_t sink_input_index, const CachedSinkInput & sink_input )
+{
+	auto client_it = this->clients.find(sink_input.client);
+	const map<string,string> *client_properties = ( client_it == this->clients.end() ) ? NULL : &client_it->second.properties;
+
+	this->stream_index.add_stream(to_string(sink_input_index), client_properties, &sink_input.properties);
+}
+
+void NativePulseAudio::index_sink_inputs_of( uint32_t client_index )
+{
+	for ( const auto & sink_input : this->sink_inputs )
+		if ( sink_input.second.client == client_index )
+			this->index_sink_input(sink_input.first, sink_input.second);
+}
+
+//   This may fail, if there is no connection to pulseaudio, but it will not
+// crash the program.
+bool NativePulseAudio::resolve( const PropertyMatch & match, StreamList & streams )
+{
+	if ( !this->connected )
+	{
+		// Attempt to re-open the connection
+		if ( !this->connect() )
+		{
+			logger.log(LOG_VERBOSE, "NativePulseAudio::resolve(): the connection is closed");
+			return false;
+		}
+	}
+
+	pa_threaded_mainloop_lock(this->mainloop);
+
+	//   The index only has the properties which have been asked about.  A new
+	// one means putting every sink input in again (just this once).
+	if ( this->stream_index.index_property(match) )
+		for ( const auto & sink_input : this->sink_inputs )
+			this->index_sink_input(sink_input.first, sink_input.second);
+
+	this->stream_index.find(match, streams);
+
+	pa_threaded_mainloop_unlock(this->mainloop);
+
+	return this->connected;
+}
+
+void NativePulseAudio::set_volumes( const VolumeWrites & writes, const WriteOrigins & origins )
+{
+	if ( writes.empty() or !this->connected )
+		return;
+
+	//   These keep their capacity from one call to the next, so this only
+	// allocates when there are more writes than ever before.  The callbacks
+	// point into 'requests', so it mustn't be resized once they start.
+	vector<NativeVolumeRequest> & requests = this->volume_requests;
+	vector<pa_operation *> & ops = this->volume_ops;
+	requests.assign(writes.size(), NativeVolumeRequest());
+	ops.clear();
+
+	pa_threaded_mainloop_lock(this->mainloop);
+
+	for ( size_t i = 0; i < writes.size(); i++ )
+	{
+		uint32_t index = (uint32_t)strtoul(writes[i].first.c_str(), NULL, 10);
+
+		auto it = this->sink_inputs.find(index);
+		if ( it == this->sink_inputs.end() )
+			continue;
+
+		//   PulseAudio's volumes are the same scale as DBus's (65536 = 100%),
+		// because that's where DBus's come from.
+		pa_cvolume volume;
+		pa_cvolume_set(&volume, it->second.n_channels, (pa_volume_t)writes[i].second);
+
+		requests[i].mainloop = this->mainloop;
+		requests[i].finished_ns = 0;
+
+		pa_operation *op = pa_context_set_sink_input_volume(this->context, index, &volume, on_volume_set, &requests[i]);
+		if ( op != NULL )
+			ops.push_back(op);
+	}
+
+	this->request_count.fetch_add(ops.size(), memory_order_relaxed);
+	if ( ops.size() > this->max_requests_in_flight.load(memory_order_relaxed) )
+		this->max_requests_in_flight.store(ops.size(), memory_order_relaxed);
+
+	//   A sink input which has gone since it was resolved just fails, which
+	// isn't an error.
+	for ( pa_operation *op : ops )
+		this->wait_for(op);
+
+	pa_threaded_mainloop_unlock(this->mainloop);
+
+	for ( size_t i = 0; i < requests.size(); i++ )
+		event_tracer.dbus_call_finished(requests[i].finished_ns, origins[i]);
+}
+
+string NativePulseAudio::get_stats() const
+{
+	return "PulseAudio (native): " + to_string(this->request_count.load(memory_order_relaxed)) + " volume requests, at most " +
+	       to_string(this->max_requests_in_flight.load(memory_order_relaxed)) + " in flight at once";
+}
@@ -0,0 +1,117 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PULSE_NATIVE_HH
+#define PULSE_NATIVE_HH
+
+#include "arguments.hh"
+#include "volume_backend.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <pulse/pulseaudio.h>
+
+//   A volume request which is in flight.  Its callback fills in the rest.
+struct NativeVolumeRequest
+{
+	pa_threaded_mainloop *mainloop;
+	uint64_t finished_ns;     // 0 = it failed (e.g. the sink input had gone)
+};
+
+//   Talks to PulseAudio over its own (native) protocol, using libpulse, rather
+// than through module-dbus-protocol.  So it works without that module, and
+// with pipewire-pulse.  Stream IDs are sink input indexes.
+//   libpulse runs in its own thread (a pa_threaded_mainloop), which keeps a
+// cache of the clients and sink inputs up to date from PulseAudio's
+// subscription events.  So resolve() doesn't have to ask PulseAudio anything,
+// and setting the volumes is one request per sink input, all sent at once.
+struct NativePulseAudio : VolumeBackend
+{
+	const Arguments arguments;
+
+	NativePulseAudio( const Arguments & args_in ) :
+	arguments(args_in), mainloop(nullptr), context(nullptr), connected(false), ever_connected(false),
+	request_count(0), max_requests_in_flight(0)
+	{ }
+
+	virtual ~NativePulseAudio() { this->disconnect(); }
+
+	virtual bool connect();
+	virtual void disconnect();
+
+	virtual bool resolve( const PropertyMatch & match, StreamList & streams );
+	virtual void set_volumes( const VolumeWrites & writes, const WriteOrigins & origins );
+
+	virtual std::string get_stats() const;
+
+private:
+	pa_threaded_mainloop *mainloop;
+	pa_context *context;
+
+	// Cleared (by the mainloop's thread) if the connection goes
+	std::atomic<bool> connected;
+	bool ever_connected;    // So that connecting again counts as a reconnect
+
+	//   Everything below here is only touched with the mainloop locked.  (The
+	// callbacks are called with it locked.)
+	struct CachedClient
+	{
+		std::map<std::string,std::string> properties;
+	};
+
+	struct CachedSinkInput
+	{
+		uint32_t client;        // PA_INVALID_INDEX if it has no client
+		uint8_t n_channels;
+		pa_volume_t volume;     // The loudest channel's
+		std::map<std::string,std::string> properties;
+	};
+
+	std::map<uint32_t,CachedClient> clients;
+	std::map<uint32_t,CachedSinkInput> sink_inputs;
+
+	//   Sink input IDs by the properties which resolve() has been asked about.
+	// Sink inputs are put in (again) whenever they, or their client's
+	// properties, change.
+	StreamIndex stream_index;
+
+	std::atomic<unsigned long> request_count;
+	std::atomic<size_t> max_requests_in_flight;
+
+	// Only used by set_volumes(), but kept to save allocating
+	std::vector<NativeVolumeRequest> volume_requests;
+	std::vector<pa_operation *> volume_ops;
+
+	bool wait_for( pa_operation *op );
+	void index_sink_input( uint32_t sink_input_index, const CachedSinkInput & sink_input );
+	void index_sink_inputs_of( uint32_t client_index );
+
+	static void on_context_state( pa_context *c, void *userdata );
+	static void on_subscription( pa_context *c, pa_subscription_event_type_t type, uint32_t index, void *userdata );
+	static void on_client_info( pa_context *c, const pa_client_info *info, int eol, void *userdata );
+	static void on_sink_input_info( pa_context *c, const pa_sink_input_info *info, int eol, void *userdata );
+	static void on_success( pa_context *c, int success, void *userdata );
+	static void on_volume_set( pa_context *c, int success, void *userdata );
+};
+
+#endif // PULSE_NATIVE_HH
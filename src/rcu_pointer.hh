@@ -0,0 +1,170 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RCU_POINTER_HH
+#define RCU_POINTER_HH
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+//   A pointer to an object which readers use all the time, and which a writer
+// occasionally replaces with a new one (e.g. a reloaded config).  Readers
+// never take a lock or wait: they just bump a counter.  The writer swaps the
+// pointer, and keeps the old object until no reader can be using it.
+//   The readers are counted in two halves, by 'generation'.  A reader which
+// might have the old object was counted (in one half or the other) before the
+// swap, and stays counted until it is done.  So once each half has been seen
+// at zero since the swap, the old object can go.  The writer flips the
+// generation with each swap, so that new readers go into the other half, and
+// a steady stream of them can't keep both halves busy forever.
+//   Nothing ever waits for the readers: old objects are deleted by a later
+// replace() or reclaim() (or when this is destroyed), once it is safe.  So a
+// writer which might not replace it again for a while should call reclaim()
+// a little later, until it says there are none left.
+template <typename T>
+struct RCUPointer
+{
+	//   Holds a reference to the current object for as long as it exists.
+	// Keep these short-lived: old objects can't be deleted while one exists.
+	struct ReadGuard
+	{
+		ReadGuard( RCUPointer & owner_in ) :
+		owner(&owner_in)
+		{
+			half = owner->generation.load() & 1;
+			owner->readers[half].fetch_add(1);
+			ptr = owner->current.load();
+		}
+
+		ReadGuard( ReadGuard && other ) :
+		owner(other.owner), half(other.half), ptr(other.ptr)
+		{
+			other.owner = nullptr;
+		}
+
+		~ReadGuard()
+		{
+			if ( owner != nullptr )
+				owner->readers[half].fetch_sub(1);
+		}
+
+		T * operator->() const { return ptr; }
+		T & operator*() const { return *ptr; }
+		T * get() const { return ptr; }
+
+	private:
+		RCUPointer *owner;
+		unsigned int half;
+		T *ptr;
+
+		ReadGuard( const ReadGuard & ) = delete;
+		ReadGuard & operator=( const ReadGuard & ) = delete;
+	};
+
+	explicit RCUPointer( T *initial ) :
+	current(initial), generation(0)
+	{
+		readers[0] = 0;
+		readers[1] = 0;
+	}
+
+	~RCUPointer()
+	{
+		delete current.load();
+
+		// There can't be any readers left by now
+		for ( const Retired & r : retired )
+			delete r.value;
+	}
+
+	ReadGuard read()
+	{
+		return ReadGuard(*this);
+	}
+
+	//   Makes 'new_value' the current object.  The old one is deleted as soon
+	// as no reader can be using it, which is often straight away.  This never
+	// waits, so it's fine to call it from a thread which readers might
+	// themselves be waiting on.
+	void replace( T *new_value )
+	{
+		std::lock_guard<std::mutex> lock(writer_mutex);
+
+		Retired r;
+		r.value = current.exchange(new_value);
+		r.drained[0] = false;
+		r.drained[1] = false;
+		retired.push_back(r);
+
+		// From here on, new readers count themselves in the other half
+		generation.fetch_add(1);
+
+		reclaim_locked();
+	}
+
+	//   Deletes the old objects which no reader can be using any more, and
+	// returns how many are still waiting for their readers to finish
+	size_t reclaim()
+	{
+		std::lock_guard<std::mutex> lock(writer_mutex);
+		reclaim_locked();
+		return retired.size();
+	}
+
+private:
+	std::atomic<T*> current;
+	std::atomic<unsigned int> generation;
+	std::atomic<unsigned long> readers[2];
+	std::mutex writer_mutex;
+
+	//   Objects which have been replaced, and which halves of the readers have
+	// been seen at zero since then
+	struct Retired
+	{
+		T *value;
+		bool drained[2];
+	};
+	std::vector<Retired> retired;
+
+	void reclaim_locked()
+	{
+		bool zero[2] = { readers[0].load() == 0, readers[1].load() == 0 };
+
+		for ( size_t i = 0; i < retired.size(); )
+		{
+			Retired & r = retired[i];
+			r.drained[0] = r.drained[0] or zero[0];
+			r.drained[1] = r.drained[1] or zero[1];
+
+			if ( r.drained[0] and r.drained[1] )
+			{
+				delete r.value;
+				retired.erase(retired.begin() + (long)i);
+			}
+			else
+				i++;
+		}
+	}
+
+	RCUPointer( const RCUPointer & ) = delete;
+	RCUPointer & operator=( const RCUPointer & ) = delete;
+};
+
+#endif // RCU_POINTER_HH
@@ -0,0 +1,264 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "realtime.hh"
+#include "arguments.hh"
+#include "logger.hh"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// The priority for --realtime, if it doesn't give one
+#define REALTIME_DEFAULT_PRIORITY 50
+
+using namespace std;
+
+static atomic<unsigned long> failure_count(0);
+
+static const char *policy_name( int policy )
+{
+	switch ( policy )
+	{
+		case SCHED_FIFO: return "SCHED_FIFO";
+		case SCHED_RR:   return "SCHED_RR";
+		default:         return "SCHED_OTHER";
+	}
+}
+
+//------------------------------------------------------------------------------
+// Parsing the options
+
+bool parse_realtime_policy( const string & spec, int & policy, int & priority )
+{
+	size_t colon = spec.find(':');
+	string name = spec.substr(0, colon);
+
+	if ( name == "fifo" )
+		policy = SCHED_FIFO;
+	else if ( name == "rr" )
+		policy = SCHED_RR;
+	else
+		return false;
+
+	priority = REALTIME_DEFAULT_PRIORITY;
+
+	if ( colon != string::npos )
+	{
+		string number = spec.substr(colon + 1);
+		char *end;
+		long temp = strtol(number.c_str(), &end, 10);
+
+		if ( number == "" or *end != '\0' or temp < sched_get_priority_min(policy) or temp > sched_get_priority_max(policy) )
+			return false;
+
+		priority = (int)temp;
+	}
+
+	return true;
+}
+
+bool parse_cpu_list( const string & spec, vector<int> & cpus )
+{
+	cpus.clear();
+	size_t start = 0;
+
+	while ( start <= spec.size() )
+	{
+		size_t comma = spec.find(',', start);
+		if ( comma == string::npos )
+			comma = spec.size();
+
+		// Each item is N or N-M
+		string item = spec.substr(start, comma - start);
+		char *end;
+		long first = strtol(item.c_str(), &end, 10), last = first;
+
+		if ( item == "" or end == item.c_str() )
+			return false;
+
+		if ( *end == '-' )
+		{
+			const char *rest = end + 1;
+			last = strtol(rest, &end, 10);
+			if ( end == rest )
+				return false;
+		}
+
+		if ( *end != '\0' or first < 0 or last < first or last >= CPU_SETSIZE )
+			return false;
+
+		for ( long cpu = first; cpu <= last; cpu++ )
+			cpus.push_back((int)cpu);
+
+		start = comma + 1;
+	}
+
+	return !cpus.empty();
+}
+
+//------------------------------------------------------------------------------
+
+bool realtime_enabled( const Arguments & arguments )
+{
+	return arguments.realtime_policy != SCHED_OTHER;
+}
+
+string realtime_description( const Arguments & arguments )
+{
+	if ( !realtime_enabled(arguments) )
+		return "off";
+
+	return string(policy_name(arguments.realtime_policy)) + " priority " + to_string(arguments.realtime_priority);
+}
+
+unsigned long realtime_failure_count()
+{
+	return failure_count.load(memory_order_relaxed);
+}
+
+static string rlimit_string( int resource )
+{
+	struct rlimit limit;
+
+	if ( getrlimit(resource, &limit) != 0 )
+		return "unknown";
+	if ( limit.rlim_cur == RLIM_INFINITY )
+		return "unlimited";
+
+	return to_string((unsigned long long)limit.rlim_cur);
+}
+
+static string cpu_list_string( const vector<int> & cpus )
+{
+	string answer;
+
+	for ( int cpu : cpus )
+		answer += ( answer == "" ? "" : "," ) + to_string(cpu);
+
+	return answer;
+}
+
+//   The page faults happen here rather than the first time the thread's calls
+// go this deep.  It mustn't be inlined, or the array might not be on the stack
+// below the caller's frame.
+static void __attribute__((noinline)) prefault_stack()
+{
+	volatile unsigned char stack[REALTIME_STACK_PREFAULT];
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+	for ( size_t i = 0; i < sizeof(stack); i += page )
+		stack[i] = 0;
+}
+
+void prefault_memory( void *p, size_t size )
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	unsigned char *start = (unsigned char *)p;
+
+	//   OR-ing in 0 writes the page (so it is faulted in writable, not just
+	// mapped to the zero page) without changing it.  It is atomic, so it is
+	// safe even if another thread is already using the memory.
+	for ( size_t i = 0; i < size; i += page )
+		__atomic_fetch_or(start + i, 0, __ATOMIC_RELAXED);
+
+	if ( size > 0 )
+		__atomic_fetch_or(start + size - 1, 0, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------
+
+bool realtime_thread_setup( const char *name, const Arguments & arguments, const vector<int> & cpus )
+{
+	bool ok = true;
+
+	if ( !cpus.empty() )
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for ( int cpu : cpus )
+			CPU_SET((size_t)cpu, &set);
+
+		int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if ( error == 0 )
+			logger.log(LOG_VERBOSE, "The %s thread is on CPUs %s", name, cpu_list_string(cpus).c_str());
+		else
+		{
+			logger.log(LOG_INFO, "Unable to put the %s thread on CPUs %s: %s", name, cpu_list_string(cpus).c_str(), strerror(error));
+			ok = false;
+		}
+	}
+
+	if ( realtime_enabled(arguments) )
+	{
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = arguments.realtime_priority;
+
+		int error = pthread_setschedparam(pthread_self(), arguments.realtime_policy, &param);
+		if ( error == 0 )
+			logger.log(LOG_VERBOSE, "The %s thread is now %s", name, realtime_description(arguments).c_str());
+		else if ( error == EPERM )
+		{
+			logger.log(LOG_INFO, "Not allowed to make the %s thread %s, so it will be an ordinary thread. That needs CAP_SYS_NICE, or an RLIMIT_RTPRIO (ulimit -r) of at least %d (it is %s).",
+			           name, realtime_description(arguments).c_str(), arguments.realtime_priority, rlimit_string(RLIMIT_RTPRIO).c_str());
+			ok = false;
+		}
+		else
+		{
+			logger.log(LOG_INFO, "Unable to make the %s thread %s: %s", name, realtime_description(arguments).c_str(), strerror(error));
+			ok = false;
+		}
+
+		prefault_stack();
+	}
+
+	if ( !ok )
+		failure_count.fetch_add(1, memory_order_relaxed);
+
+	return ok;
+}
+
+bool realtime_lock_memory( const Arguments & arguments )
+{
+	if ( !realtime_enabled(arguments) )
+		return true;
+
+	if ( mlockall(MCL_CURRENT | MCL_FUTURE) == 0 )
+	{
+		logger.log(LOG_VERBOSE, "Locked the memory into RAM");
+		return true;
+	}
+
+	if ( errno == ENOMEM or errno == EPERM )
+		logger.log(LOG_INFO, "Not allowed to lock the memory into RAM, so it could be swapped out. That needs CAP_IPC_LOCK, or an RLIMIT_MEMLOCK (ulimit -l) as big as the whole program (it is %s bytes).",
+		           rlimit_string(RLIMIT_MEMLOCK).c_str());
+	else
+		logger.log(LOG_INFO, "Unable to lock the memory into RAM: %s", strerror(errno));
+
+	failure_count.fetch_add(1, memory_order_relaxed);
+	return false;
+}
@@ -0,0 +1,74 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef REALTIME_HH
+#define REALTIME_HH
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct Arguments;
+
+//   How much of each real-time thread's stack to touch up front, so that a
+// deep call doesn't take a page fault the first time it happens
+#define REALTIME_STACK_PREFAULT (128 * 1024)
+
+//   Real-time mode (--realtime, --reader-cpus and --output-cpus): the threads
+// which the MIDI events go through (the serial reader's loop and the output
+// thread) get a SCHED_FIFO or SCHED_RR priority, so that the desktop can't
+// hold them up, and can be kept to particular CPUs.  The memory is locked, so
+// they don't wait for pages to come back from swap either.
+//   None of this is fatal: if we aren't allowed to (which needs CAP_SYS_NICE
+// and CAP_IPC_LOCK, or big enough RLIMIT_RTPRIO and RLIMIT_MEMLOCK), it is
+// logged, and everything carries on as usual.
+
+//   Parses POLICY[:PRIO] for --realtime, where POLICY is "fifo" or "rr".
+// Returns false if it doesn't make sense.
+bool parse_realtime_policy( const std::string & spec, int & policy, int & priority );
+
+// Parses a list of CPUs like "2,3" or "0-1,4" for --reader-cpus
+bool parse_cpu_list( const std::string & spec, std::vector<int> & cpus );
+
+// Whether --realtime was given
+bool realtime_enabled( const Arguments & arguments );
+
+//   Called by each real-time thread, when it starts: sets its policy and
+// priority, pins it to 'cpus' (if there are any), and touches its stack.
+// 'name' is for the log.  Does nothing if real-time mode is off and 'cpus' is
+// empty.  Returns false if anything couldn't be done.
+bool realtime_thread_setup( const char *name, const Arguments & arguments, const std::vector<int> & cpus );
+
+//   Locks all of our memory (including what is allocated later) into RAM, if
+// real-time mode is on.  Call it once everything big has been allocated.
+bool realtime_lock_memory( const Arguments & arguments );
+
+//   Faults in the pages of [p, p + size), without changing what is there,
+// e.g. a ring buffer which won't be written until the first events arrive.
+void prefault_memory( void *p, size_t size );
+
+//   How many of the things asked for couldn't be done (e.g. because we aren't
+// allowed), so that e.g. the benchmark can say its numbers aren't real-time.
+unsigned long realtime_failure_count();
+
+// A description of the mode, for the log (e.g. "SCHED_FIFO priority 50")
+std::string realtime_description( const Arguments & arguments );
+
+#endif // REALTIME_HH
@@ -0,0 +1,80 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef REUSABLE_VECTOR_HH
+#define REUSABLE_VECTOR_HH
+
+#include <cstddef>
+#include <vector>
+
+//   A vector which keeps its elements when it is cleared, rather than
+// destroying them.  Adding one assigns over whatever element was there
+// before, so e.g. a std::string reuses its old buffer.  Once it has been as
+// big as it needs to be (with strings as long as they need to be), filling it
+// again doesn't allocate anything.  This is for the event path, which is
+// supposed to be allocation-free once it has warmed up.
+//   Only the first size() elements are its contents.  The rest are still
+// there, holding whatever they held.
+template <typename T>
+struct ReusableVector
+{
+	ReusableVector() : used(0) { }
+
+	size_t size() const { return used; }
+	bool empty() const { return used == 0; }
+	void clear() { used = 0; }
+
+	//   Makes sure there are at least 'n' elements to reuse, so that it doesn't
+	// have to allocate them later.
+	void preallocate( size_t n )
+	{
+		while ( items.size() < n )
+			items.emplace_back();
+	}
+
+	//   Adds an element, and returns it to be filled in.  It still has what
+	// an earlier one left in it, so all of it has to be set.
+	T & append()
+	{
+		if ( used == items.size() )
+			items.emplace_back();
+
+		return items[used++];
+	}
+
+	void push_back( const T & item ) { append() = item; }
+
+	T & operator[]( size_t i ) { return items[i]; }
+	const T & operator[]( size_t i ) const { return items[i]; }
+
+	T * data() { return items.data(); }
+	const T * data() const { return items.data(); }
+
+	T * begin() { return items.data(); }
+	T * end() { return items.data() + used; }
+	const T * begin() const { return items.data(); }
+	const T * end() const { return items.data() + used; }
+
+private:
+	std::vector<T> items;
+	size_t used;
+};
+
+#endif // REUSABLE_VECTOR_HH
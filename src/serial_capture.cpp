@@ -0,0 +1,347 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "serial_capture.hh"
+#include "event_trace.hh"
+#include "fader_mapping.hh"
+#include "logger.hh"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+using namespace std;
+
+//==============================================================================
+// SerialCaptureWriter
+
+// The most that a record can take up besides its data: three 64-bit varints
+#define SERIAL_CAPTURE_RECORD_OVERHEAD (3 * 10)
+
+SerialCaptureWriter::SerialCaptureWriter() :
+fd(-1), filling(&buffers[0]), to_write(&buffers[1]), write_pending(false), write_failed(false),
+last_ns(0), last_flush_ns(0), dropped_count(0), running(false)
+{
+}
+
+bool SerialCaptureWriter::open( const string & filename_in, const vector<SerialDevice> & devices, string & error )
+{
+	this->close();
+
+	this->fd = ::open(filename_in.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if ( this->fd < 0 )
+	{
+		error = "unable to open " + filename_in + ": " + strerror(errno);
+		return false;
+	}
+
+	this->filename = filename_in;
+
+	//   Both buffers are as big as they'll ever be, so that record() never
+	// allocates: it drops a record rather than making one bigger.
+	for ( vector<unsigned char> & buffer : this->buffers )
+	{
+		buffer.clear();
+		buffer.reserve(SERIAL_CAPTURE_BUFFER_BYTES);
+	}
+
+	this->filling = &this->buffers[0];
+	this->to_write = &this->buffers[1];
+	this->write_pending.store(false, memory_order_relaxed);
+	this->write_failed.store(false, memory_order_relaxed);
+	this->dropped_count = 0;
+
+	this->filling->insert(this->filling->end(), SERIAL_CAPTURE_MAGIC, SERIAL_CAPTURE_MAGIC + strlen(SERIAL_CAPTURE_MAGIC));
+	this->filling->push_back(SERIAL_CAPTURE_VERSION);
+
+	this->put_varint(devices.size());
+	for ( const SerialDevice & device : devices )
+	{
+		this->put_varint(device.path.size());
+		this->filling->insert(this->filling->end(), device.path.begin(), device.path.end());
+		this->put_varint((uint64_t)device.channel_offset);
+	}
+
+	// The header is written straight away, so that any problem is found now
+	if ( !write_all(this->fd, *this->filling) )
+	{
+		error = "unable to write " + filename_in + ": " + strerror(errno);
+		::close(this->fd);
+		this->fd = -1;
+		return false;
+	}
+
+	this->filling->clear();
+	this->last_ns = this->last_flush_ns = monotonic_ns();
+
+	this->running.store(true, memory_order_release);
+	this->writer_thread = thread(&SerialCaptureWriter::writer_main, this);
+
+	return true;
+}
+
+void SerialCaptureWriter::close()
+{
+	if ( this->fd < 0 )
+		return;
+
+	// The writer thread writes anything which has been handed over first
+	this->running.store(false, memory_order_release);
+	if ( this->writer_thread.joinable() )
+		this->writer_thread.join();
+
+	if ( !this->write_failed.load(memory_order_relaxed) and !write_all(this->fd, *this->filling) )
+		logger.log(LOG_ERROR, "Unable to write to %s: %s", this->filename.c_str(), strerror(errno));
+	this->filling->clear();
+
+	if ( this->dropped_count > 0 )
+		logger.log(LOG_ERROR, "%lu reads were left out of %s, because it couldn't be written quickly enough", this->dropped_count, this->filename.c_str());
+
+	::close(this->fd);
+	this->fd = -1;
+}
+
+void SerialCaptureWriter::put_varint( uint64_t value )
+{
+	while ( value >= 0x80 )
+	{
+		this->filling->push_back((unsigned char)(value | 0x80));
+		value >>= 7;
+	}
+
+	this->filling->push_back((unsigned char)value);
+}
+
+//   This is on the serial reader's path, so all it does is copy the bytes onto
+// the end of the buffer, and (now and then) swap the buffers over.
+void SerialCaptureWriter::record( unsigned int device, uint64_t read_ns, const unsigned char *data, size_t count )
+{
+	if ( this->fd < 0 or this->write_failed.load(memory_order_relaxed) )
+		return;
+
+	if ( this->filling->size() + count + SERIAL_CAPTURE_RECORD_OVERHEAD > this->filling->capacity() )
+	{
+		//   The writer thread still has the other buffer.  Leaving the record
+		// out altogether keeps the file readable: the next one's time is
+		// still from the last one which went in.
+		this->dropped_count++;
+		return;
+	}
+
+	// Two reads can have been given the same time, but never go backwards
+	uint64_t delta = read_ns > this->last_ns ? read_ns - this->last_ns : 0;
+	this->last_ns += delta;
+
+	this->put_varint(delta);
+	this->put_varint(device);
+	this->put_varint(count);
+	this->filling->insert(this->filling->end(), data, data + count);
+
+	if ( this->filling->size() >= SERIAL_CAPTURE_FLUSH_BYTES or
+	     this->last_ns - this->last_flush_ns >= SERIAL_CAPTURE_FLUSH_MS * 1000000ULL )
+	{
+		this->hand_over();
+	}
+}
+
+//   Gives the filled buffer to the writer thread, and carries on with the
+// empty one.  If the writer is still busy with the last one, this is tried
+// again on the next record.
+void SerialCaptureWriter::hand_over()
+{
+	if ( this->write_pending.load(memory_order_acquire) )
+		return;
+
+	swap(this->filling, this->to_write);
+	this->last_flush_ns = this->last_ns;
+
+	this->write_pending.store(true, memory_order_release);
+}
+
+bool SerialCaptureWriter::write_all( int fd_out, const vector<unsigned char> & data )
+{
+	size_t done = 0;
+	while ( done < data.size() )
+	{
+		ssize_t n = write(fd_out, data.data() + done, data.size() - done);
+
+		if ( n < 0 and errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			return false;
+
+		done += (size_t)n;
+	}
+
+	return true;
+}
+
+void SerialCaptureWriter::writer_main()
+{
+	for ( ;; )
+	{
+		// Looked at first, so that whatever was handed over before close() is written
+		bool keep_running = this->running.load(memory_order_acquire);
+
+		if ( this->write_pending.load(memory_order_acquire) )
+		{
+			if ( !write_all(this->fd, *this->to_write) )
+			{
+				//   'write_pending' stays set, so nothing is handed over
+				// again, and record() stops when it sees 'write_failed'.
+				logger.log(LOG_ERROR, "Unable to write to %s: %s. No longer capturing.", this->filename.c_str(), strerror(errno));
+				this->write_failed.store(true, memory_order_relaxed);
+				return;
+			}
+
+			this->to_write->clear();
+			this->write_pending.store(false, memory_order_release);
+		}
+		else if ( !keep_running )
+			return;
+		else
+			this_thread::sleep_for(chrono::milliseconds(SERIAL_CAPTURE_WRITER_PERIOD_MS));
+	}
+}
+
+//==============================================================================
+// SerialCaptureReader
+
+bool SerialCaptureReader::open( const string & filename, string & error )
+{
+	ifstream in(filename.c_str(), ios::binary);
+	if ( !in )
+	{
+		error = "unable to open " + filename + ": " + strerror(errno);
+		return false;
+	}
+
+	this->contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	this->devices.clear();
+	this->pos = 0;
+
+	size_t magic_len = strlen(SERIAL_CAPTURE_MAGIC);
+	if ( this->contents.size() < magic_len + 1 or memcmp(this->contents.data(), SERIAL_CAPTURE_MAGIC, magic_len) != 0 )
+	{
+		error = filename + " isn't a ttymidi_pulse capture";
+		return false;
+	}
+
+	if ( this->contents[magic_len] != SERIAL_CAPTURE_VERSION )
+	{
+		error = filename + " is a capture from a different version of ttymidi_pulse";
+		return false;
+	}
+
+	this->pos = magic_len + 1;
+
+	uint64_t n_devices;
+	if ( !this->get_varint(n_devices) )
+	{
+		error = filename + " is truncated";
+		return false;
+	}
+
+	for ( uint64_t i = 0; i < n_devices; i++ )
+	{
+		uint64_t path_len, offset;
+
+		if ( !this->get_varint(path_len) or path_len > this->contents.size() - this->pos )
+		{
+			error = filename + " is truncated";
+			return false;
+		}
+
+		SerialDevice device;
+		device.path.assign((const char *)this->contents.data() + this->pos, (size_t)path_len);
+		device.baudrate = 0;
+		this->pos += (size_t)path_len;
+
+		if ( !this->get_varint(offset) or offset + MIDI_CHANNELS > MAX_FADER_CHANNELS )
+		{
+			error = filename + " is corrupt";
+			return false;
+		}
+
+		device.channel_offset = (int)offset;
+		this->devices.push_back(device);
+	}
+
+	this->records_start = this->pos;
+	this->rewind();
+
+	return true;
+}
+
+void SerialCaptureReader::rewind()
+{
+	this->pos = this->records_start;
+	this->time_ns = 0;
+	this->truncated = false;
+}
+
+bool SerialCaptureReader::get_varint( uint64_t & value )
+{
+	value = 0;
+
+	for ( unsigned int shift = 0; shift < 64; shift += 7 )
+	{
+		if ( this->pos >= this->contents.size() )
+			return false;
+
+		unsigned char byte = this->contents[this->pos++];
+		value |= (uint64_t)(byte & 0x7F) << shift;
+
+		if ( !(byte & 0x80) )
+			return true;
+	}
+
+	return false;
+}
+
+bool SerialCaptureReader::next( SerialCaptureRecord & record )
+{
+	if ( this->pos >= this->contents.size() )
+		return false;
+
+	uint64_t delta, device, count;
+
+	if ( !this->get_varint(delta) or !this->get_varint(device) or !this->get_varint(count) or
+	     count > this->contents.size() - this->pos )
+	{
+		this->truncated = true;
+		this->pos = this->contents.size();
+		return false;
+	}
+
+	this->time_ns += delta;
+
+	record.time_ns = this->time_ns;
+	record.device  = (unsigned int)device;
+	record.data    = this->contents.data() + this->pos;
+	record.count   = (size_t)count;
+
+	this->pos += (size_t)count;
+
+	return true;
+}
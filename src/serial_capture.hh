@@ -0,0 +1,138 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SERIAL_CAPTURE_HH
+#define SERIAL_CAPTURE_HH
+
+#include "arguments.hh"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+//   A capture file holds exactly what came out of the serial devices, and
+// when, so that it can be replayed later (see CaptureReplayer).  It is:
+//     "ttymidi capture" and a version byte (1)
+//     the number of devices, then for each: the length of its path, the path,
+//         and its channel offset
+//     records, each: nanoseconds since the previous record (or since the
+//         capture started), the device's number, the number of bytes, and
+//         the bytes themselves (from one read())
+//   All of the numbers are unsigned LEB128 varints, so a typical record is a
+// few bytes longer than the data in it.
+#define SERIAL_CAPTURE_MAGIC      "ttymidi capture"
+#define SERIAL_CAPTURE_VERSION    1
+
+//   Records are copied into one buffer while a background thread writes the
+// other one out.  They are swapped once there are this many bytes of records
+// (or they are SERIAL_CAPTURE_FLUSH_MS old), as long as the writer thread has
+// finished with the last lot.  If it's so far behind that a record doesn't fit
+// into SERIAL_CAPTURE_BUFFER_BYTES, the record is dropped (and counted).
+#define SERIAL_CAPTURE_FLUSH_BYTES  32768
+#define SERIAL_CAPTURE_FLUSH_MS     1000
+#define SERIAL_CAPTURE_BUFFER_BYTES (4 * SERIAL_CAPTURE_FLUSH_BYTES)
+
+// How often the writer thread looks for a buffer to write
+#define SERIAL_CAPTURE_WRITER_PERIOD_MS 20
+
+//   Writes a capture file.  Only one thread may record() (the event loop's:
+// all of the serial readers share one), and all it does is copy the bytes:
+// the file is written by a thread of its own, like the Logger's.
+struct SerialCaptureWriter
+{
+	SerialCaptureWriter();
+	~SerialCaptureWriter() { close(); }
+
+	//   Creates 'filename' (replacing it), writes the header, and starts the
+	// writer thread.  The devices' numbers are their positions in 'devices'.
+	bool open( const std::string & filename, const std::vector<SerialDevice> & devices, std::string & error );
+	// Stops the writer thread, and writes whatever is left
+	void close();
+
+	bool is_open() const { return fd >= 0; }
+
+	// 'read_ns' is when the bytes were read (see monotonic_ns())
+	void record( unsigned int device, uint64_t read_ns, const unsigned char *data, size_t count );
+
+	unsigned long get_dropped_count() const { return dropped_count; }
+
+private:
+	int fd;
+	std::string filename;
+
+	//   record() adds to 'filling'.  Once 'write_pending' is set, 'to_write'
+	// belongs to the writer thread, which empties it and clears the flag.
+	std::vector<unsigned char> buffers[2];
+	std::vector<unsigned char> *filling, *to_write;
+	std::atomic<bool> write_pending;
+	std::atomic<bool> write_failed;
+
+	uint64_t last_ns, last_flush_ns;
+	unsigned long dropped_count;
+
+	std::thread writer_thread;
+	std::atomic<bool> running;
+
+	void put_varint( uint64_t value );
+	void hand_over();
+	static bool write_all( int fd, const std::vector<unsigned char> & data );
+	void writer_main();
+};
+
+// One read() from a capture file.  'data' points into the SerialCaptureReader.
+struct SerialCaptureRecord
+{
+	uint64_t time_ns;       // Since the capture started
+	unsigned int device;
+	const unsigned char *data;
+	size_t count;
+};
+
+//   Reads a capture file.  The whole thing is read into memory: at 115200
+// baud, an hour is only about 40MB.
+struct SerialCaptureReader
+{
+	SerialCaptureReader() : pos(0), records_start(0), time_ns(0), truncated(false) {}
+
+	bool open( const std::string & filename, std::string & error );
+
+	// The devices which were captured (their baud rates are 0)
+	const std::vector<SerialDevice> & get_devices() const { return devices; }
+
+	//   Returns false at the end.  If the file stopped part way through a
+	// record (e.g. ttymidi_pulse was killed), is_truncated() says so.
+	bool next( SerialCaptureRecord & record );
+	void rewind();
+
+	bool is_truncated() const { return truncated; }
+
+private:
+	std::vector<unsigned char> contents;
+	size_t pos, records_start;
+	uint64_t time_ns;
+	bool truncated;
+	std::vector<SerialDevice> devices;
+
+	bool get_varint( uint64_t & value );
+};
+
+#endif // SERIAL_CAPTURE_HH
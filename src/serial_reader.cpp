@@ -18,33 +18,48 @@
 */
 
 #include "serial_reader.hh"
-#include "utils.hh"
+#include "logger.hh"
+#include "metrics.hh"
 
+#include <algorithm>
+#include <cerrno>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <iostream>
+#include <sys/epoll.h>
 
-// Seconds to wait between successive attempts to re-open the serial device
-#define SERIAL_DEVICE_REOPEN_SECONDS 1
-//   Seconds to wait for a message to be read from the device before we close and
-// re-open it
-#define NO_MESSAGE_RECEIVED_TIMEOUT  3
-#define MAX_MSG_SIZE                 1024
+//   Milliseconds to wait before re-opening the serial device.  This starts
+// short (so a device which was just reset comes back quickly), and doubles
+// with each failure, up to the maximum.
+#define SERIAL_DEVICE_REOPEN_MIN_MS  100
+#define SERIAL_DEVICE_REOPEN_MAX_MS 2000
 
 using namespace std;
 
-extern bool program_running;
-
 //==============================================================================
 
 void SerialMIDIReader::close_serial_device()
 {
+	if ( !this->device_open )
+		return;
+
+	if ( this->loop != nullptr )
+		this->loop->remove_fd(this->serial_fd);
+
 	tcsetattr( this->serial_fd, TCSANOW, &this->oldtio );
 
 	close( this->serial_fd );
 
 	device_open = false;
+
+	//   Whatever hadn't been written is out of date by the time the device is
+	// back (and it will have been reset anyway).
+	this->write_start = 0;
+	this->write_end = 0;
+	this->waiting_to_write = false;
+	for ( int & pitch : this->unsent_pitch )
+		pitch = SERIAL_NO_PITCH;
 }
 
 //   Attempts to open a serial device's file.  This will fail if the serial
@@ -59,22 +74,23 @@ bool SerialMIDIReader::open_serial_device( )
 	// has made an error.
 	if ( device_open )
 	{
-		cerr << current_time() << "open_serial_device(): device_open = true (i.e. device already open)" << endl;
+		logger.log(LOG_ERROR, "open_serial_device(): device_open = true (i.e. device already open)");
 		exit(1);
 	}
 
 	// Open modem device.
-	// O_RDWR:   open for reading and writing.
-	// O_NOCTTY: not as controlling tty because we don't  want to get killed
-	//           if linenoise sends CTRL-C.
-	serial_fd = open(arguments.serialdevice.c_str(), O_RDWR | O_NOCTTY );
-
-	// save current serial port settings
-	tcgetattr( this->serial_fd, &this->oldtio );
+	// O_RDWR:     open for reading and writing.
+	// O_NOCTTY:   not as controlling tty because we don't  want to get killed
+	//             if linenoise sends CTRL-C.
+	// O_NONBLOCK: the event loop tells us when there is something to read.
+	serial_fd = open(this->device.path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC );
 
 	if ( serial_fd < 0 )
 		return false;
 
+	// save current serial port settings
+	tcgetattr( this->serial_fd, &this->oldtio );
+
 	// clear struct for new port settings
 	bzero( &newtio, sizeof(newtio) );
 
@@ -86,7 +102,7 @@ bool SerialMIDIReader::open_serial_device( )
 	 * CLOCAL   : local connection, no modem contol
 	 * CREAD    : enable receiving characters
 	 */
-	newtio.c_cflag = arguments.baudrate | CS8 | CLOCAL | CREAD; // CRTSCTS removed
+	newtio.c_cflag = this->device.baudrate | CS8 | CLOCAL | CREAD; // CRTSCTS removed
 
 	/*
 	 * IGNPAR  : ignore bytes with parity errors
@@ -105,9 +121,9 @@ bool SerialMIDIReader::open_serial_device( )
 	 */
 	newtio.c_lflag = 0; // non-canonical
 
-	// Set up: we'll be reading 4 bytes at a time.
+	// The device is non-blocking, so these don't matter much
 	newtio.c_cc[VTIME] = 0;     // inter-character timer unused
-	newtio.c_cc[VMIN]  = 1;     // blocking read until n character arrives
+	newtio.c_cc[VMIN]  = 1;
 
 	// now clean the modem line and activate the settings for the port
 	tcflush(serial_fd, TCIFLUSH);
@@ -124,199 +140,217 @@ bool SerialMIDIReader::open_serial_device( )
 	return true;
 }
 
-//   Attempts to read from a serial device's file.
+//   Reads however many bytes are waiting (up to 'count'), and returns how many
+// that was.  0 means there was nothing to read.
 //   Since a serial device could be removed at any time, this is not a reliable
-// operation.  So, if the read fails, it will tell the SerialReader that the
-// device is no longer open, and will return false, so that you can attempt to
-// re-open it later.
-//   Also, if the serial device returns no data within some timeout, it will be
-// closed.  (The device can then be re-opened in read_midi_from_serial_port().)
-bool SerialMIDIReader::attempt_serial_read( void *buf, size_t count )
+// operation.  So, if the read fails, it will close the device and return 0.
+// (on_ready() then arranges to re-open it.)
+size_t SerialMIDIReader::attempt_serial_read( void *buf, size_t count )
 {
 	// If the device is not open, then just return with error
 	if ( !this->device_open )
-		return false;
-
-	// Define a set of files to watch with select()
-	fd_set file_set;
-	FD_ZERO(&file_set);                 // Clear the set
-	FD_SET(this->serial_fd, &file_set); // Add our file descriptor to the set
-
-	// Define a timeout
-	struct timeval timeout;
-	timeout.tv_sec = NO_MESSAGE_RECEIVED_TIMEOUT;
-	timeout.tv_usec = 0;
+		return 0;
 
-	// Wait to the device to become readable,
-	int ret_select = select(this->serial_fd + 1, &file_set, NULL, NULL, &timeout);
+	ssize_t ret_read = read(this->serial_fd, buf, count);
 
-	if ( !this->arguments.silent )
+	if ( ret_read > 0 )
 	{
-		if( ret_select == 0 )
-		// A timeout occurred
-			cerr << current_time() << "Timeout reading from serial device" << endl;
-		else if( ret_select == -1 )
-		// An error occurred
-			cerr << current_time() << "SerialReader::attempt_serial_read(): Error from select()" << endl;
+		this->last_read_ns = monotonic_ns();
+		return (size_t)ret_read;
 	}
 
-	if ( ret_select == 0 or ret_select == -1 )
-	// An error/timeout occurred
-	{
-		// Close the file, and return with error
-		this->close_serial_device();
+	// Nothing more to read for now
+	if ( ret_read == -1 and (errno == EAGAIN or errno == EWOULDBLOCK or errno == EINTR) )
+		return 0;
 
-		return false;
-	}
+	if ( ret_read == 0 )
+	// Unable to read any bytes from the device
+		logger.log(LOG_INFO, "No bytes read from %s. Will try to re-open.", this->device.path.c_str());
+	else
+	// An error occurred
+		logger.log(LOG_INFO, "Error reading from %s. Will try to re-open.", this->device.path.c_str());
 
-	// Perform the actual read, and handle errors
-	ssize_t ret_read = read(this->serial_fd, buf, count);
+	this->close_serial_device();
 
-	if ( !this->arguments.silent )
-	{
-		if ( ret_read == 0 )
-		// Unable to read any bytes from the device
-			cerr << current_time() << "No bytes read from serial device. Will try to re-open." << endl;
-		else if ( ret_read == -1 )
-		// An error occurred
-			cerr << current_time() << "Error reading from serial device. Will try to re-open." << endl;
-	}
+	return 0;
+}
 
-	if ( ret_read == 0 or ret_read == -1 )
-	{
-		this->device_open = false;
-		return false;
-	}
-	else	// Successful read
-		return true;
+//==============================================================================
+// Running from the event loop
+
+void SerialMIDIReader::start( EventLoop & loop_in )
+{
+	this->loop = &loop_in;
+	this->reopen_delay_ms = SERIAL_DEVICE_REOPEN_MIN_MS;
+	this->reopen_timer = this->loop->add_timer([this]( uint32_t ) { this->try_open(); });
+
+	this->try_open();
 }
 
-//   This does an iteration of the main loop of the program (when the
-// 'printonly' option is selected).  It waits for bytes from the serial device,
-// and prints them.  It also handles the re-opening of the serial device if it
-// gets closed for whatever reason.
-void SerialMIDIReader::main_loop_iteration_printonly( )
+void SerialMIDIReader::stop()
 {
-	unsigned char c;
+	this->close_serial_device();
 
-	//   Super-debug mode: only print to screen whatever comes through
-	// the serial port.
-	if ( attempt_serial_read(&c, 1) )
-		cout << hex << (int)c << "\t" << flush;
-	else
-	// Read failed
-	{
-		cerr << current_time() << "Attempting to open serial device... ";
-		if ( this->open_serial_device() )
-			cerr << "OK." << endl;
-		else
-		{
-			cerr << "Failed." << endl;
+	if ( this->loop != nullptr )
+		this->loop->remove_timer(this->reopen_timer);
 
-			//   Don't try to re-open device until some time passes (so we don't eat
-			// all of the CPU).
-			sleep(SERIAL_DEVICE_REOPEN_SECONDS);
-		}
-	}
+	this->reopen_timer = -1;
+	this->loop = nullptr;
 }
 
-//   This does an iteration of the main loop of the program (when the
-// 'printonly' option is not selected).  It waits for bytes from the serial
-// device, and gives them to MIDICommandHandler::parse_midi_command() to decode.
-// It also handles the re-opening of the serial device if it gets closed for
-// whatever reason.
-void SerialMIDIReader::main_loop_iteration_normal( )
+//   Tries to open the device, and if that doesn't work, sets the timer to try
+// again later.
+void SerialMIDIReader::try_open()
 {
-	static unsigned char buf[3];
-
-	// Get MIDI bytes as long as the device is open
 	if ( this->device_open )
+		return;
+
+	if ( this->open_serial_device() )
+	// We just successfully opened the device
 	{
-		// So let's align to the beginning of a MIDI command.
-		int i = 1;
+		logger.log(LOG_INFO, "Connected to serial device %s.", this->device.path.c_str());
 
-		while ( i < 3 )
-		{
-			unsigned char c;
+		if ( this->ever_opened )
+			metrics.add(METRIC_SERIAL_RECONNECTS);
+		this->ever_opened = true;
 
-			if ( !attempt_serial_read(&c, 1) )
-				return;
+		//   Whatever was half-received from before is gone.  The parser
+		// will skip forward to the first status byte.
+		this->parser.reset();
 
-			// Status byte has MSb set, and will always be the first byte
-			if ( (c & 0x80) == 0x80 )
-				i = 0;
+		this->watch_device(false);
+		return;
+	}
 
-			buf[i] = c;
+	if ( this->arguments.printonly )
+		logger.log(LOG_INFO, "Failed to (re)connect to %s. Trying again in %ums.", this->device.path.c_str(), this->reopen_delay_ms);
+	else
+		logger.log(LOG_VERBOSE, "Failed to (re)connect to %s. Trying again in %ums.", this->device.path.c_str(), this->reopen_delay_ms);
 
-			//   Two MIDI commands ('program change' or 'mono key pressure')
-			// only require 2 bytes, not 3.  So let's figure out are we done
-			// or should we read one more byte.
-			if ( i == 1 and ((buf[0] & 0xF0) == 0xC0 or (buf[0] & 0xF0) == 0xD0 ) )
-				break;
+	this->schedule_reopen();
+}
 
-			i++;
-		}
+//   The delay only goes back down once the device has given us something, so
+// a device which opens but then immediately fails doesn't keep us busy.
+void SerialMIDIReader::schedule_reopen()
+{
+	this->loop->set_timer(this->reopen_timer, this->reopen_delay_ms);
+	this->reopen_delay_ms = min(this->reopen_delay_ms * 2, (unsigned int)SERIAL_DEVICE_REOPEN_MAX_MS);
+}
 
-		// Print comment message (the ones that start with 0xFF 0x00 0x00)
-		if ( buf[0] == 0xFF and buf[1] == 0x00 and buf[2] == 0x00 )
-		{
-			if ( !attempt_serial_read(buf, 1) )
-				return;
+void SerialMIDIReader::watch_device( bool for_writing )
+{
+	this->loop->add_fd(this->serial_fd, for_writing ? EPOLLIN | EPOLLOUT : EPOLLIN, [this]( uint32_t events ) { this->on_ready(events); });
+	this->waiting_to_write = for_writing;
+}
 
-			size_t msglen;
-			char msg[MAX_MSG_SIZE];
+//   Called by the event loop when the device has something for us, will take
+// more of what we are writing, or has gone away.  It takes one buffer-full of
+// bytes from the serial device, and gives them to the parser, which decodes
+// the complete messages a batch at a time and passes them on to the
+// dispatcher.  (Or, in 'printonly' mode, just prints them.)  If there's more,
+// the loop calls this again next time round, after the other devices have had
+// their turn.
+void SerialMIDIReader::on_ready( uint32_t events )
+{
+	if ( events & EPOLLOUT )
+		this->flush_writes();
 
-			msglen = buf[0];
-			if ( msglen > MAX_MSG_SIZE - 1 )
-				msglen = MAX_MSG_SIZE - 1;
+	size_t n = ( events & EPOLLIN ) ? attempt_serial_read(this->read_buffer, sizeof(this->read_buffer)) : 0;
 
-			if ( !attempt_serial_read(msg, msglen) )
-				return;
+	if ( n > 0 )
+	{
+		this->reopen_delay_ms = SERIAL_DEVICE_REOPEN_MIN_MS;
+		metrics.add(METRIC_SERIAL_BYTES, n);
 
-			// Make sure the string ends with a null character
-			msg[msglen] = 0;
+		if ( this->capture != nullptr )
+			this->capture->record(this->capture_device, this->last_read_ns, this->read_buffer, n);
 
-			if ( !arguments.silent )
-				cerr << current_time() << "0xFF Non-MIDI message: " << msg << endl;
+		if ( arguments.printonly )
+		{
+			//   Super-debug mode: only print to screen whatever comes through
+			// the serial port.
+			for ( size_t i = 0; i < n; i++ )
+				cout << hex << (int)this->read_buffer[i] << "\t";
+			cout << flush;
 		}
 		else
-		// We have received a full MIDI message
-			midi_command_handler->parse_midi_command(buf, arguments);
+			this->parser.feed(this->read_buffer, n, this->last_read_ns);
 	}
-	else
-	// Device is not open
+
+	// e.g. the device has been unplugged, but read() didn't say so
+	if ( this->device_open and (events & (EPOLLHUP | EPOLLERR)) )
 	{
-		if ( this->open_serial_device() )
-		// We just successfully opened the device
+		logger.log(LOG_INFO, "Serial device %s hung up. Will try to re-open.", this->device.path.c_str());
+		this->close_serial_device();
+	}
+
+	if ( !this->device_open )
+		this->schedule_reopen();
+}
+
+//==============================================================================
+// Writing
+
+void SerialMIDIReader::queue_pitch_bend( int channel, int pitch )
+{
+	if ( channel < 0 or channel >= SERIAL_WRITE_CHANNELS or pitch < -8192 or pitch > 8191 )
+		return;
+
+	this->unsent_pitch[channel] = pitch;
+}
+
+//   Writes as much as the device will take, without waiting.  If it won't take
+// all of it, the loop calls this again (from on_ready()) when it will.
+void SerialMIDIReader::flush_writes()
+{
+	if ( !this->device_open )
+		return;
+
+	//   Only start on the next batch once the last one has all gone, and
+	// carry on until there's nothing left or the device won't take any more.
+	while ( true )
+	{
+		if ( this->write_start == this->write_end )
 		{
-			if ( !this->arguments.silent )
-				cerr << current_time()  << "Connected to serial device." << endl;
+			this->write_start = 0;
+			this->write_end = 0;
 
-			// Fast-forward to first status byte...
-			//   This must be done every time the device is opened, so it makes
-			// sense to put this here.
-			do
+			for ( int channel = 0; channel < SERIAL_WRITE_CHANNELS; channel++ )
 			{
-				if ( !attempt_serial_read(buf, 1) )
-					return;
-			} while ( program_running and (buf[0] & 0x80) == 0x00 );
+				if ( this->unsent_pitch[channel] == SERIAL_NO_PITCH )
+					continue;
+
+				unsigned int value = (unsigned int)(this->unsent_pitch[channel] + 8192);
+				this->write_buffer[this->write_end++] = (unsigned char)(0xE0 | channel);
+				this->write_buffer[this->write_end++] = (unsigned char)(value & 0x7F);
+				this->write_buffer[this->write_end++] = (unsigned char)((value >> 7) & 0x7F);
+
+				this->unsent_pitch[channel] = SERIAL_NO_PITCH;
+			}
+
+			if ( this->write_end == 0 )
+				break;
 		}
-		else
-		{
-			if ( this->arguments.verbose )
-				cerr << current_time()  << "Failed to reconnect to serial device." << endl;
 
-			//   Don't try to re-open device until some time passes (so we don't eat
-			// all of the CPU).
-			sleep(SERIAL_DEVICE_REOPEN_SECONDS);
+		ssize_t n = write(this->serial_fd, this->write_buffer + this->write_start, this->write_end - this->write_start);
+
+		if ( n > 0 )
+			this->write_start += (size_t)n;
+		else if ( n < 0 and errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR )
+		{
+			//   Reading will find out if the device has gone.  Meanwhile,
+			// there's no point trying these again.
+			logger.log(LOG_VERBOSE, "Error writing to %s: %s", this->device.path.c_str(), strerror(errno));
+			this->write_start = this->write_end;
+			break;
 		}
+
+		if ( this->write_start < this->write_end or n <= 0 )
+			break;
 	}
-}
 
-void SerialMIDIReader::main_loop_iteration( )
-{
-	if ( arguments.printonly )
-		main_loop_iteration_printonly();
-	else
-		main_loop_iteration_normal();
+	bool more = this->write_start < this->write_end;
+	if ( more != this->waiting_to_write )
+		this->watch_device(more);
 }
@@ -20,31 +20,101 @@
 #ifndef SERIAL_READER_HH
 #define SERIAL_READER_HH
 
-#include "midi_command_handler.hh"
+#include "event_loop.hh"
+#include "midi_event_dispatcher.hh"
+#include "midi_stream_parser.hh"
+#include "serial_capture.hh"
 
 #include <termios.h>
 
+// Maximum number of bytes taken from the serial device with each read()
+#define SERIAL_READ_BUFFER_SIZE 4096
+
+// Room for a pitch bend on every channel (see queue_pitch_bend())
+#define SERIAL_WRITE_CHANNELS 16
+#define SERIAL_WRITE_BUFFER_SIZE (3 * SERIAL_WRITE_CHANNELS)
+#define SERIAL_NO_PITCH (-65536)   // Outside -8192 to 8191
+
+//   Reads MIDI from a serial device, whenever an EventLoop says it has
+// something.  If the device goes away (or was never there), this keeps trying
+// to re-open it, on a timer.
+//   There can be several of these on the same loop (one per device).  Each
+// one only reads one buffer-full each time the loop comes round, so that they
+// all get a fair go.
+//   It can also write pitch bends to the device (to move motorized faders).
+// The device is never waited for: the loop says when it will take more.
 struct SerialMIDIReader
 {
 	const Arguments arguments;
-	MIDICommandHandler * const midi_command_handler;
+	const SerialDevice device;
+	MIDIEventDispatcher::Input * const midi_command_handler;
+
+	SerialMIDIReader( const Arguments & args_in, const SerialDevice & device_in, MIDIEventDispatcher::Input * const handler_in ) :
+	arguments(args_in), device(device_in), midi_command_handler(handler_in), serial_fd(-1), device_open(false), ever_opened(false),
+	last_read_ns(0), loop(nullptr), reopen_timer(-1), reopen_delay_ms(0), capture(nullptr), capture_device(0),
+	parser(args_in, handler_in), write_start(0), write_end(0), waiting_to_write(false)
+	{
+		for ( int & pitch : this->unsent_pitch )
+			pitch = SERIAL_NO_PITCH;
+	}
 
-	SerialMIDIReader( const Arguments & args_in, MIDICommandHandler * const handler_in ) :
-	arguments(args_in), midi_command_handler(handler_in), serial_fd(-1), device_open(false)
-	{ }
+	//   Write everything read to 'capture_in' (which may be shared with other
+	// readers), as device number 'device_number'.
+	void set_capture( SerialCaptureWriter *capture_in, unsigned int device_number )
+	{
+		capture = capture_in;
+		capture_device = device_number;
+	}
+
+	//   Opens the device (now, or as soon as it can), and reads it from 'loop'.
+	// These must be called on the loop's thread.
+	void start( EventLoop & loop_in );
+	void stop();
 
 	bool open_serial_device( );
 	void close_serial_device();
-	bool attempt_serial_read( void *buf, size_t count );
-	void main_loop_iteration( );
+	size_t attempt_serial_read( void *buf, size_t count );
+
+	//   Sends a pitch bend (-8192 to 8191) on 'channel' (0-15, before the
+	// device's channel offset).  Until it has been sent, a newer one for the
+	// same channel replaces it.  Call flush_writes() after queueing a batch.
+	// These must be called on the loop's thread.
+	void queue_pitch_bend( int channel, int pitch );
+	void flush_writes();
 
 private:
 	int serial_fd;
 	struct termios oldtio;
 	bool device_open;
+	bool ever_opened;           // So that opening it again counts as a reconnect
+
+	// When attempt_serial_read() last got some bytes (see monotonic_ns())
+	uint64_t last_read_ns;
+
+	EventLoop *loop;
+	int reopen_timer;
+	unsigned int reopen_delay_ms;
+
+	SerialCaptureWriter *capture;
+	unsigned int capture_device;
+
+	//   The parser knows it's giving the commands to an Input, so everything
+	// from here to the dispatcher's queue can be inlined
+	BasicMIDIStreamParser<MIDIEventDispatcher::Input> parser;
+	unsigned char read_buffer[SERIAL_READ_BUFFER_SIZE];
+
+	//   The bytes which the device hasn't taken yet are write_buffer[write_start
+	// to write_end].  Pitch bends only go in there once it's empty: until then,
+	// they wait in 'unsent_pitch', where they can still be replaced.
+	unsigned char write_buffer[SERIAL_WRITE_BUFFER_SIZE];
+	size_t write_start, write_end;
+	int unsent_pitch[SERIAL_WRITE_CHANNELS];
+	bool waiting_to_write;      // Whether the loop is watching for EPOLLOUT
 
-	void main_loop_iteration_printonly( );
-	void main_loop_iteration_normal( );
+	void try_open();
+	void schedule_reopen();
+	void watch_device( bool for_writing );
+	void on_ready( uint32_t events );
 };
 
 #endif // SERIAL_READER_HH
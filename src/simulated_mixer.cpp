@@ -0,0 +1,153 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "simulated_mixer.hh"
+#include "event_trace.hh"
+
+#include <chrono>
+#include <initializer_list>
+#include <thread>
+
+using namespace std;
+
+SimulatedMixer::SimulatedMixer( size_t n_clients, size_t streams_per_client, uint64_t call_latency_ns_in, unsigned long churn_every_in ) :
+call_latency_ns(call_latency_ns_in), churn_every(churn_every_in),
+volume_set_callback(NULL), volume_set_data(NULL),
+client_streams(n_clients), n_streams_made(0), client_properties(n_clients),
+random(12345), writes_until_churn(churn_every_in),
+set_count(0), vanished_count(0), churn_count(0)
+{
+	for ( size_t c = 0; c < n_clients; c++ )
+	{
+		for ( const char *prop_name : { "application.name", "application.process.binary" } )
+			this->client_properties[c][prop_name] = client_binary(c);
+
+		for ( size_t s = 0; s < streams_per_client; s++ )
+			this->add_stream(c);
+	}
+}
+
+string SimulatedMixer::client_binary( size_t client )
+{
+	return "sim-client-" + to_string(client);
+}
+
+//   The IDs are short enough for std::string to keep them inside itself, so
+// passing them around doesn't allocate.
+void SimulatedMixer::add_stream( size_t client )
+{
+	Stream stream;
+	stream.client = client;
+	stream.number = this->n_streams_made++;
+	stream.volume = 0;
+
+	string id = "stream" + to_string(stream.number);
+
+	this->streams[id] = stream;
+	this->client_streams[client].push_back(id);
+
+	this->index_stream(id, stream);
+}
+
+void SimulatedMixer::index_stream( const string & id, const Stream & stream )
+{
+	map<string,string> stream_properties;
+	stream_properties["media.role"] = "music";
+	stream_properties["media.name"] = "track " + to_string(stream.number);
+
+	this->stream_index.add_stream(id, &this->client_properties[stream.client], &stream_properties);
+}
+
+bool SimulatedMixer::resolve( const PropertyMatch & match, StreamList & streams_out )
+{
+	// A property which hasn't been asked about before means indexing it
+	if ( this->stream_index.index_property(match) )
+		for ( const auto & stream : this->streams )
+			this->index_stream(stream.first, stream.second);
+
+	this->stream_index.find(match, streams_out);
+
+	return true;
+}
+
+void SimulatedMixer::set_volumes( const VolumeWrites & writes, const WriteOrigins & origins )
+{
+	if ( writes.empty() )
+		return;
+
+	//   The calls are all "in flight" at once, so they take as long as one of
+	// them does.
+	if ( this->call_latency_ns > 0 )
+		this_thread::sleep_for(chrono::nanoseconds(this->call_latency_ns));
+
+	uint64_t finished_ns = monotonic_ns();
+
+	for ( size_t i = 0; i < writes.size(); i++ )
+	{
+		const pair<string,unsigned int> & write = writes[i];
+
+		auto it = this->streams.find(write.first);
+		if ( it == this->streams.end() )
+		{
+			this->vanished_count.fetch_add(1, memory_order_relaxed);
+			continue;
+		}
+
+		it->second.volume = write.second;
+		this->set_count.fetch_add(1, memory_order_relaxed);
+
+		if ( this->volume_set_callback != NULL )
+			this->volume_set_callback(this->volume_set_data, it->second.client, it->second.number, write.second);
+
+		event_tracer.dbus_call_finished(finished_ns, origins[i]);
+
+		if ( this->churn_every != 0 and --this->writes_until_churn == 0 )
+		{
+			this->writes_until_churn = this->churn_every;
+			this->churn();
+		}
+	}
+}
+
+// A random client's oldest stream goes, and it gets a new one
+void SimulatedMixer::churn()
+{
+	if ( this->client_streams.empty() )
+		return;
+
+	size_t client = (size_t)(this->random() % this->client_streams.size());
+	vector<string> & streams_of_client = this->client_streams[client];
+
+	if ( !streams_of_client.empty() )
+	{
+		this->stream_index.remove_stream(streams_of_client.front());
+		this->streams.erase(streams_of_client.front());
+		streams_of_client.erase(streams_of_client.begin());
+	}
+
+	this->add_stream(client);
+	this->churn_count.fetch_add(1, memory_order_relaxed);
+}
+
+string SimulatedMixer::get_stats() const
+{
+	return "Simulated mixer: " + to_string(this->get_set_count()) + " volumes set, " +
+	       to_string(this->get_vanished_count()) + " to streams which had gone, " +
+	       to_string(this->get_churn_count()) + " streams replaced";
+}
@@ -0,0 +1,108 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMULATED_MIXER_HH
+#define SIMULATED_MIXER_HH
+
+#include "volume_backend.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//   A VolumeBackend which is just some clients and streams in memory, for
+// measuring the rest of the program without PulseAudio.  It is deterministic:
+// the same calls give the same results every time.
+//   Client i has application.name and application.process.binary =
+// client_binary(i), and starts with 'streams_per_client' streams.  Each stream
+// has media.role = "music" and media.name = "track <n>" (counting streams
+// from 0 as they are made).  Setting the
+// volumes can be made to take 'call_latency_ns' (once per set_volumes(), as
+// the calls would be in flight together).  If 'churn_every' isn't 0, then
+// after every that many volume writes, one client loses its oldest stream
+// and gets a new one (as if a player had moved to the next track).
+struct SimulatedMixer : VolumeBackend
+{
+	//   Called whenever a stream's volume is set, on the thread which set it.
+	// (The same as MockPulseServer::VolumeSetCallback.)
+	typedef void (*VolumeSetCallback)( void *data, size_t client, size_t stream, uint32_t volume );
+
+	SimulatedMixer( size_t n_clients, size_t streams_per_client, uint64_t call_latency_ns_in, unsigned long churn_every_in );
+
+	// Must be called before anything is set
+	void set_volume_callback( VolumeSetCallback callback, void *data )
+	{
+		volume_set_callback = callback;
+		volume_set_data = data;
+	}
+
+	virtual bool connect() { return true; }
+	virtual void disconnect() { }
+
+	virtual bool resolve( const PropertyMatch & match, StreamList & streams );
+	virtual void set_volumes( const VolumeWrites & writes, const WriteOrigins & origins );
+
+	virtual std::string get_stats() const;
+
+	static std::string client_binary( size_t client );
+
+	// Counters (these can be read from any thread)
+	unsigned long get_set_count() const { return set_count.load(std::memory_order_relaxed); }
+	unsigned long get_vanished_count() const { return vanished_count.load(std::memory_order_relaxed); }
+	unsigned long get_churn_count() const { return churn_count.load(std::memory_order_relaxed); }
+
+private:
+	const uint64_t call_latency_ns;
+	const unsigned long churn_every;
+
+	VolumeSetCallback volume_set_callback;
+	void *volume_set_data;
+
+	struct Stream
+	{
+		size_t client;
+		size_t number;      // Counts up from 0, over all of the streams ever made
+		uint32_t volume;
+	};
+
+	// Each client's streams, oldest first
+	std::vector< std::vector<std::string> > client_streams;
+	std::unordered_map<std::string,Stream> streams;
+	size_t n_streams_made;
+
+	std::vector< std::map<std::string,std::string> > client_properties;
+	StreamIndex stream_index;
+
+	std::mt19937 random;            // Always seeded the same
+	unsigned long writes_until_churn;
+
+	std::atomic<unsigned long> set_count;
+	std::atomic<unsigned long> vanished_count;    // Writes to streams which had gone
+	std::atomic<unsigned long> churn_count;
+
+	void add_stream( size_t client );
+	void index_stream( const std::string & id, const Stream & stream );
+	void churn();
+};
+
+#endif // SIMULATED_MIXER_HH
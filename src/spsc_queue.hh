@@ -0,0 +1,93 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPSC_QUEUE_HH
+#define SPSC_QUEUE_HH
+
+#include <atomic>
+#include <cstddef>
+
+//   A bounded, lock-free queue for exactly one producer thread and exactly one
+// consumer thread.  push() only ever gets called by the producer, and pop() by
+// the consumer.  Neither of them ever blocks: push() fails if the queue is
+// full, and pop() fails if it is empty.
+template <typename T, size_t Capacity>
+struct SPSCQueue
+{
+	static_assert( Capacity > 0 and (Capacity & (Capacity - 1)) == 0,
+	               "SPSCQueue capacity must be a power of 2" );
+
+	SPSCQueue() :
+	head(0), tail(0)
+	{ }
+
+	// Producer only
+	bool push( const T & item )
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+
+		if ( t - head.load(std::memory_order_acquire) == Capacity )
+			return false;
+
+		buffer[t & (Capacity - 1)] = item;
+		tail.store(t + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Consumer only
+	bool pop( T & item )
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+
+		if ( h == tail.load(std::memory_order_acquire) )
+			return false;
+
+		item = buffer[h & (Capacity - 1)];
+		head.store(h + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// These can be called from any thread, but are only a snapshot
+	size_t size() const
+	{
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	static constexpr size_t capacity()
+	{
+		return Capacity;
+	}
+
+private:
+	//   The indices only ever increase (and wrap around at SIZE_MAX, which is
+	// fine as Capacity is a power of 2).  They live on separate cache lines so
+	// that the two threads don't fight over them.
+	alignas(64) std::atomic<size_t> head;   // Next slot to be read
+	alignas(64) std::atomic<size_t> tail;   // Next slot to be written
+	alignas(64) T buffer[Capacity];
+};
+
+#endif // SPSC_QUEUE_HH
@@ -0,0 +1,217 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "stream_index.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <fnmatch.h>
+
+using namespace std;
+
+//==============================================================================
+// PropertyMatch
+
+bool PropertyMatch::parse( const string & name_field, const string & value_field, PropertyMatch & match, string & error )
+{
+	static const size_t prefix_length = strlen(STREAM_PROPERTY_PREFIX);
+
+	match.of_stream = name_field.compare(0, prefix_length, STREAM_PROPERTY_PREFIX) == 0;
+	match.name = match.of_stream ? name_field.substr(prefix_length) : name_field;
+	match.key = name_field;
+
+	if ( match.name.empty() )
+	{
+		error = "no property name in '" + name_field + "'";
+		return false;
+	}
+
+	//   A '*' at the end (and nowhere else) is a prefix, which is much
+	// cheaper to match than a glob.
+	size_t special = value_field.find_first_of("*?[\\");
+
+	if ( special == string::npos )
+	{
+		match.kind = EXACT;
+		match.value = value_field;
+	}
+	else if ( special == value_field.size() - 1 and value_field[special] == '*' )
+	{
+		match.kind = PREFIX;
+		match.value = value_field.substr(0, special);
+	}
+	else
+	{
+		match.kind = GLOB;
+		match.value = value_field;
+	}
+
+	return true;
+}
+
+//==============================================================================
+// StreamIndex
+
+bool StreamIndex::index_property( const PropertyMatch & match )
+{
+	vector<string> & names = match.of_stream ? this->stream_properties : this->client_properties;
+
+	if ( std::find(names.begin(), names.end(), match.name) != names.end() )
+		return false;
+
+	names.push_back(match.name);
+
+	return true;
+}
+
+void StreamIndex::add_stream( const string & stream,
+                              const map<string,string> *client_properties_in,
+                              const map<string,string> *stream_properties_in )
+{
+	this->remove_stream(stream);
+
+	map<string,string> & values = this->values_of_stream[stream];
+
+	if ( client_properties_in != NULL )
+		for ( const string & name : this->client_properties )
+		{
+			auto it = client_properties_in->find(name);
+			if ( it != client_properties_in->end() )
+				values[name] = it->second;
+		}
+
+	if ( stream_properties_in != NULL )
+		for ( const string & name : this->stream_properties )
+		{
+			auto it = stream_properties_in->find(name);
+			if ( it != stream_properties_in->end() )
+				values[STREAM_PROPERTY_PREFIX + name] = it->second;
+		}
+
+	for ( const auto & value : values )
+		this->streams_by_property[value.first][value.second].insert(stream);
+
+	// Keep the globs' answers up to date
+	for ( const auto & value : values )
+	{
+		auto globs_it = this->glob_matches.find(value.first);
+		if ( globs_it == this->glob_matches.end() )
+			continue;
+
+		for ( auto & glob : globs_it->second )
+			if ( fnmatch(glob.first.c_str(), value.second.c_str(), 0) == 0 )
+				glob.second.insert(stream);
+	}
+}
+
+void StreamIndex::remove_stream( const string & stream )
+{
+	auto it = this->values_of_stream.find(stream);
+
+	if ( it == this->values_of_stream.end() )
+		return;
+
+	for ( const auto & value : it->second )
+	{
+		auto globs_it = this->glob_matches.find(value.first);
+		if ( globs_it != this->glob_matches.end() )
+			for ( auto & glob : globs_it->second )
+				glob.second.erase(stream);
+
+		auto property_it = this->streams_by_property.find(value.first);
+		if ( property_it == this->streams_by_property.end() )
+			continue;
+
+		auto value_it = property_it->second.find(value.second);
+		if ( value_it == property_it->second.end() )
+			continue;
+
+		value_it->second.erase(stream);
+		if ( value_it->second.empty() )
+			property_it->second.erase(value_it);
+	}
+
+	this->values_of_stream.erase(it);
+}
+
+void StreamIndex::clear_streams()
+{
+	this->streams_by_property.clear();
+	this->values_of_stream.clear();
+	this->glob_matches.clear();
+}
+
+static void append_streams( ReusableVector<string> & streams, const set<string> & found )
+{
+	for ( const string & stream : found )
+		streams.push_back(stream);
+}
+
+void StreamIndex::find( const PropertyMatch & match, ReusableVector<string> & streams )
+{
+	auto property_it = this->streams_by_property.find(match.key);
+
+	switch ( match.kind )
+	{
+		case PropertyMatch::EXACT:
+		default:
+		{
+			if ( property_it == this->streams_by_property.end() )
+				return;
+
+			auto it = property_it->second.find(match.value);
+			if ( it != property_it->second.end() )
+				append_streams(streams, it->second);
+			return;
+		}
+
+		case PropertyMatch::PREFIX:
+		{
+			if ( property_it == this->streams_by_property.end() )
+				return;
+
+			for ( auto it = property_it->second.lower_bound(match.value);
+			      it != property_it->second.end() and it->first.compare(0, match.value.size(), match.value) == 0; ++it )
+				append_streams(streams, it->second);
+			return;
+		}
+
+		case PropertyMatch::GLOB:
+		{
+			map< string, set<string> > & globs = this->glob_matches[match.key];
+			auto glob_it = globs.find(match.value);
+
+			//   The first time, go through the values there are now.  From
+			// then on, add_stream() and remove_stream() keep it up to date.
+			if ( glob_it == globs.end() )
+			{
+				glob_it = globs.insert(make_pair(match.value, set<string>())).first;
+
+				if ( property_it != this->streams_by_property.end() )
+					for ( const auto & value : property_it->second )
+						if ( fnmatch(match.value.c_str(), value.first.c_str(), 0) == 0 )
+							glob_it->second.insert(value.second.begin(), value.second.end());
+			}
+
+			append_streams(streams, glob_it->second);
+			return;
+		}
+	}
+}
@@ -0,0 +1,112 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef STREAM_INDEX_HH
+#define STREAM_INDEX_HH
+
+#include "reusable_vector.hh"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// A property name with this in front of it is the stream's own property
+#define STREAM_PROPERTY_PREFIX "stream:"
+
+//   What a rule matches: a property of the stream's client (e.g.
+// application.process.binary), or of the stream itself (e.g. media.role),
+// against a value.  The value can be:
+//     firefox      exactly that
+//     Firefox*     anything starting with "Firefox"
+//     *[Vv]ideo*   a glob, as for fnmatch() (any of * ? [ or \ makes it one)
+struct PropertyMatch
+{
+	enum Kind
+	{
+		EXACT,
+		PREFIX,     // 'value' is the prefix, without the '*'
+		GLOB
+	};
+
+	bool of_stream;         // The stream's own property, not its client's
+	std::string name;       // e.g. "media.role"
+	std::string key;        // 'name', with STREAM_PROPERTY_PREFIX if of_stream
+	std::string value;
+	Kind kind;
+
+	//   'name_field' is a property name, with STREAM_PROPERTY_PREFIX in front
+	// for a stream property.  Returns false (and sets 'error') if it's wrong.
+	static bool parse( const std::string & name_field, const std::string & value_field, PropertyMatch & match, std::string & error );
+};
+
+//   Which streams have which property values, for the properties which rules
+// have asked about.  Backends add streams as they appear and remove them as
+// they go, so it's never rebuilt from scratch (except when a new property is
+// asked about).  A match looks up its property and value, rather than going
+// through the clients:
+//     exact   one lookup
+//     prefix  a range of the (sorted) values
+//     glob    worked out once by going through the property's different
+//             values, and after that kept up to date as streams come and go
+//   Streams are known by the backend's IDs.  This isn't thread safe: it
+// belongs to the backend.
+struct StreamIndex
+{
+	//   Starts indexing the property 'match' is for.  Returns true if it's new,
+	// in which case the streams which are already in here don't have it, and
+	// the backend has to add them again.
+	bool index_property( const PropertyMatch & match );
+
+	// The names (without STREAM_PROPERTY_PREFIX) of the properties to index
+	const std::vector<std::string> & get_client_properties() const { return client_properties; }
+	const std::vector<std::string> & get_stream_properties() const { return stream_properties; }
+
+	//   Adds a stream (or replaces it, if it's already here), picking the
+	// indexed properties out of its client's properties and its own.  Either
+	// can be NULL (e.g. a stream with no client).
+	void add_stream( const std::string & stream,
+	                 const std::map<std::string,std::string> *client_properties_in,
+	                 const std::map<std::string,std::string> *stream_properties_in );
+	void remove_stream( const std::string & stream );
+
+	// Forgets all of the streams (but not which properties are indexed)
+	void clear_streams();
+
+	//   Adds the streams which 'match' matches to 'streams'.  (Once a match has
+	// been looked for before, this doesn't allocate.)
+	void find( const PropertyMatch & match, ReusableVector<std::string> & streams );
+
+	size_t n_streams() const { return values_of_stream.size(); }
+
+private:
+	std::vector<std::string> client_properties, stream_properties;
+
+	// Key -> value -> streams.  Sorted, so that a prefix is a range.
+	std::map< std::string, std::map< std::string, std::set<std::string> > > streams_by_property;
+
+	// Stream -> its values (by key), so that it can be taken out again
+	std::map< std::string, std::map<std::string,std::string> > values_of_stream;
+
+	// Key -> glob -> streams, for the globs which have been asked about
+	std::map< std::string, std::map< std::string, std::set<std::string> > > glob_matches;
+};
+
+#endif // STREAM_INDEX_HH
@@ -0,0 +1,83 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOLUME_BACKEND_HH
+#define VOLUME_BACKEND_HH
+
+#include "event_trace.hh"
+#include "reusable_vector.hh"
+#include "stream_index.hh"
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+//   Something which can set the volumes of audio streams: PulseAudio (see
+// DBusPulseAudio), or a stand-in for it (see SimulatedMixer).  Streams are
+// picked out by a property of their client (e.g. application.process.binary =
+// mpv) or of their own (e.g. media.role = video), using a StreamIndex, and
+// then known by an ID (e.g. a DBus object path) for as long as they exist.
+//   Only one thread may use a backend (the output thread), apart from
+// get_stats().
+struct VolumeBackend
+{
+	//   Called with a stream's ID and its volume (the loudest of its channels)
+	// whenever the volume changes, whether we changed it or something else did
+	// (e.g. pavucontrol).  It is called on whichever thread the backend hears
+	// about it on, not the output thread, so it mustn't take long.
+	typedef std::function<void(const std::string &, unsigned int)> VolumeCallback;
+
+	//   Stream IDs, and (stream ID, volume) pairs to set.  They are reused from
+	// one event to the next, so that the IDs' strings aren't allocated again.
+	typedef ReusableVector<std::string> StreamList;
+	typedef ReusableVector< std::pair<std::string,unsigned int> > VolumeWrites;
+
+	// The event which asked for each of a VolumeWrites, for EventTracer
+	typedef ReusableVector<EventTimes> WriteOrigins;
+
+	virtual ~VolumeBackend() {}
+
+	// Call this before connect(), if at all
+	void watch_volumes( VolumeCallback callback ) { volume_callback = callback; }
+
+	//   Returns false if it couldn't connect.  That might not be for good: see
+	// resolve().
+	virtual bool connect() = 0;
+	virtual void disconnect() = 0;
+
+	//   Adds the IDs of the streams which 'match' matches to 'streams'.  If
+	// there's no connection, this tries to make one, and returns false if it
+	// can't.
+	virtual bool resolve( const PropertyMatch & match, StreamList & streams ) = 0;
+
+	//   Sets each (stream ID, volume), on all of the stream's channels, with
+	// all of them in flight at once.  Streams which have gone are skipped.
+	// Each call is counted by EventTracer against the event in the same place
+	// in 'origins', which is as long as 'writes'.
+	virtual void set_volumes( const VolumeWrites & writes, const WriteOrigins & origins ) = 0;
+
+	// A line for the statistics printed on exit (e.g. "DBus: 10 calls, ...")
+	virtual std::string get_stats() const = 0;
+
+protected:
+	VolumeCallback volume_callback;     // Empty if nobody is watching
+};
+
+#endif // VOLUME_BACKEND_HH
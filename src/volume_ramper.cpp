@@ -0,0 +1,145 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "volume_ramper.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+VolumeRamper::VolumeRamper( double tick_rate, unsigned int ramp_ms ) :
+tick_ns(tick_rate > 0 ? (uint64_t)(1e9 / tick_rate) : 0),
+step(VOLUME_RAMP_FULL_SCALE), last_tick_ns(0), ticked(false), n_moving(0),
+tick_count(0), write_count(0)
+{
+	//   A full-scale move takes 'ramp_ms', i.e. ramp_ms / tick ticks.  (Always
+	// at least 1, or it would never get anywhere.)
+	if ( this->tick_ns != 0 and ramp_ms > 0 )
+	{
+		double ticks = (double)ramp_ms * 1e6 / (double)this->tick_ns;
+		this->step = (unsigned int)max(1.0, VOLUME_RAMP_FULL_SCALE / ticks);
+	}
+}
+
+void VolumeRamper::set_target( const string & stream, unsigned int volume, const EventTimes & origin )
+{
+	if ( this->streams.size() >= VOLUME_RAMPER_MAX_STREAMS )
+		this->forget_settled_streams();
+
+	// (Making a pair to insert would copy the string, even if it's there already)
+	auto it = this->streams.find(stream);
+	bool is_new = ( it == this->streams.end() );
+	if ( is_new )
+		it = this->streams.insert(make_pair(stream, StreamState())).first;
+
+	StreamState & s = it->second;
+
+	//   We don't know where a new stream is, so it goes straight to the target
+	// (on the next tick).
+	if ( is_new )
+	{
+		s.current = volume;
+		s.moving = false;
+	}
+	else if ( s.target == volume )
+		return;
+
+	s.target = volume;
+	s.origin = origin;
+
+	if ( !s.moving )
+	{
+		s.moving = true;
+		this->n_moving++;
+	}
+}
+
+void VolumeRamper::tick( uint64_t now_ns, ReusableVector< pair<string,unsigned int> > & writes, ReusableVector<EventTimes> & origins )
+{
+	uint64_t due_ns = this->next_tick_ns(now_ns);
+	if ( due_ns == 0 or now_ns < due_ns )
+		return;
+
+	//   If the tick is late (e.g. nothing has been moving for a while), the
+	// ramp doesn't try to catch up: it's still one step.
+	this->last_tick_ns = now_ns - now_ns % this->tick_ns;
+	this->ticked = true;
+	this->tick_count.fetch_add(1, memory_order_relaxed);
+
+	for ( auto & entry : this->streams )
+	{
+		StreamState & s = entry.second;
+		if ( !s.moving )
+			continue;
+
+		if ( s.target > s.current )
+			s.current += min(this->step, s.target - s.current);
+		else
+			s.current -= min(this->step, s.current - s.target);
+
+		pair<string,unsigned int> & write = writes.append();
+		write.first = entry.first;
+		write.second = s.current;
+		origins.push_back(s.origin);
+
+		if ( s.current == s.target )
+		{
+			s.moving = false;
+			this->n_moving--;
+		}
+	}
+
+	this->write_count.fetch_add(writes.size(), memory_order_relaxed);
+}
+
+//   The ticks are at whole multiples of tick_ns, so they stay evenly spaced
+// however late each one is handled.
+uint64_t VolumeRamper::next_tick_ns( uint64_t now_ns ) const
+{
+	if ( this->n_moving == 0 )
+		return 0;
+
+	uint64_t next = this->last_tick_ns + this->tick_ns;
+	if ( this->ticked and next > now_ns )
+		return next;
+
+	// A tick is overdue, so it's due now (0 would mean "nothing to do")
+	return max(now_ns, (uint64_t)1);
+}
+
+void VolumeRamper::clear()
+{
+	this->streams.clear();
+	this->n_moving = 0;
+}
+
+//   Streams come and go, so the map would keep growing.  A stream which has
+// got where it was going doesn't need remembering: if it's moved again, it
+// just goes straight there.
+void VolumeRamper::forget_settled_streams()
+{
+	for ( auto it = this->streams.begin(); it != this->streams.end(); )
+	{
+		if ( !it->second.moving )
+			it = this->streams.erase(it);
+		else
+			++it;
+	}
+}
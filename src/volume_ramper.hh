@@ -0,0 +1,105 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef VOLUME_RAMPER_HH
+#define VOLUME_RAMPER_HH
+
+#include "event_trace.hh"
+#include "reusable_vector.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The volume range a ramp is measured against (PulseAudio's 100%)
+#define VOLUME_RAMP_FULL_SCALE 65536
+
+// How many streams to remember before forgetting the ones which have settled
+#define VOLUME_RAMPER_MAX_STREAMS 256
+
+//   Moves stream volumes towards where their faders are, on a fixed tick
+// (e.g. 100 times a second), rather than whenever the controller sends
+// something.  On each tick, each stream which isn't there yet moves one step
+// along a ramp, and gets (at most) one write.  So however fast the faders are
+// moved, there are at most 'tick_rate' writes a second to each stream, and a
+// big jump is spread over 'ramp_ms' (for the whole range) instead of being
+// one audible step.  (With 'ramp_ms' = 0 it just goes straight there, on the
+// next tick.)
+//   The ticks are on a fixed grid of the clock, and only happen while
+// something is moving.  Every call takes the time, rather than reading a
+// clock, so the same thing can be run from monotonic_ns() or from a simulated
+// clock.
+//   A stream's first volume can't be ramped to, because we don't know where
+// it was, so it is set straight away (on the next tick).
+//   Each write comes with the times of the event which last moved that
+// stream's target, so that EventTracer can count it against that event.
+//   Only one thread may use this, apart from the counters.
+struct VolumeRamper
+{
+	// 'tick_rate' = 0 means this is switched off
+	VolumeRamper( double tick_rate, unsigned int ramp_ms );
+
+	bool enabled() const { return tick_ns != 0; }
+
+	// Sets where 'stream' should get to, for the event 'origin'
+	void set_target( const std::string & stream, unsigned int volume, const EventTimes & origin );
+
+	//   If a tick is due by 'now_ns', moves every stream which isn't there yet,
+	// and adds a (stream, volume) to 'writes' for each of them, and its
+	// target's event to 'origins'.
+	void tick( uint64_t now_ns, ReusableVector< std::pair<std::string,unsigned int> > & writes, ReusableVector<EventTimes> & origins );
+
+	// When the next tick is due, or 0 if nothing is moving
+	uint64_t next_tick_ns( uint64_t now_ns ) const;
+
+	// Forgets all of the streams (e.g. because they have all gone)
+	void clear();
+
+	// Counters (these can be read from any thread)
+	unsigned long get_tick_count() const { return tick_count.load(std::memory_order_relaxed); }
+	unsigned long get_write_count() const { return write_count.load(std::memory_order_relaxed); }
+
+private:
+	struct StreamState
+	{
+		unsigned int current;   // What was last written (or will be, on the next tick)
+		unsigned int target;
+		bool moving;
+		EventTimes origin;      // The event which set 'target'
+	};
+
+	uint64_t tick_ns;           // 0 = switched off
+	unsigned int step;          // The most a stream moves in one tick
+	uint64_t last_tick_ns;
+	bool ticked;                // Whether there has been a tick at all yet
+
+	std::map<std::string,StreamState> streams;
+	size_t n_moving;
+
+	std::atomic<unsigned long> tick_count;
+	std::atomic<unsigned long> write_count;
+
+	void forget_settled_streams();
+};
+
+#endif // VOLUME_RAMPER_HH
@@ -0,0 +1,205 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "volume_rate_limiter.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+VolumeRateLimiter::VolumeRateLimiter( double per_stream_rate, double overall_rate_in ) :
+stream_interval_ns(per_stream_rate > 0 ? (uint64_t)(1e9 / per_stream_rate) : 0),
+overall_limited(overall_rate_in > 0), overall_rate(overall_rate_in),
+tokens(0), max_tokens(0), tokens_ns(0), n_held(0),
+written_count(0), deferred_count(0), suppressed_count(0)
+{
+	if ( this->overall_limited )
+	{
+		this->max_tokens = max(1.0, this->overall_rate * VOLUME_WRITE_BURST_MS / 1000.0);
+		this->tokens = this->max_tokens;
+	}
+}
+
+void VolumeRateLimiter::refill( uint64_t now_ns )
+{
+	if ( !this->overall_limited )
+		return;
+
+	if ( now_ns > this->tokens_ns )
+	{
+		this->tokens += (double)(now_ns - this->tokens_ns) * this->overall_rate / 1e9;
+		this->tokens = min(this->tokens, this->max_tokens);
+	}
+
+	this->tokens_ns = now_ns;
+}
+
+bool VolumeRateLimiter::stream_ready( const StreamState & s, uint64_t now_ns ) const
+{
+	return s.last_write_ns == 0 or now_ns >= s.last_write_ns + this->stream_interval_ns;
+}
+
+void VolumeRateLimiter::write( StreamState & s, uint64_t now_ns )
+{
+	if ( this->overall_limited )
+		this->tokens -= 1;
+
+	s.last_write_ns = now_ns;
+	this->written_count.fetch_add(1, memory_order_relaxed);
+}
+
+bool VolumeRateLimiter::offer( const string & stream, unsigned int volume, uint64_t now_ns, const EventTimes & origin )
+{
+	if ( this->streams.size() >= VOLUME_LIMITER_MAX_STREAMS )
+		this->forget_idle_streams(now_ns);
+
+	//   Look it up before inserting it, because making the pair to insert
+	// would copy the string (which allocates, if it's long).
+	auto it = this->streams.find(stream);
+	bool is_new = ( it == this->streams.end() );
+	if ( is_new )
+		it = this->streams.insert(make_pair(stream, StreamState())).first;
+
+	StreamState & s = it->second;
+
+	if ( is_new )
+	{
+		s.last_write_ns = 0;
+		s.held = false;
+		s.held_volume = 0;
+		s.held_since_ns = 0;
+	}
+
+	this->refill(now_ns);
+
+	if ( s.held )
+	// Whatever this replaces is never going to be written
+		this->suppressed_count.fetch_add(1, memory_order_relaxed);
+
+	//   Under the overall limit, streams which are already waiting get the
+	// tokens first (see take_due()), so this one only goes straight away if
+	// nothing else is held.
+	bool others_held = this->n_held > ( s.held ? 1u : 0u );
+
+	if ( this->stream_ready(s, now_ns) and (!this->overall_limited or (this->tokens >= 1 and !others_held)) )
+	{
+		if ( s.held )
+		{
+			s.held = false;
+			this->n_held--;
+		}
+
+		this->write(s, now_ns);
+		return true;
+	}
+
+	if ( !s.held )
+	{
+		s.held = true;
+		s.held_since_ns = now_ns;
+		this->n_held++;
+	}
+
+	s.held_volume = volume;
+	s.held_origin = origin;
+
+	return false;
+}
+
+//   The writes which have been held the longest go first, so that when the
+// overall limit is what's holding them back, every stream gets its turn.
+void VolumeRateLimiter::take_due( uint64_t now_ns, ReusableVector< pair<string,unsigned int> > & due, ReusableVector<EventTimes> & origins )
+{
+	if ( this->n_held == 0 )
+		return;
+
+	this->refill(now_ns);
+
+	this->ready.clear();
+	for ( auto it = this->streams.begin(); it != this->streams.end(); ++it )
+		if ( it->second.held and this->stream_ready(it->second, now_ns) )
+			this->ready.push_back(it);
+
+	sort(this->ready.begin(), this->ready.end(), []( const map<string,StreamState>::iterator & a, const map<string,StreamState>::iterator & b )
+	{
+		return a->second.held_since_ns < b->second.held_since_ns;
+	});
+
+	for ( auto it : this->ready )
+	{
+		if ( this->overall_limited and this->tokens < 1 )
+			break;
+
+		StreamState & s = it->second;
+
+		pair<string,unsigned int> & write = due.append();
+		write.first = it->first;
+		write.second = s.held_volume;
+		origins.push_back(s.held_origin);
+		s.held = false;
+		this->n_held--;
+
+		this->write(s, now_ns);
+		this->deferred_count.fetch_add(1, memory_order_relaxed);
+	}
+}
+
+uint64_t VolumeRateLimiter::next_due_ns() const
+{
+	if ( this->n_held == 0 )
+		return 0;
+
+	// When the bucket will next have a whole token
+	uint64_t token_ns = 0;
+	if ( this->overall_limited and this->tokens < 1 )
+		token_ns = this->tokens_ns + (uint64_t)((1 - this->tokens) * 1e9 / this->overall_rate) + 1;
+
+	uint64_t answer = UINT64_MAX;
+	for ( const auto & entry : this->streams )
+	{
+		const StreamState & s = entry.second;
+		if ( !s.held )
+			continue;
+
+		uint64_t stream_ns = s.last_write_ns == 0 ? 0 : s.last_write_ns + this->stream_interval_ns;
+		answer = min(answer, max(stream_ns, token_ns));
+	}
+
+	// 0 would mean "never"
+	return max(answer, (uint64_t)1);
+}
+
+void VolumeRateLimiter::clear()
+{
+	this->streams.clear();
+	this->n_held = 0;
+}
+
+//   Streams come and go, so the map would keep growing.  A stream which has
+// nothing held, and hasn't been written recently, doesn't need remembering.
+void VolumeRateLimiter::forget_idle_streams( uint64_t now_ns )
+{
+	for ( auto it = this->streams.begin(); it != this->streams.end(); )
+	{
+		if ( !it->second.held and this->stream_ready(it->second, now_ns) )
+			it = this->streams.erase(it);
+		else
+			++it;
+	}
+}
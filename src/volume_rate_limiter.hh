@@ -0,0 +1,110 @@
+/*
+	Copyright 2019 Jet Holloway
+
+	This file is part of ttymidi_pulse.
+
+	ttymidi_pulse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	ttymidi_pulse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with ttymidi_pulse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOLUME_RATE_LIMITER_HH
+#define VOLUME_RATE_LIMITER_HH
+
+#include "event_trace.hh"
+#include "reusable_vector.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+//   How big a burst of writes the overall limit allows, in milliseconds' worth
+// of its rate.  This lets a fader which controls several streams set them all
+// at once.
+#define VOLUME_WRITE_BURST_MS 100
+
+// How many streams to remember before forgetting the ones which don't matter
+#define VOLUME_LIMITER_MAX_STREAMS 256
+
+//   Decides when each stream's volume may be written to PulseAudio.  Each
+// stream gets at most 'per_stream_rate' writes a second, and all of them
+// together at most 'overall_rate' (0 means no limit).
+//   A write which comes too soon is held back, not dropped.  If another one for
+// the same stream comes along before it has gone, that replaces it (and it
+// counts as suppressed).  While any are held under the overall limit, new
+// ones are held too, behind them.  take_due() hands back the held writes once
+// they are allowed, the longest-held first, so every stream gets its turn,
+// and the last value a fader was moved to always gets written, just a little
+// late.  It keeps the times of the event which asked for it, so that
+// EventTracer can count it against that event.
+//   Only one thread may use this, apart from the counters.
+struct VolumeRateLimiter
+{
+	VolumeRateLimiter( double per_stream_rate, double overall_rate );
+
+	//   Returns true if 'volume' can be written to 'stream' now, in which case
+	// it is counted as written.  Otherwise it is held, along with 'origin'.
+	bool offer( const std::string & stream, unsigned int volume, uint64_t now_ns, const EventTimes & origin );
+
+	//   Adds the held writes which can now go to 'due', as (stream, volume),
+	// and their events to 'origins'
+	void take_due( uint64_t now_ns, ReusableVector< std::pair<std::string,unsigned int> > & due, ReusableVector<EventTimes> & origins );
+
+	// When take_due() will next have something, by monotonic_ns() (0 = never)
+	uint64_t next_due_ns() const;
+
+	// Forgets the held writes (e.g. because the streams have all gone)
+	void clear();
+
+	// Counters (these can be read from any thread)
+	unsigned long get_written_count() const { return written_count.load(std::memory_order_relaxed); }
+	unsigned long get_deferred_count() const { return deferred_count.load(std::memory_order_relaxed); }
+	unsigned long get_suppressed_count() const { return suppressed_count.load(std::memory_order_relaxed); }
+
+private:
+	struct StreamState
+	{
+		uint64_t last_write_ns;     // 0 = never
+		bool held;
+		unsigned int held_volume;
+		uint64_t held_since_ns;
+		EventTimes held_origin;
+	};
+
+	uint64_t stream_interval_ns;    // 0 = no limit
+	bool overall_limited;
+	double overall_rate;
+
+	// A token bucket for the overall limit
+	double tokens, max_tokens;
+	uint64_t tokens_ns;
+
+	std::map<std::string,StreamState> streams;
+	size_t n_held;
+
+	// Only used by take_due(), but kept to save allocating
+	std::vector< std::map<std::string,StreamState>::iterator > ready;
+
+	std::atomic<unsigned long> written_count;     // Including deferred ones
+	std::atomic<unsigned long> deferred_count;    // Held, and then written
+	std::atomic<unsigned long> suppressed_count;  // Held, and then replaced
+
+	void refill( uint64_t now_ns );
+	bool stream_ready( const StreamState & s, uint64_t now_ns ) const;
+	void write( StreamState & s, uint64_t now_ns );
+	void forget_idle_streams( uint64_t now_ns );
+};
+
+#endif // VOLUME_RATE_LIMITER_HH